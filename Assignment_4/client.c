@@ -19,6 +19,7 @@
     #define INVALID_SOCKET_VALUE INVALID_SOCKET
     #define CLOSE_SOCKET(s) closesocket(s)
     #define GET_LAST_ERROR() WSAGetLastError()
+    #define MSG_NOSIGNAL 0
 #else
     #include <unistd.h>
     #include <sys/types.h>
@@ -26,6 +27,12 @@
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <sys/time.h>
+    #include <fcntl.h>
+    #include <signal.h>
+    #ifdef __linux__
+        #include <sys/epoll.h>
+        #include <sys/resource.h>
+    #endif
     typedef int socket_t;
     #define INVALID_SOCKET_VALUE -1
     #define CLOSE_SOCKET(s) close(s)
@@ -48,10 +55,56 @@ void print_socket_info(const char* prefix, socket_t socket_val);
 #define TYPE_1_REQUEST 1  // Client request message
 #define TYPE_2_RESPONSE 2  // Server response message
 
+// Admission outcome in a Type 2 Response
+#define ADMIT_ACCEPTED 0    // Stream at the requested resolution
+#define ADMIT_DOWNGRADED 1  // Stream at the lower resolution in the response
+#define ADMIT_QUEUED 2      // Waiting for capacity; another Type 2 Response follows
+#define ADMIT_REJECTED 3    // No capacity, the connection is closed
+
 // Protocol modes
 #define MODE_TCP 1
 #define MODE_UDP 2
 
+// Wire protocol, laid out in the "Wire protocol" section below
+#define WIRE_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define WIRE_MESSAGE_SIZE 16    // Body of a Type 1 Request / Type 2 Response
+#define WIRE_MESSAGE_FRAME (FRAME_HEADER_SIZE + WIRE_MESSAGE_SIZE)
+#define WIRE_CLIENT_ID_FRAME (FRAME_HEADER_SIZE + 4)
+#define WIRE_ACK_FRAME (FRAME_HEADER_SIZE + 12)
+#define WIRE_NACK_FRAME (FRAME_HEADER_SIZE + 8)
+#define FEC_HEADER_SIZE 8       // FRAME_PARITY body ahead of the XOR payload
+#define FRAGMENT_HEADER_SIZE 8  // Body prefix of a FRAME_FLAG_FRAGMENT datagram
+#define UDP_FRAME_MAX (FRAME_HEADER_SIZE + FEC_HEADER_SIZE + UDP_CHUNK_SIZE) // Largest UDP frame
+#define RESOLUTION_COUNT 3
+
+// Frame types
+#define FRAME_REQUEST TYPE_1_REQUEST    // Type 1 Request
+#define FRAME_RESPONSE TYPE_2_RESPONSE  // Type 2 Response
+#define FRAME_CLIENT_ID 3       // First frame on a TCP stream socket: whose stream it is
+#define FRAME_REQUEST_STREAM 4  // UDP client asks for its stream
+#define FRAME_READY 5           // Server is ready to stream
+#define FRAME_START 6           // TCP client confirms the stream start
+#define FRAME_CHUNK 7           // Video chunk; the sequence number is its chunk id
+#define FRAME_ACK 8             // Client received a chunk (latency feedback)
+#define FRAME_NACK 9            // UDP client is missing chunks
+#define FRAME_PARITY 10         // XOR parity of a group of UDP chunks
+
+// Frame flags
+#define FRAME_FLAG_LAST 0x0001  // Final chunk of the stream
+#define FRAME_FLAG_NACK 0x0002  // FRAME_READY: the server resends chunks named in a FRAME_NACK
+#define FRAME_FLAG_RETRANSMIT 0x0004 // FRAME_CHUNK: a resent copy
+#define FRAME_FLAG_FEC 0x0008   // FRAME_READY: FRAME_PARITY datagrams follow each chunk group
+#define FRAME_FLAG_FRAGMENT 0x0010 // UDP datagram carrying one slice of a longer frame
+
+// UDP loss recovery
+#define NACK_WINDOW 64          // Chunks behind the newest one that can still be NACKed
+#define NACK_INTERVAL_MS 20     // Repeat a NACK this often while chunks stay missing
+#define NACK_LINGER_MS 300      // Wait for resent chunks this long after the last chunk
+#define STREAM_TIMEOUT_MS 5000  // Give up on a UDP stream after this long without data
+#define REASSEMBLY_SLOTS 16     // UDP frames reassembled at once
+#define REASSEMBLY_TIMEOUT_MS 250 // Give up on a frame this long after its first fragment
+
 // Message structure for client-server communication
 typedef struct {
     int type;               // Message type (1 for request, 2 for response)
@@ -60,8 +113,59 @@ typedef struct {
     char protocol[10];      // Protocol (TCP or UDP)
     int streaming_port;     // Port for streaming (assigned by server)
     int client_id;          // Client ID assigned by the server
+    int status;             // ADMIT_* (responses only)
+    int queue_position;     // 1-based place in the admission queue when ADMIT_QUEUED
 } Message;
 
+// Chunks missing from a UDP stream, within NACK_WINDOW of the newest one
+typedef struct {
+    int newest;                 // Highest chunk id received
+    uint64_t missing;           // Bit id % NACK_WINDOW: chunk id not received yet
+    double since[NACK_WINDOW];  // When each missing chunk was noticed
+    int lost;                   // Chunks found missing
+    int recovered;              // ...that a resent copy delivered
+    double recovery_sum;        // Seconds from noticing a gap to the copy arriving
+    double recovery_max;
+} ReceiveWindow;
+
+// Payloads of the latest NACK_WINDOW chunks, to rebuild a lost one from parity
+typedef struct {
+    int id[NACK_WINDOW];        // Chunk each slot holds, 0 if none
+    uint8_t payload[NACK_WINDOW][UDP_CHUNK_SIZE];
+} ChunkHistory;
+
+// A UDP frame arriving in fragments
+typedef struct {
+    bool busy;
+    bool complete;              // Put together; kept to recognize the rest of a later copy
+    double started;             // When its first fragment arrived
+    int count;                  // Fragments in the frame
+    uint32_t received;          // Bit f: fragment f is in
+    int size;                   // Body bytes, known once the last fragment is in
+    uint8_t frame[UDP_FRAME_MAX]; // First fragment's frame header, then the body
+} Reassembly;
+
+// Frames of a UDP stream being put back together from their fragments
+typedef struct {
+    Reassembly slots[REASSEMBLY_SLOTS];
+    int fragments;              // Fragments received, copies included
+    int completed;              // Frames put together
+    int abandoned;              // Frames given up on
+    int fragments_missing;      // ...the fragments they still lacked
+} Reassembler;
+
+// Decoded frame header
+typedef struct {
+    int version;
+    int type;               // FRAME_*
+    int flags;              // FRAME_FLAG_*
+    uint32_t sequence;      // Chunk id of a FRAME_CHUNK, 0 otherwise
+    uint32_t timestamp;     // Sender's clock in microseconds, modulo 2^32
+    uint32_t length;        // Body bytes after the header
+} FrameHeader;
+
+const char *resolution_names[RESOLUTION_COUNT] = { "480p", "720p", "1080p" };
+
 // Get current time in seconds
 double get_time() {
 #ifdef _WIN32
@@ -123,11 +227,396 @@ void cleanup_socket_system() {
 #endif
 }
 
+// ---- Wire protocol ----
+//
+// Frame header, FRAME_HEADER_SIZE bytes in network byte order:
+//    0  version    WIRE_VERSION; frames of any other version are rejected
+//    1  type       FRAME_*
+//    2  flags      FRAME_FLAG_*, 16 bits
+//    4  sequence   chunk id of a FRAME_CHUNK, 0 otherwise
+//    8  timestamp  sender's clock in microseconds, modulo 2^32
+//   12  length     body bytes following the header
+//
+// Type 1 Request and Type 2 Response body, WIRE_MESSAGE_SIZE bytes:
+//    0  resolution      index into resolution_names
+//    1  protocol        MODE_TCP or MODE_UDP
+//    2  status          ADMIT_*
+//    3  reserved, 0
+//    4  bandwidth       Kbps
+//    8  client id
+//   12  streaming port  16 bits
+//   14  queue position  16 bits
+//
+// FRAME_CLIENT_ID and FRAME_REQUEST_STREAM carry a 32-bit client id,
+// FRAME_READY and FRAME_START have no body and a FRAME_CHUNK body is the
+// opaque payload. A FRAME_ACK's sequence is the chunk id and its timestamp
+// the client's time of the chunk's first bytes; its body:
+//    0  client id
+//    4  the chunk's send timestamp, echoed
+//    8  microseconds from the chunk's first to its last byte
+// A FRAME_NACK's sequence is the lowest missing chunk id; its body:
+//    0  client id
+//    4  mask, bit k set: chunk sequence + 1 + k is missing as well
+// A FRAME_PARITY's sequence is the first chunk id of its group; its body:
+//    0  group size
+//    1  parity count
+//    2  parity index
+//    3  reserved, 0
+//    4  mask, bit j set: chunk sequence + j is in this parity
+//    8  XOR of those chunks' payloads
+// A UDP frame too long for one datagram arrives in fragments, each with the
+// frame's header, FRAME_FLAG_FRAGMENT set and a length covering its body:
+//    0  fragment index  16 bits
+//    2  fragment count  16 bits
+//    4  offset          of the slice within the frame body
+//    8  the slice
+
+void wire_put16(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+void wire_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+uint32_t wire_get16(const uint8_t *p) {
+    return (uint32_t)p[0] << 8 | p[1];
+}
+
+uint32_t wire_get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Write a frame header stamped with the current time. Returns its size.
+int wire_put_header(uint8_t *out, int type, int flags, uint32_t sequence, uint32_t length) {
+    out[0] = WIRE_VERSION;
+    out[1] = (uint8_t)type;
+    wire_put16(out + 2, (uint32_t)flags);
+    wire_put32(out + 4, sequence);
+    wire_put32(out + 8, (uint32_t)(uint64_t)(get_time() * 1000000.0));
+    wire_put32(out + 12, length);
+    return FRAME_HEADER_SIZE;
+}
+
+// Parse a frame header. Returns false if it is from another protocol version.
+bool wire_get_header(const uint8_t *in, FrameHeader *h) {
+    h->version = in[0];
+    h->type = in[1];
+    h->flags = (int)wire_get16(in + 2);
+    h->sequence = wire_get32(in + 4);
+    h->timestamp = wire_get32(in + 8);
+    h->length = wire_get32(in + 12);
+    return h->version == WIRE_VERSION;
+}
+
+// Encode a Type 1 Request as one frame of WIRE_MESSAGE_FRAME bytes
+int wire_encode_request(const char *resolution, const char *protocol, uint8_t *out) {
+    uint8_t *body = out + wire_put_header(out, TYPE_1_REQUEST, 0, 0, WIRE_MESSAGE_SIZE);
+    memset(body, 0, WIRE_MESSAGE_SIZE);
+    for (int i = 0; i < RESOLUTION_COUNT; i++) {
+        if (strcmp(resolution, resolution_names[i]) == 0) {
+            body[0] = (uint8_t)i;
+        }
+    }
+    body[1] = strcmp(protocol, "TCP") == 0 ? MODE_TCP : MODE_UDP;
+    return WIRE_MESSAGE_FRAME;
+}
+
+// Decode a Type 2 Response frame. Returns false if it is not a valid one.
+bool wire_decode_response(const uint8_t *in, Message *m) {
+    FrameHeader h;
+    const uint8_t *body = in + FRAME_HEADER_SIZE;
+    if (!wire_get_header(in, &h) || h.type != TYPE_2_RESPONSE || h.length != WIRE_MESSAGE_SIZE ||
+        body[0] >= RESOLUTION_COUNT) {
+        return false;
+    }
+    memset(m, 0, sizeof(*m));
+    m->type = TYPE_2_RESPONSE;
+    strcpy(m->resolution, resolution_names[body[0]]);
+    strcpy(m->protocol, body[1] == MODE_TCP ? "TCP" : "UDP");
+    m->status = body[2];
+    m->bandwidth = (int)wire_get32(body + 4);
+    m->client_id = (int)wire_get32(body + 8);
+    m->streaming_port = (int)wire_get16(body + 12);
+    m->queue_position = (int)wire_get16(body + 14);
+    return true;
+}
+
+// Frame naming the client a stream belongs to (FRAME_CLIENT_ID or
+// FRAME_REQUEST_STREAM). Returns its size.
+int wire_encode_client_id(uint8_t *out, int type, int client_id) {
+    wire_put_header(out, type, 0, 0, 4);
+    wire_put32(out + FRAME_HEADER_SIZE, (uint32_t)client_id);
+    return WIRE_CLIENT_ID_FRAME;
+}
+
+// Acknowledge a chunk frame: `received` is when its first bytes arrived
+// and `receive_us` how long the rest took. Returns the frame's size.
+int wire_encode_ack(uint8_t *out, int client_id, const FrameHeader *chunk,
+                    uint32_t received, uint32_t receive_us) {
+    wire_put_header(out, FRAME_ACK, 0, chunk->sequence, WIRE_ACK_FRAME - FRAME_HEADER_SIZE);
+    wire_put32(out + 8, received);
+    wire_put32(out + FRAME_HEADER_SIZE, (uint32_t)client_id);
+    wire_put32(out + FRAME_HEADER_SIZE + 4, chunk->timestamp);
+    wire_put32(out + FRAME_HEADER_SIZE + 8, receive_us);
+    return WIRE_ACK_FRAME;
+}
+
+// Account for chunks up to `id` having been sent. Returns how many of them
+// are newly found missing.
+int window_expect(ReceiveWindow *w, int id, double now) {
+    int gaps = 0;
+    for (int k = w->newest + 1; k <= id; k++) {
+        // Slot k % NACK_WINDOW held chunk k - NACK_WINDOW, which leaves the window
+        w->missing |= 1ull << (k % NACK_WINDOW);
+        w->since[k % NACK_WINDOW] = now;
+        gaps++;
+    }
+    w->lost += gaps;
+    if (id > w->newest) {
+        w->newest = id;
+    }
+    return gaps;
+}
+
+// Account for chunk `id` arriving. Returns how many chunks it showed to be
+// missing, or -1 if it is a copy of one already received (or too old).
+int window_receive(ReceiveWindow *w, int id, double now) {
+    if (id > w->newest) {
+        int gaps = window_expect(w, id - 1, now);
+        w->missing &= ~(1ull << (id % NACK_WINDOW));
+        w->newest = id;
+        return gaps;
+    }
+    uint64_t bit = 1ull << (id % NACK_WINDOW);
+    if (id <= w->newest - NACK_WINDOW || !(w->missing & bit)) {
+        return -1;
+    }
+    w->missing &= ~bit;
+    w->recovered++;
+    double waited = now - w->since[id % NACK_WINDOW];
+    w->recovery_sum += waited;
+    if (waited > w->recovery_max) {
+        w->recovery_max = waited;
+    }
+    return 0;
+}
+
+// Rebuild the chunk a FRAME_PARITY covers if it is the only one of its
+// chunks missing. Returns the rebuilt chunk's id, or 0.
+int fec_rebuild(ChunkHistory *history, ReceiveWindow *w, const FrameHeader *h,
+                const uint8_t *body, double now) {
+    int first = (int)h->sequence;
+    int size = (int)h->length - FEC_HEADER_SIZE;
+    uint32_t mask = wire_get32(body + 4);
+    if (first < 1 || mask == 0 || size <= 0 || size > UDP_CHUNK_SIZE) {
+        return 0;
+    }
+    int last = first;
+    for (int j = 0; j < 32; j++) {
+        if (mask & (1u << j)) {
+            last = first + j;
+        }
+    }
+    window_expect(w, last, now);  // Parity goes out after all of its chunks
+    
+    int lost = 0;
+    for (int j = 0; j < 32; j++) {
+        int id = first + j;
+        if (!(mask & (1u << j))) {
+            continue;
+        }
+        if (id <= w->newest - NACK_WINDOW) {
+            return 0;
+        }
+        if (w->missing & (1ull << (id % NACK_WINDOW))) {
+            if (lost != 0) {
+                return 0;  // Two of its chunks are missing
+            }
+            lost = id;
+        } else if (history->id[id % NACK_WINDOW] != id) {
+            return 0;
+        }
+    }
+    if (lost == 0) {
+        return 0;
+    }
+    
+    uint8_t *out = history->payload[lost % NACK_WINDOW];
+    memcpy(out, body + FEC_HEADER_SIZE, size);
+    for (int j = 0; j < 32; j++) {
+        int id = first + j;
+        if (!(mask & (1u << j)) || id == lost) {
+            continue;
+        }
+        const uint8_t *in = history->payload[id % NACK_WINDOW];
+        for (int i = 0; i < size; i++) {
+            out[i] ^= in[i];
+        }
+    }
+    history->id[lost % NACK_WINDOW] = lost;
+    window_receive(w, lost, now);
+    return lost;
+}
+
+// Give up on a frame that is still missing fragments
+void reassembly_abandon(Reassembler *r, Reassembly *slot) {
+    int missing = 0;
+    for (int f = 0; f < slot->count; f++) {
+        if (!(slot->received & (1u << f))) {
+            missing++;
+        }
+    }
+    r->abandoned++;
+    r->fragments_missing += missing;
+    slot->busy = false;
+}
+
+// Free the slot of a frame put together REASSEMBLY_TIMEOUT_MS after its
+// first fragment, and give up on one still incomplete
+void reassembly_expire(Reassembler *r, double now) {
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        Reassembly *slot = &r->slots[i];
+        if (slot->busy && now - slot->started >= REASSEMBLY_TIMEOUT_MS / 1000.0) {
+            if (slot->complete) {
+                slot->busy = false;
+            } else {
+                reassembly_abandon(r, slot);
+            }
+        }
+    }
+}
+
+// Whether slot `a` is a better one to reuse than `b`: free, else holding a
+// finished frame, else the oldest
+bool reassembly_spare(const Reassembly *a, const Reassembly *b) {
+    if (a->busy != b->busy) {
+        return !a->busy;
+    }
+    if (a->complete != b->complete) {
+        return a->complete;
+    }
+    return a->started < b->started;
+}
+
+// Add a FRAME_FLAG_FRAGMENT datagram of `len` bytes. Copies of a frame,
+// resent ones too, fill each other's gaps. Returns the length of the whole
+// frame once this completes it, with *frame pointing at it until the next
+// call, or 0.
+int reassembly_add(Reassembler *r, const uint8_t *datagram, int len, const FrameHeader *h,
+                   double now, uint8_t **frame) {
+    if (h->length < FRAGMENT_HEADER_SIZE || h->length != (uint32_t)(len - FRAME_HEADER_SIZE)) {
+        return 0;
+    }
+    const uint8_t *fragment = datagram + FRAME_HEADER_SIZE;
+    int index = (int)wire_get16(fragment);
+    int count = (int)wire_get16(fragment + 2);
+    int offset = (int)wire_get32(fragment + 4);
+    int slice = (int)h->length - FRAGMENT_HEADER_SIZE;
+    if (count < 1 || count > 32 || index >= count || offset < 0 ||
+        offset + slice > UDP_FRAME_MAX - FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    r->fragments++;
+    
+    Reassembly *slot = NULL, *spare = NULL;
+    for (int i = 0; i < REASSEMBLY_SLOTS && slot == NULL; i++) {
+        Reassembly *s = &r->slots[i];
+        if (s->busy && s->frame[1] == h->type && wire_get32(s->frame + 4) == h->sequence) {
+            slot = s;
+        } else if (spare == NULL || reassembly_spare(s, spare)) {
+            spare = s;
+        }
+    }
+    if (slot != NULL && slot->complete) {
+        return 0;  // The rest of a copy of a frame already put together
+    }
+    if (slot == NULL) {
+        if (spare->busy && !spare->complete) {
+            reassembly_abandon(r, spare);  // Make room: the oldest frame is the least likely to complete
+        }
+        slot = spare;
+        slot->busy = true;
+        slot->complete = false;
+        slot->started = now;
+        slot->count = count;
+        slot->received = 0;
+        slot->size = -1;
+        memcpy(slot->frame, datagram, FRAME_HEADER_SIZE);
+    }
+    if (count != slot->count || (slot->received & (1u << index))) {
+        return 0;
+    }
+    memcpy(slot->frame + FRAME_HEADER_SIZE + offset, fragment + FRAGMENT_HEADER_SIZE, slice);
+    slot->received |= 1u << index;
+    if (index == count - 1) {
+        slot->size = offset + slice;
+    }
+    // A frame completed by a resent fragment counts as resent
+    int flags = (int)wire_get16(slot->frame + 2) | h->flags;
+    wire_put16(slot->frame + 2, (uint32_t)flags);
+    if (slot->received != (count == 32 ? ~0u : (1u << count) - 1)) {
+        return 0;
+    }
+    wire_put16(slot->frame + 2, (uint32_t)(flags & ~FRAME_FLAG_FRAGMENT));
+    wire_put32(slot->frame + 12, (uint32_t)slot->size);
+    slot->complete = true;
+    r->completed++;
+    *frame = slot->frame;
+    return FRAME_HEADER_SIZE + slot->size;
+}
+
+// NACK the lowest missing chunk and any of the 32 after it. Returns the
+// frame's size, or 0 if nothing is missing.
+int window_encode_nack(const ReceiveWindow *w, int client_id, uint8_t *out) {
+    int first = 0;
+    uint32_t mask = 0;
+    for (int id = w->newest - NACK_WINDOW + 1; id < w->newest; id++) {
+        if (id < 1 || !(w->missing & (1ull << (id % NACK_WINDOW)))) {
+            continue;
+        }
+        if (first == 0) {
+            first = id;
+        } else if (id - first - 1 < 32) {
+            mask |= 1u << (id - first - 1);
+        }
+    }
+    if (first == 0) {
+        return 0;
+    }
+    wire_put_header(out, FRAME_NACK, 0, (uint32_t)first, WIRE_NACK_FRAME - FRAME_HEADER_SIZE);
+    wire_put32(out + FRAME_HEADER_SIZE, (uint32_t)client_id);
+    wire_put32(out + FRAME_HEADER_SIZE + 4, mask);
+    return WIRE_NACK_FRAME;
+}
+
+// Read exactly `len` bytes from a TCP socket, however recv() splits them.
+// Returns false on errors, timeouts and when the server closed the socket.
+bool recv_exact(socket_t sock, void *buffer, int len) {
+    int received = 0;
+    while (received < len) {
+        int n = recv(sock, (char *)buffer + received, len - received, 0);
+        if (n <= 0) {
+            if (n < 0 && GET_LAST_ERROR() == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        received += n;
+    }
+    return true;
+}
+
 // Send Type 1 Request and receive Type 2 Response using TCP
 int connection_phase(const char *server_ip, int server_port, const char *resolution, const char *protocol, int *streaming_port) {
     socket_t sock = INVALID_SOCKET_VALUE;
     struct sockaddr_in serv_addr;
-    Message request, response;
+    Message response;
+    uint8_t frame[WIRE_MESSAGE_FRAME];
     
     // Create TCP socket for connection phase
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET_VALUE) {
@@ -154,14 +643,9 @@ int connection_phase(const char *server_ip, int server_port, const char *resolut
     
     printf("Connected to server at %s:%d for connection phase\n", server_ip, server_port);
     
-    // Prepare Type 1 Request
-    request.type = TYPE_1_REQUEST;
-    strncpy(request.resolution, resolution, sizeof(request.resolution));
-    strncpy(request.protocol, protocol, sizeof(request.protocol));
-    request.bandwidth = 0; // Client doesn't set bandwidth
-    
-    // Send Type 1 Request
-    if (send(sock, (char*)&request, sizeof(request), 0) < 0) {
+    // Send Type 1 Request; the client doesn't set bandwidth
+    int frame_len = wire_encode_request(resolution, protocol, frame);
+    if (send(sock, (char*)frame, frame_len, 0) != frame_len) {
         print_socket_error("Failed to send request message");
         CLOSE_SOCKET(sock);
         exit(EXIT_FAILURE);
@@ -169,19 +653,34 @@ int connection_phase(const char *server_ip, int server_port, const char *resolut
     
     printf("Sent Type 1 Request with resolution: %s and protocol: %s\n", resolution, protocol);
     
-    // Receive Type 2 Response
-    int bytes_received = recv(sock, (char*)&response, sizeof(response), 0);
-    if (bytes_received <= 0) {
-        print_socket_error("Failed to receive response from server");
-        CLOSE_SOCKET(sock);
-        exit(EXIT_FAILURE);
-    }
+    // Receive Type 2 Response; while queued for admission the server sends
+    // another one once there is capacity
+    do {
+        if (!recv_exact(sock, frame, WIRE_MESSAGE_FRAME)) {
+            print_socket_error("Failed to receive response from server");
+            CLOSE_SOCKET(sock);
+            exit(EXIT_FAILURE);
+        }
+        
+        if (!wire_decode_response(frame, &response)) {
+            printf("Received invalid response type\n");
+            CLOSE_SOCKET(sock);
+            exit(EXIT_FAILURE);
+        }
+        
+        if (response.status == ADMIT_QUEUED) {
+            printf("Server is at capacity, queued for admission at position %d...\n", response.queue_position);
+        }
+    } while (response.status == ADMIT_QUEUED);
     
-    if (response.type != TYPE_2_RESPONSE) {
-        printf("Received invalid response type\n");
+    if (response.status == ADMIT_REJECTED) {
+        printf("Server rejected the %s stream: not enough capacity\n", response.resolution);
         CLOSE_SOCKET(sock);
         exit(EXIT_FAILURE);
     }
+    if (response.status == ADMIT_DOWNGRADED) {
+        printf("Server is short on capacity, downgraded from %s to %s\n", resolution, response.resolution);
+    }
     
     // Extract streaming port and client_id assigned by server
     *streaming_port = response.streaming_port;
@@ -258,11 +757,11 @@ void tcp_client(const char *server_ip, int server_port, const char *resolution)
     print_socket_info("Using socket: ", sock);
     
     // Send client_id that was assigned by the server
-    char id_buffer[32];
-    snprintf(id_buffer, sizeof(id_buffer), "%d", client_id);
+    uint8_t frame[WIRE_CLIENT_ID_FRAME];
+    int frame_len = wire_encode_client_id(frame, FRAME_CLIENT_ID, client_id);
     
-    printf("Sending client ID: %s\n", id_buffer);
-    if (send(sock, id_buffer, strlen(id_buffer), 0) < 0) {
+    printf("Sending client ID: %d\n", client_id);
+    if (send(sock, (char*)frame, frame_len, 0) != frame_len) {
         print_socket_error("Failed to send client ID");
         CLOSE_SOCKET(sock);
         exit(EXIT_FAILURE);
@@ -281,19 +780,17 @@ void tcp_client(const char *server_ip, int server_port, const char *resolution)
     
     // Wait for server to be ready
     printf("Waiting for server READY_TO_STREAM message (timeout: 15 seconds)...\n");
-    int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
-    
-    if (bytes_received <= 0) {
+    FrameHeader header;
+    if (!recv_exact(sock, frame, FRAME_HEADER_SIZE)) {
         printf("Server not ready to stream (timeout after 15 seconds)\n");
         print_socket_error("Error");
         CLOSE_SOCKET(sock);
         exit(EXIT_FAILURE);
     }
     
-    printf("Received message from server: '%s'\n", buffer);
-    
-    if (strcmp(buffer, "READY_TO_STREAM") != 0) {
-        printf("Server sent unexpected message: '%s' instead of 'READY_TO_STREAM'\n", buffer);
+    if (!wire_get_header(frame, &header) || header.type != FRAME_READY || header.length != 0) {
+        printf("Server sent unexpected frame (version %d, type %d) instead of READY_TO_STREAM\n",
+               header.version, header.type);
         CLOSE_SOCKET(sock);
         exit(EXIT_FAILURE);
     }
@@ -302,7 +799,8 @@ void tcp_client(const char *server_ip, int server_port, const char *resolution)
     
     // Send confirmation to start streaming
     printf("Sending START_STREAM confirmation to server\n");
-    if (send(sock, "START_STREAM", strlen("START_STREAM"), 0) < 0) {
+    wire_put_header(frame, FRAME_START, 0, 0, 0);
+    if (send(sock, (char*)frame, FRAME_HEADER_SIZE, 0) != FRAME_HEADER_SIZE) {
         print_socket_error("Failed to send START_STREAM confirmation");
         CLOSE_SOCKET(sock);
         exit(EXIT_FAILURE);
@@ -318,20 +816,35 @@ void tcp_client(const char *server_ip, int server_port, const char *resolution)
     int chunks_received = 0;
     double last_data_rate = 0;
     
-    // Receive video stream
+    // Receive video stream: one chunk frame at a time, header then payload
     while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
-        
-        if (bytes_received <= 0) {
+        if (!recv_exact(sock, frame, FRAME_HEADER_SIZE)) {
+            printf("Connection closed by server or error\n");
+            break;
+        }
+        double first_byte = get_time();
+        if (!wire_get_header(frame, &header) || header.type != FRAME_CHUNK ||
+            header.length > BUFFER_SIZE) {
+            printf("\nServer sent an invalid chunk frame (version %d, type %d, %u bytes)\n",
+                   header.version, header.type, header.length);
+            break;
+        }
+        if (!recv_exact(sock, buffer, (int)header.length)) {
             printf("Connection closed by server or error\n");
             break;
         }
+        int bytes_received = FRAME_HEADER_SIZE + (int)header.length;
+        double current_time = get_time();
+        
+        // Echo the send time so the server can measure the latency
+        uint8_t ack[WIRE_ACK_FRAME];
+        int ack_len = wire_encode_ack(ack, client_id, &header, (uint32_t)(uint64_t)(first_byte * 1000000.0),
+                                      (uint32_t)((current_time - first_byte) * 1000000.0));
+        send(sock, (char*)ack, ack_len, MSG_NOSIGNAL);
         
         // Update statistics
         total_bytes += bytes_received;
         chunks_received++;
-        double current_time = get_time();
         double elapsed = current_time - start_time;
         double interval = current_time - last_time;
         
@@ -355,10 +868,11 @@ void tcp_client(const char *server_ip, int server_port, const char *resolution)
         }
         
         // Simulate video processing (just printing the chunk ID)
-        int chunk_id;
-        sscanf(buffer, "VIDEO_CHUNK_%d_", &chunk_id);
-        printf("\rReceiving chunk #%d", chunk_id);
+        printf("\rReceiving chunk #%u", header.sequence);
         fflush(stdout);
+        if (header.flags & FRAME_FLAG_LAST) {
+            break;
+        }
     }
     
     printf("\nStream ended after receiving %d chunks\n", chunks_received);
@@ -400,9 +914,14 @@ void udp_client(const char *server_ip, int server_port, const char *resolution)
     int max_retries = 5;
     bool received_ready = false;
     
+    // The client ID tells the server which session the request is for
+    uint8_t request[WIRE_CLIENT_ID_FRAME];
+    int request_len = wire_encode_client_id(request, FRAME_REQUEST_STREAM, client_id);
+    FrameHeader header;
+    
     while (retry_count < max_retries && !received_ready) {
         // Send request
-        if (sendto(sock, "REQUEST_STREAM", strlen("REQUEST_STREAM"), 0, 
+        if (sendto(sock, (char*)request, request_len, 0, 
                (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
             print_socket_error("Failed to send UDP request");
             retry_count++;
@@ -424,16 +943,16 @@ void udp_client(const char *server_ip, int server_port, const char *resolution)
 #endif
         
         socklen_t server_addr_len = sizeof(serv_addr);
-        memset(buffer, 0, BUFFER_SIZE);
         int bytes_received = recvfrom(sock, buffer, BUFFER_SIZE, 0, 
                                      (struct sockaddr *)&serv_addr, &server_addr_len);
         
         if (bytes_received > 0) {
-            if (strcmp(buffer, "READY_TO_STREAM") == 0) {
+            if (bytes_received == FRAME_HEADER_SIZE && wire_get_header((uint8_t *)buffer, &header) &&
+                header.type == FRAME_READY) {
                 received_ready = true;
                 printf("Received READY_TO_STREAM response from server\n");
             } else {
-                printf("Received unexpected response: '%s'\n", buffer);
+                printf("Received unexpected response (%d bytes)\n", bytes_received);
                 retry_count++;
             }
         } else {
@@ -449,105 +968,999 @@ void udp_client(const char *server_ip, int server_port, const char *resolution)
         exit(EXIT_FAILURE);
     }
     
-    printf("Starting video stream reception (UDP, %s)...\n", resolution);
+    // With FRAME_FLAG_NACK the server resends chunks we report missing; with
+    // FRAME_FLAG_FEC parity follows each group of chunks
+    bool nack = (header.flags & FRAME_FLAG_NACK) != 0;
+    bool fec = (header.flags & FRAME_FLAG_FEC) != 0;
+    bool recovering = nack || fec;
+    printf("Starting video stream reception (UDP, %s%s%s)...\n", resolution,
+           nack ? ", lost chunks resent on NACK" : "", fec ? ", lost chunks rebuilt from parity" : "");
+    ChunkHistory *history = NULL;
+    if (fec && (history = calloc(1, sizeof(ChunkHistory))) == NULL) {
+        perror("Memory allocation failed");
+        CLOSE_SOCKET(sock);
+        exit(EXIT_FAILURE);
+    }
     
-    // Set longer timeout for video streaming
+    // Wake up every NACK interval to repeat NACKs and to end the wait for
+    // missing chunks; otherwise wait out the stream timeout
+    int wait_ms = recovering ? NACK_INTERVAL_MS : STREAM_TIMEOUT_MS;
 #ifdef _WIN32
-    DWORD stream_timeout = 5000;  // 5 seconds in milliseconds
+    DWORD stream_timeout = wait_ms;
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&stream_timeout, sizeof(stream_timeout));
 #else
     struct timeval stream_tv;
-    stream_tv.tv_sec = 5;  // 5 seconds timeout
-    stream_tv.tv_usec = 0;
+    stream_tv.tv_sec = wait_ms / 1000;
+    stream_tv.tv_usec = (wait_ms % 1000) * 1000;
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&stream_tv, sizeof(stream_tv));
 #endif
     
-    // Start receiving video
-    char video_chunk[UDP_CHUNK_SIZE] = {0};
+    // Start receiving video: every datagram is a chunk or parity frame, or a
+    // fragment of one
+    uint8_t video_chunk[UDP_FRAME_MAX];
+    uint8_t nack_frame[WIRE_NACK_FRAME];
+    ReceiveWindow window;
+    memset(&window, 0, sizeof(window));
+    Reassembler *reassembler = calloc(1, sizeof(Reassembler));
+    if (reassembler == NULL) {
+        perror("Memory allocation failed");
+        CLOSE_SOCKET(sock);
+        exit(EXIT_FAILURE);
+    }
     double start_time = get_time();
     double last_stats_time = start_time;
+    double last_data = start_time;
+    double last_nack = 0;
+    double ended = 0;           // When the last chunk arrived
     int chunks_received = 0;
+    int duplicates = 0;
+    int rebuilt = 0;            // Chunks rebuilt from parity
     unsigned long total_data = 0;
     unsigned long recent_data = 0;
-    int lost_packets = 0;
-    int expected_chunk_id = 0;
     
     while (1) {
-        memset(video_chunk, 0, UDP_CHUNK_SIZE);
-        
-#ifdef _WIN32
-        DWORD timeout = 5000;  // 5 seconds in milliseconds
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
-#else
-        struct timeval timeout;
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
-#endif
-
         socklen_t server_addr_len = sizeof(serv_addr);
         
         // Receive video chunk
-        int bytes_received = recvfrom(sock, video_chunk, UDP_CHUNK_SIZE, 0, 
+        int bytes_received = recvfrom(sock, (char*)video_chunk, sizeof(video_chunk), 0, 
                                       (struct sockaddr *)&serv_addr, &server_addr_len);
+        double current_time = get_time();
+        reassembly_expire(reassembler, current_time);
+        
+        // A fragment is only processed with the one completing its frame
+        uint8_t *frame = video_chunk;
+        int frame_len = bytes_received;
+        if (bytes_received >= FRAME_HEADER_SIZE && wire_get_header(video_chunk, &header) &&
+            (header.flags & FRAME_FLAG_FRAGMENT)) {
+            last_data = current_time;
+            frame_len = reassembly_add(reassembler, video_chunk, bytes_received, &header, current_time, &frame);
+        }
         
         if (bytes_received <= 0) {
-            printf("\nTimeout or end of stream\n");
+            if (!recovering || current_time - last_data >= STREAM_TIMEOUT_MS / 1000.0 ||
+                (ended > 0 && current_time - ended >= NACK_LINGER_MS / 1000.0)) {
+                printf("\nTimeout or end of stream\n");
+                break;
+            }
+        } else if (frame_len == 0) {
+            // Waiting for the rest of the frame
+        } else if (frame_len < FRAME_HEADER_SIZE || !wire_get_header(frame, &header) ||
+                   (header.type != FRAME_CHUNK && header.type != FRAME_PARITY) ||
+                   header.length != (uint32_t)(frame_len - FRAME_HEADER_SIZE)) {
+            continue;  // Not a whole chunk or parity frame
+        } else if (header.type == FRAME_PARITY) {
+            last_data = current_time;
+            int chunk_id = fec && header.length > FEC_HEADER_SIZE ?
+                fec_rebuild(history, &window, &header, frame + FRAME_HEADER_SIZE, current_time) : 0;
+            if (chunk_id > 0) {
+                rebuilt++;
+                chunks_received++;
+                total_data += header.length - FEC_HEADER_SIZE;
+                printf("\rReceiving chunk #%d (rebuilt)", chunk_id);
+                fflush(stdout);
+            }
+            if (header.flags & FRAME_FLAG_LAST) {
+                ended = current_time;
+            }
+        } else {
+            last_data = current_time;
+            
+            // Echo the send time so the server can measure the latency; a
+            // datagram arrives whole, so it took no time after its first byte
+            uint8_t ack[WIRE_ACK_FRAME];
+            int ack_len = wire_encode_ack(ack, client_id, &header, (uint32_t)(uint64_t)(current_time * 1000000.0), 0);
+            sendto(sock, (char*)ack, ack_len, 0, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+            
+            int chunk_id = (int)header.sequence;
+            int gaps = window_receive(&window, chunk_id, current_time);
+            if (gaps < 0) {
+                duplicates++;
+                continue;
+            }
+            if (gaps > 0) {
+                printf("\nPacket loss detected! Expected %d, got %d\n", chunk_id - gaps, chunk_id);
+                last_nack = 0;  // NACK new gaps right away
+            }
+            if (history != NULL) {
+                history->id[chunk_id % NACK_WINDOW] = chunk_id;
+                memcpy(history->payload[chunk_id % NACK_WINDOW], frame + FRAME_HEADER_SIZE, header.length);
+            }
+            
+            // Update statistics
+            total_data += frame_len;
+            chunks_received++;
+            double elapsed = current_time - start_time;
+            double interval = current_time - last_stats_time;
+            int lost_packets = window.lost - window.recovered;
+            
+            // Print statistics every 10 chunks
+            if (chunks_received % 10 == 0) {
+                double overall_data_rate = total_data / elapsed;
+                if (interval > 0) {
+                    recent_data = (frame_len * 10) / interval;
+                }
+                
+                printf("\n----- UDP Streaming Statistics -----\n");
+                printf("Resolution: %s (Bandwidth: %d Kbps)\n", resolution, bandwidth);
+                printf("Chunks received: %d\n", chunks_received);
+                printf("Total data received: %lu bytes\n", total_data);
+                printf("Elapsed time: %.2f seconds\n", elapsed);
+                printf("Overall data rate: %.2f bytes/sec\n", overall_data_rate);
+                printf("Recent data rate: %lu bytes/sec\n", recent_data);
+                printf("Lost packets: %d\n", lost_packets);
+                printf("Packet loss rate: %.2f%%\n", 
+                       (lost_packets * 100.0) / (chunks_received + lost_packets));
+                printf("------------------------------------\n");
+                
+                last_stats_time = current_time;
+            }
+            
+            // Simulate video processing
+            printf("\rReceiving chunk #%d%s", chunk_id,
+                   (header.flags & FRAME_FLAG_RETRANSMIT) ? " (resent)" : "");
+            fflush(stdout);
+            if (header.flags & FRAME_FLAG_LAST) {
+                ended = current_time;
+            }
+        }
+        
+        if (ended > 0 && (!recovering || window.missing == 0 ||
+                          current_time - ended >= NACK_LINGER_MS / 1000.0)) {
             break;
         }
         
-        // Update statistics
-        total_data += bytes_received;
-        chunks_received++;
-        double current_time = get_time();
-        double elapsed = current_time - start_time;
-        double interval = current_time - last_stats_time;
+        // One NACK names every missing chunk; repeat it until they arrive
+        if (nack && window.missing != 0 && current_time - last_nack >= NACK_INTERVAL_MS / 1000.0) {
+            int nack_len = window_encode_nack(&window, client_id, nack_frame);
+            sendto(sock, (char*)nack_frame, nack_len, 0, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+            last_nack = current_time;
+        }
+    }
+    
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        if (reassembler->slots[i].busy && !reassembler->slots[i].complete) {
+            reassembly_abandon(reassembler, &reassembler->slots[i]);
+        }
+    }
+    int unrecovered = window.lost - window.recovered;
+    printf("\nStream ended after receiving %d chunks\n", chunks_received);
+    if (reassembler->fragments > 0) {
+        printf("Fragments: %d received, %d frames reassembled, %d incomplete with %d fragments missing\n",
+               reassembler->fragments, reassembler->completed, reassembler->abandoned,
+               reassembler->fragments_missing);
+    }
+    if (window.lost > 0) {
+        printf("Lost chunks: %d of %d (%.2f%% effective loss), %d recovered by retransmission, "
+               "%d rebuilt from parity, %d duplicates\n",
+               unrecovered, chunks_received + unrecovered, unrecovered * 100.0 / (chunks_received + unrecovered),
+               window.recovered - rebuilt, rebuilt, duplicates);
+    }
+    if (window.recovered > 0) {
+        printf("Recovery latency: avg %.2f ms, max %.2f ms\n",
+               window.recovery_sum * 1000.0 / window.recovered, window.recovery_max * 1000.0);
+    }
+    free(history);
+    free(reassembler);
+    CLOSE_SOCKET(sock);
+}
+
+// ---- Load generator (--load) ----
+//
+// One process plays N viewers at once to load-test the server: each goes
+// through the connection phase and streams its video like tcp_client() or
+// udp_client(), but all of them are multiplexed over one epoll loop with
+// non-blocking sockets, and nothing is printed per chunk. Viewers arrive
+// at a fixed rate, as a Poisson process or on a linear ramp, with a
+// resolution and protocol drawn for each. Every viewer's time to first
+// chunk, throughput, loss and playback stalls go into histograms that are
+// printed with their percentiles once the last viewer is done.
+//
+// A viewer plays its video back as it arrives: playback starts --buffer ms
+// after the first chunk, and each chunk holds as much video as the
+// bandwidth in the Type 2 Response delivers in its time. A chunk that
+// arrives after the video before it has played out is a stall.
+
+#ifdef __linux__
+
+#define LOAD_TICK_MS 100            // Timeouts are checked this often
+#define LOAD_REPORT_MS 1000         // Progress line interval
+#define LOAD_CONNECT_TIMEOUT_MS 15000 // Give up on a TCP connection making no progress
+#define LOAD_CONNECT_RETRIES 15     // TCP stream connection attempts, a second apart
+#define LOAD_READY_RETRIES 5        // UDP REQUEST_STREAMs before giving up
+#define LOAD_READY_RETRY_MS 3000    // ...and how long each waits for READY_TO_STREAM
+#define LOAD_FRAGMENT_SLOTS 4       // UDP frames a viewer has fragments of at once
+#define LOAD_MAX_EVENTS 256
+#define LOAD_READ_BUDGET (4 * TCP_CHUNK_SIZE) // Bytes read from one TCP socket per event
+
+// Viewer states
+#define LOAD_IDLE 0                 // Not arrived yet
+#define LOAD_CONNECT 1              // Connecting for the connection phase
+#define LOAD_RESPONSE 2             // Waiting for the Type 2 Response
+#define LOAD_STREAM_CONNECT 3       // TCP: connecting to the stream port
+#define LOAD_BACKOFF 4              // TCP: waiting to retry the stream port
+#define LOAD_READY 5                // Waiting for READY_TO_STREAM
+#define LOAD_STREAMING 6
+#define LOAD_DONE 7
+
+// How a viewer ended
+#define LOAD_COMPLETED 0            // Streamed to the end (UDP: or until the stream went quiet)
+#define LOAD_REJECTED 1             // Turned away by admission control
+#define LOAD_FAILED 2               // Connection error, timeout or a stream cut short
+#define LOAD_OUTCOMES 3
+
+// Arrival processes
+#define ARRIVAL_FIXED 0             // Evenly spaced at --rate
+#define ARRIVAL_POISSON 1           // Exponential gaps averaging 1 / --rate
+#define ARRIVAL_RAMP 2              // Rate climbs by --rate / --ramp every second up to --rate
+
+// Histograms: HIST_SUB buckets per power of two, so values within about
+// 3% share a bucket (an HDR histogram with 1.5 significant digits)
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} Histogram;
+
+// A UDP frame some of whose fragments have arrived; load viewers only
+// count the bytes, they do not put the frame back together
+typedef struct {
+    bool busy;
+    uint32_t sequence;
+    int type;
+    int count;                  // Fragments in the frame
+    uint32_t received;          // Bit f: fragment f is in
+    int size;                   // Body bytes received
+    double started;
+} FragmentTally;
+
+// One simulated viewer
+typedef struct {
+    int fd;
+    int state;                  // LOAD_*
+    int outcome;                // LOAD_COMPLETED etc., once LOAD_DONE
+    bool udp;
+    int resolution;             // Index into resolution_names
+    bool downgraded;
+    int client_id;
+    int bandwidth;              // Kbps, from the Type 2 Response
+    int streaming_port;
+    int tries;                  // Connection attempts or REQUEST_STREAMs sent
+    double arrived;
+    double deadline;            // Timeout of the current state, 0 = none
+    uint8_t frame[WIRE_MESSAGE_FRAME]; // Response, READY or chunk header being read
+    int frame_got;
+    FrameHeader chunk;          // TCP: chunk whose body is being read
+    uint32_t body_left;
+    double chunk_started;       // When its first byte arrived
+    int chunks;
+    uint64_t bytes;
+    double first_chunk;
+    double last_chunk;
+    double play_until;          // When the video received so far has played out
+    int stalls;
+    double stalled;             // Seconds spent stalled
+    ReceiveWindow window;       // UDP: chunks missing
+    FragmentTally fragments[LOAD_FRAGMENT_SLOTS];
+} LoadViewer;
+
+// Options of a --load run
+typedef struct {
+    int viewers;
+    double rate;                // Arrivals per second
+    int arrival;                // ARRIVAL_*
+    double ramp_s;
+    int mix[8];                 // Resolutions drawn from, repeats weigh one more
+    int mix_count;
+    int udp_percent;
+    double buffer_s;            // Playback start after the first chunk
+    uint64_t seed;
+} LoadConfig;
+
+LoadConfig load_config = { 0, 50, ARRIVAL_FIXED, 10, { 0, 1, 2 }, 3, 50, 1.0, 0 };
+
+// Results
+Histogram ttfc_hist;            // Arrival to first chunk, µs
+Histogram throughput_hist;      // First to last chunk, Kbps
+Histogram loss_hist;            // UDP chunks lost, 1/100 %
+Histogram stalls_hist;          // Stalls per viewer
+Histogram stalled_hist;         // Time spent stalled per viewer, µs
+int load_outcomes[LOAD_OUTCOMES];
+int load_downgraded = 0;
+int load_active = 0;
+uint64_t load_bytes = 0;
+uint64_t load_rng = 0;
+int load_epoll = -1;
+struct sockaddr_in load_server;
+uint8_t load_scratch[TCP_CHUNK_SIZE]; // TCP chunk bodies and UDP datagrams are read into this
+
+int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int bucket = (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// Exclusive upper bound of a bucket
+uint64_t hist_bucket_limit(int bucket) {
+    if (bucket < HIST_SUB) {
+        return (uint64_t)bucket + 1;
+    }
+    int msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB + 1) << (msb - HIST_SUB_BITS);
+}
+
+void hist_record(Histogram *h, uint64_t v) {
+    h->counts[hist_bucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+// Upper bound of the bucket holding quantile q (0..1), never above the
+// largest sample
+uint64_t hist_quantile(const Histogram *h, double q) {
+    uint64_t rank = (uint64_t)(q * h->count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            uint64_t limit = hist_bucket_limit(i);
+            return limit < h->max ? limit : h->max;
+        }
+    }
+    return h->max;
+}
+
+// "<label>: avg, p50, p99, p999, max" line, values divided by `scale`
+void hist_print(const char *label, const Histogram *h, double scale, const char *unit) {
+    if (h->count == 0) {
+        printf("%-20s no samples\n", label);
+        return;
+    }
+    printf("%-20s %6" PRIu64 " viewers, avg %.2f%s, p50 %.2f%s, p99 %.2f%s, p999 %.2f%s, max %.2f%s\n",
+           label, h->count, h->sum / scale / h->count, unit, hist_quantile(h, 0.50) / scale, unit,
+           hist_quantile(h, 0.99) / scale, unit, hist_quantile(h, 0.999) / scale, unit, h->max / scale, unit);
+}
+
+// xorshift64*, seeded by --seed so a run draws the same viewers again
+uint64_t load_random(void) {
+    load_rng ^= load_rng >> 12;
+    load_rng ^= load_rng << 25;
+    load_rng ^= load_rng >> 27;
+    return load_rng * 0x2545F4914F6CDD1Dull;
+}
+
+// Uniform in (0, 1]
+double load_uniform(void) {
+    return ((load_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// Natural logarithm for x > 0, which keeps client.c free of -lm:
+// ln(m * 2^e) = e ln 2 + 2 atanh((m - 1) / (m + 1)) with m in [1, 2)
+double load_log(double x) {
+    int e = 0;
+    while (x < 1) {
+        x *= 2;
+        e--;
+    }
+    while (x >= 2) {
+        x /= 2;
+        e++;
+    }
+    double y = (x - 1) / (x + 1), y2 = y * y, term = y, sum = 0;
+    for (int k = 1; k < 40; k += 2) {
+        sum += term / k;
+        term *= y2;
+    }
+    return 2 * sum + e * 0.69314718055994531;
+}
+
+// Seconds from the arrival at `t` (since the first one) to the next
+double load_next_arrival(double t) {
+    switch (load_config.arrival) {
+    case ARRIVAL_POISSON:
+        return -load_log(load_uniform()) / load_config.rate;
+    case ARRIVAL_RAMP: {
+        double share = (t + 1) / load_config.ramp_s;
+        return 1.0 / (load_config.rate * (share < 1 ? share : 1));
+    }
+    default:
+        return 1.0 / load_config.rate;
+    }
+}
+
+// Watch a viewer's socket for reading or, while it connects, writing
+int load_watch(LoadViewer *v, int op, bool writable) {
+    struct epoll_event ev;
+    ev.events = writable ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = v;
+    return epoll_ctl(load_epoll, op, v->fd, &ev);
+}
+
+// Start a non-blocking connection to `port`. Returns false on errors.
+bool load_connect(LoadViewer *v, int port, double now) {
+    struct sockaddr_in addr = load_server;
+    addr.sin_port = htons(port);
+    v->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (v->fd < 0) {
+        return false;
+    }
+    fcntl(v->fd, F_SETFL, fcntl(v->fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(v->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        CLOSE_SOCKET(v->fd);
+        v->fd = INVALID_SOCKET_VALUE;
+        return false;
+    }
+    v->deadline = now + LOAD_CONNECT_TIMEOUT_MS / 1000.0;
+    v->frame_got = 0;
+    return load_watch(v, EPOLL_CTL_ADD, true) == 0;
+}
+
+// Record a viewer's statistics and close its socket
+void load_finish(LoadViewer *v, int outcome) {
+    if (v->fd != INVALID_SOCKET_VALUE) {
+        CLOSE_SOCKET(v->fd);  // Also takes it out of the epoll set
+        v->fd = INVALID_SOCKET_VALUE;
+    }
+    v->state = LOAD_DONE;
+    v->outcome = outcome;
+    load_outcomes[outcome]++;
+    load_active--;
+    if (v->chunks == 0) {
+        return;
+    }
+    hist_record(&stalls_hist, (uint64_t)v->stalls);
+    hist_record(&stalled_hist, (uint64_t)(v->stalled * 1000000.0));
+    if (v->chunks > 1 && v->last_chunk > v->first_chunk) {
+        hist_record(&throughput_hist, (uint64_t)(v->bytes * 8 / (v->last_chunk - v->first_chunk) / 1000.0));
+    }
+    if (v->udp) {
+        int lost = v->window.lost - v->window.recovered;
+        hist_record(&loss_hist, (uint64_t)(lost * 10000.0 / (v->chunks + lost)));
+    }
+}
+
+// A chunk of `size` payload bytes arrived whole
+void load_chunk(LoadViewer *v, int size, double now) {
+    double duration = v->bandwidth > 0 ? size * 8.0 / (v->bandwidth * 1000.0) : 0;
+    if (v->chunks == 0) {
+        v->first_chunk = now;
+        v->play_until = now + load_config.buffer_s + duration;
+        hist_record(&ttfc_hist, (uint64_t)((now - v->arrived) * 1000000.0));
+    } else if (now > v->play_until) {
+        v->stalls++;
+        v->stalled += now - v->play_until;
+        v->play_until = now + duration;
+    } else {
+        v->play_until += duration;
+    }
+    v->last_chunk = now;
+    v->chunks++;
+    v->bytes += size;
+    load_bytes += size;
+}
+
+// Connection phase done: open the stream the way tcp_client() and
+// udp_client() do
+void load_stream(LoadViewer *v, int server_port, double now) {
+    CLOSE_SOCKET(v->fd);
+    v->fd = INVALID_SOCKET_VALUE;
+    v->tries = 1;
+    if (!v->udp) {
+        v->state = LOAD_STREAM_CONNECT;
+        if (!load_connect(v, server_port + 1, now)) {
+            v->state = LOAD_BACKOFF;
+            v->deadline = now + 1;
+        }
+        return;
+    }
+    struct sockaddr_in addr = load_server;
+    addr.sin_port = htons(v->streaming_port);
+    uint8_t request[WIRE_CLIENT_ID_FRAME];
+    int request_len = wire_encode_client_id(request, FRAME_REQUEST_STREAM, v->client_id);
+    v->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (v->fd < 0 || fcntl(v->fd, F_SETFL, fcntl(v->fd, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+        connect(v->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        load_watch(v, EPOLL_CTL_ADD, false) < 0) {
+        load_finish(v, LOAD_FAILED);
+        return;
+    }
+    send(v->fd, (char *)request, request_len, 0);
+    v->state = LOAD_READY;
+    v->deadline = now + LOAD_READY_RETRY_MS / 1000.0;
+}
+
+// Count a fragment of a UDP frame. Returns the frame's body size once all
+// of its fragments are in, else 0.
+int load_fragment(LoadViewer *v, const uint8_t *datagram, int len, const FrameHeader *h, double now) {
+    if (h->length < FRAGMENT_HEADER_SIZE || h->length != (uint32_t)(len - FRAME_HEADER_SIZE)) {
+        return 0;
+    }
+    int index = (int)wire_get16(datagram + FRAME_HEADER_SIZE);
+    int count = (int)wire_get16(datagram + FRAME_HEADER_SIZE + 2);
+    if (count < 1 || count > 32 || index >= count) {
+        return 0;
+    }
+    FragmentTally *slot = NULL, *spare = &v->fragments[0];
+    for (int i = 0; i < LOAD_FRAGMENT_SLOTS; i++) {
+        FragmentTally *f = &v->fragments[i];
+        if (f->busy && f->type == h->type && f->sequence == h->sequence) {
+            slot = f;
+            break;
+        }
+        if (!f->busy || (spare->busy && f->started < spare->started)) {
+            spare = f;
+        }
+    }
+    if (slot == NULL) {
+        slot = spare;  // The oldest frame is the least likely to complete
+        slot->busy = true;
+        slot->type = h->type;
+        slot->sequence = h->sequence;
+        slot->count = count;
+        slot->received = 0;
+        slot->size = 0;
+        slot->started = now;
+    }
+    if (count != slot->count || (slot->received & (1u << index))) {
+        return 0;
+    }
+    slot->received |= 1u << index;
+    slot->size += (int)h->length - FRAGMENT_HEADER_SIZE;
+    if (slot->received != (count == 32 ? ~0u : (1u << count) - 1)) {
+        return 0;
+    }
+    slot->busy = false;
+    return slot->size;
+}
+
+// Read the Type 2 Response; a queued viewer keeps waiting for the next one
+void load_read_response(LoadViewer *v, int server_port, double now) {
+    while (v->state == LOAD_RESPONSE) {
+        int n = recv(v->fd, (char *)v->frame + v->frame_got, WIRE_MESSAGE_FRAME - v->frame_got, 0);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return;
+            }
+            load_finish(v, LOAD_FAILED);
+            return;
+        }
+        v->frame_got += n;
+        if (v->frame_got < WIRE_MESSAGE_FRAME) {
+            continue;
+        }
+        Message response;
+        v->frame_got = 0;
+        if (!wire_decode_response(v->frame, &response)) {
+            load_finish(v, LOAD_FAILED);
+        } else if (response.status == ADMIT_REJECTED) {
+            load_finish(v, LOAD_REJECTED);
+        } else if (response.status != ADMIT_QUEUED) {
+            if (response.status == ADMIT_DOWNGRADED) {
+                v->downgraded = true;
+                load_downgraded++;
+            }
+            v->client_id = response.client_id;
+            v->bandwidth = response.bandwidth;
+            v->streaming_port = response.streaming_port;
+            load_stream(v, server_port, now);
+        }
+    }
+}
+
+// Read a TCP viewer's READY_TO_STREAM or chunk frames
+void load_read_tcp(LoadViewer *v, double now) {
+    int budget = LOAD_READ_BUDGET;
+    while (budget > 0 && (v->state == LOAD_READY || v->state == LOAD_STREAMING)) {
+        int n;
+        if (v->frame_got < FRAME_HEADER_SIZE) {
+            n = recv(v->fd, (char *)v->frame + v->frame_got, FRAME_HEADER_SIZE - v->frame_got, 0);
+        } else {
+            int want = v->body_left < sizeof(load_scratch) ? (int)v->body_left : (int)sizeof(load_scratch);
+            n = recv(v->fd, (char *)load_scratch, want, 0);
+        }
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return;
+            }
+            load_finish(v, LOAD_FAILED);  // Closed before the last chunk
+            return;
+        }
+        budget -= n;
+        v->deadline = now + LOAD_CONNECT_TIMEOUT_MS / 1000.0;
+        if (v->frame_got < FRAME_HEADER_SIZE) {
+            if (v->frame_got == 0) {
+                v->chunk_started = now;
+            }
+            v->frame_got += n;
+            if (v->frame_got < FRAME_HEADER_SIZE) {
+                continue;
+            }
+            FrameHeader h;
+            if (!wire_get_header(v->frame, &h)) {
+                load_finish(v, LOAD_FAILED);
+                return;
+            }
+            if (v->state == LOAD_READY) {
+                if (h.type != FRAME_READY || h.length != 0) {
+                    load_finish(v, LOAD_FAILED);
+                    return;
+                }
+                wire_put_header(v->frame, FRAME_START, 0, 0, 0);
+                send(v->fd, (char *)v->frame, FRAME_HEADER_SIZE, MSG_NOSIGNAL);
+                v->state = LOAD_STREAMING;
+                v->frame_got = 0;
+                continue;
+            }
+            if (h.type != FRAME_CHUNK || h.length > TCP_CHUNK_SIZE) {
+                load_finish(v, LOAD_FAILED);
+                return;
+            }
+            v->chunk = h;
+            v->body_left = h.length;
+        } else {
+            v->body_left -= n;
+        }
+        if (v->body_left > 0) {
+            continue;
+        }
         
-        // Check for lost packets
-        int chunk_id;
-        sscanf(video_chunk, "VIDEO_CHUNK_%d_", &chunk_id);
+        // Whole chunk in: acknowledge it like tcp_client() does
+        uint8_t ack[WIRE_ACK_FRAME];
+        int ack_len = wire_encode_ack(ack, v->client_id, &v->chunk, (uint32_t)(uint64_t)(v->chunk_started * 1000000.0),
+                                      (uint32_t)((now - v->chunk_started) * 1000000.0));
+        send(v->fd, (char *)ack, ack_len, MSG_NOSIGNAL);
+        load_chunk(v, (int)v->chunk.length, now);
+        v->frame_got = 0;
+        if (v->chunk.flags & FRAME_FLAG_LAST) {
+            load_finish(v, LOAD_COMPLETED);
+        }
+    }
+}
+
+// Read a UDP viewer's datagrams
+void load_read_udp(LoadViewer *v, double now) {
+    while (v->state == LOAD_READY || v->state == LOAD_STREAMING) {
+        int n = recv(v->fd, (char *)load_scratch, UDP_FRAME_MAX, 0);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED) {
+                load_finish(v, LOAD_FAILED);
+            }
+            return;
+        }
+        FrameHeader h;
+        if (n < FRAME_HEADER_SIZE || !wire_get_header(load_scratch, &h)) {
+            continue;
+        }
+        v->deadline = now + STREAM_TIMEOUT_MS / 1000.0;
+        if (v->state == LOAD_READY && (h.type == FRAME_READY || h.type == FRAME_CHUNK)) {
+            v->state = LOAD_STREAMING;  // Chunks also show the READY_TO_STREAM got lost
+        }
+        if (h.type == FRAME_READY) {
+            continue;
+        }
+        int size = (int)h.length;
+        if (h.flags & FRAME_FLAG_FRAGMENT) {
+            size = load_fragment(v, load_scratch, n, &h, now);
+            if (size == 0) {
+                continue;
+            }
+        } else if (h.length != (uint32_t)(n - FRAME_HEADER_SIZE)) {
+            continue;
+        }
+        if (h.type != FRAME_CHUNK) {
+            continue;  // Parity: load viewers do not rebuild chunks
+        }
+        uint8_t ack[WIRE_ACK_FRAME];
+        int ack_len = wire_encode_ack(ack, v->client_id, &h, (uint32_t)(uint64_t)(now * 1000000.0), 0);
+        send(v->fd, (char *)ack, ack_len, 0);
+        if (window_receive(&v->window, (int)h.sequence, now) < 0) {
+            continue;  // A copy
+        }
+        load_chunk(v, size, now);
+        if (h.flags & FRAME_FLAG_LAST) {
+            load_finish(v, LOAD_COMPLETED);
+        }
+    }
+}
+
+// Socket event of a viewer
+void load_event(LoadViewer *v, uint32_t events, int server_port, double now) {
+    if (v->state == LOAD_CONNECT || v->state == LOAD_STREAM_CONNECT) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(v->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0 || (events & EPOLLERR)) {
+            if (v->state == LOAD_STREAM_CONNECT && v->tries < LOAD_CONNECT_RETRIES) {
+                CLOSE_SOCKET(v->fd);
+                v->fd = INVALID_SOCKET_VALUE;
+                v->state = LOAD_BACKOFF;
+                v->deadline = now + 1;
+            } else {
+                load_finish(v, LOAD_FAILED);
+            }
+            return;
+        }
+        uint8_t frame[WIRE_MESSAGE_FRAME];
+        int frame_len = v->state == LOAD_CONNECT ?
+            wire_encode_request(resolution_names[v->resolution], v->udp ? "UDP" : "TCP", frame) :
+            wire_encode_client_id(frame, FRAME_CLIENT_ID, v->client_id);
+        if (send(v->fd, (char *)frame, frame_len, MSG_NOSIGNAL) != frame_len || load_watch(v, EPOLL_CTL_MOD, false) < 0) {
+            load_finish(v, LOAD_FAILED);
+            return;
+        }
+        // The control phase has no client timeout: the server answers or closes
+        v->state = v->state == LOAD_CONNECT ? LOAD_RESPONSE : LOAD_READY;
+        v->deadline = v->state == LOAD_RESPONSE ? 0 : now + LOAD_CONNECT_TIMEOUT_MS / 1000.0;
+        return;
+    }
+    if (v->state == LOAD_RESPONSE) {
+        load_read_response(v, server_port, now);
+    } else if (v->udp) {
+        load_read_udp(v, now);
+    } else {
+        load_read_tcp(v, now);
+    }
+}
+
+// Act on a viewer's expired timeout
+void load_timeout(LoadViewer *v, int server_port, double now) {
+    if (v->state == LOAD_BACKOFF) {
+        v->tries++;
+        v->state = LOAD_STREAM_CONNECT;
+        if (!load_connect(v, server_port + 1, now)) {
+            load_finish(v, LOAD_FAILED);
+        }
+    } else if (v->udp && v->state == LOAD_READY && v->tries < LOAD_READY_RETRIES) {
+        uint8_t request[WIRE_CLIENT_ID_FRAME];
+        int request_len = wire_encode_client_id(request, FRAME_REQUEST_STREAM, v->client_id);
+        send(v->fd, (char *)request, request_len, 0);
+        v->tries++;
+        v->deadline = now + LOAD_READY_RETRY_MS / 1000.0;
+    } else {
+        // A UDP stream that went quiet after some chunks lost its tail
+        load_finish(v, v->udp && v->chunks > 0 ? LOAD_COMPLETED : LOAD_FAILED);
+    }
+}
+
+// Start viewer `v` now
+void load_arrive(LoadViewer *v, double now) {
+    v->fd = INVALID_SOCKET_VALUE;
+    v->arrived = now;
+    v->udp = (int)(load_random() % 100) < load_config.udp_percent;
+    v->resolution = load_config.mix[load_random() % load_config.mix_count];
+    v->state = LOAD_CONNECT;
+    load_active++;
+    if (!load_connect(v, ntohs(load_server.sin_port), now)) {
+        load_finish(v, LOAD_FAILED);
+    }
+}
+
+// Parse the options after "--load N". Returns 0 on errors.
+int parse_load_options(int argc, char *argv[], int first) {
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            load_config.rate = atof(argv[++i]);
+            if (load_config.rate <= 0) {
+                printf("Invalid arrival rate: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--arrival") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "fixed") == 0) {
+                load_config.arrival = ARRIVAL_FIXED;
+            } else if (strcmp(argv[i], "poisson") == 0) {
+                load_config.arrival = ARRIVAL_POISSON;
+            } else if (strcmp(argv[i], "ramp") == 0) {
+                load_config.arrival = ARRIVAL_RAMP;
+            } else {
+                printf("Invalid arrival process: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--ramp") == 0 && i + 1 < argc) {
+            load_config.ramp_s = atof(argv[++i]);
+            if (load_config.ramp_s <= 0) {
+                printf("Invalid ramp: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            char list[64];
+            snprintf(list, sizeof(list), "%s", argv[++i]);
+            load_config.mix_count = 0;
+            for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+                int r = 0;
+                while (r < RESOLUTION_COUNT && strcmp(name, resolution_names[r]) != 0) {
+                    r++;
+                }
+                if (r == RESOLUTION_COUNT || load_config.mix_count == 8) {
+                    printf("Invalid resolution mix: %s\n", argv[i]);
+                    return 0;
+                }
+                load_config.mix[load_config.mix_count++] = r;
+            }
+            if (load_config.mix_count == 0) {
+                printf("Invalid resolution mix: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--udp") == 0 && i + 1 < argc) {
+            load_config.udp_percent = atoi(argv[++i]);
+            if (load_config.udp_percent < 0 || load_config.udp_percent > 100) {
+                printf("Invalid UDP share: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--buffer") == 0 && i + 1 < argc) {
+            load_config.buffer_s = atof(argv[++i]) / 1000.0;
+            if (load_config.buffer_s < 0) {
+                printf("Invalid playback buffer: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            load_config.seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            printf("Unknown or incomplete option: %s\n", argv[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Run the --load test against the server and print its results
+int load_test(const char *server_ip, int server_port) {
+    memset(&load_server, 0, sizeof(load_server));
+    load_server.sin_family = AF_INET;
+    load_server.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &load_server.sin_addr) <= 0) {
+        print_socket_error("Invalid address or address not supported");
+        return -1;
+    }
+    
+    // Every viewer holds a socket; take all the descriptors we may
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    LoadViewer *viewers = calloc(load_config.viewers, sizeof(LoadViewer));
+    load_epoll = epoll_create1(0);
+    if (viewers == NULL || load_epoll < 0) {
+        perror("Load test setup failed");
+        free(viewers);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    load_rng = load_config.seed != 0 ? load_config.seed : (uint64_t)time(NULL);
+    load_rng |= 1;  // xorshift state must not be 0
+    
+    const char *arrivals[] = { "fixed", "Poisson", "ramp" };
+    printf("Load test: %d viewers, %s arrivals at %.1f/s, %d%% UDP, %.0f ms playback buffer\n",
+           load_config.viewers, arrivals[load_config.arrival], load_config.rate,
+           load_config.udp_percent, load_config.buffer_s * 1000.0);
+    
+    struct epoll_event events[LOAD_MAX_EVENTS];
+    double start = get_time();
+    double next_arrival = start;
+    double next_tick = start + LOAD_TICK_MS / 1000.0;
+    double next_report = start + LOAD_REPORT_MS / 1000.0;
+    uint64_t reported_bytes = 0;
+    int arrived = 0;
+    while (arrived < load_config.viewers || load_active > 0) {
+        double now = get_time();
+        double wake = next_tick;
+        if (arrived < load_config.viewers && next_arrival < wake) {
+            wake = next_arrival;
+        }
+        int timeout = wake > now ? (int)((wake - now) * 1000.0) + 1 : 0;
+        int n = epoll_wait(load_epoll, events, LOAD_MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        now = get_time();
+        for (int i = 0; i < n; i++) {
+            LoadViewer *v = events[i].data.ptr;
+            if (v->state != LOAD_DONE) {
+                load_event(v, events[i].events, server_port, now);
+            }
+        }
         
-        if (expected_chunk_id != -1 && chunk_id != expected_chunk_id) {
-            lost_packets += (chunk_id - expected_chunk_id - 1);
-            printf("\nPacket loss detected! Expected %d, got %d\n", 
-                   expected_chunk_id + 1, chunk_id);
+        while (arrived < load_config.viewers && now >= next_arrival) {
+            load_arrive(&viewers[arrived++], now);
+            next_arrival += load_next_arrival(next_arrival - start);
         }
-        expected_chunk_id = chunk_id;
         
-        // Print statistics every 10 chunks
-        if (chunks_received % 10 == 0) {
-            double overall_data_rate = total_data / elapsed;
-            if (interval > 0) {
-                recent_data = (bytes_received * 10) / interval;
+        if (now >= next_tick) {
+            for (int i = 0; i < arrived; i++) {
+                LoadViewer *v = &viewers[i];
+                if (v->state != LOAD_DONE && v->deadline > 0 && now >= v->deadline) {
+                    load_timeout(v, server_port, now);
+                }
             }
-            
-            printf("\n----- UDP Streaming Statistics -----\n");
-            printf("Resolution: %s (Bandwidth: %d Kbps)\n", resolution, bandwidth);
-            printf("Chunks received: %d\n", chunks_received);
-            printf("Total data received: %lu bytes\n", total_data);
-            printf("Elapsed time: %.2f seconds\n", elapsed);
-            printf("Overall data rate: %.2f bytes/sec\n", overall_data_rate);
-            printf("Recent data rate: %lu bytes/sec\n", recent_data);
-            printf("Lost packets: %d\n", lost_packets);
-            printf("Packet loss rate: %.2f%%\n", 
-                   (lost_packets * 100.0) / (chunks_received + lost_packets));
-            printf("------------------------------------\n");
-            
-            last_stats_time = current_time;
+            next_tick = now + LOAD_TICK_MS / 1000.0;
         }
         
-        // Simulate video processing
-        printf("\rReceiving chunk #%d", chunk_id);
-        fflush(stdout);
+        if (now >= next_report) {
+            printf("[%6.1f s] %d arrived, %d active, %d completed, %d rejected, %d failed, %.2f Mbit/s\n",
+                   now - start, arrived, load_active, load_outcomes[LOAD_COMPLETED],
+                   load_outcomes[LOAD_REJECTED], load_outcomes[LOAD_FAILED],
+                   (load_bytes - reported_bytes) * 8.0 / (now - next_report + LOAD_REPORT_MS / 1000.0) / 1000000.0);
+            fflush(stdout);
+            reported_bytes = load_bytes;
+            next_report = now + LOAD_REPORT_MS / 1000.0;
+        }
     }
     
-    printf("\nStream ended after receiving %d chunks\n", chunks_received);
-    CLOSE_SOCKET(sock);
+    double elapsed = get_time() - start;
+    int udp_viewers = 0;
+    for (int i = 0; i < arrived; i++) {
+        udp_viewers += viewers[i].udp;
+    }
+    printf("\n----- Load Test Results -----\n");
+    printf("Viewers: %d (%d TCP, %d UDP) in %.2f seconds\n", arrived, arrived - udp_viewers, udp_viewers, elapsed);
+    printf("Completed: %d, downgraded: %d, rejected: %d, failed: %d\n", load_outcomes[LOAD_COMPLETED],
+           load_downgraded, load_outcomes[LOAD_REJECTED], load_outcomes[LOAD_FAILED]);
+    printf("Total data received: %" PRIu64 " bytes (%.2f Mbit/s)\n", load_bytes,
+           elapsed > 0 ? load_bytes * 8.0 / elapsed / 1000000.0 : 0);
+    hist_print("Time to first chunk:", &ttfc_hist, 1000.0, " ms");
+    hist_print("Throughput:", &throughput_hist, 1.0, " Kbps");
+    hist_print("UDP chunk loss:", &loss_hist, 100.0, "%");
+    hist_print("Stalls:", &stalls_hist, 1.0, "");
+    hist_print("Time stalled:", &stalled_hist, 1000.0, " ms");
+    printf("-----------------------------\n");
+    
+    CLOSE_SOCKET(load_epoll);
+    free(viewers);
+    return load_outcomes[LOAD_FAILED] > 0 ? 1 : 0;
+}
+
+#endif // __linux__
+
+void print_usage(const char *program) {
+    printf("Usage: %s <Server IP> <Server Port> <Resolution: 480p/720p/1080p> <Mode: TCP/UDP>\n", program);
+    printf("       %s <Server IP> <Server Port> --load <Viewers> [options]\n", program);
+    printf("Load test options (Linux only):\n");
+    printf("  --rate N            Viewer arrivals per second (default: 50)\n");
+    printf("  --arrival PROCESS   fixed, poisson, or ramp: the rate climbs to --rate over --ramp (default: fixed)\n");
+    printf("  --ramp SECONDS      Length of the ramp (default: 10)\n");
+    printf("  --mix LIST          Resolutions viewers pick from, repeat one to weigh it (default: 480p,720p,1080p)\n");
+    printf("  --udp PERCENT       Viewers streaming over UDP, the rest use TCP (default: 50)\n");
+    printf("  --buffer MS         Video buffered before playback starts (default: 1000)\n");
+    printf("  --seed N            Seed of the viewer draws, to repeat a run (default: from the clock)\n");
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        printf("Usage: %s <Server IP> <Server Port> <Resolution: 480p/720p/1080p> <Mode: TCP/UDP>\n", argv[0]);
+    bool load = argc >= 5 && strcmp(argv[3], "--load") == 0;
+    if (argc != 5 && !load) {
+        print_usage(argv[0]);
         return -1;
     }
     
@@ -559,6 +1972,23 @@ int main(int argc, char *argv[]) {
     
     const char *server_ip = argv[1];
     int server_port = atoi(argv[2]);
+    if (load) {
+#ifdef __linux__
+        load_config.viewers = atoi(argv[4]);
+        if (load_config.viewers <= 0 || !parse_load_options(argc, argv, 5)) {
+            print_usage(argv[0]);
+            cleanup_socket_system();
+            return -1;
+        }
+        int result = load_test(server_ip, server_port);
+        cleanup_socket_system();
+        return result;
+#else
+        printf("--load needs Linux (epoll)\n");
+        cleanup_socket_system();
+        return -1;
+#endif
+    }
     const char *resolution = argv[3];
     const char *mode = argv[4];
     
@@ -0,0 +1,1214 @@
+#define _GNU_SOURCE  // splice, recvmmsg/sendmmsg and F_SETPIPE_SZ are Linux extensions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#ifndef __linux__
+    #error "linkem needs Linux: epoll, splice and recvmmsg/sendmmsg"
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * linkem: userspace link emulator for benchmarking server.c and client.c
+ *
+ * A relay that sits between the clients and the server on one machine and
+ * sends their traffic over emulated links, one per direction, in the style
+ * of Mahimahi's link and delay shells:
+ *
+ *   client --> [listen port] linkem --uplink--> server
+ *   client <-- [listen port] linkem <-downlink- server
+ *
+ * A link delivers data only at the delivery opportunities of a trace: each
+ * line of a Mahimahi trace file is the millisecond at which LINK_MTU bytes
+ * may leave, and the trace repeats after its last line. Before it reaches
+ * the link's queue every packet crosses a fixed one-way delay. UDP
+ * datagrams may be lost on the way in and are dropped when the queue is
+ * over its limit (drop-tail). A run with the same traces, options and seed
+ * treats the same traffic the same way.
+ *
+ * TCP connections are terminated on both ends and their bytes moved with
+ * splice() from socket to pipe to socket, never copied through user space.
+ * The pipe is the connection's buffer in the proxy: the bytes wait in it
+ * for their delay and their delivery opportunities, and once it is full
+ * the proxy stops reading, which slows the sender down through TCP's own
+ * flow control. TCP data is never lost. UDP uses recvmmsg()/sendmmsg() in
+ * batches of UDP_BATCH, with one upstream socket per client address so the
+ * server's replies find their way back.
+ *
+ * The server names its UDP port in the Type 2 Response, so it must be told
+ * to name the proxy's instead: run it with --advertise-port <listen port>.
+ * Clients then connect to the proxy's listen port as they would to the
+ * server, and the TCP stream port is the listen port + 1 as usual.
+ */
+
+#define LINK_MTU 1500               // Bytes one delivery opportunity carries
+#define LINK_BATCH 64               // Opportunities served together when they are due at once
+#define UDP_BATCH 64                // Datagrams per recvmmsg()/sendmmsg()
+#define UDP_MAX_DATAGRAM 65536
+#define UDP_FLOW_BUCKETS 4096       // Client address hash table, a power of two
+#define UDP_FLOW_IDLE_MS 30000      // Forget a UDP client after this long without traffic
+#define TCP_BUFFER_DEFAULT (1 << 20) // Pipe per TCP direction (--tcp-buffer)
+#define MAX_EVENTS 256
+#define REPORT_MS 1000              // Sweep idle UDP flows this often
+
+// Link directions
+#define UPLINK 0                    // Client to server
+#define DOWNLINK 1                  // Server to client
+
+// What an epoll event belongs to; every tag is the first member of its owner
+#define SOURCE_CONTROL_LISTENER 1   // TCP listen port: connection phase
+#define SOURCE_STREAM_LISTENER 2    // TCP listen port + 1: TCP streams
+#define SOURCE_UDP_LISTENER 3       // UDP listen port: datagrams from clients
+#define SOURCE_UDP_FLOW 4           // A client's upstream UDP socket to the server
+#define SOURCE_CONN_CLIENT 5        // Client end of a relayed TCP connection
+#define SOURCE_CONN_SERVER 6        // Server end of a relayed TCP connection
+
+typedef struct Conn Conn;
+typedef struct Side Side;
+typedef struct Flow Flow;
+
+// Data on a link: a UDP datagram, or bytes a TCP side moved into its pipe
+typedef struct Packet {
+    struct Packet *prev;
+    struct Packet *next;
+    double release;             // When it has crossed the delay, ms since start
+    int len;                    // TCP: bytes still in the pipe; UDP: datagram size
+    int credit;                 // UDP: opportunity bytes still owed before it leaves
+    Side *side;                 // TCP side whose pipe holds the bytes, NULL for UDP
+    Flow *flow;                 // UDP client the datagram belongs to
+    uint8_t data[];             // UDP datagram
+} Packet;
+
+// One direction of the emulated path. Packets are kept in arrival order,
+// which the fixed delay turns into release order; those before `boundary`
+// have crossed the delay and wait in the queue for delivery opportunities.
+typedef struct {
+    const char *name;
+    int *trace;                 // Opportunity times in ms, NULL = unlimited rate
+    int trace_len;
+    long next;                  // Next opportunity, counted across repetitions of the trace
+    double delay_ms;
+    double loss;                // UDP loss on the way in, %
+    long queue_limit;           // Queue bytes beyond which UDP datagrams are dropped, 0 = none
+    long queued;                // Bytes in the queue
+    Packet *head;
+    Packet *tail;
+    Packet *boundary;           // First packet still crossing the delay, NULL if none
+    uint64_t delivered_bytes;
+    uint64_t delivered_datagrams;
+    uint64_t lost;              // UDP datagrams taken by --loss
+    uint64_t tail_drops;        // ...and by the full queue
+    uint64_t opportunities;     // Opportunities that passed, used or not
+    uint64_t used;              // ...that delivered something
+    double sojourn_sum;         // Queueing delay of delivered datagrams, ms
+    double sojourn_max;
+} Link;
+
+// One direction of a relayed TCP connection
+struct Side {
+    Conn *conn;
+    int dir;                    // UPLINK or DOWNLINK
+    int in;                     // Socket the bytes come from
+    int out;                    // Socket they go to
+    int pipe[2];
+    int capacity;               // Pipe size
+    int buffered;               // Bytes in the pipe
+    int pending;                // Its packets on the link
+    bool readable;              // Stopped reading with data left: the pipe was full
+    bool eof;                   // `in` reached end of file
+    bool blocked;               // `out` is full, or still connecting
+    bool shut;                  // `out` shut down for writing
+    bool paused;                // On the paused list
+    Side *next_paused;
+};
+
+// Tag of one socket of a connection
+typedef struct {
+    int source;                 // SOURCE_CONN_CLIENT or SOURCE_CONN_SERVER
+    Conn *conn;
+} ConnEnd;
+
+struct Conn {
+    ConnEnd ends[2];            // Client and server socket tags
+    int fd[2];                  // Client socket, server socket
+    Side side[2];               // UPLINK: client to server, DOWNLINK: server to client
+    bool connecting;            // Server socket still connecting
+    bool closed;                // Sockets closed; freed once no packet refers to it
+    Conn *next_dead;            // On the list freed after the event loop iteration
+};
+
+// A UDP client and the socket relaying its datagrams to the server
+struct Flow {
+    int source;                 // SOURCE_UDP_FLOW, must stay the first member
+    int fd;                     // Connected to the server's UDP port
+    struct sockaddr_in client;
+    double last_active;
+    int pending;                // Its packets on either link
+    Flow *next;                 // Hash chain
+};
+
+// Runtime options
+typedef struct {
+    int listen_port;
+    struct sockaddr_in server;  // Control port; the TCP stream port is one above
+    const char *traces[2];      // Trace file per direction (--uplink/--downlink)
+    int rate_kbps[2];           // Constant rate instead of a trace (--uplink-kbps/--downlink-kbps)
+    double delay_ms;
+    double loss[2];
+    long queue_limit;
+    int tcp_buffer;
+    uint64_t seed;
+} ProxyConfig;
+
+ProxyConfig proxy_config = { 0, { 0 }, { NULL, NULL }, { 0, 0 }, 0, { 0, 0 }, 0,
+                             TCP_BUFFER_DEFAULT, 0 };
+
+// Globals
+int epoll_fd = -1;
+int control_listener_fd = -1;
+int stream_listener_fd = -1;
+int udp_fd = -1;                // Also sends the downlink's datagrams back to the clients
+int control_listener_source = SOURCE_CONTROL_LISTENER;
+int stream_listener_source = SOURCE_STREAM_LISTENER;
+int udp_listener_source = SOURCE_UDP_LISTENER;
+Link links[2];
+Flow *flows[UDP_FLOW_BUCKETS];
+int flow_count = 0;
+Side *paused_sides = NULL;      // TCP sides that stopped reading on a full pipe
+Conn *dead_conns = NULL;        // Closed connections nothing refers to any more
+uint64_t rng[4];                // xoshiro256** state for the loss
+struct timespec start_time;
+volatile sig_atomic_t running = 1;
+uint64_t conns_opened = 0;
+bool pipe_size_warned = false;
+
+// Batch of downlink datagrams for one sendmmsg() on udp_fd
+struct mmsghdr out_msgs[UDP_BATCH];
+struct iovec out_iov[UDP_BATCH];
+Packet *out_packets[UDP_BATCH];
+int out_count = 0;
+
+// ---- Helpers ----
+
+// Milliseconds since the proxy started; traces count from here
+double clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - start_time.tv_sec) * 1000.0 + (ts.tv_nsec - start_time.tv_nsec) / 1000000.0;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int watch(int fd, void *tag, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = tag;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// xoshiro256**
+uint64_t rng_next(void) {
+    uint64_t result = rotl64(rng[1] * 5, 7) * 9;
+    uint64_t t = rng[1] << 17;
+    rng[2] ^= rng[0];
+    rng[3] ^= rng[1];
+    rng[1] ^= rng[2];
+    rng[0] ^= rng[3];
+    rng[2] ^= t;
+    rng[3] = rotl64(rng[3], 45);
+    return result;
+}
+
+bool rng_chance(double percent) {
+    return percent > 0 && (rng_next() >> 11) * (1.0 / 9007199254740992.0) * 100.0 < percent;
+}
+
+// ---- Traces ----
+
+// Load a Mahimahi trace: one opportunity time in ms per line, non-decreasing,
+// the last one positive. Returns the number of opportunities, 0 on errors.
+int trace_load(const char *path, int **out) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return 0;
+    }
+    int count = 0, capacity = 1024;
+    int *times = malloc(capacity * sizeof(int));
+    long t;
+    while (times != NULL && fscanf(f, "%ld", &t) == 1) {
+        if (t < 0 || (count > 0 && t < times[count - 1])) {
+            printf("%s: opportunity times must not decrease (line %d)\n", path, count + 1);
+            free(times);
+            fclose(f);
+            return 0;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            int *grown = realloc(times, capacity * sizeof(int));
+            if (grown == NULL) {
+                free(times);
+            }
+            times = grown;
+            if (times == NULL) {
+                break;
+            }
+        }
+        times[count++] = (int)t;
+    }
+    fclose(f);
+    if (times == NULL) {
+        perror("Memory allocation failed");
+        return 0;
+    }
+    if (count == 0 || times[count - 1] <= 0) {
+        printf("%s: not a Mahimahi trace\n", path);
+        free(times);
+        return 0;
+    }
+    *out = times;
+    return count;
+}
+
+// A one-second trace with opportunities spread evenly for `kbps`, like
+// Mahimahi's constant-rate traces
+int trace_constant(int kbps, int **out) {
+    int count = (int)((int64_t)kbps * 1000 / 8 / LINK_MTU);
+    if (count < 1) {
+        return 0;
+    }
+    int *times = malloc(count * sizeof(int));
+    if (times == NULL) {
+        perror("Memory allocation failed");
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        times[i] = (int)((int64_t)(i + 1) * 1000 / count);
+    }
+    *out = times;
+    return count;
+}
+
+// Time of opportunity `k`, counted across repetitions of the trace
+double link_opportunity(const Link *l, long k) {
+    long period = l->trace[l->trace_len - 1];
+    return (double)l->trace[k % l->trace_len] + (double)(k / l->trace_len) * period;
+}
+
+// First opportunity from l->next on at or after `t`
+long link_first_opportunity(const Link *l, double t) {
+    long period = l->trace[l->trace_len - 1];
+    long loop = (long)(t / period);
+    int lo = 0, hi = l->trace_len - 1;  // trace[hi] + loop * period > t
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (l->trace[mid] + (double)loop * period >= t) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    long k = loop * l->trace_len + lo;
+    return k > l->next ? k : l->next;
+}
+
+// ---- Links ----
+
+void link_append(Link *l, Packet *p) {
+    p->next = NULL;
+    p->prev = l->tail;
+    if (l->tail != NULL) {
+        l->tail->next = p;
+    } else {
+        l->head = p;
+    }
+    l->tail = p;
+    if (l->boundary == NULL) {
+        l->boundary = p;
+    }
+}
+
+void link_unlink(Link *l, Packet *p) {
+    if (p->prev != NULL) {
+        p->prev->next = p->next;
+    } else {
+        l->head = p->next;
+    }
+    if (p->next != NULL) {
+        p->next->prev = p->prev;
+    } else {
+        l->tail = p->prev;
+    }
+    if (l->boundary == p) {
+        l->boundary = p->next;
+    }
+}
+
+void conn_release(Conn *c);
+void side_settle(Side *s);
+
+// Take a packet off its link and free it
+void link_remove(Link *l, Packet *p, bool queued) {
+    link_unlink(l, p);
+    if (queued) {
+        l->queued -= p->len;
+    }
+    if (p->side != NULL) {
+        p->side->pending--;
+        side_settle(p->side);
+    } else {
+        p->flow->pending--;
+    }
+    free(p);
+}
+
+// Let the packets whose delay has passed by `t` into the queue; UDP
+// datagrams that do not fit are dropped
+void link_admit(Link *l, double t) {
+    while (l->boundary != NULL && l->boundary->release <= t) {
+        Packet *p = l->boundary;
+        if (p->side == NULL && l->queue_limit > 0 && l->queued + p->len > l->queue_limit) {
+            l->tail_drops++;
+            link_remove(l, p, false);  // Moves the boundary on
+            continue;
+        }
+        l->queued += p->len;
+        l->boundary = p->next;
+    }
+}
+
+void udp_flush(void);
+
+// Hand a datagram that made it across the link to its socket
+void udp_deliver(Link *l, Packet *p, double now) {
+    double sojourn = now - p->release;
+    l->sojourn_sum += sojourn;
+    if (sojourn > l->sojourn_max) {
+        l->sojourn_max = sojourn;
+    }
+    l->delivered_bytes += p->len;
+    l->delivered_datagrams++;
+    link_unlink(l, p);
+    l->queued -= p->len;
+    if (l == &links[UPLINK]) {
+        // Upstream sockets are connected; a lost send is a lost datagram
+        send(p->flow->fd, p->data, p->len, MSG_DONTWAIT);
+        p->flow->pending--;
+        free(p);
+        return;
+    }
+    struct msghdr *msg = &out_msgs[out_count].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    out_iov[out_count].iov_base = p->data;
+    out_iov[out_count].iov_len = p->len;
+    msg->msg_name = &p->flow->client;
+    msg->msg_namelen = sizeof(p->flow->client);
+    msg->msg_iov = &out_iov[out_count];
+    msg->msg_iovlen = 1;
+    out_packets[out_count++] = p;
+    if (out_count == UDP_BATCH) {
+        udp_flush();
+    }
+}
+
+void conn_fail(Conn *c, const char *what);
+
+// Write up to `want` bytes of a TCP packet from its side's pipe. Returns
+// the bytes written; a full socket blocks the side until EPOLLOUT, which
+// being edge-triggered only comes once splice() has seen EAGAIN.
+int tcp_deliver(Link *l, Packet *p, int want) {
+    Side *s = p->side;
+    int sent = 0;
+    while (sent < want) {
+        ssize_t n = splice(s->pipe[0], NULL, s->out, NULL, want - sent, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            sent += (int)n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            s->blocked = true;
+            break;
+        } else if (n == 0 || errno != EINTR) {
+            conn_fail(s->conn, "write");
+            return 0;
+        }
+    }
+    p->len -= sent;
+    s->buffered -= sent;
+    l->queued -= sent;
+    l->delivered_bytes += sent;
+    if (p->len == 0) {
+        link_remove(l, p, false);
+    }
+    return sent;
+}
+
+// Deliver queued packets in order until `budget` bytes are used (< 0:
+// no limit). TCP sides that cannot take more are skipped along with all
+// their later packets, so each connection stays in order.
+int link_serve(Link *l, int budget, double now) {
+    Packet *p = l->head;
+    while (p != l->boundary && budget != 0) {
+        Packet *next = p->next;
+        if (p->side == NULL) {
+            int take = budget < 0 || p->credit < budget ? p->credit : budget;
+            p->credit -= take;
+            if (budget > 0) {
+                budget -= take;
+            }
+            if (p->credit == 0) {
+                udp_deliver(l, p, now);
+            }
+        } else if (p->side->conn->closed) {
+            link_remove(l, p, true);
+        } else if (!p->side->blocked) {
+            int sent = tcp_deliver(l, p, budget < 0 || p->len < budget ? p->len : budget);
+            if (budget > 0) {
+                budget -= sent;
+            }
+        }
+        p = next;
+    }
+    return budget;
+}
+
+// Whether a queued packet could go out now
+bool link_ready(const Link *l) {
+    for (Packet *p = l->head; p != l->boundary; p = p->next) {
+        if (p->side == NULL || (!p->side->blocked && !p->side->conn->closed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Run the link up to `now`: every opportunity that passed delivers
+// LINK_MTU bytes of what was queued by then. Opportunities with no
+// release between them are served together, up to LINK_BATCH at a time,
+// so a fast link costs one splice() per batch rather than per
+// opportunity; stretches with nothing queued are skipped without walking
+// their opportunities.
+void link_run(Link *l, double now) {
+    if (l->trace == NULL) {
+        link_admit(l, now);
+        link_serve(l, -1, now);
+        return;
+    }
+    while (1) {
+        if (l->head == l->boundary) {
+            // Nothing queued: jump to the first opportunity after the next release
+            double release = l->boundary != NULL ? l->boundary->release : now;
+            long k = link_first_opportunity(l, release < now ? release : now);
+            l->opportunities += k - l->next;
+            l->next = k;
+        }
+        double t = link_opportunity(l, l->next);
+        if (t > now) {
+            break;
+        }
+        link_admit(l, t);
+        int count = 1;
+        while (count < LINK_BATCH) {
+            double later = link_opportunity(l, l->next + count);
+            if (later > now || (l->boundary != NULL && later >= l->boundary->release)) {
+                break;
+            }
+            count++;
+        }
+        l->opportunities += count;
+        l->next += count;
+        int budget = count * LINK_MTU;
+        int left = link_serve(l, budget, t);
+        l->used += (budget - left + LINK_MTU - 1) / LINK_MTU;
+        if (left == budget && l->head != l->boundary) {
+            // What is queued is stuck behind full sockets: the opportunities
+            // until the next release or now would go unused as well
+            double release = l->boundary != NULL ? l->boundary->release : now;
+            long k = link_first_opportunity(l, release < now ? release : now);
+            l->opportunities += k - l->next;
+            l->next = k;
+        }
+    }
+    link_admit(l, now);
+}
+
+// When the link next needs to run, in ms since start; < 0 if only a
+// socket event can move it
+double link_next_event(const Link *l) {
+    bool ready = link_ready(l);
+    if (l->trace == NULL) {
+        return l->boundary != NULL ? l->boundary->release : -1;
+    }
+    if (ready) {
+        return link_opportunity(l, l->next);
+    }
+    if (l->boundary == NULL) {
+        return -1;
+    }
+    return link_opportunity(l, link_first_opportunity(l, l->boundary->release));
+}
+
+// Send the batched downlink datagrams
+void udp_flush(void) {
+    int done = 0;
+    while (done < out_count) {
+        int n = sendmmsg(udp_fd, out_msgs + done, out_count - done, MSG_DONTWAIT);
+        if (n > 0) {
+            done += n;
+        } else if (errno != EINTR) {
+            break;  // The rest are lost, like any UDP datagram
+        }
+    }
+    for (int i = 0; i < out_count; i++) {
+        out_packets[i]->flow->pending--;
+        free(out_packets[i]);
+    }
+    out_count = 0;
+}
+
+// ---- UDP ----
+
+unsigned flow_hash(const struct sockaddr_in *addr) {
+    uint32_t h = addr->sin_addr.s_addr * 2654435761u ^ addr->sin_port * 40503u;
+    return (h ^ (h >> 16)) & (UDP_FLOW_BUCKETS - 1);
+}
+
+// The flow of a client address, opened on its first datagram
+Flow *flow_get(const struct sockaddr_in *client, double now) {
+    Flow **bucket = &flows[flow_hash(client)];
+    for (Flow *f = *bucket; f != NULL; f = f->next) {
+        if (f->client.sin_addr.s_addr == client->sin_addr.s_addr && f->client.sin_port == client->sin_port) {
+            f->last_active = now;
+            return f;
+        }
+    }
+    Flow *f = calloc(1, sizeof(Flow));
+    if (f == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    f->source = SOURCE_UDP_FLOW;
+    f->client = *client;
+    f->last_active = now;
+    f->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (f->fd < 0 || connect(f->fd, (struct sockaddr *)&proxy_config.server, sizeof(proxy_config.server)) < 0 ||
+        watch(f->fd, f, EPOLLIN | EPOLLET) < 0) {
+        perror("UDP upstream socket");
+        if (f->fd >= 0) {
+            close(f->fd);
+        }
+        free(f);
+        return NULL;
+    }
+    f->next = *bucket;
+    *bucket = f;
+    flow_count++;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client->sin_addr, ip, sizeof(ip));
+    printf("UDP client %s:%d relayed\n", ip, ntohs(client->sin_port));
+    return f;
+}
+
+// Forget UDP clients that went quiet and have nothing on the links
+void flow_sweep(double now) {
+    for (int b = 0; b < UDP_FLOW_BUCKETS; b++) {
+        Flow **link = &flows[b];
+        while (*link != NULL) {
+            Flow *f = *link;
+            if (f->pending == 0 && now - f->last_active > UDP_FLOW_IDLE_MS) {
+                *link = f->next;
+                close(f->fd);
+                free(f);
+                flow_count--;
+            } else {
+                link = &f->next;
+            }
+        }
+    }
+}
+
+// Put an arriving datagram on a link, unless the loss takes it
+void udp_enqueue(int dir, Flow *f, const uint8_t *data, int len, double now) {
+    Link *l = &links[dir];
+    if (rng_chance(l->loss)) {
+        l->lost++;
+        return;
+    }
+    Packet *p = malloc(sizeof(Packet) + len);
+    if (p == NULL) {
+        perror("Memory allocation failed");
+        return;
+    }
+    memcpy(p->data, data, len);
+    p->release = now + l->delay_ms;
+    p->len = len;
+    p->credit = len;
+    p->side = NULL;
+    p->flow = f;
+    f->pending++;
+    link_append(l, p);
+}
+
+// Read every datagram waiting on `fd`: client datagrams on the listener
+// (uplink) or the server's on a flow's upstream socket (downlink)
+void udp_read(int fd, Flow *flow) {
+    static uint8_t buffers[UDP_BATCH][UDP_MAX_DATAGRAM];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_in from[UDP_BATCH];
+    while (1) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iov[i].iov_base = buffers[i];
+            iov[i].iov_len = UDP_MAX_DATAGRAM;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        int n = recvmmsg(fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                perror("recvmmsg");
+            }
+            return;
+        }
+        double now = clock_ms();
+        for (int i = 0; i < n; i++) {
+            if (flow == NULL) {
+                Flow *f = flow_get(&from[i], now);
+                if (f != NULL) {
+                    udp_enqueue(UPLINK, f, buffers[i], (int)msgs[i].msg_len, now);
+                }
+            } else {
+                flow->last_active = now;
+                udp_enqueue(DOWNLINK, flow, buffers[i], (int)msgs[i].msg_len, now);
+            }
+        }
+        if (n < UDP_BATCH) {
+            return;
+        }
+    }
+}
+
+// ---- TCP ----
+
+// Retire a closed connection once nothing refers to it. It is freed
+// after the event loop iteration, as later events of the same batch may
+// still point at it.
+void conn_release(Conn *c) {
+    if (!c->closed || c->side[0].pending > 0 || c->side[1].pending > 0 ||
+        c->side[0].paused || c->side[1].paused || c->next_dead != NULL || dead_conns == c) {
+        return;
+    }
+    c->next_dead = dead_conns;
+    dead_conns = c;
+}
+
+void conn_reap(void) {
+    while (dead_conns != NULL) {
+        Conn *c = dead_conns;
+        dead_conns = c->next_dead;
+        for (int dir = 0; dir < 2; dir++) {
+            close(c->side[dir].pipe[0]);
+            close(c->side[dir].pipe[1]);
+        }
+        free(c);
+    }
+}
+
+// Close both sockets; whatever the links still hold for it is dropped
+void conn_close(Conn *c) {
+    if (c->closed) {
+        return;
+    }
+    c->closed = true;
+    close(c->fd[0]);
+    close(c->fd[1]);
+    conn_release(c);
+}
+
+void conn_fail(Conn *c, const char *what) {
+    if (!c->closed && errno != ECONNRESET && errno != EPIPE) {
+        perror(what);
+    }
+    conn_close(c);
+}
+
+// Once a side read end of file and delivered everything, pass the end of
+// file on; a connection whose both sides did is done
+void side_settle(Side *s) {
+    Conn *c = s->conn;
+    if (c->closed) {
+        conn_release(c);
+        return;
+    }
+    if (s->eof && s->pending == 0 && !s->shut) {
+        shutdown(s->out, SHUT_WR);
+        s->shut = true;
+        if (c->side[UPLINK].shut && c->side[DOWNLINK].shut) {
+            conn_close(c);
+        }
+    }
+}
+
+// Stop reading on a full pipe until the link drains it
+void side_pause(Side *s) {
+    s->readable = true;
+    if (!s->paused) {
+        s->paused = true;
+        s->next_paused = paused_sides;
+        paused_sides = s;
+    }
+}
+
+// Move what the socket has into the side's pipe while the pipe has room;
+// every splice() becomes a packet on the side's link
+void side_read(Side *s, double now) {
+    Link *l = &links[s->dir];
+    while (!s->eof && !s->conn->closed) {
+        int room = s->capacity - s->buffered;
+        if (room <= 0) {
+            side_pause(s);
+            return;
+        }
+        ssize_t n = splice(s->in, NULL, s->pipe[1], NULL, room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            Packet *p = malloc(sizeof(Packet));
+            if (p == NULL) {
+                perror("Memory allocation failed");
+                conn_close(s->conn);
+                return;
+            }
+            p->release = now + l->delay_ms;
+            p->len = (int)n;
+            p->credit = 0;
+            p->side = s;
+            p->flow = NULL;
+            s->buffered += (int)n;
+            s->pending++;
+            link_append(l, p);
+        } else if (n == 0) {
+            s->eof = true;
+            side_settle(s);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // The pipe fills up by pages rather than bytes, so it may be
+            // full before `room` says so while the socket still has data,
+            // or its end of file, to give
+            char peek;
+            if (recv(s->in, &peek, 1, MSG_PEEK | MSG_DONTWAIT) >= 0) {
+                side_pause(s);
+            } else {
+                s->readable = false;
+            }
+            return;
+        } else if (errno != EINTR) {
+            conn_fail(s->conn, "read");
+            return;
+        }
+    }
+}
+
+// Retry the sides that stopped on a full pipe
+void resume_paused(double now) {
+    Side *list = paused_sides;
+    paused_sides = NULL;
+    while (list != NULL) {
+        Side *s = list;
+        list = s->next_paused;
+        s->paused = false;
+        if (s->conn->closed) {
+            conn_release(s->conn);
+        } else if (s->readable) {
+            side_read(s, now);
+        }
+    }
+}
+
+// Accept a client and open its relay connection to the server port the
+// listener stands for
+void tcp_accept(int listener, int port_offset) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int fd = accept4(listener, (struct sockaddr *)&client_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        Conn *c = calloc(1, sizeof(Conn));
+        if (c == NULL) {
+            perror("Memory allocation failed");
+            close(fd);
+            continue;
+        }
+        struct sockaddr_in server = proxy_config.server;
+        server.sin_port = htons(ntohs(server.sin_port) + port_offset);
+        c->fd[0] = fd;
+        c->fd[1] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(c->fd[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        bool ok = c->fd[1] >= 0 &&
+                  (connect(c->fd[1], (struct sockaddr *)&server, sizeof(server)) == 0 || errno == EINPROGRESS);
+        for (int dir = 0; ok && dir < 2; dir++) {
+            Side *s = &c->side[dir];
+            s->conn = c;
+            s->dir = dir;
+            s->in = c->fd[dir == UPLINK ? 0 : 1];
+            s->out = c->fd[dir == UPLINK ? 1 : 0];
+            s->pipe[0] = s->pipe[1] = -1;
+            if (pipe2(s->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+                ok = false;
+                break;
+            }
+            if (fcntl(s->pipe[1], F_SETPIPE_SZ, proxy_config.tcp_buffer) < 0 && !pipe_size_warned) {
+                // Unprivileged pipes stop at /proc/sys/fs/pipe-max-size and
+                // pipe-user-pages-soft; the link then gets less to queue
+                perror("Setting the TCP buffer size");
+                pipe_size_warned = true;
+            }
+            s->capacity = fcntl(s->pipe[1], F_GETPIPE_SZ);
+        }
+        c->connecting = true;
+        c->side[UPLINK].blocked = true;  // Until the server socket is connected
+        for (int end = 0; ok && end < 2; end++) {
+            c->ends[end].source = end == 0 ? SOURCE_CONN_CLIENT : SOURCE_CONN_SERVER;
+            c->ends[end].conn = c;
+            ok = watch(c->fd[end], &c->ends[end], EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == 0;
+        }
+        if (!ok) {
+            perror("TCP relay setup");
+            close(fd);
+            if (c->fd[1] >= 0) {
+                close(c->fd[1]);
+            }
+            for (int dir = 0; dir < 2; dir++) {
+                if (c->side[dir].pipe[0] > 0) {
+                    close(c->side[dir].pipe[0]);
+                    close(c->side[dir].pipe[1]);
+                }
+            }
+            free(c);
+            continue;
+        }
+        conns_opened++;
+    }
+}
+
+// Socket event on one end of a relayed connection
+void conn_event(ConnEnd *end, uint32_t events, double now) {
+    Conn *c = end->conn;
+    int which = end->source == SOURCE_CONN_CLIENT ? 0 : 1;
+    if (c->closed) {
+        return;
+    }
+    if (which == 1 && c->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(c->fd[1], SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            errno = error;
+            perror("Connecting to the server");
+            conn_close(c);
+            return;
+        }
+        c->connecting = false;
+    }
+    // Readable: the side this socket feeds; writable: the side it drains
+    Side *in = &c->side[which == 0 ? UPLINK : DOWNLINK];
+    Side *out = &c->side[which == 0 ? DOWNLINK : UPLINK];
+    if (events & EPOLLOUT) {
+        out->blocked = false;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        side_read(in, now);
+    }
+}
+
+// ---- Main loop ----
+
+void print_link(const Link *l, double elapsed_ms) {
+    printf("%s: %" PRIu64 " bytes delivered (%.2f Mbit/s), %" PRIu64 " datagrams",
+           l->name, l->delivered_bytes, elapsed_ms > 0 ? l->delivered_bytes * 8.0 / elapsed_ms / 1000.0 : 0,
+           l->delivered_datagrams);
+    if (l->delivered_datagrams > 0) {
+        printf(" queued avg %.2f ms max %.2f ms", l->sojourn_sum / l->delivered_datagrams, l->sojourn_max);
+    }
+    printf(", %" PRIu64 " lost, %" PRIu64 " tail drops", l->lost, l->tail_drops);
+    if (l->trace != NULL && l->opportunities > 0) {
+        printf(", %.1f%% of %" PRIu64 " opportunities used", l->used * 100.0 / l->opportunities,
+               l->opportunities);
+    }
+    printf("\n");
+}
+
+void signal_handler(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+bool parse_percent(const char *text, double *out) {
+    *out = atof(text);
+    return *out >= 0 && *out <= 100;
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s <Listen Port> <Server IP> <Server Port> [options]\n", program);
+    printf("Relays clients to the server over emulated links; run the server with\n");
+    printf("--advertise-port <Listen Port> so its UDP traffic comes through too.\n");
+    printf("Options:\n");
+    printf("  --uplink TRACE        Mahimahi trace for client-to-server traffic (default: unlimited)\n");
+    printf("  --downlink TRACE      Mahimahi trace for server-to-client traffic (default: unlimited)\n");
+    printf("  --uplink-kbps N       Constant-rate uplink instead of a trace\n");
+    printf("  --downlink-kbps N     Constant-rate downlink instead of a trace\n");
+    printf("  --delay MS            One-way delay in each direction (default: 0)\n");
+    printf("  --loss PERCENT        UDP datagram loss in each direction\n");
+    printf("  --uplink-loss PERCENT, --downlink-loss PERCENT  ...in one direction\n");
+    printf("  --queue BYTES         Drop-tail queue per direction for UDP (default: unlimited)\n");
+    printf("  --tcp-buffer BYTES    Pipe per TCP direction; bounds its queue (default: %d)\n", TCP_BUFFER_DEFAULT);
+    printf("  --seed N              Loss random seed, to replay a run (default: from the clock)\n");
+}
+
+int parse_options(int argc, char *argv[]) {
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--uplink") == 0 && i + 1 < argc) {
+            proxy_config.traces[UPLINK] = argv[++i];
+        } else if (strcmp(argv[i], "--downlink") == 0 && i + 1 < argc) {
+            proxy_config.traces[DOWNLINK] = argv[++i];
+        } else if (strcmp(argv[i], "--uplink-kbps") == 0 && i + 1 < argc) {
+            proxy_config.rate_kbps[UPLINK] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--downlink-kbps") == 0 && i + 1 < argc) {
+            proxy_config.rate_kbps[DOWNLINK] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {
+            proxy_config.delay_ms = atof(argv[++i]);
+            if (proxy_config.delay_ms < 0) {
+                printf("Invalid delay: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+            if (!parse_percent(argv[++i], &proxy_config.loss[UPLINK])) {
+                printf("Invalid loss rate: %s\n", argv[i]);
+                return 0;
+            }
+            proxy_config.loss[DOWNLINK] = proxy_config.loss[UPLINK];
+        } else if (strcmp(argv[i], "--uplink-loss") == 0 && i + 1 < argc) {
+            if (!parse_percent(argv[++i], &proxy_config.loss[UPLINK])) {
+                printf("Invalid loss rate: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--downlink-loss") == 0 && i + 1 < argc) {
+            if (!parse_percent(argv[++i], &proxy_config.loss[DOWNLINK])) {
+                printf("Invalid loss rate: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc) {
+            proxy_config.queue_limit = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--tcp-buffer") == 0 && i + 1 < argc) {
+            proxy_config.tcp_buffer = atoi(argv[++i]);
+            if (proxy_config.tcp_buffer < 4096) {
+                printf("Invalid TCP buffer: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            proxy_config.seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            printf("Unknown or incomplete option: %s\n", argv[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Listening socket on the proxy's port (+ `offset` for TCP streams)
+int open_listener(int type, int offset) {
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(proxy_config.listen_port + offset);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        (type == SOCK_STREAM && listen(fd, SOMAXCONN) < 0)) {
+        perror(type == SOCK_STREAM ? "TCP listener" : "UDP socket");
+        return -1;
+    }
+    return fd;
+}
+
+// Set up one direction's link; false if its trace is unusable
+bool link_init(Link *l, int dir) {
+    memset(l, 0, sizeof(*l));
+    l->name = dir == UPLINK ? "Uplink" : "Downlink";
+    l->delay_ms = proxy_config.delay_ms;
+    l->loss = proxy_config.loss[dir];
+    l->queue_limit = proxy_config.queue_limit;
+    if (proxy_config.traces[dir] != NULL) {
+        l->trace_len = trace_load(proxy_config.traces[dir], &l->trace);
+        if (l->trace_len == 0) {
+            return false;
+        }
+    } else if (proxy_config.rate_kbps[dir] > 0) {
+        l->trace_len = trace_constant(proxy_config.rate_kbps[dir], &l->trace);
+        if (l->trace_len == 0) {
+            printf("%s rate must be at least %d Kbps\n", l->name, LINK_MTU * 8 / 1000 + 1);
+            return false;
+        }
+    }
+    if (l->trace != NULL) {
+        printf("%s: %d opportunities every %d ms (%.2f Mbit/s)", l->name, l->trace_len,
+               l->trace[l->trace_len - 1], l->trace_len * LINK_MTU * 8.0 / l->trace[l->trace_len - 1] / 1000.0);
+    } else {
+        printf("%s: unlimited rate", l->name);
+    }
+    printf(", %.1f ms delay, %.2f%% UDP loss\n", l->delay_ms, l->loss);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || !parse_options(argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    proxy_config.listen_port = atoi(argv[1]);
+    int server_port = atoi(argv[3]);
+    proxy_config.server.sin_family = AF_INET;
+    proxy_config.server.sin_port = htons(server_port);
+    if (proxy_config.listen_port <= 0 || proxy_config.listen_port > 65534 ||
+        server_port <= 0 || server_port > 65534 ||
+        inet_pton(AF_INET, argv[2], &proxy_config.server.sin_addr) <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    uint64_t seed = proxy_config.seed != 0 ? proxy_config.seed : (uint64_t)time(NULL);
+    for (int i = 0; i < 4; i++) {
+        rng[i] = splitmix64(&seed);
+    }
+    if (!link_init(&links[UPLINK], UPLINK) || !link_init(&links[DOWNLINK], DOWNLINK)) {
+        return 1;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    control_listener_fd = open_listener(SOCK_STREAM, 0);
+    stream_listener_fd = open_listener(SOCK_STREAM, 1);
+    udp_fd = open_listener(SOCK_DGRAM, 0);
+    if (epoll_fd < 0 || control_listener_fd < 0 || stream_listener_fd < 0 || udp_fd < 0 ||
+        watch(control_listener_fd, &control_listener_source, EPOLLIN | EPOLLET) < 0 ||
+        watch(stream_listener_fd, &stream_listener_source, EPOLLIN | EPOLLET) < 0 ||
+        watch(udp_fd, &udp_listener_source, EPOLLIN | EPOLLET) < 0) {
+        return 1;
+    }
+    printf("Relaying port %d (TCP %d and %d, UDP %d) to %s:%d\n", proxy_config.listen_port,
+           proxy_config.listen_port, proxy_config.listen_port + 1, proxy_config.listen_port, argv[2], server_port);
+
+    struct epoll_event events[MAX_EVENTS];
+    double last_sweep = 0;
+    while (running) {
+        // Sleep until the earlier link needs to run, rounding up to whole ms
+        double now = clock_ms();
+        int timeout = -1;
+        for (int dir = 0; dir < 2; dir++) {
+            double next = link_next_event(&links[dir]);
+            if (next >= 0) {
+                int ms = next <= now ? 0 : (int)(next - now) + 1;
+                if (timeout < 0 || ms < timeout) {
+                    timeout = ms;
+                }
+            }
+        }
+        if (flow_count > 0 && (timeout < 0 || timeout > REPORT_MS)) {
+            timeout = REPORT_MS;
+        }
+
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        now = clock_ms();
+        for (int i = 0; i < n; i++) {
+            switch (*(int *)events[i].data.ptr) {
+            case SOURCE_CONTROL_LISTENER:
+                tcp_accept(control_listener_fd, 0);
+                break;
+            case SOURCE_STREAM_LISTENER:
+                tcp_accept(stream_listener_fd, 1);
+                break;
+            case SOURCE_UDP_LISTENER:
+                udp_read(udp_fd, NULL);
+                break;
+            case SOURCE_UDP_FLOW:
+                udp_read(((Flow *)events[i].data.ptr)->fd, (Flow *)events[i].data.ptr);
+                break;
+            case SOURCE_CONN_CLIENT:
+            case SOURCE_CONN_SERVER:
+                conn_event((ConnEnd *)events[i].data.ptr, events[i].events, now);
+                break;
+            }
+        }
+
+        now = clock_ms();
+        link_run(&links[UPLINK], now);
+        link_run(&links[DOWNLINK], now);
+        udp_flush();
+        resume_paused(now);
+        conn_reap();
+        if (now - last_sweep >= REPORT_MS) {
+            flow_sweep(now);
+            last_sweep = now;
+        }
+    }
+
+    double elapsed = clock_ms();
+    printf("\nlinkem: %" PRIu64 " TCP connections, %d UDP clients active, %.1f s\n",
+           conns_opened, flow_count, elapsed / 1000.0);
+    print_link(&links[UPLINK], elapsed);
+    print_link(&links[DOWNLINK], elapsed);
+    return 0;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE  // accept4, epoll and friends are not part of plain C99
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +21,7 @@
     typedef SOCKET socket_t;
     #define INVALID_SOCKET_VALUE INVALID_SOCKET
     #define CLOSE_SOCKET(s) closesocket(s)
+    #define SHUT_WR SD_SEND
     #define strcasecmp _stricmp
     #define sleep(x) Sleep(x*1000)
     #define usleep(x) Sleep(x/1000)
@@ -39,6 +42,9 @@
     #define MUTEX_UNLOCK(mutex) LeaveCriticalSection(&mutex)
     #define MUTEX_DESTROY(mutex) DeleteCriticalSection(&mutex)
     
+    #define CACHE_ALIGNED __declspec(align(CACHE_LINE_SIZE))
+    #define THREAD_LOCAL __declspec(thread)
+    
     // Condition variable for Windows
     #if (_WIN32_WINNT >= 0x0600)  // Vista or newer
         // Simplified condition variable - just use the Windows native one
@@ -79,11 +85,18 @@
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <sys/time.h>
+    #include <sys/uio.h>
     #include <signal.h>
     #include <ctype.h>
     #include <errno.h>
     #include <fcntl.h>
+    #include <poll.h>
     #include <pthread.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #ifdef __linux__
+        #include <sys/eventfd.h>
+    #endif
     
     typedef int socket_t;
     #define INVALID_SOCKET_VALUE -1
@@ -93,7 +106,7 @@
     typedef pthread_t thread_t;
     #define THREAD_RETURN_TYPE void*
     #define THREAD_PARAM void*
-    #define THREAD_CREATE(thread, func, arg) pthread_create(&thread, NULL, func, arg)
+    #define THREAD_CREATE(thread, func, arg) (pthread_create(&thread, NULL, func, arg) == 0)
     #define THREAD_JOIN(thread) pthread_join(thread, NULL)
     #define THREAD_DETACH(thread) pthread_detach(thread)
     
@@ -104,28 +117,144 @@
     #define MUTEX_UNLOCK(mutex) pthread_mutex_unlock(&mutex)
     #define MUTEX_DESTROY(mutex) pthread_mutex_destroy(&mutex)
     
+    #define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+    #define THREAD_LOCAL __thread
+    
     #define GET_ERROR() errno
 #endif
 
+// SIMD parity kernels for FEC, picked at run time from what the CPU has
+#if defined(__x86_64__) || defined(__i386__)
+    #define FEC_X86 1
+    #include <immintrin.h>
+#endif
+
+// Event-driven I/O (Linux only): all sessions are multiplexed over a few
+// epoll reactors instead of one thread per client. Build with -DNO_EPOLL
+// to fall back to the thread-per-client handlers used on other platforms.
+#if defined(__linux__) && !defined(NO_EPOLL)
+    #define USE_EPOLL 1
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sys/uio.h>
+    #include <sys/resource.h>
+    #include <netinet/udp.h>
+    #include <linux/filter.h>
+    #include <stdint.h>
+    #ifndef SO_REUSEPORT
+        #define SO_REUSEPORT 15
+    #endif
+    #ifndef SO_ATTACH_REUSEPORT_CBPF
+        #define SO_ATTACH_REUSEPORT_CBPF 51
+    #endif
+#endif
+
 #define BUFFER_SIZE 4096
-#define MAX_CLIENTS 20   // Increased from 10 to 20 for more concurrent connections
+#define CACHE_LINE_SIZE 64
+#define MAX_SESSIONS 131072      // Session table limit, a power of two
+#define SESSION_INDEX_BITS 17    // log2(MAX_SESSIONS): the low client ID bits index the table
+#define SESSION_SLAB_SIZE 1024   // Session entries allocated at a time
+#define UDP_TABLE_SIZE (2 * MAX_SESSIONS) // UDP session table slots, a power of two
 #define TCP_CHUNK_SIZE 131072  // 128KB for TCP
 #define UDP_CHUNK_SIZE 8192    // 8KB for UDP to avoid "message too long" error
 #define VIDEO_CHUNK_SIZE TCP_CHUNK_SIZE  // Default for backward compatibility
 #define VIDEO_CHUNKS 100
+#define RESOLUTION_COUNT 3      // Resolutions with their own row in the chunk store
+#define CHUNK_CLASS_TCP 0       // Chunk store column for TCP_CHUNK_SIZE chunks
+#define CHUNK_CLASS_UDP 1       // Chunk store column for UDP_CHUNK_SIZE chunks
+#define CHUNK_CLASSES 2
 #define UDP_PACKET_LOSS_RATE 5  // 5% packet loss rate for UDP simulation
+#define UDP_MTU 1500            // Default path MTU UDP frames are packetized for (--mtu)
+#define UDP_MIN_MTU 576         // Smallest --mtu; keeps a frame within UDP_MAX_FRAGMENTS
+#define UDP_MAX_FRAGMENTS 32
+#define UDP_IP_OVERHEAD 28      // IPv4 and UDP headers in every datagram
+#define TCP_IP_OVERHEAD 52      // IPv4 and TCP headers with timestamps in every segment
+#define TCP_SEGMENT_SIZE 1448   // MSS of a 1500-byte path: the packets TCP loss is drawn for
+#define TCP_RTO_MIN_MS 200      // Linux's floor on the retransmission timeout
+#define ENCODE_TIME_MS 50       // Simulated encoding time per TCP chunk
+#define PIPELINE_DEPTH 8        // Default chunks encoded ahead of the leading sender
+#define MAX_PIPELINE_DEPTH 64
+#define PIPELINE_RETRY_MS 5     // Sender back-off while the encoder is behind
+#define PACER_SLACK_MS 5        // Extra bucket depth absorbing late timer wakeups
+#define SHARE_ROUND_MS 10       // --capacity-kbps budget is handed out per round of this length
+#define PLAYOUT_DELAY_MS 2000   // Client buffering before playback: chunk 1's deadline
+#define ADMIT_RETRY_MS 50       // How often a queued client checks for capacity
+#define ADMIT_QUEUE_TIMEOUT_MS 30000  // Longest a client waits in the admission queue
+#define UDP_BATCH_MAX 64        // Datagrams queued per reactor before a forced flush
+#define NACK_HISTORY 64         // Recent chunks a UDP stream keeps for retransmission (--nack)
+#define NACK_RESEND_MS 20       // Least time between two copies of a chunk
+#define NACK_LINGER_MS 500      // A UDP stream answers NACKs this long after its last chunk
+#define FEC_GROUP_MS 100        // Longest stretch of video one FEC group spans (--fec)
+#define FEC_MAX_GROUP 16        // Chunks per FEC group
+#define FEC_MAX_PARITY 4        // Parity datagrams per FEC group
+#define IMPAIR_QUEUE_MS 100     // Backlog the --link-kbps bottleneck holds before it drops datagrams
+#define IMPAIR_REORDER_MS 10    // Extra hold of a datagram picked by --reorder
+#define SEND_STALL_TIMEOUT_MS 10000  // Give up on a TCP stream after 10 s without send progress
+#define LOG_RATE_DEFAULT 50     // Per-chunk log events per second per thread
 
 // Request and Response Types
 #define TYPE_1_REQUEST 1  // Client request message
 #define TYPE_2_RESPONSE 2  // Server response message
 
+// Admission outcome in a Type 2 Response
+#define ADMIT_ACCEPTED 0    // Stream at the requested resolution
+#define ADMIT_DOWNGRADED 1  // Stream at the lower resolution in the response
+#define ADMIT_QUEUED 2      // Waiting for capacity; another Type 2 Response follows
+#define ADMIT_REJECTED 3    // No capacity, the connection is closed
+
+// Admission control modes (--admission), for when a stream does not fit
+#define ADMISSION_OFF 0
+#define ADMISSION_REJECT 1     // Turn it away
+#define ADMISSION_QUEUE 2      // Hold it until earlier streams end
+#define ADMISSION_DOWNGRADE 3  // Offer the highest resolution that fits, else reject
+
 // Protocol modes
 #define MODE_TCP 1
 #define MODE_UDP 2
 
+// Wire protocol: every message is a frame, a FRAME_HEADER_SIZE header in
+// network byte order followed by `length` body bytes (see "Wire protocol")
+#define WIRE_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define WIRE_MESSAGE_SIZE 16    // Body of a Type 1 Request / Type 2 Response
+#define WIRE_MESSAGE_FRAME (FRAME_HEADER_SIZE + WIRE_MESSAGE_SIZE)
+#define WIRE_CLIENT_ID_FRAME (FRAME_HEADER_SIZE + 4)
+#define WIRE_ACK_FRAME (FRAME_HEADER_SIZE + 12)
+#define WIRE_NACK_FRAME (FRAME_HEADER_SIZE + 8)
+#define NACK_MAX_CHUNKS 33      // Chunks one FRAME_NACK can name
+#define FEC_HEADER_SIZE 8       // FRAME_PARITY body ahead of the XOR payload
+#define FRAGMENT_HEADER_SIZE 8  // Body prefix of a FRAME_FLAG_FRAGMENT datagram
+
+// Frame types
+#define FRAME_REQUEST TYPE_1_REQUEST    // Type 1 Request
+#define FRAME_RESPONSE TYPE_2_RESPONSE  // Type 2 Response
+#define FRAME_CLIENT_ID 3       // First frame on a TCP stream socket: whose stream it is
+#define FRAME_REQUEST_STREAM 4  // UDP client asks for its stream
+#define FRAME_READY 5           // Server is ready to stream
+#define FRAME_START 6           // TCP client confirms the stream start
+#define FRAME_CHUNK 7           // Video chunk; the sequence number is its chunk id
+#define FRAME_ACK 8             // Client received a chunk (latency feedback)
+#define FRAME_NACK 9            // UDP client is missing chunks (--nack)
+#define FRAME_PARITY 10         // XOR parity of a group of UDP chunks (--fec)
+
+// Frame flags
+#define FRAME_FLAG_LAST 0x0001  // Final chunk of the stream
+#define FRAME_FLAG_NACK 0x0002  // FRAME_READY: the server resends chunks named in a FRAME_NACK
+#define FRAME_FLAG_RETRANSMIT 0x0004 // FRAME_CHUNK: a resent copy
+#define FRAME_FLAG_FEC 0x0008   // FRAME_READY: FRAME_PARITY datagrams follow each chunk group
+#define FRAME_FLAG_FRAGMENT 0x0010 // UDP datagram carrying one slice of a longer frame
+
 // Scheduling policies
 #define POLICY_FCFS 1  // First-Come-First-Serve
 #define POLICY_RR 2    // Round-Robin
+#define POLICY_DRR 3   // Deficit Round-Robin, weighted by estimate_bandwidth
+#define POLICY_EDF 4   // Earliest playout deadline first
+
+// Log severity levels
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
 
 // Connection states
 #define STATE_IDLE 0
@@ -141,45 +270,306 @@ typedef struct {
     char protocol[10];      // Protocol (TCP or UDP)
     int streaming_port;     // Port for streaming (assigned by server)
     int client_id;          // Client ID assigned by server
+    int status;             // ADMIT_* (responses only)
+    int queue_position;     // 1-based place in the admission queue when ADMIT_QUEUED
 } Message;
 
-// Statistics structure
+// Decoded frame header
+typedef struct {
+    int version;
+    int type;               // FRAME_*
+    int flags;              // FRAME_FLAG_*
+    uint32_t sequence;      // Chunk id of a FRAME_CHUNK, 0 otherwise
+    uint32_t timestamp;     // Sender's clock in microseconds, modulo 2^32
+    uint32_t length;        // Body bytes after the header
+} FrameHeader;
+
+// Decoded FRAME_ACK
+typedef struct {
+    int client_id;
+    int chunk_id;
+    uint32_t received;      // Client clock when the chunk's first bytes arrived, microseconds
+    uint32_t sent;          // The chunk's timestamp echoed back (server monotonic clock)
+    uint32_t receive_us;    // Client time from the chunk's first to its last byte
+} ChunkAck;
+
+// Decoded FRAME_NACK
+typedef struct {
+    int client_id;
+    int first;              // Lowest missing chunk id
+    uint32_t mask;          // Bit k: chunk first + 1 + k is missing too
+} ChunkNack;
+
+// Statistics structure: per-client fields that change a few times per
+// stream, guarded by stats_mutex. Per-chunk counters are in StreamCounters.
 typedef struct {
     int client_id;
     char protocol[10];
     char resolution[10]; // Added resolution field
     struct sockaddr_in address;
-    unsigned long bytes_sent;
-    int chunks_sent;
     double start_time;
-    double current_time;
-    double data_rate;
+    double admission_latency; // Seconds from the Type 2 Response to stream start
     int state;  // Client state
     int active; // Whether this client is active
     int streaming_port; // Port used for streaming
     socket_t socket_fd;      // Socket file descriptor for TCP streaming
-    double latency;     // Average latency in ms
-    int packets_dropped; // Number of dropped packets (UDP only)
 } ClientStats;
 
-// Queue for FCFS scheduling
-typedef struct QueueNode {
+// Per-chunk counters of one client, on their own cache line(s). Only the
+// thread streaming to the client writes them, with relaxed atomic stores
+// between two increments of `seq`; readers take a consistent copy with
+// stats_snapshot() and never hold up the writer.
+typedef struct CACHE_ALIGNED {
+    unsigned seq;               // Odd while the writer is updating
+    uint64_t bytes_sent;
+    uint64_t chunks_sent;
+    uint64_t packets_dropped;   // UDP only
+    uint64_t send_calls;        // TCP send syscalls for this stream
+    uint64_t send_blocked;      // ...that found the socket buffer full
+    uint64_t last_send_us;      // get_time() of the latest chunk
+    uint64_t target_kbps;       // Pacing target from estimate_bandwidth
+    uint64_t achieved_bps;      // Rate the pacer actually delivered
+    uint64_t deadline_misses;   // Chunks sent after, or skipped at, their playout deadline
+    uint64_t late_skipped;      // ...of which skipped (UDP under EDF)
+    uint64_t nacked;            // --nack: chunk requests in the client's NACKs
+    uint64_t nack_refused;      // ...past their playout deadline or out of the history
+    uint64_t retransmits;       // Copies resent for NACKs, lost ones included
+    uint64_t recovered;         // ...that delivered a dropped chunk
+    uint64_t fec_groups;        // --fec: chunk groups closed
+    uint64_t fec_parity;        // ...parity datagrams sent for them, lost ones included
+    uint64_t fec_recoverable;   // ...dropped chunks the delivered parity can rebuild
+    uint64_t fragments;         // UDP datagrams, lost ones included
+    uint64_t fragments_dropped; // ...of which the simulated loss took
+    uint64_t segments;          // TCP segments the impairment drew loss for
+    uint64_t segments_lost;     // ...of which it took, each costing a retransmission
+} StreamCounters;
+
+// Per-session token bucket. Tokens are bytes and refill at the target rate up
+// to the bucket depth; a chunk goes out once the bucket holds all of it. Send
+// times are absolute deadlines derived from the bucket, so time spent sending
+// or waiting on the encoder does not slow the long-run rate.
+typedef struct {
+    double rate;            // Bytes per second
+    double depth;           // Bucket size in bytes (the allowed burst)
+    double tokens;
+    double refilled;        // When tokens were last brought up to date
+    int target_kbps;
+    double first_send;      // Start of the first paced send
+    double last_send;       // Start of the most recent paced send
+    double paced_bytes;     // Bytes sent between first_send and last_send
+    int last_bytes;
+    int sends;
+} Pacer;
+
+// A session's claim on the --capacity-kbps budget, kept by the thread
+// sending for it (see "Link sharing"), and its chunks' playout deadlines
+typedef struct {
+    int64_t deficit;        // Bytes the session may still send (RR, DRR)
+    uint64_t round;         // Last round credited
+    uint64_t weight;        // Quantum weight: 1 for RR, target Kbps for DRR
+    bool backlogged;        // Short of credit, counted in share_weight
+    double start;           // Stream start on the sender's clock
+    double chunk_seconds;   // Playback time of one chunk at the target bitrate
+    double deadline;        // EDF: deadline of the chunk waiting in edf_heap
+    int bytes;              // EDF: its size
+    int heap_slot;          // EDF: position in edf_heap + 1, 0 if not waiting
+    bool active;            // Set up by share_init; zeroed memory is no claim at all
+    int granted;            // EDF: the dispatcher let the waiting chunk go (atomic)
+} ShareState;
+
+// Immutable video chunk shared by every session streaming it. The chunk
+// store holds one reference and each sender holds another while sending.
+typedef struct VideoChunk {
+    int refcount;       // Atomic; the chunk is freed when it drops to zero
+    int chunk_id;
+    int size;
+    char data[];
+} VideoChunk;
+
+// A recent chunk of a UDP stream, kept for retransmission (--nack)
+typedef struct {
+    VideoChunk *chunk;      // Reference, NULL while the slot is empty
+    double first_sent;      // First transmission, or its simulated loss
+    double last_sent;       // Latest copy
+    uint32_t missing;       // Fragments no copy got past the simulated loss with
+    bool delivered;         // Some copy got past the simulated loss
+} NackSlot;
+
+// Slot chunk_id % NACK_HISTORY holds the chunk; only the thread streaming
+// the session uses it
+typedef struct {
+    NackSlot slots[NACK_HISTORY];
+} NackHistory;
+
+// Parity of the UDP chunk groups a stream sends (--fec). Groups are
+// aligned runs of group_size chunk ids; parity i is the XOR of the
+// group's chunks first + j with j % parity_count == i.
+typedef struct {
+    int group_size;             // Chunks per group, 0 with FEC off
+    int parity_count;           // Parity datagrams per group
+    int first;                  // Chunk id the open group starts at
+    uint32_t covered;           // Chunks in the open group's parity, bit j = first + j
+    uint32_t lost;              // ...of which the simulated loss took
+    VideoChunk *parity[FEC_MAX_PARITY]; // FEC_HEADER_SIZE bytes, then the XOR of the payloads
+} FecEncoder;
+
+// One ring slot
+typedef struct {
+    int seq;                    // chunk_id held by the slot, 0 while it is rewritten
+    VideoChunk *chunk;
+} PipelineSlot;
+
+// Encode pipeline for one resolution and chunk class. A single encoder worker
+// publishes chunks in order into a bounded ring and stays at most `depth`
+// chunks ahead of the leading sender; senders read the ring without locks.
+// Encoding time scales with chunk size (ENCODE_TIME_MS per TCP chunk). The
+// chunk store keeps every published chunk alive, so a sender that fell
+// behind the ring simply takes its chunk from the store.
+typedef struct {
+    int resolution;             // Row in resolution_names / chunk_store
+    int chunk_class;
+    PipelineSlot slots[MAX_PIPELINE_DEPTH];
+    int head;                   // Last chunk_id published (atomic)
+    int demand;                 // Highest chunk_id requested by a sender (atomic)
+    int underrun_id;            // Highest chunk_id requested before it was ready (atomic)
+    unsigned long takes;        // Chunks handed to senders (atomic)
+    unsigned long underruns;    // Chunks a sender had to wait for (atomic)
+    unsigned long occupancy_sum; // Ready chunks ahead of the leader, summed over takes (atomic)
+#ifdef _WIN32
+    mutex_t lock;
+    win_cond_t space;
+#else
+    pthread_mutex_t lock;       // Only used to park the encoder while the ring is full
+    pthread_cond_t space;
+#endif
+    thread_t thread;
+} EncodePipeline;
+
+// Run queue for FCFS scheduling: a bounded multi-producer multi-consumer
+// ring. A cell's seq tells whose turn it is: producers may fill cell i when
+// seq == i and consumers may take it when seq == i + 1, so either side
+// claims a cell with one CAS on tail or head and nobody takes a lock.
+#define RUN_QUEUE_SIZE MAX_SESSIONS // Every live session fits at once
+
+typedef struct {
+    unsigned seq;
     int client_id;
-    struct QueueNode *next;
-} QueueNode;
+} RunQueueCell;
+
+typedef struct {
+    unsigned head;              // Next cell to take
+    char pad1[CACHE_LINE_SIZE - sizeof(unsigned)];
+    unsigned tail;              // Next cell to fill
+    char pad2[CACHE_LINE_SIZE - sizeof(unsigned)];
+    int sleeping;               // Scheduler is (about to be) blocked in run_queue_wait()
+    char pad3[CACHE_LINE_SIZE - sizeof(int)];
+    RunQueueCell cells[RUN_QUEUE_SIZE];
+} RunQueue;
+
+// Stream worker pool, for builds without epoll and --bench-workers
+#define POOL_MAX_WORKERS 256
+#define POOL_DEQUE_SIZE 1024    // Ready tasks exposed per worker; more stay parked
+#define POOL_RUN_CHUNKS 8       // Chunks a task may send in one run before others get a turn
+#define POOL_IDLE_MS 1000       // Longest sleep of a worker with nothing parked
+
+// PoolTask.run results
+#define POOL_YIELD 0            // Run again at task->wake
+#define POOL_DONE 1             // Finished; the task has freed itself
+
+typedef struct PoolTask {
+    int (*run)(struct PoolTask *task, double now);
+    double wake;                // When a yielded task wants to run again (get_time())
+    struct PoolTask *next;      // Inbox link
+} PoolTask;
+
+typedef struct CACHE_ALIGNED {
+    int64_t top;                // Next task a thief takes
+    char pad1[CACHE_LINE_SIZE - sizeof(int64_t)];
+    int64_t bottom;             // Next free slot, written by the owner only
+    char pad2[CACHE_LINE_SIZE - sizeof(int64_t)];
+    PoolTask *items[POOL_DEQUE_SIZE];
+} PoolDeque;
+
+typedef struct {
+    PoolDeque deque;
+    int id;
+    thread_t thread;
+    mutex_t inbox_mutex;
+    PoolTask *inbox;            // Posted by other threads
+    PoolTask **heap;            // Parked tasks by wake time, owner only
+    int heap_count;
+    int heap_capacity;
+    int sleeping;               // Blocked (or about to block) in pool_worker_wait()
+    uint64_t runs;              // Task runs (atomic, for print_stats)
+    uint64_t steals;            // ...of tasks taken from another worker
+#ifdef _WIN32
+    HANDLE wake_event;          // Auto-reset
+#else
+    int wake_fd[2];             // eventfd (twice) or a pipe, as for the run queue
+#endif
+} PoolWorker;
+
+// Latency histograms: HIST_SUB buckets per power of two microseconds
+// (values within 25% share a bucket), up to about two hours
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (32 * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+} Histogram;
+
+// Where the simulated encoding time is paid
+#define ENCODE_COST_CLIENT 1    // Every client waits ENCODE_TIME_MS before each TCP chunk
+#define ENCODE_COST_NONE 2      // Chunks are sent straight from the chunk store
+#define ENCODE_COST_PIPELINE 3  // Encoder workers fill a ring ahead of the senders
+
+// Runtime options given as flags after <Server Port> <Scheduling Policy>
+typedef struct {
+    int reactors;       // Event-loop threads (--reactors N, 0 = one per online CPU)
+    int send_stall_ms;  // Abort a TCP stream after this long without send progress
+    int sndbuf;         // SO_SNDBUF for TCP stream sockets (0 = kernel autotuning)
+    int encode_cost;    // ENCODE_COST_* (--encode-cost pipeline|client|none)
+    int pipeline_depth; // Ring size for ENCODE_COST_PIPELINE
+    int burst;          // Token bucket depth in bytes (0 = one chunk)
+    int udp_batch;      // UDP datagrams per sendmmsg() flush (1 = send immediately)
+    bool udp_gso;       // Merge datagrams to the same peer with UDP_SEGMENT
+    bool udp_steer;     // Pick the reactor UDP socket from the client IP, not the kernel hash
+    bool preload_chunks; // Build the whole chunk store at startup
+    int log_level;      // LOG_* threshold (--log-level)
+    int log_rate;       // Rate-limited log events per second per thread (0 = no limit)
+    const char *log_file; // Binary log file, NULL = text on stdout
+    int capacity_kbps;  // Egress budget shared by all streams (0 = unlimited)
+    int admission;      // ADMISSION_* (--admission)
+    int admit_kbps;     // Bandwidth admission may commit (0 = --capacity-kbps)
+    int workers;        // Stream worker threads without epoll (--workers N, 0 = one per online CPU)
+    bool nack;          // Resend UDP chunks the client reports missing (--nack)
+    int fec_percent;    // FEC parity datagrams per group, % of its chunks (--fec, 0 = off)
+    int mtu;            // Path MTU UDP frames are split for (--mtu, 0 = one datagram per frame)
+    double loss_percent;  // Packet loss (--loss, < 0 = UDP_PACKET_LOSS_RATE on UDP only)
+    double burst_enter;   // Gilbert-Elliott: % chance per packet of entering the bad state (--loss-burst)
+    double burst_exit;    // ...and of leaving it
+    double burst_loss;    // Loss in the bad state, %
+    int delay_ms;         // One-way delay added to every stream (--delay)
+    int jitter_ms;        // Uniform variation of the delay, +/-
+    double reorder_percent;   // UDP datagrams held IMPAIR_REORDER_MS longer (--reorder)
+    double duplicate_percent; // UDP datagrams delivered twice (--duplicate)
+    int link_kbps;        // Bottleneck rate of each stream's emulated link (--link-kbps, 0 = none)
+    uint64_t seed;        // Impairment PRNG seed (--seed, 0 = from the clock)
+    int advertise_port;   // UDP port named in Type 2 Responses (--advertise-port, 0 = server_port)
+} ServerConfig;
 
 // Function declarations with proper return types
 #ifdef _WIN32
     THREAD_RETURN_TYPE handle_connection_phase(THREAD_PARAM arg);
-    THREAD_RETURN_TYPE handle_tcp_streaming(THREAD_PARAM arg);
-    THREAD_RETURN_TYPE handle_udp_streaming(THREAD_PARAM arg);
     THREAD_RETURN_TYPE scheduler_thread(THREAD_PARAM arg);
     THREAD_RETURN_TYPE handle_tcp_connections(THREAD_PARAM arg);
     BOOL WINAPI signal_handler(DWORD sig);
 #else
     void *handle_connection_phase(void *arg);
-    void *handle_tcp_streaming(void *arg);
-    void *handle_udp_streaming(void *arg);
     void *scheduler_thread(void *arg);
     void *handle_tcp_connections(void *arg);
     void signal_handler(int sig);
@@ -248,474 +638,2085 @@ double get_time() {
 #endif
 }
 
+// End-to-end latency of one stream, from the client's chunk acks (see
+// "Latency feedback"). The histograms take atomic adds; the other fields
+// belong to the one thread reading the stream's acks.
+typedef struct {
+    Histogram rtt;              // Round trip of a chunk's first byte and its ack
+    Histogram delivery;         // One-way delay until a chunk was complete at the client
+    Histogram variation;        // One-way delay above the stream's lowest
+    Histogram recovery;         // --nack: a dropped chunk's first send to the copy that got through
+    uint64_t ttfb_us;           // Type 1 Request to the first chunk byte at the client (atomic)
+    uint64_t request_us;        // Monotonic time the Type 1 Request arrived
+    uint32_t rtt_min_us;
+    int32_t delay_base;         // First (client receive - server send) sample; the clocks differ
+    int32_t delay_min;          // Lowest sample relative to delay_base
+    int acks;
+} LatencyStats;
+
+// Network impairment state of one stream (see "Network impairment"). Only
+// the thread streaming the client touches it, so it needs no lock.
+typedef struct {
+    uint64_t rng[4];            // xoshiro256** state
+    bool burst;                 // Gilbert-Elliott chain in its bad state
+    double link_free;           // When the --link-kbps bottleneck has sent its backlog
+} Impairment;
+
+// Monotonic clock in seconds, used for deadlines and frame timestamps
+double get_monotonic_time() {
+#ifdef _WIN32
+    return get_time();  // Already QueryPerformanceCounter
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+}
+
+// One slot of the session table. A client ID is the slot index in its
+// low SESSION_INDEX_BITS and the slot's generation above them; the
+// generation moves on whenever the slot is freed, so IDs of finished
+// sessions stop matching.
+typedef struct {
+    StreamCounters counters;    // Hot, written by the streaming thread
+    ClientStats stats;          // Cold, guarded by stats_mutex
+    unsigned generation;        // Current generation (atomic for readers)
+    int next_free;              // Free list link, -1 at the end
+    int used;                   // Has held a session, so print_stats shows it
+    uint64_t admit_us;          // Set by prepare_response(), cleared at stream start
+    int committed_kbps;         // Bandwidth admission control counts for the session
+    int queued;                 // In the admission queue
+    int next_queued;            // Admission queue link (client ID), -1 at the end
+    LatencyStats latency;       // Reset by register_client()
+    Impairment impair;          // Seeded by stats_stream_started()
+    struct sockaddr_in udp_request_from; // REQUEST_STREAM parked until the stream picks it up
+    int udp_request_ready;      // Cleared by udp_expect_request()
+#ifndef USE_EPOLL
+    uint64_t nack_pending;      // Latest FRAME_NACK from the dispatcher: first << 32 | mask, 0 if none
+#else
+    struct Session *udp_session; // UDP session streaming the client, for its reactor's NACKs
+    int udp_request_via;        // Reactor whose socket got the parked REQUEST_STREAM
+#endif
+} SessionEntry;
+
+#define SESSION_GENERATION_MAX ((1u << (31 - SESSION_INDEX_BITS)) - 1)
+#define SESSION_INDEX(id) ((unsigned)(id) & (MAX_SESSIONS - 1))
+#define SESSION_GENERATION(id) ((unsigned)(id) >> SESSION_INDEX_BITS)
+#define CLIENT_STATS(id) (session_entry(id)->stats)
+
 // Globals
-ClientStats client_stats[MAX_CLIENTS];
-int client_count = 0;
+SessionEntry *session_slabs[MAX_SESSIONS / SESSION_SLAB_SIZE]; // Never freed or moved
+int session_capacity = 0;   // Entries in allocated slabs (atomic for readers)
+int session_free = -1;      // Free list head, guarded by stats_mutex
+int session_active_count = 0; // Guarded by stats_mutex
+uint64_t session_ready[MAX_SESSIONS / 64]; // RR: sessions waiting for the scheduler
 #ifdef _WIN32
 mutex_t stats_mutex;
 mutex_t queue_mutex;
 mutex_t udp_mutex;
+mutex_t udp_table_mutex;
 mutex_t log_mutex;
-win_cond_t queue_cond_var;  // Windows-specific condition variable
+mutex_t edf_mutex;
+HANDLE run_queue_event;     // Auto-reset event the scheduler sleeps on
 #else
 pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t udp_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t udp_table_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t edf_mutex = PTHREAD_MUTEX_INITIALIZER;
+int run_queue_fd[2] = { -1, -1 }; // Scheduler wakeup: eventfd (twice) or a pipe
 #endif
 int scheduling_policy = POLICY_FCFS; // Default scheduling policy
+const char *policy_names[] = { "", "FCFS", "Round-Robin", "Deficit Round-Robin",
+                               "Earliest Deadline First" }; // By POLICY_*
 int server_port = 8080;  // Default port
-int current_rr_client = 0; // For round-robin scheduling
-socket_t udp_socket = INVALID_SOCKET_VALUE;     // Single shared UDP socket
+unsigned current_rr_client = 0; // For round-robin scheduling: last table index served
+socket_t server_fd = INVALID_SOCKET_VALUE;      // Connection phase listening socket
+socket_t udp_socket = INVALID_SOCKET_VALUE;     // Shared UDP socket (reactor 0's with epoll)
 socket_t tcp_streaming_socket = INVALID_SOCKET_VALUE; // Single TCP socket for streaming
+ServerConfig server_config = { 0, SEND_STALL_TIMEOUT_MS, 0, ENCODE_COST_PIPELINE, PIPELINE_DEPTH, 0,
+                              UDP_BATCH_MAX, true, false, false, LOG_INFO, LOG_RATE_DEFAULT, NULL, 0,
+                              ADMISSION_OFF, 0, 0, false, 0, UDP_MTU,
+                              -1, 0, 0, 100, 0, 0, 0, 0, 0, 0, 0 };
 
-QueueNode *queue_head = NULL;
-QueueNode *queue_tail = NULL;
+// Chunk store indexed by [resolution][chunk class][chunk_id], filled lazily
+const char *resolution_names[RESOLUTION_COUNT] = { "480p", "720p", "1080p" };
+// Chunk payloads leave room for the frame header, so a framed chunk is
+// exactly TCP_CHUNK_SIZE or UDP_CHUNK_SIZE bytes on the wire
+const int chunk_class_sizes[CHUNK_CLASSES] = { TCP_CHUNK_SIZE - FRAME_HEADER_SIZE,
+                                               UDP_CHUNK_SIZE - FRAME_HEADER_SIZE };
+VideoChunk *chunk_store[RESOLUTION_COUNT][CHUNK_CLASSES][VIDEO_CHUNKS + 1];
+int chunk_store_built = 0;
+unsigned long udp_datagrams_sent = 0;  // UDP send path counters (atomic)
+unsigned long udp_send_syscalls = 0;
+unsigned long udp_sessions_moved = 0;  // UDP sessions handed to the reactor whose socket got REQUEST_STREAM
+EncodePipeline pipelines[RESOLUTION_COUNT][CHUNK_CLASSES];
+uint64_t share_weight = 0;      // Sum of backlogged sessions' weights (atomic)
+int64_t share_pool = 0;         // FCFS: budget left in share_pool_round (atomic)
+uint64_t share_pool_round = 0;
+ShareState *edf_heap[MAX_SESSIONS]; // Waiting chunks by deadline, guarded by edf_mutex
+int edf_count = 0;
+
+RunQueue run_queue;
+PoolWorker pool_workers[POOL_MAX_WORKERS];
+int pool_worker_count = 0;
+unsigned pool_next_worker = 0;  // Inbox for the next posted task (atomic)
+Histogram admission_hist;       // Admission to stream start
+int admit_committed_kbps = 0;   // Admission control state, guarded by stats_mutex
+int admit_queue_head = -1;      // Client IDs waiting for capacity, oldest first
+int admit_queue_tail = -1;
+int admit_queue_length = 0;
+uint64_t admit_outcomes[4];     // Type 1 Requests answered, by ADMIT_*
+uint64_t admit_queue_admitted = 0; // ADMIT_QUEUED requests let in later
+uint64_t admit_queue_timeouts = 0; // ADMIT_QUEUED requests that gave up waiting
 
 void log_message(const char* format, ...);
+void log_warning(const char* format, ...);
+void log_event(int event, int a, int b, int c);
 int estimate_bandwidth(const char *resolution);
-void update_stats(int client_id, int bytes, const char *protocol);
-void generate_video_chunk(char *buffer, int chunk_id, const char *resolution);
+void update_stats(int client_id, int bytes);
+void fill_video_chunk(char *buffer, int chunk_id, const char *resolution, int chunk_size);
 void print_stats();
 int dequeue_client();
 void enqueue_client(int client_id);
+SessionEntry *session_entry(int client_id);
+VideoChunk *chunk_retain(VideoChunk *chunk);
+void chunk_release(VideoChunk *chunk);
+void release_client(int client_id, int state);
+void admit_queue_remove(int client_id);
+int admit_limit_kbps(void);
+void udp_expect_request(int client_id);
+void udp_table_remove(uint32_t ip, uint16_t port, int client_id);
 
-// Thread-safe logging function
-void log_message(const char* format, ...) {
+// ---- Asynchronous logger ----
+//
+// Each thread appends fixed-size LogRecords to its own single-producer
+// ring. A formatter thread drains all rings every LOG_FLUSH_MS, orders the
+// batch by timestamp and writes it with a single flush: as text on stdout,
+// or as raw records into an mmap'd file (--log-file) that --decode-log
+// turns back into text. Per-chunk events are numbered entries of
+// log_events[] with int arguments, so logging one is a level check, a rate
+// check and a 32-byte copy. log_message() formats on the caller and queues
+// the string; it is meant for everything that is not per chunk.
+
+#define LOG_RING_SIZE 4096      // Records per thread (power of two)
+#define LOG_BATCH_MAX 8192      // Records formatted per pass
+#define LOG_FLUSH_MS 20         // Formatter period
+#define LOG_TEXT_MAX 1024       // Longest log_message() line
+#define LOG_FILE_GROW 65536     // Records added whenever the log file is extended
+
+// Events with a fixed format
+#define LOG_EV_TEXT 0           // log_message() string
+#define LOG_EV_TCP_CHUNK_SENT 1
+#define LOG_EV_UDP_CHUNK_SENT 2
+#define LOG_EV_UDP_CHUNK_LOST 3
+#define LOG_EV_COUNT 4
+
+typedef struct {
+    int level;
+    bool rate_limited;          // Subject to --log-rate
+    const char *format;         // Takes the record's int arguments in order
+} LogEvent;
+
+const LogEvent log_events[LOG_EV_COUNT] = {
+    { LOG_INFO, false, "%s" },
+    { LOG_INFO, true, "Sent chunk %d/%d to TCP client %d" },
+    { LOG_INFO, true, "Sent chunk %d/%d to UDP client %d" },
+    { LOG_INFO, true, "Simulating packet loss for chunk %d to UDP client %d" },
+};
+
+typedef struct {
+    uint64_t time_us;           // get_time() in microseconds
+    uint16_t event;             // LOG_EV_*
+    uint8_t level;
+    uint8_t thread;             // Producing ring
+    uint32_t suppressed;        // Events of this kind rate-limited since the last one
+    union {
+        int32_t args[4];
+        struct {
+            char *text;         // Heap copy, freed by the formatter
+            uint32_t length;
+        } text;
+    } u;
+} LogRecord;
+
+// Single-producer ring; head and tail sit on different cache lines
+typedef struct LogRing {
+    unsigned head;              // Next slot the owning thread writes
+    char pad1[CACHE_LINE_SIZE - sizeof(unsigned)];
+    unsigned tail;              // Next slot the formatter reads
+    char pad2[CACHE_LINE_SIZE - sizeof(unsigned)];
+    int id;
+    int in_use;                 // Claimed by a live thread
+    unsigned long overruns;     // Records lost because the ring was full
+    uint64_t rate_second[LOG_EV_COUNT]; // Second rate_count belongs to
+    uint32_t rate_count[LOG_EV_COUNT];
+    uint32_t suppressed[LOG_EV_COUNT];
+    struct LogRing *next;
+    LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+// Binary log file layout: this header, then LogRecords. A LOG_EV_TEXT
+// record carries the length in args[0] and is followed by the text padded
+// to whole records.
+typedef struct {
+    char magic[8];              // LOG_FILE_MAGIC
+    uint32_t record_size;
+    uint32_t event_count;
+    uint64_t records;           // Records after the header
+    uint64_t start_us;          // Logger start time
+} LogFileHeader;
+
+#define LOG_FILE_MAGIC "VSLOG01"
+
+int log_running = 0;            // Records go through the rings (atomic)
+LogRing *log_rings = NULL;      // Every ring ever claimed, newest first
+int log_ring_count = 0;
+THREAD_LOCAL LogRing *log_ring = NULL;
+LogRecord log_batch[LOG_BATCH_MAX];
+unsigned long log_overruns_reported = 0;
+uint64_t log_start_us = 0;
 #ifdef _WIN32
-    MUTEX_LOCK(log_mutex);
+mutex_t log_drain_mutex;
 #else
-    pthread_mutex_lock(&log_mutex);
+pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t log_ring_key;
+int log_file_fd = -1;
+LogFileHeader *log_map = NULL;  // mmap'd log file
+uint64_t log_map_records = 0;   // Records the mapping can hold
+#endif
+
+// Print one record as a line of text
+void log_print_record(FILE *out, const LogRecord *rec, const char *text) {
+    if (rec->event == LOG_EV_TEXT) {
+        fputs(text, out);
+    } else if (rec->event < LOG_EV_COUNT) {
+        fprintf(out, log_events[rec->event].format,
+                rec->u.args[0], rec->u.args[1], rec->u.args[2], rec->u.args[3]);
+    }
+    if (rec->suppressed > 0) {
+        fprintf(out, " (%u similar suppressed)", rec->suppressed);
+    }
+    fputc('\n', out);
+}
+
+#ifndef _WIN32
+// Make room for `count` more records in the log file
+int log_file_reserve(uint64_t count) {
+    if (log_map->records + count <= log_map_records) {
+        return 1;
+    }
+    uint64_t capacity = log_map_records + LOG_FILE_GROW + count;
+    size_t old_size = sizeof(LogFileHeader) + log_map_records * sizeof(LogRecord);
+    size_t new_size = sizeof(LogFileHeader) + capacity * sizeof(LogRecord);
+    if (ftruncate(log_file_fd, new_size) < 0) {
+        return 0;
+    }
+    munmap(log_map, old_size);
+    log_map = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, log_file_fd, 0);
+    if (log_map == MAP_FAILED) {
+        log_map = NULL;
+        return 0;
+    }
+    log_map_records = capacity;
+    return 1;
+}
+
+// Copy one record (and its text) into the log file
+void log_file_append(const LogRecord *rec) {
+    uint32_t text_records = 0;
+    if (rec->event == LOG_EV_TEXT) {
+        text_records = (rec->u.text.length + sizeof(LogRecord) - 1) / sizeof(LogRecord);
+    }
+    if (log_map == NULL || !log_file_reserve(1 + text_records)) {
+        return;
+    }
+    LogRecord *dest = (LogRecord *)(log_map + 1) + log_map->records;
+    *dest = *rec;
+    if (rec->event == LOG_EV_TEXT) {
+        memset(&dest->u, 0, sizeof(dest->u));
+        dest->u.args[0] = (int32_t)rec->u.text.length;
+        memset(dest + 1, 0, text_records * sizeof(LogRecord));
+        memcpy(dest + 1, rec->u.text.text, rec->u.text.length);
+    }
+    log_map->records += 1 + text_records;
+}
+
+int log_file_open(const char *path) {
+    log_file_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (log_file_fd < 0 || ftruncate(log_file_fd, sizeof(LogFileHeader)) < 0) {
+        return 0;
+    }
+    log_map = mmap(NULL, sizeof(LogFileHeader), PROT_READ | PROT_WRITE, MAP_SHARED, log_file_fd, 0);
+    if (log_map == MAP_FAILED) {
+        log_map = NULL;
+        return 0;
+    }
+    memcpy(log_map->magic, LOG_FILE_MAGIC, sizeof(log_map->magic));
+    log_map->record_size = sizeof(LogRecord);
+    log_map->event_count = LOG_EV_COUNT;
+    log_map->records = 0;
+    log_map->start_us = log_start_us;
+    return 1;
+}
+
+// Trim the unused tail and push the file to disk
+void log_file_close() {
+    if (log_map == NULL) {
+        return;
+    }
+    size_t used = sizeof(LogFileHeader) + log_map->records * sizeof(LogRecord);
+    msync(log_map, used, MS_SYNC);
+    munmap(log_map, sizeof(LogFileHeader) + log_map_records * sizeof(LogRecord));
+    log_map = NULL;
+    if (ftruncate(log_file_fd, used) < 0) {
+        perror("Failed to trim log file");
+    }
+    close(log_file_fd);
+    log_file_fd = -1;
+}
+
+// A thread exited: its ring can be claimed again once drained
+void log_ring_release(void *ring) {
+    __atomic_store_n(&((LogRing *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+// Ring of the calling thread, claimed on its first record
+LogRing *log_thread_ring() {
+    if (log_ring != NULL) {
+        return log_ring;
+    }
+    MUTEX_LOCK(log_mutex);
+    LogRing *ring = log_rings;
+    while (ring != NULL && __atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE)) {
+        ring = ring->next;
+    }
+    if (ring == NULL && log_ring_count < 256 && (ring = calloc(1, sizeof(LogRing))) != NULL) {
+        ring->id = log_ring_count++;
+        ring->next = log_rings;
+        __atomic_store_n(&log_rings, ring, __ATOMIC_RELEASE);
+    }
+    if (ring != NULL) {
+        ring->in_use = 1;
+    }
+    MUTEX_UNLOCK(log_mutex);
+#ifndef _WIN32
+    if (ring != NULL) {
+        pthread_setspecific(log_ring_key, ring);
+    }
 #endif
+    log_ring = ring;
+    return ring;
+}
+
+// Hand a record to the formatter, or print it directly before the logger
+// starts and after it shuts down
+void log_submit(LogRecord *rec) {
+    LogRing *ring;
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) || (ring = log_thread_ring()) == NULL) {
+        MUTEX_LOCK(log_mutex);
+        log_print_record(stdout, rec, rec->event == LOG_EV_TEXT ? rec->u.text.text : NULL);
+        fflush(stdout);
+        MUTEX_UNLOCK(log_mutex);
+        if (rec->event == LOG_EV_TEXT) {
+            free(rec->u.text.text);
+        }
+        return;
+    }
+    
+    if (log_events[rec->event].rate_limited && server_config.log_rate > 0) {
+        uint64_t second = rec->time_us / 1000000;
+        if (ring->rate_second[rec->event] != second) {
+            ring->rate_second[rec->event] = second;
+            ring->rate_count[rec->event] = 0;
+        }
+        if (ring->rate_count[rec->event]++ >= (uint32_t)server_config.log_rate) {
+            ring->suppressed[rec->event]++;
+            return;
+        }
+        rec->suppressed = ring->suppressed[rec->event];
+        ring->suppressed[rec->event] = 0;
+    }
+    
+    rec->thread = (uint8_t)ring->id;
+    unsigned head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        ring->overruns++;
+        if (rec->event == LOG_EV_TEXT) {
+            free(rec->u.text.text);
+        }
+        return;
+    }
+    ring->records[head & (LOG_RING_SIZE - 1)] = *rec;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Log a fixed-format event; the hot-path form of logging
+void log_event(int event, int a, int b, int c) {
+    if (log_events[event].level < server_config.log_level) {
+        return;
+    }
+    LogRecord rec;
+    rec.time_us = (uint64_t)(get_time() * 1000000.0);
+    rec.event = (uint16_t)event;
+    rec.level = (uint8_t)log_events[event].level;
+    rec.thread = 0;
+    rec.suppressed = 0;
+    rec.u.args[0] = a;
+    rec.u.args[1] = b;
+    rec.u.args[2] = c;
+    rec.u.args[3] = 0;
+    log_submit(&rec);
+}
+
+void log_text(int level, const char *format, va_list args) {
+    if (level < server_config.log_level) {
+        return;
+    }
+    char buffer[LOG_TEXT_MAX];
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    if (length < 0) {
+        return;
+    }
+    if (length >= (int)sizeof(buffer)) {
+        length = sizeof(buffer) - 1;
+    }
     
+    LogRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.time_us = (uint64_t)(get_time() * 1000000.0);
+    rec.event = LOG_EV_TEXT;
+    rec.level = (uint8_t)level;
+    rec.u.text.text = malloc(length + 1);
+    if (rec.u.text.text == NULL) {
+        return;
+    }
+    memcpy(rec.u.text.text, buffer, length + 1);
+    rec.u.text.length = (uint32_t)length;
+    log_submit(&rec);
+}
+
+// Thread-safe logging function
+void log_message(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_text(LOG_INFO, format, args);
+    va_end(args);
+}
+
+// Same, for failures that do not stop the server
+void log_warning(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    vprintf(format, args);
+    log_text(LOG_WARN, format, args);
     va_end(args);
-    printf("\n");
-    fflush(stdout);
+}
+
+int log_record_compare(const void *a, const void *b) {
+    const LogRecord *x = (const LogRecord *)a;
+    const LogRecord *y = (const LogRecord *)b;
+    if (x->time_us != y->time_us) {
+        return x->time_us < y->time_us ? -1 : 1;
+    }
+    return (int)x->thread - (int)y->thread;
+}
+
+// Format or store everything queued so far. Returns the records handled.
+int log_drain() {
+    MUTEX_LOCK(log_drain_mutex);
+    int count = 0;
+    unsigned long overruns = 0;
+    for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        unsigned tail = ring->tail;
+        unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head && count < LOG_BATCH_MAX) {
+            log_batch[count++] = ring->records[tail & (LOG_RING_SIZE - 1)];
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        overruns += ring->overruns;
+    }
     
-#ifdef _WIN32
-    MUTEX_UNLOCK(log_mutex);
-#else
-    pthread_mutex_unlock(&log_mutex);
+    // Rings are individually ordered; merge them by time
+    qsort(log_batch, count, sizeof(LogRecord), log_record_compare);
+    for (int i = 0; i < count; i++) {
+        LogRecord *rec = &log_batch[i];
+#ifndef _WIN32
+        if (log_map != NULL) {
+            log_file_append(rec);
+        } else
 #endif
+        log_print_record(stdout, rec, rec->event == LOG_EV_TEXT ? rec->u.text.text : NULL);
+        if (rec->event == LOG_EV_TEXT) {
+            free(rec->u.text.text);
+        }
+    }
+    if (overruns > log_overruns_reported) {
+        printf("Logger: %lu records dropped, rings full\n", overruns - log_overruns_reported);
+        log_overruns_reported = overruns;
+    }
+    if (count > 0) {
+        fflush(stdout);
+    }
+    MUTEX_UNLOCK(log_drain_mutex);
+    return count;
 }
 
-// Add client to queue
-void enqueue_client(int client_id) {
-#ifdef _WIN32
-    MUTEX_LOCK(queue_mutex);
-#else
-    pthread_mutex_lock(&queue_mutex);
-#endif
-    
-    QueueNode *new_node = (QueueNode *)malloc(sizeof(QueueNode));
-    new_node->client_id = client_id;
-    new_node->next = NULL;
-    
-    if (queue_tail == NULL) {
-        queue_head = new_node;
-        queue_tail = new_node;
-    } else {
-        queue_tail->next = new_node;
-        queue_tail = new_node;
+THREAD_RETURN_TYPE log_formatter_thread(THREAD_PARAM arg) {
+    (void)arg;
+    while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        // Keep going without sleeping while a backlog remains
+        if (log_drain() < LOG_BATCH_MAX) {
+            usleep(LOG_FLUSH_MS * 1000);
+        }
     }
-    
 #ifdef _WIN32
-    WIN_COND_SIGNAL(queue_cond_var);
-    MUTEX_UNLOCK(queue_mutex);
+    return 0;
 #else
-    pthread_cond_signal(&queue_cond);
-    pthread_mutex_unlock(&queue_mutex);
+    return NULL;
 #endif
 }
 
-// Get next client from queue
-int dequeue_client() {
+// Route logging through the rings and start the formatter
+int log_start() {
+    log_start_us = (uint64_t)(get_time() * 1000000.0);
 #ifdef _WIN32
-    MUTEX_LOCK(queue_mutex);
-    
-    while (queue_head == NULL) {
-        WIN_COND_WAIT(queue_cond_var, queue_mutex);
+    MUTEX_INIT(log_drain_mutex);
+    if (server_config.log_file != NULL) {
+        printf("Binary log files are not supported on Windows\n");
+        return 0;
     }
 #else
-    pthread_mutex_lock(&queue_mutex);
-    
-    while (queue_head == NULL) {
-        pthread_cond_wait(&queue_cond, &queue_mutex);
+    pthread_key_create(&log_ring_key, log_ring_release);
+    if (server_config.log_file != NULL && !log_file_open(server_config.log_file)) {
+        perror("Failed to open log file");
+        return 0;
     }
 #endif
-    
-    QueueNode *temp = queue_head;
-    int client_id = temp->client_id;
-    queue_head = queue_head->next;
-    
-    if (queue_head == NULL) {
-        queue_tail = NULL;
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+    thread_t formatter;
+    if (!THREAD_CREATE(formatter, log_formatter_thread, NULL)) {
+        __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+        return 0;
     }
-    
-    free(temp);
-#ifdef _WIN32
-    MUTEX_UNLOCK(queue_mutex);
-#else
-    pthread_mutex_unlock(&queue_mutex);
-#endif
-    
-    return client_id;
+    THREAD_DETACH(formatter);
+    return 1;
 }
 
-// Estimate bandwidth based on resolution
-int estimate_bandwidth(const char *resolution) {
-    if (strcmp(resolution, "480p") == 0) {
-        return 1500;  // 1.5 Mbps for 480p
-    } else if (strcmp(resolution, "720p") == 0) {
-        return 3000;  // 3 Mbps for 720p
-    } else if (strcmp(resolution, "1080p") == 0) {
-        return 6000;  // 6 Mbps for 1080p
-    } else {
-        return 1000;  // Default
+// Write out what is queued and go back to printing directly
+void log_shutdown() {
+    if (!__atomic_exchange_n(&log_running, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    while (log_drain() > 0) {
     }
+#ifndef _WIN32
+    log_file_close();
+#endif
 }
 
-// Simulate video data
-void generate_video_chunk(char *buffer, int chunk_id, const char *resolution) {
-    // In a real application, this would read actual video data
-    // For simulation, we'll just fill the buffer with identifiable data
-    int header_len = snprintf(buffer, 100, "VIDEO_CHUNK_%d_%s_", chunk_id, resolution);
-    
-    // Simulate encoding time
-    usleep(50000); // 50ms of "encoding time"
-    
-    // Fill the rest with repeating pattern to simulate video payload
-    // Safer alternative to random data for large chunks
-    char pattern[10] = "VIDEODATA";
-    
-    // Determine the appropriate chunk size based on the buffer size
-    int max_chunk_size;
-    if (strcasecmp(resolution, "UDP") == 0) {
-        max_chunk_size = UDP_CHUNK_SIZE - 1; // Leave space for null terminator
-    } else {
-        max_chunk_size = VIDEO_CHUNK_SIZE - 1; // Leave space for null terminator
+// Print a binary log file written with --log-file
+int run_log_decoder(const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        perror("Failed to open log file");
+        return 1;
     }
-    
-    for (int i = header_len; i < max_chunk_size - 1; i += 9) {
-        int space_left = max_chunk_size - i;
-        int copy_size = (space_left < 9) ? space_left : 9;
-        memcpy(buffer + i, pattern, copy_size);
+    LogFileHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, LOG_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(LogRecord) || header.event_count != LOG_EV_COUNT) {
+        printf("%s is not a log file written by this server version\n", path);
+        fclose(in);
+        return 1;
     }
     
-    // Ensure null termination
-    buffer[max_chunk_size] = '\0';
+    static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+    char text[LOG_TEXT_MAX + sizeof(LogRecord)];
+    LogRecord rec;
+    uint64_t done = 0;
+    while (done < header.records && fread(&rec, sizeof(rec), 1, in) == 1) {
+        done++;
+        if (rec.event == LOG_EV_TEXT) {
+            uint32_t length = (uint32_t)rec.u.args[0];
+            uint32_t text_records = (length + sizeof(LogRecord) - 1) / sizeof(LogRecord);
+            if (length > LOG_TEXT_MAX || fread(text, sizeof(LogRecord), text_records, in) != text_records) {
+                break;
+            }
+            text[length] = '\0';
+            done += text_records;
+        }
+        printf("%12.6f %-5s T%-3u ", (double)(rec.time_us - header.start_us) / 1000000.0,
+               rec.level <= LOG_ERROR ? level_names[rec.level] : "?", rec.thread);
+        log_print_record(stdout, &rec, text);
+    }
+    fclose(in);
+    return 0;
 }
 
-// Update client statistics
-void update_stats(int client_id, int bytes, const char *protocol) {
-#ifdef _WIN32
-    MUTEX_LOCK(stats_mutex);
-#else
-    pthread_mutex_lock(&stats_mutex);
-#endif
-    
-    client_stats[client_id].bytes_sent += bytes;
-    client_stats[client_id].chunks_sent++;
-    client_stats[client_id].current_time = get_time();
-    double elapsed = client_stats[client_id].current_time - client_stats[client_id].start_time;
-    client_stats[client_id].data_rate = (elapsed > 0) ? 
-                                        (client_stats[client_id].bytes_sent / elapsed) : 0;
-    strncpy(client_stats[client_id].protocol, protocol, sizeof(client_stats[client_id].protocol));
-    client_stats[client_id].protocol[sizeof(client_stats[client_id].protocol) - 1] = '\0';
-    
+// ---- Run queue ----
+
+void run_queue_init(void) {
+    for (unsigned i = 0; i < RUN_QUEUE_SIZE; i++) {
+        run_queue.cells[i].seq = i;
+    }
 #ifdef _WIN32
-    MUTEX_UNLOCK(stats_mutex);
+    run_queue_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#elif defined(__linux__)
+    run_queue_fd[0] = run_queue_fd[1] = eventfd(0, EFD_CLOEXEC);
 #else
-    pthread_mutex_unlock(&stats_mutex);
+    if (pipe(run_queue_fd) == 0) {
+        fcntl(run_queue_fd[1], F_SETFL, O_NONBLOCK);
+    }
 #endif
 }
 
-// Print statistics for all clients
-void print_stats() {
-#ifdef _WIN32
-    MUTEX_LOCK(stats_mutex);
-#else
-    pthread_mutex_lock(&stats_mutex);
-#endif
-    
-    log_message("\n----- Streaming Statistics -----");
-    if (client_count == 0) {
-        log_message("No clients connected yet.");
-    } else {
-        // First print a summary of all clients
-        log_message("Total clients connected: %d\n", client_count);
-        
-        // Then print detailed stats for each client
-        for (int i = 0; i < client_count; i++) {
-            log_message("Client %d (%s): %s - %s", 
-                   client_stats[i].client_id,
-                   inet_ntoa(client_stats[i].address.sin_addr),
-                   client_stats[i].protocol,
-                   client_stats[i].resolution);
-                   
-            if (client_stats[i].chunks_sent > 0) {
-                log_message("  Status: %s", 
-                       client_stats[i].state == STATE_STREAMING ? "Streaming" : 
-                       client_stats[i].state == STATE_FINISHED ? "Finished" : 
-                       client_stats[i].state == STATE_IDLE ? "Idle" : "Connecting");
-                log_message("  Bytes sent: %lu", client_stats[i].bytes_sent);
-                log_message("  Chunks sent: %d", client_stats[i].chunks_sent);
-                log_message("  Data rate: %.2f bytes/sec", client_stats[i].data_rate);
-                double elapsed = client_stats[i].current_time - client_stats[i].start_time;
-                log_message("  Elapsed time: %.2f seconds", elapsed);
-                
-                // Print protocol-specific metrics
-                if (strcmp(client_stats[i].protocol, "UDP") == 0) {
-                    log_message("  Packets dropped: %d", client_stats[i].packets_dropped);
-                    float loss_rate = (client_stats[i].packets_dropped * 100.0f) / 
-                                     (client_stats[i].chunks_sent + client_stats[i].packets_dropped);
-                    log_message("  Packet loss rate: %.2f%%", loss_rate);
-                }
-                
-                // Print latency if measured
-                if (client_stats[i].latency > 0) {
-                    log_message("  Average latency: %.2f ms", client_stats[i].latency);
-                }
-                
-                printf("\n");
-            } else {
-                log_message("  Status: %s", 
-                       client_stats[i].state == STATE_STREAMING ? "Streaming" : 
-                       client_stats[i].state == STATE_FINISHED ? "Finished" : 
-                       client_stats[i].state == STATE_IDLE ? "Idle" : "Connecting");
-                log_message("  No streaming data sent yet\n");
+// Returns false if the ring is full
+bool run_queue_push(int client_id) {
+    unsigned pos = __atomic_load_n(&run_queue.tail, __ATOMIC_RELAXED);
+    while (1) {
+        RunQueueCell *cell = &run_queue.cells[pos & (RUN_QUEUE_SIZE - 1)];
+        int diff = (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            // On failure pos is reloaded with the current tail
+            if (__atomic_compare_exchange_n(&run_queue.tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->client_id = client_id;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
             }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&run_queue.tail, __ATOMIC_RELAXED);
         }
     }
-    
-    log_message("------------------------------");
-#ifdef _WIN32
-    MUTEX_UNLOCK(stats_mutex);
-#else
-    pthread_mutex_unlock(&stats_mutex);
-#endif
-}
-
-// Generate a random port number in the valid range
-int get_random_port() {
-    return 10000 + (rand() % 40000); // Between 10000 and 49999
 }
 
-// Handle connection phase for a new client
-THREAD_RETURN_TYPE handle_connection_phase(THREAD_PARAM arg) {
-    socket_t client_socket = *((socket_t *)arg);
-    free(arg);
-    
-    // Get client's address information
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    getpeername(client_socket, (struct sockaddr*)&client_addr, &addr_len);
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    
-    // Register the client
-    int client_id;
-    
-#ifdef _WIN32
-    MUTEX_LOCK(stats_mutex);
-#else
-    pthread_mutex_lock(&stats_mutex);
-#endif
-    
-    // Find a free slot or reuse an existing inactive client with the same IP
-    client_id = -1;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        // Check if this is an existing client from the same IP that's inactive
-        if (!client_stats[i].active) {
-            char stored_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client_stats[i].address.sin_addr, stored_ip, INET_ADDRSTRLEN);
-            
-            // Either a new slot or an old inactive client from same IP
-            if (client_id == -1 || strcmp(stored_ip, client_ip) == 0) {
-                client_id = i;
-                if (strcmp(stored_ip, client_ip) == 0) {
-                    // Prefer reusing slots from the same client
-                    break;
-                }
+// Returns -1 if the ring is empty
+int run_queue_pop(void) {
+    unsigned pos = __atomic_load_n(&run_queue.head, __ATOMIC_RELAXED);
+    while (1) {
+        RunQueueCell *cell = &run_queue.cells[pos & (RUN_QUEUE_SIZE - 1)];
+        int diff = (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&run_queue.head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                int client_id = cell->client_id;
+                __atomic_store_n(&cell->seq, pos + RUN_QUEUE_SIZE, __ATOMIC_RELEASE);
+                return client_id;
             }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&run_queue.head, __ATOMIC_RELAXED);
         }
     }
-    
-    if (client_id == -1) {
-        // All client slots are occupied
+}
+
+// Wake the scheduler if it is blocked (or about to block) on an empty
+// queue. Pairs with the fence in dequeue_client(): either the scheduler
+// sees the new session on its second look, or we see it sleeping.
+void run_queue_wake(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&run_queue.sleeping, __ATOMIC_RELAXED)) {
+        return;
+    }
 #ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
+    SetEvent(run_queue_event);
 #else
-        pthread_mutex_unlock(&stats_mutex);
+    uint64_t one = 1;
+    if (write(run_queue_fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Run queue wakeup failed");
+    }
 #endif
-        printf("Maximum client limit reached, rejecting new connection from %s\n", client_ip);
-        CLOSE_SOCKET(client_socket);
+}
+
+void run_queue_wait(void) {
 #ifdef _WIN32
-        return 0;
+    WaitForSingleObject(run_queue_event, INFINITE);
 #else
-        return NULL;
-#endif
-    }
-    
-    // Initialize or reset client stats
-    client_stats[client_id].client_id = client_id;
-    client_stats[client_id].address = client_addr;
-    client_stats[client_id].bytes_sent = 0;
-    client_stats[client_id].chunks_sent = 0;
-    client_stats[client_id].start_time = get_time();
-    client_stats[client_id].current_time = client_stats[client_id].start_time;
-    client_stats[client_id].data_rate = 0;
-    client_stats[client_id].state = STATE_CONNECTION;
-    client_stats[client_id].active = 1;
-    client_stats[client_id].streaming_port = 0;
-    client_stats[client_id].socket_fd = INVALID_SOCKET_VALUE;
-    
-    if (client_id >= client_count) {
-        client_count = client_id + 1;
+    // An eventfd read returns and resets the count; from a pipe, drain
+    // whatever wakeups piled up
+    uint64_t count;
+    if (read(run_queue_fd[0], &count, sizeof(count)) < 0 && errno != EINTR) {
+        perror("Run queue wait failed");
+        usleep(50000);
     }
-    
-#ifdef _WIN32
-    MUTEX_UNLOCK(stats_mutex);
-#else
-    pthread_mutex_unlock(&stats_mutex);
 #endif
-    
-    printf("Client %d connected: %s\n", client_id, client_ip);
-    
-    // Handle Type 1 Request
-    Message request, response;
-    memset(&request, 0, sizeof(request));
-    memset(&response, 0, sizeof(response));
-    
-    // Receive Type 1 Request with timeout
+}
+
+// Hand an admitted client to the scheduler: FCFS keeps arrival order in
+// the run queue, RR and DRR mark the session ready and serve ready
+// sessions by table index.
+void enqueue_client(int client_id) {
+    if (scheduling_policy != POLICY_FCFS) {
+        unsigned index = SESSION_INDEX(client_id);
 #ifdef _WIN32
-    DWORD tv_ms = 5000;  // 5 seconds timeout
-    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv_ms, sizeof(tv_ms));
+        MUTEX_LOCK(queue_mutex);
 #else
-    struct timeval tv;
-    tv.tv_sec = 5;  // 5 seconds timeout
-    tv.tv_usec = 0;
-    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+        pthread_mutex_lock(&queue_mutex);
 #endif
-    
-    int bytes_received = recv(client_socket, (char*)&request, sizeof(request), 0);
-    if (bytes_received <= 0) {
-        printf("Failed to receive Type 1 Request from client %d\n", client_id);
-        print_socket_error("Receive error");
-        CLOSE_SOCKET(client_socket);
-        
+        session_ready[index / 64] |= 1ULL << (index % 64);
 #ifdef _WIN32
-        MUTEX_LOCK(stats_mutex);
+        MUTEX_UNLOCK(queue_mutex);
 #else
-        pthread_mutex_lock(&stats_mutex);
+        pthread_mutex_unlock(&queue_mutex);
 #endif
-        client_stats[client_id].active = 0;
-        client_stats[client_id].state = STATE_IDLE;
+    } else if (!run_queue_push(client_id)) {
+        // Cannot happen while RUN_QUEUE_SIZE >= MAX_SESSIONS
+        log_warning("Run queue full, dropping client %d", client_id);
+        release_client(client_id, STATE_FINISHED);
+        return;
+    }
+    run_queue_wake();
+}
+
+// Take the first ready session after the RR cursor, wrapping around the
+// table, and advance the cursor to it. Returns its client ID, or -1 if
+// none is ready.
+int rr_take_ready(void) {
+    int client_id = -1;
 #ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
+    MUTEX_LOCK(queue_mutex);
 #else
-        pthread_mutex_unlock(&stats_mutex);
+    pthread_mutex_lock(&queue_mutex);
 #endif
-        
+    unsigned words = (unsigned)__atomic_load_n(&session_capacity, __ATOMIC_ACQUIRE) / 64;
+    unsigned start = words > 0 ? (current_rr_client + 1) % (words * 64) : 0;
+    // words + 1 passes: the last revisits the first word's bits below start
+    for (unsigned n = 0; words > 0 && n <= words; n++) {
+        unsigned w = (start / 64 + n) % words;
+        uint64_t bits = session_ready[w];
+        if (n == 0) {
+            bits &= ~0ULL << (start % 64);
+        }
+        if (bits != 0) {
+            unsigned index = w * 64 + (unsigned)__builtin_ctzll(bits);
+            session_ready[w] &= ~(1ULL << (index % 64));
+            current_rr_client = index;
+            // release_client() clears the bit under queue_mutex, so the
+            // entry still holds the session that set it
+            client_id = (int)(__atomic_load_n(&session_entry(index)->generation, __ATOMIC_ACQUIRE)
+                              << SESSION_INDEX_BITS) | (int)index;
+            break;
+        }
+    }
 #ifdef _WIN32
-        return 0;
+    MUTEX_UNLOCK(queue_mutex);
 #else
-        return NULL;
+    pthread_mutex_unlock(&queue_mutex);
 #endif
+    return client_id;
+}
+
+// Block until the scheduling policy has a client to start and return it
+int dequeue_client() {
+    while (1) {
+        int client_id = scheduling_policy == POLICY_FCFS ? run_queue_pop() : rr_take_ready();
+        if (client_id >= 0) {
+            return client_id;
+        }
+        
+        // Announce the sleep, then look once more so a session enqueued
+        // in between is not left waiting for the next wakeup
+        __atomic_store_n(&run_queue.sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        client_id = scheduling_policy == POLICY_FCFS ? run_queue_pop() : rr_take_ready();
+        if (client_id < 0) {
+            run_queue_wait();
+        }
+        __atomic_store_n(&run_queue.sleeping, 0, __ATOMIC_RELAXED);
+        if (client_id >= 0) {
+            return client_id;
+        }
+    }
+}
+
+// Estimate bandwidth based on resolution
+int estimate_bandwidth(const char *resolution) {
+    if (strcmp(resolution, "480p") == 0) {
+        return 1500;  // 1.5 Mbps for 480p
+    } else if (strcmp(resolution, "720p") == 0) {
+        return 3000;  // 3 Mbps for 720p
+    } else if (strcmp(resolution, "1080p") == 0) {
+        return 6000;  // 6 Mbps for 1080p
+    } else {
+        return 1000;  // Default
+    }
+}
+
+// Start a full bucket paced at the resolution's bandwidth (Kbps, as in the
+// Type 2 Response). The bucket always holds at least one chunk, plus a few
+// milliseconds of tokens so a timer firing late does not lose time.
+void pacer_init(Pacer *p, const char *resolution, int chunk_size, double now) {
+    p->target_kbps = estimate_bandwidth(resolution);
+    p->rate = p->target_kbps * 1000.0 / 8.0;
+    p->depth = server_config.burst > chunk_size ? server_config.burst : chunk_size;
+    p->tokens = p->depth;
+    p->depth += p->rate * PACER_SLACK_MS / 1000.0;
+    p->refilled = now;
+    p->first_send = 0;
+    p->last_send = 0;
+    p->paced_bytes = 0;
+    p->last_bytes = 0;
+    p->sends = 0;
+}
+
+// Earliest time `bytes` may go out
+double pacer_due(Pacer *p, int bytes, double now) {
+    p->tokens += (now - p->refilled) * p->rate;
+    if (p->tokens > p->depth) {
+        p->tokens = p->depth;
+    }
+    p->refilled = now;
+    return p->tokens >= bytes ? now : now + (bytes - p->tokens) / p->rate;
+}
+
+// Charge a send that starts now (call once pacer_due has passed)
+void pacer_consume(Pacer *p, int bytes, double now) {
+    pacer_due(p, bytes, now);
+    p->tokens -= bytes;
+    if (p->sends++ == 0) {
+        p->first_send = now;
+    } else {
+        p->paced_bytes += p->last_bytes;
+    }
+    p->last_send = now;
+    p->last_bytes = bytes;
+}
+
+// Rate between the first and the latest send start, in Kbps
+double pacer_achieved_kbps(const Pacer *p) {
+    double elapsed = p->last_send - p->first_send;
+    return elapsed > 0 ? p->paced_bytes * 8.0 / 1000.0 / elapsed : 0.0;
+}
+
+// ---- Link sharing ----
+//
+// With --capacity-kbps all streams share one egress budget, handed out in
+// SHARE_ROUND_MS rounds according to the scheduling policy:
+//   FCFS  one pool per round, taken by whichever session asks first
+//   RR    every backlogged session gets the same quantum of bytes per round
+//   DRR   quanta are weighted by the session's estimate_bandwidth()
+//   EDF   a dispatcher thread lets waiting chunks go strictly in order of
+//         playout deadline, as far as each round's budget reaches
+// RR and DRR keep a per-session deficit: quantum a session could not use
+// yet carries over, so a 128KB TCP chunk goes out once enough rounds have
+// been credited. The sending thread credits its session lazily whenever it
+// asks, splitting each round among the sessions short of credit. A session
+// whose pacer keeps it below its share piles up credit; once that exceeds
+// a chunk plus a quantum it drops out of the split and leaves its share to
+// the others. Without --capacity-kbps only the pacers apply.
+//
+// Chunk i of a stream is due at the client PLAYOUT_DELAY_MS after the
+// stream started plus the playback time of chunks 1..i-1 at the target
+// bitrate. Misses are counted under every policy so they can be compared;
+// under EDF a UDP chunk that is already late is skipped instead of sent.
+
+#define SHARE_ROUND_BYTES ((int64_t)server_config.capacity_kbps * 1000 / 8 * SHARE_ROUND_MS / 1000)
+
+// `now` is on the clock later passed to share_due (the pacer's)
+void share_init(ShareState *sh, const char *resolution, int chunk_size, double now) {
+    int target_kbps = estimate_bandwidth(resolution);
+    sh->deficit = 0;
+    sh->round = 0;
+    sh->weight = scheduling_policy == POLICY_DRR ? (uint64_t)target_kbps : 1;
+    sh->backlogged = false;
+    sh->start = now;
+    sh->chunk_seconds = chunk_size * 8.0 / (target_kbps * 1000.0);
+    sh->deadline = 0;
+    sh->bytes = 0;
+    sh->heap_slot = 0;
+    sh->granted = 0;
+    sh->active = true;
+}
+
+// Playout deadline of chunk `chunk_id` (1-based)
+double share_deadline(const ShareState *sh, int chunk_id) {
+    return sh->start + PLAYOUT_DELAY_MS / 1000.0 + (chunk_id - 1) * sh->chunk_seconds;
+}
+
+// ---- EDF heap: binary min-heap on deadline, caller holds edf_mutex ----
+
+void edf_heap_place(int i, ShareState *sh) {
+    edf_heap[i] = sh;
+    sh->heap_slot = i + 1;
+}
+
+void edf_heap_up(int i) {
+    ShareState *sh = edf_heap[i];
+    while (i > 0 && edf_heap[(i - 1) / 2]->deadline > sh->deadline) {
+        edf_heap_place(i, edf_heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    edf_heap_place(i, sh);
+}
+
+void edf_heap_down(int i) {
+    ShareState *sh = edf_heap[i];
+    while (2 * i + 1 < edf_count) {
+        int child = 2 * i + 1;
+        if (child + 1 < edf_count && edf_heap[child + 1]->deadline < edf_heap[child]->deadline) {
+            child++;
+        }
+        if (edf_heap[child]->deadline >= sh->deadline) {
+            break;
+        }
+        edf_heap_place(i, edf_heap[child]);
+        i = child;
+    }
+    edf_heap_place(i, sh);
+}
+
+void edf_heap_remove(ShareState *sh) {
+    int i = sh->heap_slot - 1;
+    sh->heap_slot = 0;
+    if (--edf_count > i) {
+        ShareState *last = edf_heap[edf_count];
+        edf_heap_place(i, last);
+        edf_heap_up(i);
+        if (last->heap_slot == i + 1) {
+            edf_heap_down(i);
+        }
+    }
+}
+
+// Stop taking part in the split, when the session ends or has credit to
+// spare, and give up a chunk waiting for the EDF dispatcher
+void share_end(ShareState *sh) {
+    if (!sh->active) {
+        return;  // Connection-phase sessions never claimed a share
+    }
+    if (sh->backlogged) {
+        __atomic_sub_fetch(&share_weight, sh->weight, __ATOMIC_RELAXED);
+        sh->backlogged = false;
+    }
+    if (scheduling_policy == POLICY_EDF) {
+        MUTEX_LOCK(edf_mutex);
+        if (sh->heap_slot > 0) {
+            edf_heap_remove(sh);
+        }
+        MUTEX_UNLOCK(edf_mutex);
     }
+}
+
+// Earliest time chunk `chunk_id` of `bytes` may go out as far as the
+// budget is concerned
+double share_due(ShareState *sh, int chunk_id, int bytes, double now) {
+    if (server_config.capacity_kbps <= 0) {
+        return now;
+    }
+    uint64_t round = (uint64_t)(now * 1000.0 / SHARE_ROUND_MS);
+    double next_round = (round + 1) * SHARE_ROUND_MS / 1000.0;
     
-    if (request.type != TYPE_1_REQUEST) {
-        printf("Received invalid request type from client %d\n", client_id);
-        CLOSE_SOCKET(client_socket);
-        
-#ifdef _WIN32
-        MUTEX_LOCK(stats_mutex);
+    if (scheduling_policy == POLICY_EDF) {
+        if (__atomic_load_n(&sh->granted, __ATOMIC_ACQUIRE)) {
+            return now;
+        }
+        MUTEX_LOCK(edf_mutex);
+        if (sh->heap_slot == 0) {
+            sh->deadline = share_deadline(sh, chunk_id);
+            sh->bytes = bytes;
+            edf_heap_place(edf_count++, sh);
+            edf_heap_up(edf_count - 1);
+        }
+        MUTEX_UNLOCK(edf_mutex);
+        // The dispatcher hands out grants on round boundaries; look again
+        // half a round later
+        return next_round + SHARE_ROUND_MS / 2000.0;
+    }
+    
+    if (scheduling_policy == POLICY_FCFS) {
+        // Whoever first sees a new round credits it; the pool holds at most
+        // one TCP chunk more than a round so an idle link builds no burst
+        uint64_t pool_round = __atomic_load_n(&share_pool_round, __ATOMIC_ACQUIRE);
+        if (round > pool_round &&
+            __atomic_compare_exchange_n(&share_pool_round, &pool_round, round, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            uint64_t rounds = pool_round == 0 ? 1 : round - pool_round;
+            int64_t limit = TCP_CHUNK_SIZE + SHARE_ROUND_BYTES;
+            int64_t pool = __atomic_add_fetch(&share_pool, SHARE_ROUND_BYTES * (int64_t)(rounds < 64 ? rounds : 64),
+                                              __ATOMIC_ACQ_REL);
+            if (pool > limit) {
+                __atomic_sub_fetch(&share_pool, pool - limit, __ATOMIC_ACQ_REL);
+            }
+        }
+        return __atomic_load_n(&share_pool, __ATOMIC_ACQUIRE) >= bytes ? now : next_round;
+    }
+    
+    if (round > sh->round) {
+        if (sh->backlogged) {
+            uint64_t total = __atomic_load_n(&share_weight, __ATOMIC_RELAXED);
+            int64_t quantum = (int64_t)(SHARE_ROUND_BYTES * sh->weight / total);
+            if (quantum < 1) {
+                quantum = 1;
+            }
+            uint64_t rounds = round - sh->round;
+            sh->deficit += quantum * (int64_t)(rounds < 64 ? rounds : 64);
+            if (sh->deficit >= bytes + quantum) {
+                // More than the session can use: it is held back by its own
+                // pacer, so stop taking a share until it runs short again
+                sh->deficit = bytes + quantum;
+                share_end(sh);
+            }
+        }
+        sh->round = round;
+    }
+    if (sh->deficit >= bytes) {
+        return now;
+    }
+    if (!sh->backlogged) {
+        __atomic_add_fetch(&share_weight, sh->weight, __ATOMIC_RELAXED);
+        sh->backlogged = true;
+    }
+    return next_round;
+}
+
+// Charge a send that share_due allowed
+void share_consume(ShareState *sh, int bytes) {
+    if (server_config.capacity_kbps <= 0) {
+        return;
+    }
+    if (scheduling_policy == POLICY_EDF) {
+        __atomic_store_n(&sh->granted, 0, __ATOMIC_RELAXED);  // Charged when granted
+    } else if (scheduling_policy == POLICY_FCFS) {
+        __atomic_sub_fetch(&share_pool, bytes, __ATOMIC_ACQ_REL);
+    } else {
+        sh->deficit -= bytes;
+    }
+}
+
+// Clock the senders pass to share_due
+double share_clock(void) {
+#ifdef USE_EPOLL
+    return get_monotonic_time();
 #else
-        pthread_mutex_lock(&stats_mutex);
+    return get_time();
 #endif
-        client_stats[client_id].active = 0;
-        client_stats[client_id].state = STATE_IDLE;
+}
+
+// EDF: at every round boundary add the round's budget and grant waiting
+// chunks in deadline order while it lasts. The budget stays with the head
+// of the heap, so a TCP chunk larger than a round goes out once enough
+// rounds are banked and nothing with a later deadline overtakes it.
+THREAD_RETURN_TYPE edf_dispatcher_thread(THREAD_PARAM arg) {
+    (void)arg;
+    int64_t pool = 0;
+    while (1) {
+        double now = share_clock();
+        double next_round = ((uint64_t)(now * 1000.0 / SHARE_ROUND_MS) + 1) * SHARE_ROUND_MS / 1000.0;
+        usleep((int)((next_round - now) * 1000000.0) + 1);
+        
+        pool += SHARE_ROUND_BYTES;
+        MUTEX_LOCK(edf_mutex);
+        if (edf_count == 0 && pool > SHARE_ROUND_BYTES) {
+            pool = SHARE_ROUND_BYTES;  // An idle link builds no burst
+        }
+        while (edf_count > 0 && pool >= edf_heap[0]->bytes) {
+            ShareState *sh = edf_heap[0];
+            pool -= sh->bytes;
+            edf_heap_remove(sh);
+            __atomic_store_n(&sh->granted, 1, __ATOMIC_RELEASE);
+        }
+        MUTEX_UNLOCK(edf_mutex);
+    }
+    
 #ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
+    return 0;
 #else
-        pthread_mutex_unlock(&stats_mutex);
+    return NULL;
 #endif
-        
+}
+
+// ---- Session table ----
+//
+// Sessions live in SESSION_SLAB_SIZE-entry slabs allocated on demand, so
+// the table costs nothing until it is used and entries never move once
+// handed out. Free entries form a LIFO list through next_free, making
+// register_client() and release_client() O(1). Because a client ID carries
+// its entry's generation, an ID that outlived its session (a late TCP
+// connect, a stray REQUEST_STREAM) no longer matches once the entry is
+// freed, even after the index has been given to someone else.
+
+// Entry for a client ID. Only the index bits are used, so callers that
+// need to know the ID is current check session_current() or client_active().
+SessionEntry *session_entry(int client_id) {
+    unsigned index = SESSION_INDEX(client_id);
+    return &session_slabs[index / SESSION_SLAB_SIZE][index % SESSION_SLAB_SIZE];
+}
+
+// Whether `client_id` names the current session of its entry
+int session_current(int client_id) {
+    if (client_id < 0 ||
+        SESSION_INDEX(client_id) >= (unsigned)__atomic_load_n(&session_capacity, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    return __atomic_load_n(&session_entry(client_id)->generation, __ATOMIC_ACQUIRE) ==
+           SESSION_GENERATION(client_id);
+}
+
+// Whether `client_id` is a live session (registered and not yet released)
+int client_active(int client_id) {
+    return session_current(client_id) &&
+           __atomic_load_n(&CLIENT_STATS(client_id).active, __ATOMIC_RELAXED);
+}
+
+// Add a slab to the table and put its entries on the free list. Caller
+// holds stats_mutex. Returns 0 once MAX_SESSIONS is reached or on ENOMEM.
+int session_grow(void) {
+    if (session_capacity >= MAX_SESSIONS) {
+        return 0;
+    }
+    size_t size = SESSION_SLAB_SIZE * sizeof(SessionEntry);
+    SessionEntry *slab;
 #ifdef _WIN32
+    slab = (SessionEntry *)_aligned_malloc(size, CACHE_LINE_SIZE);
+    if (slab == NULL) {
         return 0;
+    }
 #else
-        return NULL;
+    if (posix_memalign((void **)&slab, CACHE_LINE_SIZE, size) != 0) {
+        return 0;
+    }
 #endif
+    memset(slab, 0, size);
+    for (int i = 0; i < SESSION_SLAB_SIZE; i++) {
+        slab[i].generation = 1;
+        slab[i].next_free = i + 1 < SESSION_SLAB_SIZE ? session_capacity + i + 1 : session_free;
+        slab[i].stats.state = STATE_IDLE;
+        slab[i].stats.socket_fd = INVALID_SOCKET_VALUE;
     }
-    
-    printf("Received Type 1 Request from client %d - Requested resolution: %s\n", 
-           client_id, request.resolution);
-    
-    // Update client stats with resolution and protocol
-#ifdef _WIN32
-    MUTEX_LOCK(stats_mutex);
-#else
-    pthread_mutex_lock(&stats_mutex);
-#endif
-    strncpy(client_stats[client_id].resolution, request.resolution, sizeof(client_stats[client_id].resolution) - 1);
-    client_stats[client_id].resolution[sizeof(client_stats[client_id].resolution) - 1] = '\0';
-    strncpy(client_stats[client_id].protocol, request.protocol, sizeof(client_stats[client_id].protocol) - 1);
-    client_stats[client_id].protocol[sizeof(client_stats[client_id].protocol) - 1] = '\0';
+    session_slabs[session_capacity / SESSION_SLAB_SIZE] = slab;
+    session_free = session_capacity;
+    __atomic_store_n(&session_capacity, session_capacity + SESSION_SLAB_SIZE, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// ---- Stream counters ----
+
+// Writer side: bracket every update so readers can detect a torn copy
+void stats_write_begin(StreamCounters *c) {
+    __atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void stats_write_end(StreamCounters *c) {
+    __atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Single writer, so a plain read followed by an atomic store is enough
+#define STATS_SET(field, value) __atomic_store_n(&(field), (uint64_t)(value), __ATOMIC_RELAXED)
+#define STATS_ADD(field, n) STATS_SET(field, (field) + (n))
+
+// Consistent copy of a client's counters, retried while the writer is active
+void stats_snapshot(int client_id, StreamCounters *out) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    unsigned seq;
+    do {
+        seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        out->bytes_sent = __atomic_load_n(&c->bytes_sent, __ATOMIC_RELAXED);
+        out->chunks_sent = __atomic_load_n(&c->chunks_sent, __ATOMIC_RELAXED);
+        out->packets_dropped = __atomic_load_n(&c->packets_dropped, __ATOMIC_RELAXED);
+        out->send_calls = __atomic_load_n(&c->send_calls, __ATOMIC_RELAXED);
+        out->send_blocked = __atomic_load_n(&c->send_blocked, __ATOMIC_RELAXED);
+        out->last_send_us = __atomic_load_n(&c->last_send_us, __ATOMIC_RELAXED);
+        out->target_kbps = __atomic_load_n(&c->target_kbps, __ATOMIC_RELAXED);
+        out->achieved_bps = __atomic_load_n(&c->achieved_bps, __ATOMIC_RELAXED);
+        out->deadline_misses = __atomic_load_n(&c->deadline_misses, __ATOMIC_RELAXED);
+        out->late_skipped = __atomic_load_n(&c->late_skipped, __ATOMIC_RELAXED);
+        out->nacked = __atomic_load_n(&c->nacked, __ATOMIC_RELAXED);
+        out->nack_refused = __atomic_load_n(&c->nack_refused, __ATOMIC_RELAXED);
+        out->retransmits = __atomic_load_n(&c->retransmits, __ATOMIC_RELAXED);
+        out->recovered = __atomic_load_n(&c->recovered, __ATOMIC_RELAXED);
+        out->fec_groups = __atomic_load_n(&c->fec_groups, __ATOMIC_RELAXED);
+        out->fec_parity = __atomic_load_n(&c->fec_parity, __ATOMIC_RELAXED);
+        out->fec_recoverable = __atomic_load_n(&c->fec_recoverable, __ATOMIC_RELAXED);
+        out->fragments = __atomic_load_n(&c->fragments, __ATOMIC_RELAXED);
+        out->fragments_dropped = __atomic_load_n(&c->fragments_dropped, __ATOMIC_RELAXED);
+        out->segments = __atomic_load_n(&c->segments, __ATOMIC_RELAXED);
+        out->segments_lost = __atomic_load_n(&c->segments_lost, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&c->seq, __ATOMIC_RELAXED) != seq);
+    out->seq = seq;
+}
+
+// Zero a client's counters when its slot is handed to a new connection
+void stats_reset(int client_id) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_SET(c->bytes_sent, 0);
+    STATS_SET(c->chunks_sent, 0);
+    STATS_SET(c->packets_dropped, 0);
+    STATS_SET(c->send_calls, 0);
+    STATS_SET(c->send_blocked, 0);
+    STATS_SET(c->last_send_us, 0);
+    STATS_SET(c->target_kbps, 0);
+    STATS_SET(c->achieved_bps, 0);
+    STATS_SET(c->deadline_misses, 0);
+    STATS_SET(c->late_skipped, 0);
+    STATS_SET(c->nacked, 0);
+    STATS_SET(c->nack_refused, 0);
+    STATS_SET(c->retransmits, 0);
+    STATS_SET(c->recovered, 0);
+    STATS_SET(c->fec_groups, 0);
+    STATS_SET(c->fec_parity, 0);
+    STATS_SET(c->fec_recoverable, 0);
+    STATS_SET(c->fragments, 0);
+    STATS_SET(c->fragments_dropped, 0);
+    STATS_SET(c->segments, 0);
+    STATS_SET(c->segments_lost, 0);
+    stats_write_end(c);
+}
+
+// Count a chunk sent (or dropped, with 0 bytes)
+void update_stats(int client_id, int bytes) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_ADD(c->bytes_sent, bytes);
+    STATS_ADD(c->chunks_sent, 1);
+    STATS_SET(c->last_send_us, get_time() * 1000000.0);
+    stats_write_end(c);
+}
+
+void stats_record_drop(int client_id) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_ADD(c->packets_dropped, 1);
+    stats_write_end(c);
+}
+
+// A chunk missed its playout deadline: sent late, or skipped if `skipped`
+void stats_record_deadline_miss(int client_id, bool skipped) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_ADD(c->deadline_misses, 1);
+    if (skipped) {
+        STATS_ADD(c->late_skipped, 1);
+    }
+    stats_write_end(c);
+}
+
+// A chunk named in a NACK; `refused` if it could not be resent
+void stats_record_nack(int client_id, bool refused) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_ADD(c->nacked, 1);
+    if (refused) {
+        STATS_ADD(c->nack_refused, 1);
+    }
+    stats_write_end(c);
+}
+
+// A copy resent for a NACK; `recovered` if it delivered a dropped chunk
+void stats_record_retransmit(int client_id, bool recovered) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_ADD(c->retransmits, 1);
+    if (recovered) {
+        STATS_ADD(c->recovered, 1);
+    }
+    stats_write_end(c);
+}
+
+// An FEC group closed with `parity` datagrams, which can rebuild
+// `recoverable` of its dropped chunks
+void stats_record_fec(int client_id, int parity, int recoverable) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_ADD(c->fec_groups, 1);
+    STATS_ADD(c->fec_parity, parity);
+    STATS_ADD(c->fec_recoverable, recoverable);
+    stats_write_end(c);
+}
+
+// A UDP frame went out in `fragments` datagrams, `dropped` of them lost
+void stats_record_fragments(int client_id, int fragments, int dropped) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_ADD(c->fragments, fragments);
+    STATS_ADD(c->fragments_dropped, dropped);
+    stats_write_end(c);
+}
+
+// The impairment drew loss for `segments` TCP segments and took `lost`
+void stats_record_segments(int client_id, int segments, int lost) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_ADD(c->segments, segments);
+    STATS_ADD(c->segments_lost, lost);
+    stats_write_end(c);
+}
+
+// TCP send syscall totals for the stream so far
+void stats_record_sends(int client_id, unsigned long calls, unsigned long blocked) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_SET(c->send_calls, calls);
+    STATS_SET(c->send_blocked, blocked);
+    stats_write_end(c);
+}
+
+// Publish target and achieved rate to the client's stats
+void pacer_report(int client_id, const Pacer *p) {
+    StreamCounters *c = &session_entry(client_id)->counters;
+    stats_write_begin(c);
+    STATS_SET(c->target_kbps, p->target_kbps);
+    STATS_SET(c->achieved_bps, pacer_achieved_kbps(p) * 1000.0);
+    stats_write_end(c);
+}
+
+
+// Fill a chunk payload with mock video data, different for every chunk and
+// resolution. The chunk id travels in the frame header.
+void fill_video_chunk(char *buffer, int chunk_id, const char *resolution, int chunk_size) {
+    // In a real application, this would read actual video data
+    uint32_t x = (uint32_t)chunk_id * 2654435761u;
+    for (const char *c = resolution; *c != '\0'; c++) {
+        x = x * 31 + (unsigned char)*c;
+    }
+    for (int i = 0; i < chunk_size; i++) {
+        x = x * 1664525u + 1013904223u;
+        buffer[i] = (char)(x >> 24);
+    }
+}
+
+// Map a resolution name to its chunk store row, -1 if it is not cached
+int resolution_index(const char *resolution) {
+    for (int i = 0; i < RESOLUTION_COUNT; i++) {
+        if (strcmp(resolution, resolution_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ---- Wire protocol ----
+//
+// Frame header, FRAME_HEADER_SIZE bytes in network byte order:
+//    0  version    WIRE_VERSION; frames of any other version are rejected
+//    1  type       FRAME_*
+//    2  flags      FRAME_FLAG_*, 16 bits
+//    4  sequence   chunk id of a FRAME_CHUNK, 0 otherwise
+//    8  timestamp  sender's clock in microseconds, modulo 2^32 (the
+//                  server's is monotonic)
+//   12  length     body bytes following the header
+//
+// Type 1 Request and Type 2 Response body, WIRE_MESSAGE_SIZE bytes:
+//    0  resolution      index into resolution_names
+//    1  protocol        MODE_TCP or MODE_UDP
+//    2  status          ADMIT_*
+//    3  reserved, 0
+//    4  bandwidth       Kbps
+//    8  client id
+//   12  streaming port  16 bits
+//   14  queue position  16 bits
+//
+// FRAME_CLIENT_ID and FRAME_REQUEST_STREAM carry a 32-bit client id,
+// FRAME_READY and FRAME_START have no body and a FRAME_CHUNK body is the
+// opaque payload. A FRAME_ACK's sequence is the chunk id and its timestamp
+// the client's time of the chunk's first bytes; the body has the client id,
+// the chunk's own timestamp echoed and the client's microseconds from the
+// chunk's first to its last byte. A FRAME_NACK's sequence is the lowest
+// missing chunk id; its body has the client id and a 32-bit mask whose bit
+// k marks chunk sequence + 1 + k missing as well. A FRAME_PARITY's sequence
+// is the first chunk id of its group; its body is FEC_HEADER_SIZE bytes:
+//    0  group size      chunks per group
+//    1  parity count    parity datagrams per group
+//    2  parity index
+//    3  reserved, 0
+//    4  mask            bit j: chunk sequence + j is in this parity
+// followed by the XOR of those chunks' payloads. A UDP frame too long for
+// one datagram goes out in fragments: each repeats the frame header with
+// FRAME_FLAG_FRAGMENT set and a length covering FRAGMENT_HEADER_SIZE bytes
+//    0  fragment index  16 bits
+//    2  fragment count  16 bits
+//    4  offset          of the slice within the frame body
+// and the slice itself. Fields are written byte
+// by byte, so neither struct padding nor host byte order ever reaches the
+// wire.
+
+void wire_put16(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+void wire_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+uint32_t wire_get16(const uint8_t *p) {
+    return (uint32_t)p[0] << 8 | p[1];
+}
+
+uint32_t wire_get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Write a frame header stamped with the current time. Returns its size.
+int wire_put_header(uint8_t *out, int type, int flags, uint32_t sequence, uint32_t length) {
+    out[0] = WIRE_VERSION;
+    out[1] = (uint8_t)type;
+    wire_put16(out + 2, (uint32_t)flags);
+    wire_put32(out + 4, sequence);
+    wire_put32(out + 8, (uint32_t)(uint64_t)(get_monotonic_time() * 1000000.0));
+    wire_put32(out + 12, length);
+    return FRAME_HEADER_SIZE;
+}
+
+// Parse a frame header. Returns false if it is from another protocol version.
+bool wire_get_header(const uint8_t *in, FrameHeader *h) {
+    h->version = in[0];
+    h->type = in[1];
+    h->flags = (int)wire_get16(in + 2);
+    h->sequence = wire_get32(in + 4);
+    h->timestamp = wire_get32(in + 8);
+    h->length = wire_get32(in + 12);
+    return h->version == WIRE_VERSION;
+}
+
+// Header of a chunk frame, with FRAME_FLAG_LAST added on the last chunk
+void wire_put_chunk_header(uint8_t *out, const VideoChunk *chunk, int flags) {
+    if (chunk->chunk_id == VIDEO_CHUNKS) {
+        flags |= FRAME_FLAG_LAST;
+    }
+    wire_put_header(out, FRAME_CHUNK, flags, (uint32_t)chunk->chunk_id, (uint32_t)chunk->size);
+}
+
+// Encode a Type 1 Request or Type 2 Response as one frame of
+// WIRE_MESSAGE_FRAME bytes. Returns the frame size.
+int wire_encode_message(const Message *m, uint8_t *out) {
+    uint8_t *body = out + wire_put_header(out, m->type, 0, 0, WIRE_MESSAGE_SIZE);
+    int res = resolution_index(m->resolution);
+    body[0] = (uint8_t)(res < 0 ? 0xff : res);
+    body[1] = strcmp(m->protocol, "TCP") == 0 ? MODE_TCP : MODE_UDP;
+    body[2] = (uint8_t)m->status;
+    body[3] = 0;
+    wire_put32(body + 4, (uint32_t)m->bandwidth);
+    wire_put32(body + 8, (uint32_t)m->client_id);
+    wire_put16(body + 12, (uint32_t)m->streaming_port);
+    wire_put16(body + 14, (uint32_t)m->queue_position);
+    return WIRE_MESSAGE_FRAME;
+}
+
+// Decode a WIRE_MESSAGE_FRAME byte frame that should be of `type`.
+// Returns false if it is not a valid one.
+bool wire_decode_message(const uint8_t *in, int type, Message *m) {
+    FrameHeader h;
+    const uint8_t *body = in + FRAME_HEADER_SIZE;
+    if (!wire_get_header(in, &h) || h.type != type || h.length != WIRE_MESSAGE_SIZE ||
+        body[0] >= RESOLUTION_COUNT || (body[1] != MODE_TCP && body[1] != MODE_UDP)) {
+        return false;
+    }
+    memset(m, 0, sizeof(*m));
+    m->type = type;
+    strcpy(m->resolution, resolution_names[body[0]]);
+    strcpy(m->protocol, body[1] == MODE_TCP ? "TCP" : "UDP");
+    m->status = body[2];
+    m->bandwidth = (int)wire_get32(body + 4);
+    m->client_id = (int)wire_get32(body + 8);
+    m->streaming_port = (int)wire_get16(body + 12);
+    m->queue_position = (int)wire_get16(body + 14);
+    return true;
+}
+
+// Decode a FRAME_CLIENT_ID / FRAME_REQUEST_STREAM frame of `len` bytes
+bool wire_decode_client_id(const uint8_t *in, int len, int type, int *client_id) {
+    FrameHeader h;
+    if (len != WIRE_CLIENT_ID_FRAME || !wire_get_header(in, &h) || h.type != type || h.length != 4) {
+        return false;
+    }
+    *client_id = (int)wire_get32(in + FRAME_HEADER_SIZE);
+    return true;
+}
+
+// Decode a FRAME_ACK of `len` bytes
+bool wire_decode_ack(const uint8_t *in, int len, ChunkAck *ack) {
+    FrameHeader h;
+    if (len != WIRE_ACK_FRAME || !wire_get_header(in, &h) || h.type != FRAME_ACK ||
+        h.length != WIRE_ACK_FRAME - FRAME_HEADER_SIZE) {
+        return false;
+    }
+    ack->chunk_id = (int)h.sequence;
+    ack->received = h.timestamp;
+    ack->client_id = (int)wire_get32(in + FRAME_HEADER_SIZE);
+    ack->sent = wire_get32(in + FRAME_HEADER_SIZE + 4);
+    ack->receive_us = wire_get32(in + FRAME_HEADER_SIZE + 8);
+    return true;
+}
+
+// Decode a FRAME_NACK of `len` bytes
+bool wire_decode_nack(const uint8_t *in, int len, ChunkNack *nack) {
+    FrameHeader h;
+    if (len != WIRE_NACK_FRAME || !wire_get_header(in, &h) || h.type != FRAME_NACK ||
+        h.length != WIRE_NACK_FRAME - FRAME_HEADER_SIZE || h.sequence < 1 || h.sequence > INT32_MAX - 32) {
+        return false;
+    }
+    nack->first = (int)h.sequence;
+    nack->client_id = (int)wire_get32(in + FRAME_HEADER_SIZE);
+    nack->mask = wire_get32(in + FRAME_HEADER_SIZE + 4);
+    return true;
+}
+
+// List the chunk ids a FRAME_NACK names. Returns how many, at most NACK_MAX_CHUNKS.
+int nack_chunk_ids(const ChunkNack *nack, int *ids) {
+    int count = 0;
+    ids[count++] = nack->first;
+    for (int k = 0; k < 32; k++) {
+        if (nack->mask & (1u << k)) {
+            ids[count++] = nack->first + 1 + k;
+        }
+    }
+    return count;
+}
+
+// Write `header_len` header bytes then the payload, from byte `offset` on
+// with one gather call: to `dest` on a UDP socket, or NULL on a connected
+// one. Returns the bytes the socket took, or -1 like send().
+int send_frame_parts(socket_t fd, const uint8_t *header, int header_len, const char *payload,
+                     int payload_len, int offset, const struct sockaddr_in *dest) {
 #ifdef _WIN32
-    MUTEX_UNLOCK(stats_mutex);
+    WSABUF iov[2];
+    #define IOV_SET(v, base, len) ((v).buf = (char *)(base), (v).len = (ULONG)(len))
 #else
-    pthread_mutex_unlock(&stats_mutex);
+    struct iovec iov[2];
+    #define IOV_SET(v, base, len) ((v).iov_base = (void *)(base), (v).iov_len = (len))
 #endif
-    
-    // Prepare Type 2 Response
-    response.type = TYPE_2_RESPONSE;
-    strncpy(response.resolution, request.resolution, sizeof(response.resolution));
-    strncpy(response.protocol, request.protocol, sizeof(response.protocol));
-    response.bandwidth = estimate_bandwidth(request.resolution);
-    response.client_id = client_id;  // Include client ID in response
-    
-    // Both TCP and UDP will use server_port
-    response.streaming_port = server_port;
-    
-    // Send Type 2 Response
-    int bytes_sent = send(client_socket, (char*)&response, sizeof(response), 0);
-    if (bytes_sent <= 0) {
-        printf("Failed to send Type 2 Response to client %d\n", client_id);
-        CLOSE_SOCKET(client_socket);
-        
+    int count = 0;
+    if (offset < header_len) {
+        IOV_SET(iov[count], header + offset, header_len - offset);
+        count++;
+        offset = 0;
+    } else {
+        offset -= header_len;
+    }
+    if (payload_len > offset) {
+        IOV_SET(iov[count], payload + offset, payload_len - offset);
+        count++;
+    }
+    #undef IOV_SET
 #ifdef _WIN32
-        MUTEX_LOCK(stats_mutex);
+    DWORD sent = 0;
+    if (WSASendTo(fd, iov, count, &sent, 0, (const struct sockaddr *)dest,
+                  dest != NULL ? sizeof(*dest) : 0, NULL, NULL) != 0) {
+        return -1;
+    }
+    return (int)sent;
 #else
-        pthread_mutex_lock(&stats_mutex);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)dest;
+    msg.msg_namelen = dest != NULL ? sizeof(*dest) : 0;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return (int)sendmsg(fd, &msg, 0);
 #endif
-        client_stats[client_id].active = 0;
-        client_stats[client_id].state = STATE_IDLE;
+}
+
+// Write a frame with its FRAME_HEADER_SIZE header, as send_frame_parts
+int send_frame(socket_t fd, const uint8_t *header, const char *payload, int payload_len,
+               int offset, const struct sockaddr_in *dest) {
+    return send_frame_parts(fd, header, FRAME_HEADER_SIZE, payload, payload_len, offset, dest);
+}
+
+// ---- Packetization ----
+//
+// A UDP frame that does not fit one datagram of the path MTU (--mtu) goes
+// out in fragments of at most that size, so no chunk depends on IP
+// fragmentation. The client reassembles each frame and gives up on one
+// whose fragments stop arriving. The simulated loss takes individual
+// datagrams: a frame is lost when any of its fragments is, and a resent
+// copy fills the gaps the first one left. With --mtu 0 every frame is one
+// datagram, as before.
+
+// Body bytes each fragment but the last carries
+int udp_fragment_slice(void) {
+    return server_config.mtu - UDP_IP_OVERHEAD - FRAME_HEADER_SIZE - FRAGMENT_HEADER_SIZE;
+}
+
+// Datagrams a UDP frame with a `size`-byte body goes out in
+int udp_fragment_count(int size) {
+    if (server_config.mtu == 0 || FRAME_HEADER_SIZE + size <= server_config.mtu - UDP_IP_OVERHEAD) {
+        return 1;
+    }
+    return (size + udp_fragment_slice() - 1) / udp_fragment_slice();
+}
+
+// Whether the simulated loss took every datagram of a `size`-byte frame
+bool udp_all_dropped(int size, uint32_t dropped) {
+    int count = udp_fragment_count(size);
+    return dropped == (count == 32 ? ~0u : (1u << count) - 1);
+}
+
+// Header of datagram `index` of a frame with header `frame` and a
+// `size`-byte body: the frame header itself if the frame fits one datagram.
+// Sets the slice of the body it carries; returns the header's length.
+int wire_put_fragment_header(uint8_t *out, const uint8_t *frame, int size, int index,
+                             int *offset, int *len) {
+    int count = udp_fragment_count(size);
+    memcpy(out, frame, FRAME_HEADER_SIZE);
+    if (count == 1) {
+        *offset = 0;
+        *len = size;
+        return FRAME_HEADER_SIZE;
+    }
+    *offset = index * udp_fragment_slice();
+    *len = size - *offset < udp_fragment_slice() ? size - *offset : udp_fragment_slice();
+    wire_put16(out + 2, wire_get16(frame + 2) | FRAME_FLAG_FRAGMENT);
+    wire_put32(out + 12, (uint32_t)(FRAGMENT_HEADER_SIZE + *len));
+    wire_put16(out + FRAME_HEADER_SIZE, (uint32_t)index);
+    wire_put16(out + FRAME_HEADER_SIZE + 2, (uint32_t)count);
+    wire_put32(out + FRAME_HEADER_SIZE + 4, (uint32_t)*offset);
+    return FRAME_HEADER_SIZE + FRAGMENT_HEADER_SIZE;
+}
+
+// ---- Network impairment ----
+//
+// Streams leave the server through an emulated network path, so the
+// protocols can be compared under realistic conditions without root or
+// tc. Every stream draws from its own xoshiro256** generator, seeded from
+// --seed and the client ID, so a run with the same seed and clients
+// replays the same impairments. Per packet the path applies:
+//   - loss: Bernoulli (--loss) or a Gilbert-Elliott chain (--loss-burst)
+//     whose bad state loses packets in bursts
+//   - a bottleneck of --link-kbps per stream, which queues packets and
+//     drops datagrams once IMPAIR_QUEUE_MS of backlog are waiting
+//   - a one-way --delay with uniform jitter
+//   - on UDP, reordering (--reorder) and duplication (--duplicate)
+// UDP datagrams the path holds back wait on a delay line until their
+// release time. TCP delivers in order and hides loss, so a TCP chunk is
+// held after it is stamped: for its time on the bottleneck, the delay, and
+// one retransmission for every segment the loss takes.
+// Without options only the UDP_PACKET_LOSS_RATE Bernoulli loss on UDP
+// applies, as before: it is spread over a frame's datagrams so that a whole
+// chunk is still lost that often. --loss is a rate per datagram.
+
+// What the path does to the datagrams of one UDP frame
+typedef struct {
+    uint32_t dropped;           // Bit f: fragment f is lost
+    uint32_t duplicated;        // Bit f: fragment f arrives twice
+    double release[UDP_MAX_FRAGMENTS]; // When fragment f leaves the path, 0 = right away
+} UdpFate;
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Seed a stream's generator and reset its path
+void impair_start(Impairment *im, int client_id) {
+    uint64_t x = server_config.seed ^ ((uint64_t)(uint32_t)client_id << 32);
+    for (int i = 0; i < 4; i++) {
+        im->rng[i] = splitmix64(&x);
+    }
+    im->burst = false;
+    im->link_free = 0;
+}
+
+// Impairment state of a stream; a `client_id` of -1 gets one per thread
+// (--bench-fec)
+Impairment *impair_state(int client_id) {
+    static THREAD_LOCAL Impairment detached;
+    static THREAD_LOCAL bool detached_seeded = false;
+    if (client_id >= 0) {
+        return &session_entry(client_id)->impair;
+    }
+    if (!detached_seeded) {
+        impair_start(&detached, client_id);
+        detached_seeded = true;
+    }
+    return &detached;
+}
+
+uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// xoshiro256**
+uint64_t impair_next(Impairment *im) {
+    uint64_t *s = im->rng;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
+}
+
+// Uniform in [0, 1)
+double impair_uniform(Impairment *im) {
+    return (impair_next(im) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+bool impair_chance(Impairment *im, double percent) {
+    return percent > 0 && impair_uniform(im) * 100.0 < percent;
+}
+
+// Default loss of one datagram in a UDP frame of n, by n (impair_init)
+double udp_default_loss[UDP_MAX_FRAGMENTS + 1];
+
+// Bernoulli loss of one of `datagrams` datagrams: --loss if given, else
+// the UDP_PACKET_LOSS_RATE of a chunk spread over them on UDP, none on TCP
+double impair_loss_percent(int protocol, int datagrams) {
+    if (server_config.loss_percent >= 0) {
+        return server_config.loss_percent;
+    }
+    return protocol == MODE_UDP ? udp_default_loss[datagrams] : 0;
+}
+
+// Calibrate the default UDP loss per chunk: a frame of n datagrams is
+// lost with UDP_PACKET_LOSS_RATE when each datagram is lost with
+// 1 - (1 - rate)^(1/n), the root found by bisection
+void impair_init(void) {
+    double keep = 1.0 - UDP_PACKET_LOSS_RATE / 100.0;
+    for (int n = 1; n <= UDP_MAX_FRAGMENTS; n++) {
+        double lo = keep, hi = 1.0;
+        for (int i = 0; i < 60; i++) {
+            double mid = (lo + hi) / 2, power = 1.0;
+            for (int k = 0; k < n; k++) {
+                power *= mid;
+            }
+            if (power < keep) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        udp_default_loss[n] = (1.0 - lo) * 100.0;
+    }
+}
+
+// Whether the loss model takes the stream's next packet. The
+// Gilbert-Elliott chain moves once per packet; in its good state the
+// Bernoulli loss applies.
+bool impair_lose(Impairment *im, int protocol, int datagrams) {
+    if (server_config.burst_enter > 0) {
+        if (impair_chance(im, im->burst ? server_config.burst_exit : server_config.burst_enter)) {
+            im->burst = !im->burst;
+        }
+        if (im->burst) {
+            return impair_chance(im, server_config.burst_loss);
+        }
+    }
+    return impair_chance(im, impair_loss_percent(protocol, datagrams));
+}
+
+// One-way delay of the next packet in seconds, --delay +/- the jitter
+double impair_delay(Impairment *im) {
+    double delay = server_config.delay_ms;
+    if (server_config.jitter_ms > 0) {
+        delay += (impair_uniform(im) * 2.0 - 1.0) * server_config.jitter_ms;
+    }
+    return delay > 0 ? delay / 1000.0 : 0;
+}
+
+// Put `bytes` on the stream's bottleneck at `now`. Returns when they have
+// left it, or 0 if `may_drop` and the queue is full.
+double impair_link(Impairment *im, int bytes, double now, bool may_drop) {
+    double start = im->link_free > now ? im->link_free : now;
+    if (may_drop && start - now > IMPAIR_QUEUE_MS / 1000.0) {
+        return 0;
+    }
+    im->link_free = start + bytes * 8.0 / (server_config.link_kbps * 1000.0);
+    return im->link_free;
+}
+
+// Run the path over the datagrams of a `size`-byte frame sent at `now`
+// and count them for the stream (none for a `client_id` of -1)
+void udp_impair(int client_id, int size, double now, UdpFate *fate) {
+    Impairment *im = impair_state(client_id);
+    int count = udp_fragment_count(size);
+    fate->dropped = 0;
+    fate->duplicated = 0;
+    for (int f = 0; f < count; f++) {
+        fate->release[f] = 0;
+        if (impair_lose(im, MODE_UDP, count)) {
+            fate->dropped |= 1u << f;
+            continue;
+        }
+        double release = now;
+        if (server_config.link_kbps > 0) {
+            int bytes = FRAME_HEADER_SIZE + size;
+            if (count > 1) {
+                int rest = size - f * udp_fragment_slice();
+                bytes = FRAME_HEADER_SIZE + FRAGMENT_HEADER_SIZE +
+                        (rest < udp_fragment_slice() ? rest : udp_fragment_slice());
+            }
+            release = impair_link(im, UDP_IP_OVERHEAD + bytes, now, true);
+            if (release == 0) {
+                fate->dropped |= 1u << f;  // Tail drop at the bottleneck
+                continue;
+            }
+        }
+        release += impair_delay(im);
+        if (impair_chance(im, server_config.reorder_percent)) {
+            release += IMPAIR_REORDER_MS / 1000.0;
+        }
+        if (impair_chance(im, server_config.duplicate_percent)) {
+            fate->duplicated |= 1u << f;
+        }
+        if (release > now) {
+            fate->release[f] = release;
+        }
+    }
+    if (client_id >= 0) {
+        stats_record_fragments(client_id, count, __builtin_popcount(fate->dropped));
+    }
+}
+
+// How long a TCP chunk of `bytes` stamped at `now` is held before it is
+// written: its time on the bottleneck, the one-way delay, and for every
+// segment the loss takes a retransmission, a round trip but no less than
+// the TCP_RTO_MIN_MS timeout (on a short path, as on loopback, the floor
+// is what a loss costs)
+double impair_tcp_hold(int client_id, int bytes, double now) {
+    Impairment *im = impair_state(client_id);
+    double hold = 0;
+    if (server_config.link_kbps > 0) {
+        int segments = (bytes + TCP_SEGMENT_SIZE - 1) / TCP_SEGMENT_SIZE;
+        hold = impair_link(im, bytes + segments * TCP_IP_OVERHEAD, now, false) - now;
+    }
+    hold += impair_delay(im);
+    if (server_config.burst_enter > 0 || impair_loss_percent(MODE_TCP, 1) > 0) {
+        int segments = 0, lost = 0;
+        for (int sent = 0; sent < bytes; sent += TCP_SEGMENT_SIZE) {
+            segments++;
+            if (impair_lose(im, MODE_TCP, 1)) {
+                double rtt = impair_delay(im) + impair_delay(im);
+                hold += rtt > TCP_RTO_MIN_MS / 1000.0 ? rtt : TCP_RTO_MIN_MS / 1000.0;
+                lost++;
+            }
+        }
+        if (client_id >= 0) {
+            stats_record_segments(client_id, segments, lost);
+        }
+    }
+    return hold;
+}
+
+// Datagrams the path holds back, in a binary min-heap on their release
+// time, ties in the order they were queued. Each reactor keeps one beside
+// its transmit batch; without epoll each UDP stream task keeps its own.
+typedef struct {
+    double release;
+    uint64_t order;
+    VideoChunk *chunk;          // Reference released once the datagram is sent
+    uint8_t header[FRAME_HEADER_SIZE + FRAGMENT_HEADER_SIZE]; // Frame or fragment header
+    int header_len;
+    int offset;                 // Slice of the chunk it carries
+    int len;
+    struct sockaddr_in dest;
+} DelayedDatagram;
+
+typedef struct {
+    DelayedDatagram *items;
+    int count;
+    int capacity;
+    uint64_t order;
+} DelayLine;
+
+bool delayed_before(const DelayedDatagram *a, const DelayedDatagram *b) {
+    return a->release < b->release || (a->release == b->release && a->order < b->order);
+}
+
+// Hold a datagram until `release`, taking a reference to its chunk.
+// Returns false (the datagram is lost) if the line cannot grow.
+bool delay_line_push(DelayLine *d, double release, VideoChunk *chunk, const uint8_t *header,
+                     int header_len, int offset, int len, const struct sockaddr_in *dest) {
+    if (d->count == d->capacity) {
+        int capacity = d->capacity > 0 ? 2 * d->capacity : 64;
+        DelayedDatagram *items = realloc(d->items, capacity * sizeof(DelayedDatagram));
+        if (items == NULL) {
+            perror("Memory allocation failed");
+            return false;
+        }
+        d->items = items;
+        d->capacity = capacity;
+    }
+    DelayedDatagram item;
+    item.release = release;
+    item.order = d->order++;
+    item.chunk = chunk_retain(chunk);
+    memcpy(item.header, header, header_len);
+    item.header_len = header_len;
+    item.offset = offset;
+    item.len = len;
+    item.dest = *dest;
+    int i = d->count++;
+    while (i > 0 && delayed_before(&item, &d->items[(i - 1) / 2])) {
+        d->items[i] = d->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    d->items[i] = item;
+    return true;
+}
+
+// Release time of the next datagram, 0 when the line is empty
+double delay_line_next(const DelayLine *d) {
+    return d->count > 0 ? d->items[0].release : 0;
+}
+
+// Take the next datagram into `out` if it is due at `now`; the caller
+// sends it and releases its chunk reference
+bool delay_line_pop(DelayLine *d, double now, DelayedDatagram *out) {
+    if (d->count == 0 || d->items[0].release > now) {
+        return false;
+    }
+    *out = d->items[0];
+    DelayedDatagram last = d->items[--d->count];
+    int i = 0;
+    while (2 * i + 1 < d->count) {
+        int child = 2 * i + 1;
+        if (child + 1 < d->count && delayed_before(&d->items[child + 1], &d->items[child])) {
+            child++;
+        }
+        if (!delayed_before(&d->items[child], &last)) {
+            break;
+        }
+        d->items[i] = d->items[child];
+        i = child;
+    }
+    d->items[i] = last;
+    return true;
+}
+
+// Drop everything still held
+void delay_line_clear(DelayLine *d) {
+    for (int i = 0; i < d->count; i++) {
+        chunk_release(d->items[i].chunk);
+    }
+    free(d->items);
+    memset(d, 0, sizeof(*d));
+}
+
+// Allocate and fill a chunk holding a single reference
+VideoChunk *chunk_build(const char *resolution, int chunk_class, int chunk_id) {
+    int size = chunk_class_sizes[chunk_class];
+    VideoChunk *chunk = malloc(sizeof(VideoChunk) + size);
+    if (chunk == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    chunk->refcount = 1;
+    chunk->chunk_id = chunk_id;
+    chunk->size = size;
+    fill_video_chunk(chunk->data, chunk_id, resolution, size);
+    return chunk;
+}
+
+// Take a reference to a chunk, building and publishing it on first use.
+// Resolutions outside the store get a private chunk that dies with its user.
+VideoChunk *chunk_acquire(const char *resolution, int chunk_class, int chunk_id) {
+    int res = resolution_index(resolution);
+    if (res < 0 || chunk_id < 1 || chunk_id > VIDEO_CHUNKS) {
+        return chunk_build(resolution, chunk_class, chunk_id);
+    }
+    
+    VideoChunk **slot = &chunk_store[res][chunk_class][chunk_id];
+    VideoChunk *chunk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        VideoChunk *built = chunk_build(resolution, chunk_class, chunk_id);
+        if (built == NULL) {
+            return NULL;
+        }
+        // The store keeps the initial reference; a racing builder loses
+        VideoChunk *expected = NULL;
+        if (__atomic_compare_exchange_n(slot, &expected, built, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            chunk = built;
+            __atomic_add_fetch(&chunk_store_built, 1, __ATOMIC_RELAXED);
+        } else {
+            free(built);
+            chunk = expected;
+        }
+    }
+    __atomic_add_fetch(&chunk->refcount, 1, __ATOMIC_RELAXED);
+    return chunk;
+}
+
+// Take another reference to a chunk already held
+VideoChunk *chunk_retain(VideoChunk *chunk) {
+    __atomic_add_fetch(&chunk->refcount, 1, __ATOMIC_RELAXED);
+    return chunk;
+}
+
+// Drop a reference taken with chunk_acquire or chunk_retain
+void chunk_release(VideoChunk *chunk) {
+    if (chunk != NULL && __atomic_sub_fetch(&chunk->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(chunk);
+    }
+}
+
+// Build every cached chunk up front (--preload-chunks)
+void chunk_store_preload() {
+    for (int res = 0; res < RESOLUTION_COUNT; res++) {
+        for (int chunk_class = 0; chunk_class < CHUNK_CLASSES; chunk_class++) {
+            for (int id = 1; id <= VIDEO_CHUNKS; id++) {
+                chunk_release(chunk_acquire(resolution_names[res], chunk_class, id));
+            }
+        }
+    }
+    printf("Preloaded %d video chunks\n", chunk_store_built);
+}
+
+// Encoder worker: publish the chunks of one pipeline in order, paying the
+// simulated encoding time once per chunk instead of once per client
 #ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
+THREAD_RETURN_TYPE encoder_thread(THREAD_PARAM arg) {
 #else
-        pthread_mutex_unlock(&stats_mutex);
+void *encoder_thread(void *arg) {
 #endif
-        
+    EncodePipeline *p = (EncodePipeline *)arg;
+    const char *resolution = resolution_names[p->resolution];
+    int depth = server_config.pipeline_depth;
+    int chunk_size = chunk_class_sizes[p->chunk_class];
+    long encode_us = (long)ENCODE_TIME_MS * 1000 * chunk_size / TCP_CHUNK_SIZE;
+    
+    for (int id = 1; id <= VIDEO_CHUNKS; id++) {
+        // Wait for space: never run more than depth chunks ahead of the leader
 #ifdef _WIN32
-        return 0;
+        MUTEX_LOCK(p->lock);
+        while (id > __atomic_load_n(&p->demand, __ATOMIC_ACQUIRE) + depth) {
+            WIN_COND_WAIT(p->space, p->lock);
+        }
+        MUTEX_UNLOCK(p->lock);
 #else
-        return NULL;
+        pthread_mutex_lock(&p->lock);
+        while (id > __atomic_load_n(&p->demand, __ATOMIC_ACQUIRE) + depth) {
+            pthread_cond_wait(&p->space, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
 #endif
+        
+        // Preloaded chunks are already encoded
+        if (__atomic_load_n(&chunk_store[p->resolution][p->chunk_class][id], __ATOMIC_ACQUIRE) == NULL) {
+            usleep(encode_us);
+        }
+        
+        // Rewrite the slot under a sequence check; readers that race with it
+        // fall back to the chunk store
+        PipelineSlot *slot = &p->slots[id % depth];
+        __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        VideoChunk *chunk = chunk_acquire(resolution, p->chunk_class, id);
+        __atomic_store_n(&slot->chunk, chunk, __ATOMIC_RELAXED);
+        chunk_release(chunk);  // The chunk store keeps it alive
+        __atomic_store_n(&slot->seq, id, __ATOMIC_RELEASE);
+        __atomic_store_n(&p->head, id, __ATOMIC_RELEASE);
     }
     
-    printf("Sent Type 2 Response to client %d - Resolution: %s, Protocol: %s, Bandwidth: %d Kbps\n",
-           client_id, response.resolution, response.protocol, response.bandwidth);
-    
-    // Close the connection phase socket
-    CLOSE_SOCKET(client_socket);
-    
-    // Add the client to the queue for scheduling
-    enqueue_client(client_id);
-    
+    log_message("Encoder for %s %s finished all %d chunks", resolution,
+           p->chunk_class == CHUNK_CLASS_TCP ? "TCP" : "UDP", VIDEO_CHUNKS);
 #ifdef _WIN32
     return 0;
 #else
@@ -723,699 +2724,4509 @@ THREAD_RETURN_TYPE handle_connection_phase(THREAD_PARAM arg) {
 #endif
 }
 
-// Handle TCP streaming for a client
-THREAD_RETURN_TYPE handle_tcp_streaming(THREAD_PARAM arg) {
-    int client_id = *((int *)arg);
-    free(arg);
-    
+// Start one encoder worker per resolution and chunk class
+bool pipeline_start() {
+    for (int i = 0; i < RESOLUTION_COUNT * CHUNK_CLASSES; i++) {
+        EncodePipeline *p = &pipelines[i / CHUNK_CLASSES][i % CHUNK_CLASSES];
+        p->resolution = i / CHUNK_CLASSES;
+        p->chunk_class = i % CHUNK_CLASSES;
 #ifdef _WIN32
-    MUTEX_LOCK(stats_mutex);
+        MUTEX_INIT(p->lock);
+        WIN_COND_INIT(p->space);
 #else
-    pthread_mutex_lock(&stats_mutex);
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->space, NULL);
 #endif
-    client_stats[client_id].state = STATE_STREAMING;
-    client_stats[client_id].start_time = get_time();
-    char resolution[10];
-    strncpy(resolution, client_stats[client_id].resolution, sizeof(resolution));
-    resolution[sizeof(resolution) - 1] = '\0'; // Ensure null termination
-    socket_t client_socket = client_stats[client_id].socket_fd;
+        if (!THREAD_CREATE(p->thread, encoder_thread, p)) {
+            perror("Failed to create encoder thread");
+            return false;
+        }
+        THREAD_DETACH(p->thread);
+    }
+    printf("Encode pipeline started (%d chunks ahead per stream type)\n", server_config.pipeline_depth);
+    return true;
+}
+
+// Take a reference to the chunk a sender needs next. Returns false when the
+// encode pipeline has not produced it yet; otherwise *chunk is set (NULL only
+// if memory ran out). Without the pipeline the chunk is taken from the store.
+bool chunk_take(const char *resolution, int chunk_class, int chunk_id, VideoChunk **chunk) {
+    int res = resolution_index(resolution);
+    if (server_config.encode_cost != ENCODE_COST_PIPELINE || res < 0 || 
+        chunk_id < 1 || chunk_id > VIDEO_CHUNKS) {
+        *chunk = chunk_acquire(resolution, chunk_class, chunk_id);
+        return true;
+    }
+    EncodePipeline *p = &pipelines[res][chunk_class];
+    
+    // Lead the encoder forward, waking it if it was parked on a full ring
+    int leader = __atomic_load_n(&p->demand, __ATOMIC_RELAXED);
+    while (leader < chunk_id) {
+        if (__atomic_compare_exchange_n(&p->demand, &leader, chunk_id, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            leader = chunk_id;
 #ifdef _WIN32
-    MUTEX_UNLOCK(stats_mutex);
+            MUTEX_LOCK(p->lock);
+            WIN_COND_SIGNAL(p->space);
+            MUTEX_UNLOCK(p->lock);
 #else
-    pthread_mutex_unlock(&stats_mutex);
+            pthread_mutex_lock(&p->lock);
+            pthread_cond_signal(&p->space);
+            pthread_mutex_unlock(&p->lock);
 #endif
+            break;
+        }
+    }
     
+    int head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+    if (chunk_id > head) {
+        // Count each chunk that was asked for too early once, not every retry
+        int seen = __atomic_load_n(&p->underrun_id, __ATOMIC_RELAXED);
+        while (seen < chunk_id) {
+            if (__atomic_compare_exchange_n(&p->underrun_id, &seen, chunk_id, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                __atomic_add_fetch(&p->underruns, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        return false;
+    }
+    __atomic_add_fetch(&p->takes, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->occupancy_sum, head > leader ? head - leader : 0, __ATOMIC_RELAXED);
+    
+    PipelineSlot *slot = &p->slots[chunk_id % server_config.pipeline_depth];
+    VideoChunk *ready = NULL;
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == chunk_id) {
+        ready = __atomic_load_n(&slot->chunk, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != chunk_id) {
+            ready = NULL;  // Overwritten while we read it
+        }
+    }
+    if (ready != NULL) {
+        __atomic_add_fetch(&ready->refcount, 1, __ATOMIC_RELAXED);
+        *chunk = ready;
+    } else {
+        *chunk = chunk_acquire(resolution, chunk_class, chunk_id);
+    }
+    return true;
+}
+
+// ---- Latency histograms ----
+
+int hist_bucket(uint64_t us) {
+    if (us < HIST_SUB) {
+        return (int)us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    int bucket = (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// Exclusive upper bound of a bucket in microseconds
+uint64_t hist_bucket_limit(int bucket) {
+    if (bucket < HIST_SUB) {
+        return (uint64_t)bucket + 1;
+    }
+    int msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB + 1) << (msb - HIST_SUB_BITS);
+}
+
+// Add a sample; safe from any thread
+void hist_record(Histogram *h, uint64_t us) {
+    __atomic_add_fetch(&h->counts[hist_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_us, us, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    while (us > max &&
+           !__atomic_compare_exchange_n(&h->max_us, &max, us, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Add every sample of `from` to `into` (print_stats totals, single thread)
+void hist_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    }
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    into->sum_us += __atomic_load_n(&from->sum_us, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max_us, __ATOMIC_RELAXED);
+    into->max_us = max > into->max_us ? max : into->max_us;
+}
+
+// Upper bound in microseconds of the bucket holding quantile q (0..1),
+// never above the largest sample
+uint64_t hist_quantile_us(const Histogram *h, double q) {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > rank) {
+            uint64_t limit = hist_bucket_limit(i);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+// "<label>: avg, p50, p99, max" line for a histogram with samples
+void hist_log(const char *label, const Histogram *h) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    log_message("%s: %" PRIu64 " samples, avg %.2f ms, p50 < %.2f ms, p99 < %.2f ms, max %.2f ms",
+                label, count, __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) / 1000.0 / count,
+                hist_quantile_us(h, 0.50) / 1000.0, hist_quantile_us(h, 0.99) / 1000.0,
+                __atomic_load_n(&h->max_us, __ATOMIC_RELAXED) / 1000.0);
+}
+
+// ---- Latency feedback ----
+//
+// Every chunk frame carries the server's monotonic send time, and clients
+// answer each chunk with a FRAME_ACK echoing it (on the TCP stream socket,
+// or to the UDP port). With S the echoed send time, R the client's time of
+// the chunk's first bytes, D the client's time from first to last byte and
+// A the ack's arrival:
+//   RTT             A - S - D, the round trip with the transfer time taken out
+//   delay variation (R - S) - min(R - S): the clocks are not synchronised,
+//                   but their offset cancels out of the difference
+//   delivery        variation + min RTT / 2 + D, how long after S the
+//                   whole chunk was at the client
+//   TTFB            from the Type 1 Request to the first chunk's first byte
+//                   at the client, counting min RTT / 2 for the request
+
+uint32_t monotonic_us32(void) {
+    return (uint32_t)(uint64_t)(get_monotonic_time() * 1000000.0);
+}
+
+// Account for one ack. Called by the thread reading the stream's acks.
+void latency_record_ack(int client_id, const ChunkAck *ack) {
+    SessionEntry *e = session_entry(client_id);
+    LatencyStats *l = &e->latency;
+    int64_t rtt = (int64_t)(uint32_t)(monotonic_us32() - ack->sent) - ack->receive_us;
+    int32_t delay = (int32_t)(ack->received - ack->sent);
+    if (rtt < 0) {
+        rtt = 0;
+    }
+    if (l->acks++ == 0) {
+        l->delay_base = delay;
+        l->delay_min = 0;
+        l->rtt_min_us = (uint32_t)rtt;
+    }
+    int32_t relative = (int32_t)((uint32_t)delay - (uint32_t)l->delay_base);
+    if (relative < l->delay_min) {
+        l->delay_min = relative;
+    }
+    if ((uint32_t)rtt < l->rtt_min_us) {
+        l->rtt_min_us = (uint32_t)rtt;
+    }
+    uint64_t variation = (uint64_t)((int64_t)relative - l->delay_min);
+    uint64_t one_way = variation + l->rtt_min_us / 2;
+    hist_record(&l->rtt, (uint64_t)rtt);
+    hist_record(&l->variation, variation);
+    hist_record(&l->delivery, one_way + ack->receive_us);
+    
+    // The first ack is for the first chunk that reached the client
+    if (l->acks == 1 && l->request_us != 0) {
+        uint32_t waited = ack->sent - (uint32_t)l->request_us;
+        __atomic_store_n(&l->ttfb_us, l->rtt_min_us / 2 + (uint64_t)waited + one_way, __ATOMIC_RELAXED);
+    }
+}
+
+// ---- Retransmission ----
+//
+// With --nack the FRAME_READY of a UDP stream carries FRAME_FLAG_NACK. The
+// client then reports gaps in the chunk ids with FRAME_NACKs, repeated
+// while chunks stay missing, and the stream resends a chunk its history
+// still holds if the copy can reach the client before the chunk's playout
+// deadline. Copies are paced, and lost by the simulation, like any other
+// chunk; the client completes a chunk from the fragments of all its copies.
+// The stream keeps answering NACKs for NACK_LINGER_MS after its last chunk.
+
+// Remember a chunk just sent, with the fragments the simulated loss
+// `dropped`. The history takes a reference of its own.
+void nack_history_store(NackHistory *h, VideoChunk *chunk, uint32_t dropped, double now) {
+    NackSlot *slot = &h->slots[chunk->chunk_id % NACK_HISTORY];
+    chunk_release(slot->chunk);
+    slot->chunk = chunk_retain(chunk);
+    slot->first_sent = now;
+    slot->last_sent = now;
+    slot->missing = dropped;
+    slot->delivered = dropped == 0;
+}
+
+void nack_history_clear(NackHistory *h) {
+    for (int i = 0; i < NACK_HISTORY; i++) {
+        chunk_release(h->slots[i].chunk);
+        h->slots[i].chunk = NULL;
+    }
+}
+
+// Answer one NACKed chunk. A copy that goes out is charged to the pacer
+// and the link budget; the result is a reference to send, with what the
+// impaired path does to its fragments in `fate`, or NULL when nothing is
+// sent: the chunk is too late or gone from the history, or a copy left a
+// moment ago.
+VideoChunk *nack_resend(NackHistory *h, Pacer *pacer, ShareState *share, int client_id,
+                        int chunk_id, double now, UdpFate *fate) {
+    NackSlot *slot = &h->slots[chunk_id % NACK_HISTORY];
+    LatencyStats *l = &session_entry(client_id)->latency;
+    double one_way = __atomic_load_n(&l->rtt_min_us, __ATOMIC_RELAXED) / 2000000.0;
+    if (slot->chunk == NULL || slot->chunk->chunk_id != chunk_id ||
+        now + one_way > share_deadline(share, chunk_id)) {
+        stats_record_nack(client_id, true);
+        return NULL;
+    }
+    stats_record_nack(client_id, false);
+    if (now - slot->last_sent < NACK_RESEND_MS / 1000.0) {
+        return NULL;  // The last copy may still be on its way
+    }
+    slot->last_sent = now;
+    pacer_consume(pacer, UDP_CHUNK_SIZE, now);
+    share_consume(share, UDP_CHUNK_SIZE);
+    
+    udp_impair(client_id, slot->chunk->size, now, fate);
+    slot->missing &= fate->dropped;
+    stats_record_retransmit(client_id, slot->missing == 0 && !slot->delivered);
+    if (fate->dropped != 0) {
+        log_event(LOG_EV_UDP_CHUNK_LOST, chunk_id, client_id, 0);
+    }
+    if (slot->missing == 0 && !slot->delivered) {
+        slot->delivered = true;
+        hist_record(&l->recovery, (uint64_t)((now - slot->first_sent) * 1000000.0));
+    }
+    return chunk_retain(slot->chunk);
+}
+
+// ---- Forward error correction ----
+//
+// With --fec a UDP stream follows each group of chunks with XOR parity
+// datagrams, so the client can rebuild a lost chunk without a round trip.
+// A group spans at most FEC_GROUP_MS of the stream's video, which bounds
+// the wait for a rebuild, and --fec sets its parity as a share of its
+// chunks. Parity i covers every parity_count-th chunk from the i-th on and
+// can rebuild one loss among them. Parity is paced, charged to the link
+// budget and lost by the simulation like the chunks themselves.
+
+typedef void (*FecXorKernel)(uint8_t *dst, const uint8_t *src, size_t len);
+
+typedef struct {
+    const char *name;
+    FecXorKernel run;
+} FecKernel;
+
+// dst ^= src, eight bytes at a time
+void fec_xor_scalar(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+#ifdef FEC_X86
+__attribute__((target("sse2")))
+void fec_xor_sse2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(dst + i + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *)(dst + i + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i *)(dst + i + 48));
+        a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)(src + i)));
+        a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(src + i + 16)));
+        a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *)(src + i + 32)));
+        a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *)(src + i + 48)));
+        _mm_storeu_si128((__m128i *)(dst + i), a0);
+        _mm_storeu_si128((__m128i *)(dst + i + 16), a1);
+        _mm_storeu_si128((__m128i *)(dst + i + 32), a2);
+        _mm_storeu_si128((__m128i *)(dst + i + 48), a3);
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(src + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), a);
+    }
+    fec_xor_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+void fec_xor_avx2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(dst + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(dst + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(dst + i + 96));
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(src + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(src + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(src + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(src + i + 96)));
+        _mm256_storeu_si256((__m256i *)(dst + i), a0);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), a1);
+        _mm256_storeu_si256((__m256i *)(dst + i + 64), a2);
+        _mm256_storeu_si256((__m256i *)(dst + i + 96), a3);
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(src + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), a);
+    }
+    fec_xor_scalar(dst + i, src + i, len - i);
+}
+#endif
+
+// Kernels this CPU can run, fastest last. Returns how many.
+int fec_kernels(FecKernel *out) {
+    int n = 0;
+    out[n].name = "scalar";
+    out[n++].run = fec_xor_scalar;
+#ifdef FEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        out[n].name = "sse2";
+        out[n++].run = fec_xor_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        out[n].name = "avx2";
+        out[n++].run = fec_xor_avx2;
+    }
+#endif
+    return n;
+}
+
+FecXorKernel fec_xor = fec_xor_scalar;
+const char *fec_kernel_name = "scalar";
+
+// Pick the fastest parity kernel, once at startup
+void fec_init(void) {
+    FecKernel kernels[3];
+    int n = fec_kernels(kernels);
+    fec_xor = kernels[n - 1].run;
+    fec_kernel_name = kernels[n - 1].name;
+}
+
+// Bits j of a group mask with j % stride == index
+uint32_t fec_stride_mask(int index, int stride) {
+    uint32_t mask = 0;
+    for (int j = index; j < 32; j += stride) {
+        mask |= 1u << j;
+    }
+    return mask;
+}
+
+// Shape a stream's groups: as many chunks as FEC_GROUP_MS of its video
+// holds, and at least enough for one parity to stay within --fec percent,
+// with about that percent of the group in parity
+void fec_start(FecEncoder *f, const char *resolution) {
+    memset(f, 0, sizeof(*f));
+    if (server_config.fec_percent <= 0) {
+        return;
+    }
+    double chunk_ms = UDP_CHUNK_SIZE * 8.0 / estimate_bandwidth(resolution);
+    int k = (int)(FEC_GROUP_MS / chunk_ms);
+    int k_min = (100 + server_config.fec_percent - 1) / server_config.fec_percent;
+    k = k < k_min ? k_min : k;
+    k = k < 2 ? 2 : k > FEC_MAX_GROUP ? FEC_MAX_GROUP : k;
+    int r = (k * server_config.fec_percent + 50) / 100;
+    r = r < 1 ? 1 : r > FEC_MAX_PARITY ? FEC_MAX_PARITY : r > k ? k : r;
+    f->group_size = k;
+    f->parity_count = r;
+    f->first = 1;
+}
+
+void fec_end(FecEncoder *f) {
+    for (int i = 0; i < FEC_MAX_PARITY; i++) {
+        chunk_release(f->parity[i]);
+        f->parity[i] = NULL;
+    }
+}
+
+// True when chunk `chunk_id` lies past the open group, whose parity must
+// then go out first
+bool fec_group_ended(const FecEncoder *f, int chunk_id) {
+    return f->covered != 0 && chunk_id >= f->first + f->group_size;
+}
+
+// Add a chunk that went out, or was lost on the way, to the open group.
+// Returns true once the group is complete.
+bool fec_add(FecEncoder *f, const VideoChunk *chunk, bool lost) {
+    if (f->covered == 0) {
+        // Open the chunk's group; chunks skipped under EDF can leave whole groups out
+        f->first += (chunk->chunk_id - f->first) / f->group_size * f->group_size;
+        for (int i = 0; i < f->parity_count; i++) {
+            VideoChunk *parity = malloc(sizeof(VideoChunk) + FEC_HEADER_SIZE + chunk->size);
+            if (parity != NULL) {
+                parity->refcount = 1;
+                parity->chunk_id = f->first;
+                parity->size = FEC_HEADER_SIZE + chunk->size;
+                memset(parity->data, 0, parity->size);
+            }
+            f->parity[i] = parity;
+        }
+    }
+    int j = chunk->chunk_id - f->first;
+    VideoChunk *parity = f->parity[j % f->parity_count];
+    if (parity != NULL) {
+        fec_xor((uint8_t *)parity->data + FEC_HEADER_SIZE, (const uint8_t *)chunk->data, chunk->size);
+    }
+    f->covered |= 1u << j;
+    if (lost) {
+        f->lost |= 1u << j;
+    }
+    return j == f->group_size - 1 || chunk->chunk_id == VIDEO_CHUNKS;
+}
+
+// Close the open group. Each parity frame is charged to the pacer and the
+// link budget and goes through the impaired path; those with a fragment
+// left to send are left in `out`, references for the caller to send and
+// release, with their frame headers in `headers` and their fates in
+// `fates`. Returns how many. A `client_id` of -1 records no stats
+// (--bench-fec).
+int fec_finish(FecEncoder *f, Pacer *pacer, ShareState *share, int client_id, double now,
+               VideoChunk **out, uint8_t (*headers)[FRAME_HEADER_SIZE], UdpFate *fates) {
+    int flags = f->first + f->group_size > VIDEO_CHUNKS ? FRAME_FLAG_LAST : 0;
+    int sent = 0, count = 0, recoverable = 0;
+    for (int i = 0; i < f->parity_count; i++) {
+        VideoChunk *parity = f->parity[i];
+        uint32_t mask = f->covered & fec_stride_mask(i, f->parity_count);
+        f->parity[i] = NULL;
+        if (parity == NULL || mask == 0) {
+            chunk_release(parity);
+            continue;
+        }
+        uint8_t *body = (uint8_t *)parity->data;
+        body[0] = (uint8_t)f->group_size;
+        body[1] = (uint8_t)f->parity_count;
+        body[2] = (uint8_t)i;
+        body[3] = 0;
+        wire_put32(body + 4, mask);
+        pacer_consume(pacer, UDP_CHUNK_SIZE, now);
+        share_consume(share, UDP_CHUNK_SIZE);
+        sent++;
+        udp_impair(client_id, parity->size, now, &fates[count]);
+        if (udp_all_dropped(parity->size, fates[count].dropped)) {
+            chunk_release(parity);
+            continue;
+        }
+        if (fates[count].dropped == 0 && __builtin_popcount(f->lost & mask) == 1) {
+            recoverable++;
+        }
+        wire_put_header(headers[count], FRAME_PARITY, flags, (uint32_t)f->first, (uint32_t)parity->size);
+        out[count++] = parity;
+    }
+    if (client_id >= 0) {
+        stats_record_fec(client_id, sent, recoverable);
+    }
+    f->first += f->group_size;
+    f->covered = 0;
+    f->lost = 0;
+    return count;
+}
+
+// FRAME_READY flags announcing the loss recovery of a UDP stream
+int udp_ready_flags(void) {
+    return (server_config.nack ? FRAME_FLAG_NACK : 0) | (server_config.fec_percent > 0 ? FRAME_FLAG_FEC : 0);
+}
+
+// Print statistics for every session table entry that has been used.
+// The entries' ClientStats are copied under stats_mutex and the counters
+// are snapshots, so no lock is held while printing.
+void print_stats() {
+    int capacity = __atomic_load_n(&session_capacity, __ATOMIC_ACQUIRE);
+    ClientStats *clients = capacity > 0 ? (ClientStats *)malloc(capacity * sizeof(ClientStats)) : NULL;
+    int count = 0;
+    int active;
 #ifdef _WIN32
-    printf("*** Starting TCP streaming for client %d (socket_fd: %" PRIu64 ") ***\n", 
-           client_id, (uint64_t)client_socket);
+    MUTEX_LOCK(stats_mutex);
 #else
-    printf("*** Starting TCP streaming for client %d (socket_fd: %d) ***\n", 
-           client_id, client_socket);
+    pthread_mutex_lock(&stats_mutex);
 #endif
-    
-    // Double check that we have a valid socket
-    if (client_socket == INVALID_SOCKET_VALUE) {
+    for (int i = 0; clients != NULL && i < capacity; i++) {
+        SessionEntry *e = session_entry(i);
+        if (e->used) {
+            clients[count++] = e->stats;
+        }
+    }
+    active = session_active_count;
 #ifdef _WIN32
-        printf("*** CRITICAL ERROR: Invalid socket file descriptor (%" PRIu64 ") for client %d ***\n", 
-               (uint64_t)client_socket, client_id);
+    MUTEX_UNLOCK(stats_mutex);
 #else
-        printf("*** CRITICAL ERROR: Invalid socket file descriptor (%d) for client %d ***\n", 
-               client_socket, client_id);
+    pthread_mutex_unlock(&stats_mutex);
 #endif
+    
+    log_message("\n----- Streaming Statistics -----");
+    if (count == 0) {
+        log_message("No clients connected yet.");
+    } else {
+        // First print a summary of all clients
+        log_message("Total clients connected: %d (%d active, table capacity %d)\n",
+                    count, active, capacity);
+        
+        // Jain's fairness index over the streams' throughput, raw and as a
+        // fraction of each stream's target: (sum x)^2 / (n * sum x^2)
+        int streams = 0;
+        double kbps_sum = 0, kbps_sq = 0, share_sum = 0, share_sq = 0;
+        double kbps_min = 0, kbps_max = 0;
+        uint64_t chunks_due = 0, chunks_missed = 0, chunks_skipped = 0;
+        uint64_t udp_chunks = 0, udp_unrecovered = 0, udp_redundant = 0;
+        int udp_streams_recovering = 0;
+        Histogram rtt_all, delivery_all, ttfb_all;
+        memset(&rtt_all, 0, sizeof(rtt_all));
+        memset(&delivery_all, 0, sizeof(delivery_all));
+        memset(&ttfb_all, 0, sizeof(ttfb_all));
+        
+        // Then print detailed stats for each client
+        for (int i = 0; i < count; i++) {
+            ClientStats *client = &clients[i];
+            StreamCounters c;
+            stats_snapshot(client->client_id, &c);
+            log_message("Client %d (%s): %s - %s", 
+                   client->client_id,
+                   inet_ntoa(client->address.sin_addr),
+                   client->protocol,
+                   client->resolution);
+                   
+            if (c.chunks_sent > 0) {
+                log_message("  Status: %s", 
+                       client->state == STATE_STREAMING ? "Streaming" : 
+                       client->state == STATE_FINISHED ? "Finished" : 
+                       client->state == STATE_IDLE ? "Idle" : "Connecting");
+                double elapsed = c.last_send_us / 1000000.0 - client->start_time;
+                log_message("  Bytes sent: %" PRIu64, c.bytes_sent);
+                log_message("  Chunks sent: %" PRIu64, c.chunks_sent);
+                log_message("  Data rate: %.2f bytes/sec", elapsed > 0 ? c.bytes_sent / elapsed : 0.0);
+                log_message("  Elapsed time: %.2f seconds", elapsed);
+                if (elapsed > 0) {
+                    double kbps = c.bytes_sent * 8.0 / 1000.0 / elapsed;
+                    double share = c.target_kbps > 0 ? kbps / c.target_kbps : 1.0;
+                    log_message("  Throughput: %.1f Kbps (%.0f%% of target)", kbps, share * 100.0);
+                    kbps_min = streams == 0 || kbps < kbps_min ? kbps : kbps_min;
+                    kbps_max = kbps > kbps_max ? kbps : kbps_max;
+                    kbps_sum += kbps;
+                    kbps_sq += kbps * kbps;
+                    share_sum += share;
+                    share_sq += share * share;
+                    streams++;
+                }
+                if (client->admission_latency > 0) {
+                    log_message("  Admission to stream start: %.2f ms", client->admission_latency * 1000.0);
+                }
+                
+                // Print playout deadline misses (each one is a player stall)
+                uint64_t due = c.chunks_sent + c.late_skipped;  // Sent counts lost chunks too
+                log_message("  Deadline misses: %" PRIu64 " of %" PRIu64 " chunks (%.2f%%), %" PRIu64 " late chunks skipped",
+                            c.deadline_misses, due, c.deadline_misses * 100.0 / due, c.late_skipped);
+                chunks_due += due;
+                chunks_missed += c.deadline_misses;
+                chunks_skipped += c.late_skipped;
+                
+                // Print protocol-specific metrics
+                if (strcmp(client->protocol, "UDP") == 0) {
+                    log_message("  Packets dropped: %" PRIu64, c.packets_dropped);
+                    float loss_rate = (c.packets_dropped * 100.0f) / 
+                                     (c.chunks_sent + c.packets_dropped);
+                    log_message("  Packet loss rate: %.2f%%", loss_rate);
+                    if (c.fragments > c.chunks_sent) {
+                        log_message("  Fragments: %" PRIu64 " datagrams, %" PRIu64 " dropped (%.2f%%)",
+                                    c.fragments, c.fragments_dropped, c.fragments_dropped * 100.0 / c.fragments);
+                    }
+                    if (c.nacked > 0) {
+                        log_message("  Retransmission: %" PRIu64 " chunks NACKed, %" PRIu64 " refused, "
+                                    "%" PRIu64 " copies resent (%.2f%% overhead)",
+                                    c.nacked, c.nack_refused, c.retransmits,
+                                    c.retransmits * 100.0 / c.chunks_sent);
+                        hist_log("  Recovery latency", &session_entry(client->client_id)->latency.recovery);
+                    }
+                    if (c.fec_groups > 0) {
+                        log_message("  FEC: %" PRIu64 " groups, %" PRIu64 " parity datagrams (%.2f%% overhead), "
+                                    "%" PRIu64 " dropped chunks recoverable",
+                                    c.fec_groups, c.fec_parity, c.fec_parity * 100.0 / c.chunks_sent,
+                                    c.fec_recoverable);
+                    }
+                    if (c.nacked > 0 || c.fec_groups > 0) {
+                        // With both on, a chunk FEC rebuilt may also have been resent
+                        uint64_t repaired = c.recovered + c.fec_recoverable;
+                        uint64_t unrecovered = repaired < c.packets_dropped ? c.packets_dropped - repaired : 0;
+                        log_message("  Effective loss: %" PRIu64 " of %" PRIu64 " chunks (%.2f%%), "
+                                    "%" PRIu64 " recovered",
+                                    unrecovered, c.chunks_sent, unrecovered * 100.0 / c.chunks_sent,
+                                    c.packets_dropped - unrecovered);
+                        udp_streams_recovering++;
+                        udp_chunks += c.chunks_sent;
+                        udp_unrecovered += unrecovered;
+                        udp_redundant += c.retransmits + c.fec_parity;
+                    }
+                }
+                
+                // Print send-path cost for TCP streams
+                if (strcmp(client->protocol, "TCP") == 0 && c.send_calls > 0) {
+                    log_message("  Send syscalls per chunk: %.2f (%" PRIu64 " would-block)",
+                           (double)c.send_calls / c.chunks_sent, c.send_blocked);
+                }
+                if (c.segments_lost > 0) {
+                    log_message("  Simulated TCP loss: %" PRIu64 " of %" PRIu64 " segments (%.2f%%), "
+                                "each held back a retransmission",
+                                c.segments_lost, c.segments, c.segments_lost * 100.0 / c.segments);
+                }
+                
+                // Print pacing accuracy
+                if (c.target_kbps > 0) {
+                    double achieved_kbps = c.achieved_bps / 1000.0;
+                    log_message("  Pacing: %.1f Kbps achieved, %" PRIu64 " Kbps target (%+.2f%%)",
+                           achieved_kbps, c.target_kbps,
+                           (achieved_kbps - c.target_kbps) * 100.0 / c.target_kbps);
+                }
+                
+                // Print end-to-end latency measured from the client's acks
+                LatencyStats *l = &session_entry(client->client_id)->latency;
+                uint64_t ttfb = __atomic_load_n(&l->ttfb_us, __ATOMIC_RELAXED);
+                if (__atomic_load_n(&l->rtt.count, __ATOMIC_RELAXED) > 0) {
+                    hist_log("  RTT", &l->rtt);
+                    hist_log("  Delivery latency", &l->delivery);
+                    hist_log("  Delay variation", &l->variation);
+                    hist_merge(&rtt_all, &l->rtt);
+                    hist_merge(&delivery_all, &l->delivery);
+                }
+                if (ttfb > 0) {
+                    log_message("  Time to first byte: %.2f ms", ttfb / 1000.0);
+                    hist_record(&ttfb_all, ttfb);
+                }
+                
+                printf("\n");
+            } else {
+                log_message("  Status: %s", 
+                       client->state == STATE_STREAMING ? "Streaming" : 
+                       client->state == STATE_FINISHED ? "Finished" : 
+                       client->state == STATE_IDLE ? "Idle" : "Connecting");
+                log_message("  No streaming data sent yet\n");
+            }
+        }
+        
+        if (streams > 0) {
+            log_message("Throughput over %d streams (%s%s): total %.1f Kbps, min %.1f, max %.1f",
+                        streams, policy_names[scheduling_policy],
+                        server_config.capacity_kbps > 0 ? ", shared capacity" : "",
+                        kbps_sum, kbps_min, kbps_max);
+            log_message("Jain's fairness index: %.3f on throughput, %.3f on throughput/target",
+                        kbps_sq > 0 ? kbps_sum * kbps_sum / (streams * kbps_sq) : 1.0,
+                        share_sq > 0 ? share_sum * share_sum / (streams * share_sq) : 1.0);
+        }
+        if (chunks_due > 0) {
+            log_message("Stall rate: %" PRIu64 " of %" PRIu64 " chunks missed their playout deadline (%.2f%%), "
+                        "%" PRIu64 " skipped", chunks_missed, chunks_due,
+                        chunks_missed * 100.0 / chunks_due, chunks_skipped);
+        }
+        if (udp_streams_recovering > 0) {
+            log_message("Loss recovery over %d UDP streams: effective loss %.2f%%, %.2f%% overhead",
+                        udp_streams_recovering, udp_unrecovered * 100.0 / udp_chunks,
+                        udp_redundant * 100.0 / udp_chunks);
+        }
+        if (rtt_all.count > 0) {
+            hist_log("RTT over all streams", &rtt_all);
+            hist_log("Delivery latency over all streams", &delivery_all);
+        }
+        if (ttfb_all.count > 0) {
+            hist_log("Time to first byte", &ttfb_all);
+        }
+    }
+    
+    if (server_config.admission != ADMISSION_OFF) {
+        static const char *modes[] = { "", "reject", "queue", "downgrade" };
 #ifdef _WIN32
         MUTEX_LOCK(stats_mutex);
 #else
         pthread_mutex_lock(&stats_mutex);
 #endif
-        client_stats[client_id].state = STATE_FINISHED;
-        client_stats[client_id].active = 0;
+        log_message("Admission control (%s, %d Kbps): %d Kbps committed, %" PRIu64 " accepted, "
+                    "%" PRIu64 " downgraded, %" PRIu64 " queued, %" PRIu64 " rejected; from the queue "
+                    "%" PRIu64 " admitted, %" PRIu64 " timed out, %d waiting",
+                    modes[server_config.admission], admit_limit_kbps(), admit_committed_kbps,
+                    admit_outcomes[ADMIT_ACCEPTED], admit_outcomes[ADMIT_DOWNGRADED],
+                    admit_outcomes[ADMIT_QUEUED], admit_outcomes[ADMIT_REJECTED],
+                    admit_queue_admitted, admit_queue_timeouts, admit_queue_length);
 #ifdef _WIN32
         MUTEX_UNLOCK(stats_mutex);
 #else
         pthread_mutex_unlock(&stats_mutex);
 #endif
-#ifdef _WIN32
-        return 0;
-#else
-        return NULL;
-#endif
     }
+    if (pool_worker_count > 0) {
+        uint64_t runs = 0, steals = 0;
+        for (int i = 0; i < pool_worker_count; i++) {
+            runs += __atomic_load_n(&pool_workers[i].runs, __ATOMIC_RELAXED);
+            steals += __atomic_load_n(&pool_workers[i].steals, __ATOMIC_RELAXED);
+        }
+        log_message("Worker pool: %d workers, %" PRIu64 " task runs, %" PRIu64 " stolen (%.1f%%)",
+                    pool_worker_count, runs, steals, runs > 0 ? steals * 100.0 / runs : 0.0);
+    }
+    int built = __atomic_load_n(&chunk_store_built, __ATOMIC_RELAXED);
+    log_message("Chunk store: %d chunks cached", built);
+    if (__atomic_load_n(&admission_hist.count, __ATOMIC_RELAXED) > 0) {
+        hist_log("Admission to stream start", &admission_hist);
+    }
+    unsigned long datagrams = __atomic_load_n(&udp_datagrams_sent, __ATOMIC_RELAXED);
+    unsigned long udp_syscalls = __atomic_load_n(&udp_send_syscalls, __ATOMIC_RELAXED);
+    if (udp_syscalls > 0) {
+        log_message("UDP send path: %lu datagrams in %lu syscalls (%.2f per call)",
+               datagrams, udp_syscalls, (double)datagrams / udp_syscalls);
+    }
+    unsigned long moved = __atomic_load_n(&udp_sessions_moved, __ATOMIC_RELAXED);
+    if (moved > 0) {
+        log_message("UDP sessions moved to the receiving socket's reactor: %lu", moved);
+    }
+    if (server_config.encode_cost == ENCODE_COST_PIPELINE) {
+        for (int i = 0; i < RESOLUTION_COUNT * CHUNK_CLASSES; i++) {
+            EncodePipeline *p = &pipelines[i / CHUNK_CLASSES][i % CHUNK_CLASSES];
+            int head = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+            int leader = __atomic_load_n(&p->demand, __ATOMIC_RELAXED);
+            unsigned long takes = __atomic_load_n(&p->takes, __ATOMIC_RELAXED);
+            unsigned long occupancy_sum = __atomic_load_n(&p->occupancy_sum, __ATOMIC_RELAXED);
+            log_message("Pipeline %s %s: %d/%d encoded, occupancy %d/%d (avg %.1f), %lu underruns",
+                   resolution_names[p->resolution], p->chunk_class == CHUNK_CLASS_TCP ? "TCP" : "UDP",
+                   head, VIDEO_CHUNKS,
+                   head > leader ? head - leader : 0, server_config.pipeline_depth,
+                   takes > 0 ? (double)occupancy_sum / takes : 0.0,
+                   __atomic_load_n(&p->underruns, __ATOMIC_RELAXED));
+        }
+    }
+    free(clients);
     
-    // Set send timeout to avoid blocking indefinitely
+    log_message("------------------------------");
+}
+
+// Generate a random port number in the valid range
+int get_random_port() {
+    return 10000 + (rand() % 40000); // Between 10000 and 49999
+}
+
+// Claim a session table entry for a new connection-phase socket. Returns
+// the new client ID, or -1 when MAX_SESSIONS sessions are live.
+int register_client(const struct sockaddr_in *client_addr) {
 #ifdef _WIN32
-    DWORD send_timeout = 2000;  // 2 seconds in milliseconds
-    if (setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&send_timeout, sizeof(send_timeout)) < 0) {
+    MUTEX_LOCK(stats_mutex);
 #else
-    struct timeval send_tv;
-    send_tv.tv_sec = 2;  // Reduced from 3 to 2 seconds timeout
-    send_tv.tv_usec = 0;
-    if (setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&send_tv, sizeof(send_tv)) < 0) {
+    pthread_mutex_lock(&stats_mutex);
 #endif
-        printf("*** WARNING: Failed to set TCP send timeout for client %d ***\n", client_id);
-        print_socket_error("setsockopt failed");
-    }
     
-    // Set socket to non-blocking mode
-    int flags = fcntl(client_socket, F_GETFL, 0);
-    if (flags < 0) {
-        printf("*** WARNING: Failed to get socket flags for client %d ***\n", client_id);
-        print_socket_error("fcntl failed");
-    } else if (fcntl(client_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
-        printf("*** WARNING: Failed to set socket non-blocking for client %d ***\n", client_id);
-        print_socket_error("fcntl failed");
+    int client_id = -1;
+    if (session_free != -1 || session_grow()) {
+        int index = session_free;
+        SessionEntry *e = session_entry(index);
+        session_free = e->next_free;
+        client_id = (int)(e->generation << SESSION_INDEX_BITS) | index;
+        
+        e->stats.client_id = client_id;
+        e->stats.address = *client_addr;
+        e->stats.start_time = get_time();
+        e->stats.state = STATE_CONNECTION;
+        e->stats.admission_latency = 0;
+        e->admit_us = 0;
+        memset(&e->latency, 0, sizeof(e->latency));
+        e->committed_kbps = 0;
+        e->queued = 0;
+        e->next_queued = -1;
+        e->stats.protocol[0] = '\0';
+        e->stats.resolution[0] = '\0';
+        e->stats.streaming_port = 0;
+        e->stats.socket_fd = INVALID_SOCKET_VALUE;
+        e->used = 1;
+        stats_reset(client_id);
+        __atomic_store_n(&e->stats.active, 1, __ATOMIC_RELAXED);
+        session_active_count++;
     }
     
-    // Send ready message
-    int retry_count = 0;
-    int max_retries = 5;
-    bool ready_sent = false;
-    
-    printf("*** Attempting to send READY_TO_STREAM to client %d ***\n", client_id);
-    
-    while (!ready_sent && retry_count < max_retries) {
-        int send_result = send(client_socket, "READY_TO_STREAM", strlen("READY_TO_STREAM"), 0);
-        if (send_result < 0) {
 #ifdef _WIN32
-            if (WSAGetLastError() == WSAEWOULDBLOCK) {
+    MUTEX_UNLOCK(stats_mutex);
 #else
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    pthread_mutex_unlock(&stats_mutex);
 #endif
-                // Socket would block, retry after a short delay
-                usleep(100000); // 100ms
-                retry_count++;
-                printf("*** TCP send would block for client %d, retry %d/%d ***\n", 
-                       client_id, retry_count, max_retries);
-            } else {
-                printf("*** ERROR: Failed to send READY_TO_STREAM message to client %d ***\n", client_id);
-                print_socket_error("Send error");
-                CLOSE_SOCKET(client_socket);
+    
+    return client_id;
+}
+
+// End a session: record its final state and return the entry to the free
+// list. The entry's generation moves on, so `client_id` stops being valid;
+// releasing an ID that is already stale does nothing.
+void release_client(int client_id, int state) {
 #ifdef _WIN32
-                MUTEX_LOCK(stats_mutex);
+    MUTEX_LOCK(stats_mutex);
 #else
-                pthread_mutex_lock(&stats_mutex);
+    pthread_mutex_lock(&stats_mutex);
 #endif
-                client_stats[client_id].state = STATE_FINISHED;
-                client_stats[client_id].active = 0;
+    if (session_current(client_id) && CLIENT_STATS(client_id).active) {
+        SessionEntry *e = session_entry(client_id);
+        unsigned index = SESSION_INDEX(client_id);
+        e->stats.state = state;
+        __atomic_store_n(&e->stats.active, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->generation, e->generation % SESSION_GENERATION_MAX + 1, __ATOMIC_RELEASE);
+        
+        // Drop a pending RR turn so the entry's next session is not
+        // scheduled on its behalf
 #ifdef _WIN32
-                MUTEX_UNLOCK(stats_mutex);
+        MUTEX_LOCK(queue_mutex);
 #else
-                pthread_mutex_unlock(&stats_mutex);
+        pthread_mutex_lock(&queue_mutex);
 #endif
+        session_ready[index / 64] &= ~(1ULL << (index % 64));
 #ifdef _WIN32
-                return 0;
+        MUTEX_UNLOCK(queue_mutex);
 #else
-                return NULL;
+        pthread_mutex_unlock(&queue_mutex);
 #endif
-            }
-        } else {
-            printf("*** Successfully sent READY_TO_STREAM to client %d ***\n", client_id);
-            ready_sent = true;
+        
+        // Give back its admission claim, or its place in the queue
+        if (e->queued) {
+            admit_queue_remove(client_id);
         }
+        admit_committed_kbps -= e->committed_kbps;
+        e->committed_kbps = 0;
+        
+        // A UDP stream that never started still listens for its REQUEST_STREAM
+        if (strcmp(e->stats.protocol, "UDP") == 0) {
+            udp_table_remove(e->stats.address.sin_addr.s_addr, 0, client_id);
+        }
+        
+        e->next_free = session_free;
+        session_free = (int)index;
+        session_active_count--;
     }
-    
-    if (!ready_sent) {
-        printf("*** ERROR: Failed to send READY_TO_STREAM after %d attempts for client %d ***\n", 
-               max_retries, client_id);
-        CLOSE_SOCKET(client_socket);
-#ifdef _WIN32
-        MUTEX_LOCK(stats_mutex);
-#else
-        pthread_mutex_lock(&stats_mutex);
-#endif
-        client_stats[client_id].state = STATE_FINISHED;
-        client_stats[client_id].active = 0;
 #ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
+    MUTEX_UNLOCK(stats_mutex);
 #else
-        pthread_mutex_unlock(&stats_mutex);
+    pthread_mutex_unlock(&stats_mutex);
 #endif
-#ifdef _WIN32
+}
+
+// Mark a session as streaming and record how long it took to get there
+// from admission (the Type 2 Response). A TCP client that reconnects its stream socket is
+// only counted the first time. Caller holds stats_mutex.
+void stats_stream_started(int client_id) {
+    SessionEntry *e = session_entry(client_id);
+    double now = get_time();
+    impair_start(&e->impair, client_id);
+    e->stats.state = STATE_STREAMING;
+    e->stats.start_time = now;
+    if (e->admit_us == 0) {
+        return;
+    }
+    uint64_t now_us = (uint64_t)(now * 1000000.0);
+    uint64_t waited = now_us > e->admit_us ? now_us - e->admit_us : 0;
+    e->admit_us = 0;
+    e->stats.admission_latency = waited / 1000000.0;
+    hist_record(&admission_hist, waited);
+}
+
+// ---- Admission control ----
+//
+// Every admitted session commits estimate_bandwidth() of its resolution
+// until it is released. With --admission, a Type 1 Request whose stream
+// does not fit into what is left of --admit-kbps (default --capacity-kbps)
+// is turned away, queued or downgraded instead of pushing the server into
+// overload, where every stream misses its rate. Queued clients keep their
+// connection open and are admitted strictly in arrival order, so a 1080p
+// stream at the head is not starved by 480p streams behind it.
+
+// Bandwidth admission control may commit, 0 when it is off
+int admit_limit_kbps(void) {
+    if (server_config.admission == ADMISSION_OFF) {
         return 0;
-#else
-        return NULL;
-#endif
     }
+    return server_config.admit_kbps > 0 ? server_config.admit_kbps : server_config.capacity_kbps;
+}
+
+// Whether a stream of `kbps` fits. Caller holds stats_mutex.
+bool admit_fits(int kbps) {
+    int limit = admit_limit_kbps();
+    return limit <= 0 || admit_committed_kbps + kbps <= limit;
+}
+
+// Admit the session at `resolution`. Caller holds stats_mutex.
+void admit_commit(int client_id, const char *resolution) {
+    SessionEntry *e = session_entry(client_id);
+    if (resolution != e->stats.resolution) {  // A queued session is admitted at the resolution it holds
+        strncpy(e->stats.resolution, resolution, sizeof(e->stats.resolution) - 1);
+        e->stats.resolution[sizeof(e->stats.resolution) - 1] = '\0';
+    }
+    e->committed_kbps = estimate_bandwidth(resolution);
+    admit_committed_kbps += e->committed_kbps;
+    e->admit_us = (uint64_t)(get_time() * 1000000.0);
+    udp_expect_request(client_id);
+}
+
+// Take a session out of the admission queue. Caller holds stats_mutex.
+void admit_queue_remove(int client_id) {
+    int *link = &admit_queue_head;
+    int prev = -1;
+    while (*link != -1 && *link != client_id) {
+        prev = *link;
+        link = &session_entry(*link)->next_queued;
+    }
+    if (*link == -1) {
+        return;
+    }
+    SessionEntry *e = session_entry(client_id);
+    *link = e->next_queued;
+    if (admit_queue_tail == client_id) {
+        admit_queue_tail = prev;
+    }
+    e->queued = 0;
+    e->next_queued = -1;
+    admit_queue_length--;
+}
+
+// Fill in a Type 2 Response
+void fill_response(int client_id, const char *resolution, const char *protocol,
+                   int status, int queue_position, Message *response) {
+    memset(response, 0, sizeof(*response));
+    response->type = TYPE_2_RESPONSE;
+    strncpy(response->resolution, resolution, sizeof(response->resolution) - 1);
+    strncpy(response->protocol, protocol, sizeof(response->protocol) - 1);
+    response->bandwidth = estimate_bandwidth(resolution);
+    response->client_id = client_id;  // Include client ID in response
+    response->status = status;
+    response->queue_position = queue_position;
+    
+    // Both TCP and UDP will use server_port, unless clients reach it
+    // through a relay such as linkem on another port
+    response->streaming_port = server_config.advertise_port > 0 ? server_config.advertise_port : server_port;
+}
+
+// Record the requested stream, decide on its admission and fill in the
+// Type 2 Response. ADMIT_ACCEPTED and ADMIT_DOWNGRADED responses hand the
+// session to the scheduler; after ADMIT_QUEUED the caller keeps polling
+// admit_poll() and sends its response too; ADMIT_REJECTED ends the session.
+void prepare_response(int client_id, const Message *request, Message *response) {
+    char resolution[10];
+    strncpy(resolution, request->resolution, sizeof(resolution) - 1);
+    resolution[sizeof(resolution) - 1] = '\0';
+    int status = ADMIT_ACCEPTED;
+    int position = 0;
     
-    printf("*** Sent READY_TO_STREAM to TCP client %d ***\n", client_id);
-    
-    // Wait for start confirmation with timeout
 #ifdef _WIN32
-    DWORD recv_timeout = 5000;  // 5 seconds in milliseconds
-    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&recv_timeout, sizeof(recv_timeout)) < 0) {
+    MUTEX_LOCK(stats_mutex);
 #else
-    struct timeval recv_tv;
-    recv_tv.tv_sec = 5;  // 5 seconds timeout
-    recv_tv.tv_usec = 0;
-    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&recv_tv, sizeof(recv_tv)) < 0) {
+    pthread_mutex_lock(&stats_mutex);
 #endif
-        printf("*** WARNING: Failed to set TCP receive timeout for client %d ***\n", client_id);
-        print_socket_error("setsockopt failed");
+    SessionEntry *e = session_entry(client_id);
+    strncpy(e->stats.resolution, resolution, sizeof(e->stats.resolution) - 1);
+    e->stats.resolution[sizeof(e->stats.resolution) - 1] = '\0';
+    strncpy(e->stats.protocol, request->protocol, sizeof(e->stats.protocol) - 1);
+    e->stats.protocol[sizeof(e->stats.protocol) - 1] = '\0';
+    e->latency.request_us = (uint64_t)(get_monotonic_time() * 1000000.0);  // Time to first byte starts here
+    
+    if (admit_queue_length > 0 || !admit_fits(estimate_bandwidth(resolution))) {
+        status = ADMIT_REJECTED;
+        if (server_config.admission == ADMISSION_DOWNGRADE) {
+            for (int r = resolution_index(resolution) - 1; r >= 0; r--) {
+                if (admit_fits(estimate_bandwidth(resolution_names[r]))) {
+                    strcpy(resolution, resolution_names[r]);
+                    status = ADMIT_DOWNGRADED;
+                    break;
+                }
+            }
+        } else if (server_config.admission == ADMISSION_QUEUE) {
+            e->queued = 1;
+            e->next_queued = -1;
+            if (admit_queue_tail == -1) {
+                admit_queue_head = client_id;
+            } else {
+                session_entry(admit_queue_tail)->next_queued = client_id;
+            }
+            admit_queue_tail = client_id;
+            position = ++admit_queue_length;
+            status = ADMIT_QUEUED;
+        }
     }
-    
-    char buffer[BUFFER_SIZE] = {0};
-    
-    printf("*** Waiting for START_STREAM from client %d (timeout: 5 seconds) ***\n", client_id);
-    
-    // Using select() to properly handle non-blocking sockets with timeout
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(client_socket, &read_fds);
-    
-    // Wait up to 5 seconds for start confirmation
+    if (status == ADMIT_ACCEPTED || status == ADMIT_DOWNGRADED) {
+        admit_commit(client_id, resolution);
+    }
+    admit_outcomes[status]++;
 #ifdef _WIN32
-    struct timeval select_tv;
-    select_tv.tv_sec = 5;
-    select_tv.tv_usec = 0;
-    int select_result = select(0, &read_fds, NULL, NULL, &select_tv);
+    MUTEX_UNLOCK(stats_mutex);
 #else
-    struct timeval select_tv;
-    select_tv.tv_sec = 5;
-    select_tv.tv_usec = 0;
-    int select_result = select(client_socket + 1, &read_fds, NULL, NULL, &select_tv);
+    pthread_mutex_unlock(&stats_mutex);
 #endif
     
-    if (select_result <= 0) {
-        // Timeout or error
-        printf("*** ERROR: Client %d did not confirm stream start (timeout or error) ***\n", client_id);
-        print_socket_error("Select error");
-        CLOSE_SOCKET(client_socket);
+    fill_response(client_id, resolution, request->protocol, status, position, response);
+}
+
+// Admit a queued session once it is at the head of the queue and its
+// stream fits. Returns 1 with the final Type 2 Response filled in, 0 while
+// it has to keep waiting.
+int admit_poll(int client_id, Message *response) {
+    int admitted = 0;
 #ifdef _WIN32
-        MUTEX_LOCK(stats_mutex);
+    MUTEX_LOCK(stats_mutex);
 #else
-        pthread_mutex_lock(&stats_mutex);
+    pthread_mutex_lock(&stats_mutex);
 #endif
-        client_stats[client_id].state = STATE_FINISHED;
-        client_stats[client_id].active = 0;
+    SessionEntry *e = session_entry(client_id);
+    if (admit_queue_head == client_id && admit_fits(estimate_bandwidth(e->stats.resolution))) {
+        admit_queue_remove(client_id);
+        admit_commit(client_id, e->stats.resolution);
+        admit_queue_admitted++;
+        fill_response(client_id, e->stats.resolution, e->stats.protocol, ADMIT_ACCEPTED, 0, response);
+        admitted = 1;
+    }
 #ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
+    MUTEX_UNLOCK(stats_mutex);
 #else
-        pthread_mutex_unlock(&stats_mutex);
+    pthread_mutex_unlock(&stats_mutex);
 #endif
+    return admitted;
+}
+
+// Give up on a queued session after ADMIT_QUEUE_TIMEOUT_MS and fill in the
+// rejection to send it
+void admit_withdraw(int client_id, Message *response) {
 #ifdef _WIN32
-        return 0;
+    MUTEX_LOCK(stats_mutex);
 #else
-        return NULL;
+    pthread_mutex_lock(&stats_mutex);
 #endif
+    SessionEntry *e = session_entry(client_id);
+    if (e->queued) {
+        admit_queue_remove(client_id);
     }
-    
-    printf("*** Select() indicates client %d is ready to receive ***\n", client_id);
-    
-    int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-    if (bytes_received <= 0) {
-        printf("*** ERROR: Client %d did not confirm stream start (error) ***\n", client_id);
-        print_socket_error("Receive error");
-        CLOSE_SOCKET(client_socket);
+    admit_queue_timeouts++;
+    fill_response(client_id, e->stats.resolution, e->stats.protocol, ADMIT_REJECTED, 0, response);
 #ifdef _WIN32
-        MUTEX_LOCK(stats_mutex);
+    MUTEX_UNLOCK(stats_mutex);
 #else
-        pthread_mutex_lock(&stats_mutex);
+    pthread_mutex_unlock(&stats_mutex);
 #endif
-        client_stats[client_id].state = STATE_FINISHED;
-        client_stats[client_id].active = 0;
+}
+
+// ---- UDP session table ----
+//
+// Control datagrams on the UDP port are matched to sessions through an
+// open-addressing table keyed by (ip, port, client_id). A session waiting
+// for REQUEST_STREAM is keyed with port 0 since its UDP port is not known
+// yet; once the request arrives it is re-keyed with the sender's port.
+// The port 0 key goes in when the stream is admitted, before the client
+// reads its Type 2 Response, with no owner until the stream starts; a
+// request that comes in that window is parked in the session entry.
+// Writers (session start, match and end) are serialized by udp_table_mutex.
+// Lookups take no lock: each slot carries a sequence number that is odd
+// while a writer changes it, and readers retry a slot whose number moved.
+
+#define UDP_REQUEST_TIMEOUT_MS 7500  // Time a selected UDP client has to send REQUEST_STREAM
+#define UDP_OWNER_NONE -1   // Owner of an admitted session no reactor has picked up yet
+
+// Slot states
+#define UDP_SLOT_EMPTY 0    // Never used, ends a probe sequence
+#define UDP_SLOT_USED 1
+#define UDP_SLOT_DELETED 2  // Tombstone, reusable by inserts
+
+typedef struct {
+    unsigned seq;       // Odd while a writer is changing the slot
+    int state;          // UDP_SLOT_*
+    uint32_t ip;        // Network byte order
+    uint16_t port;      // Network byte order, 0 while waiting for REQUEST_STREAM
+    int client_id;
+    int owner;          // Reactor driving the session (-1 in the threaded build)
+} UdpTableSlot;
+
+UdpTableSlot udp_table[UDP_TABLE_SIZE];
+
+unsigned udp_table_hash(uint32_t ip, uint16_t port, int client_id) {
+    uint32_t h = ip * 0x9E3779B1u ^ (uint32_t)port * 0x85EBCA77u ^ (uint32_t)client_id * 0xC2B2AE3Du;
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    return h & (UDP_TABLE_SIZE - 1);
+}
+
+// Publish a slot change: readers that saw the old sequence number retry
+void udp_slot_write(UdpTableSlot *slot, int state, uint32_t ip, uint16_t port,
+                    int client_id, int owner) {
+    unsigned seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->ip, ip, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->port, port, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->client_id, client_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->owner, owner, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->state, state, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Consistent copy of a slot, taken without the writer lock
+void udp_slot_read(UdpTableSlot *slot, UdpTableSlot *copy) {
+    unsigned seq;
+    do {
+        // Read the slot again while a writer is changing it
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        copy->state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+        copy->ip = __atomic_load_n(&slot->ip, __ATOMIC_RELAXED);
+        copy->port = __atomic_load_n(&slot->port, __ATOMIC_RELAXED);
+        copy->client_id = __atomic_load_n(&slot->client_id, __ATOMIC_RELAXED);
+        copy->owner = __atomic_load_n(&slot->owner, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq);
+    copy->seq = seq;
+}
+
+// Find a session without locking. Returns its owner, or -2 if absent.
+int udp_table_lookup(uint32_t ip, uint16_t port, int client_id) {
+    unsigned i = udp_table_hash(ip, port, client_id);
+    for (int probes = 0; probes < UDP_TABLE_SIZE; probes++) {
+        UdpTableSlot slot;
+        udp_slot_read(&udp_table[i], &slot);
+        if (slot.state == UDP_SLOT_EMPTY) {
+            return -2;
+        }
+        if (slot.state == UDP_SLOT_USED && slot.ip == ip && slot.port == port &&
+            slot.client_id == client_id) {
+            return slot.owner;
+        }
+        i = (i + 1) & (UDP_TABLE_SIZE - 1);
+    }
+    return -2;
+}
+
+// Slot holding a key, or NULL. Caller holds udp_table_mutex.
+UdpTableSlot *udp_table_find_locked(uint32_t ip, uint16_t port, int client_id) {
+    unsigned i = udp_table_hash(ip, port, client_id);
+    for (int probes = 0; probes < UDP_TABLE_SIZE; probes++) {
+        UdpTableSlot *slot = &udp_table[i];
+        if (slot->state == UDP_SLOT_EMPTY) {
+            return NULL;
+        }
+        if (slot->state == UDP_SLOT_USED && slot->ip == ip && slot->port == port &&
+            slot->client_id == client_id) {
+            return slot;
+        }
+        i = (i + 1) & (UDP_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+// Add or update a session. Returns 0 if the table is full.
+int udp_table_insert(uint32_t ip, uint16_t port, int client_id, int owner) {
+    MUTEX_LOCK(udp_table_mutex);
+    UdpTableSlot *slot = udp_table_find_locked(ip, port, client_id);
+    unsigned i = udp_table_hash(ip, port, client_id);
+    for (int probes = 0; slot == NULL && probes < UDP_TABLE_SIZE; probes++) {
+        if (udp_table[i].state != UDP_SLOT_USED) {
+            slot = &udp_table[i];
+        }
+        i = (i + 1) & (UDP_TABLE_SIZE - 1);
+    }
+    if (slot != NULL) {
+        udp_slot_write(slot, UDP_SLOT_USED, ip, port, client_id, owner);
+    }
+    MUTEX_UNLOCK(udp_table_mutex);
+    return slot != NULL;
+}
+
+void udp_table_remove(uint32_t ip, uint16_t port, int client_id) {
+    MUTEX_LOCK(udp_table_mutex);
+    UdpTableSlot *slot = udp_table_find_locked(ip, port, client_id);
+    if (slot != NULL) {
+        udp_slot_write(slot, UDP_SLOT_DELETED, ip, port, client_id, -1);
+    }
+    MUTEX_UNLOCK(udp_table_mutex);
+}
+
+// Start listening for the REQUEST_STREAM of an admitted UDP stream. Caller
+// holds stats_mutex.
+void udp_expect_request(int client_id) {
+    SessionEntry *e = session_entry(client_id);
+    if (strcmp(e->stats.protocol, "UDP") != 0) {
+        return;
+    }
+    __atomic_store_n(&e->udp_request_ready, 0, __ATOMIC_RELAXED);
+    udp_table_insert(e->stats.address.sin_addr.s_addr, 0, client_id, UDP_OWNER_NONE);
+}
+
+// Session a REQUEST_STREAM from `sender` is meant for. Returns its owner,
+// or -2 if no session is waiting for it.
+int udp_route_request(const struct sockaddr_in *sender, int client_id) {
+    return udp_table_lookup(sender->sin_addr.s_addr, 0, client_id);
+}
+
+// ---- Stream worker pool ----
+//
+// Without epoll, streams run as tasks on a fixed pool of worker threads,
+// one per online CPU (--workers), rather than a thread each. A task runs
+// until its pacer or the --capacity-kbps budget says the next chunk is not
+// due yet, then yields with the time it wants to run again. Each worker
+// parks the tasks it owns in a private min-heap on that time. When its
+// deque runs empty it moves the due ones over, earliest at the bottom: the
+// owner pops at the bottom, while an idle worker steals from the top of
+// someone else's deque (Chase-Lev). Ready sessions thus drain from busy
+// workers to idle ones, and a stolen task stays with its thief. New tasks
+// are posted to the workers' inboxes round-robin.
+
+int online_cpus(void) {
 #ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
 #else
-        pthread_mutex_unlock(&stats_mutex);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
 #endif
-#ifdef _WIN32
-        return 0;
-#else
+}
+
+// Owner only. Returns false when the deque is full.
+bool pool_deque_push(PoolDeque *d, PoolTask *task) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= POOL_DEQUE_SIZE) {
+        return false;
+    }
+    __atomic_store_n(&d->items[b & (POOL_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Owner only. The last task is raced for with thieves through `top`.
+PoolTask *pool_deque_pop(PoolDeque *d) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
         return NULL;
-#endif
     }
-    
-    printf("*** Received '%s' from client %d ***\n", buffer, client_id);
-    
-    if (strcmp(buffer, "START_STREAM") != 0) {
-        printf("*** ERROR: Client %d sent incorrect confirmation: '%s' ***\n", client_id, buffer);
-        CLOSE_SOCKET(client_socket);
-#ifdef _WIN32
-        MUTEX_LOCK(stats_mutex);
-#else
-        pthread_mutex_lock(&stats_mutex);
-#endif
-        client_stats[client_id].state = STATE_FINISHED;
-        client_stats[client_id].active = 0;
-#ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
-#else
-        pthread_mutex_unlock(&stats_mutex);
-#endif
-#ifdef _WIN32
-        return 0;
-#else
+    PoolTask *task = __atomic_load_n(&d->items[b & (POOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;  // A thief got it
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Any thread. NULL if the deque is empty or another thief won.
+PoolTask *pool_deque_steal(PoolDeque *d) {
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) {
         return NULL;
-#endif
     }
-    
-    printf("*** Client %d confirmed TCP stream start ***\n", client_id);
-    
-    // Tracking variables for latency calculation
-    double total_latency = 0.0;
-    int measured_chunks = 0;
-    
-    // Stream video data
-    char video_chunk[TCP_CHUNK_SIZE];
-    for (int i = 1; i <= VIDEO_CHUNKS; i++) {
+    PoolTask *task = __atomic_load_n(&d->items[t & (POOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return task;
+}
+
+bool pool_deque_empty(PoolDeque *d) {
+    return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+}
+
+// ---- Parked tasks: binary min-heap on wake, owner only ----
+
+void pool_heap_push(PoolWorker *w, PoolTask *task) {
+    if (w->heap_count == w->heap_capacity) {
+        int capacity = w->heap_capacity > 0 ? w->heap_capacity * 2 : 64;
+        PoolTask **heap = realloc(w->heap, capacity * sizeof(PoolTask *));
+        if (heap == NULL) {
+            perror("Worker heap allocation failed");
+            exit(1);
+        }
+        w->heap = heap;
+        w->heap_capacity = capacity;
+    }
+    int i = w->heap_count++;
+    while (i > 0 && w->heap[(i - 1) / 2]->wake > task->wake) {
+        w->heap[i] = w->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    w->heap[i] = task;
+}
+
+PoolTask *pool_heap_pop(PoolWorker *w) {
+    PoolTask *top = w->heap[0];
+    PoolTask *last = w->heap[--w->heap_count];
+    int i = 0;
+    while (2 * i + 1 < w->heap_count) {
+        int child = 2 * i + 1;
+        if (child + 1 < w->heap_count && w->heap[child + 1]->wake < w->heap[child]->wake) {
+            child++;
+        }
+        if (w->heap[child]->wake >= last->wake) {
+            break;
+        }
+        w->heap[i] = w->heap[child];
+        i = child;
+    }
+    if (w->heap_count > 0) {
+        w->heap[i] = last;
+    }
+    return top;
+}
+
+// ---- Sleeping and waking workers ----
+
+void pool_worker_wake(PoolWorker *w) {
 #ifdef _WIN32
-        MUTEX_LOCK(stats_mutex);
+    SetEvent(w->wake_event);
 #else
-        pthread_mutex_lock(&stats_mutex);
+    uint64_t one = 1;
+    if (write(w->wake_fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Worker wakeup failed");
+    }
 #endif
-        int active = client_stats[client_id].active;
+}
+
+void pool_worker_wait(PoolWorker *w, int timeout_ms) {
 #ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
+    WaitForSingleObject(w->wake_event, (DWORD)timeout_ms);
 #else
-        pthread_mutex_unlock(&stats_mutex);
+    struct pollfd pfd;
+    pfd.fd = w->wake_fd[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        uint64_t count[8];
+        if (read(w->wake_fd[0], count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("Worker wait failed");
+        }
+    }
 #endif
-        
-        if (!active) {
-            break;
+}
+
+// Whether anything is waiting that worker `w` could run now
+bool pool_has_work(PoolWorker *w) {
+    if (__atomic_load_n(&w->inbox, __ATOMIC_ACQUIRE) != NULL) {
+        return true;
+    }
+    for (int i = 0; i < pool_worker_count; i++) {
+        if (!pool_deque_empty(&pool_workers[i].deque)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Get a sleeping worker to come and steal. Pairs with the fence before a
+// worker's last look in pool_worker_thread().
+void pool_wake_idle(PoolWorker *self) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < pool_worker_count; i++) {
+        PoolWorker *w = &pool_workers[i];
+        if (w != self && __atomic_load_n(&w->sleeping, __ATOMIC_RELAXED)) {
+            pool_worker_wake(w);
+            return;
         }
+    }
+}
+
+// Hand a new task to the pool; it runs as soon as a worker gets to it
+void pool_submit(PoolTask *task) {
+    PoolWorker *w = &pool_workers[__atomic_fetch_add(&pool_next_worker, 1, __ATOMIC_RELAXED) %
+                                  (unsigned)pool_worker_count];
+    MUTEX_LOCK(w->inbox_mutex);
+    task->next = w->inbox;
+    __atomic_store_n(&w->inbox, task, __ATOMIC_RELEASE);
+    MUTEX_UNLOCK(w->inbox_mutex);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->sleeping, __ATOMIC_RELAXED)) {
+        pool_worker_wake(w);
+    }
+}
+
+THREAD_RETURN_TYPE pool_worker_thread(THREAD_PARAM arg) {
+    PoolWorker *w = (PoolWorker *)arg;
+    int victim = w->id;
+    PoolTask *batch[POOL_DEQUE_SIZE];
+    
+    while (1) {
+        double now = get_time();
         
-        // Generate a chunk of video data
-        generate_video_chunk(video_chunk, i, resolution);
+        // Posted tasks are due at once
+        if (__atomic_load_n(&w->inbox, __ATOMIC_ACQUIRE) != NULL) {
+            MUTEX_LOCK(w->inbox_mutex);
+            PoolTask *posted = w->inbox;
+            __atomic_store_n(&w->inbox, NULL, __ATOMIC_RELAXED);
+            MUTEX_UNLOCK(w->inbox_mutex);
+            while (posted != NULL) {
+                PoolTask *task = posted;
+                posted = task->next;
+                task->wake = now;
+                pool_heap_push(w, task);
+            }
+        }
         
-        // Measure latency
-        double send_time = get_time();
+        PoolTask *task = pool_deque_pop(&w->deque);
+        if (task == NULL && w->heap_count > 0 && w->heap[0]->wake <= now) {
+            // Expose the due tasks, earliest at the bottom where we pop
+            int count = 0;
+            while (count < POOL_DEQUE_SIZE && w->heap_count > 0 && w->heap[0]->wake <= now) {
+                batch[count++] = pool_heap_pop(w);
+            }
+            while (count > 1) {
+                pool_deque_push(&w->deque, batch[--count]);
+            }
+            task = batch[0];
+            if (!pool_deque_empty(&w->deque)) {
+                pool_wake_idle(w);
+            }
+        }
+        if (task == NULL) {
+            for (int i = 1; i < pool_worker_count && task == NULL; i++) {
+                victim = (victim + 1) % pool_worker_count;
+                if (victim != w->id) {
+                    task = pool_deque_steal(&pool_workers[victim].deque);
+                }
+            }
+            if (task != NULL) {
+                __atomic_add_fetch(&w->steals, 1, __ATOMIC_RELAXED);
+            }
+        }
         
-        // Send the chunk with improved error handling for non-blocking socket
-        int total_sent = 0;
-        int remaining = TCP_CHUNK_SIZE;
-        int retry_count = 0;
-        int max_send_retries = 10;
+        if (task != NULL) {
+            __atomic_add_fetch(&w->runs, 1, __ATOMIC_RELAXED);
+            if (task->run(task, get_time()) == POOL_YIELD) {
+                pool_heap_push(w, task);
+            }
+            continue;
+        }
         
-        while (total_sent < TCP_CHUNK_SIZE && retry_count < max_send_retries) {
-            fd_set write_fds;
-            FD_ZERO(&write_fds);
-            FD_SET(client_socket, &write_fds);
-            
-            // Set timeout for select
-            struct timeval write_tv;
-            write_tv.tv_sec = 1;  // 1 second timeout
-            write_tv.tv_usec = 0;
-            
-#ifdef _WIN32
-            int select_result = select(0, NULL, &write_fds, NULL, &write_tv);
-#else
-            int select_result = select(client_socket + 1, NULL, &write_fds, NULL, &write_tv);
-#endif
-            
-            if (select_result <= 0) {
-                // Timeout or error occurred
-                retry_count++;
-                continue;
+        // Nothing to run: sleep until the next parked task is due, a task is
+        // posted or a busy worker has work to spare
+        int timeout_ms = POOL_IDLE_MS;
+        if (w->heap_count > 0) {
+            timeout_ms = (int)((w->heap[0]->wake - now) * 1000.0) + 1;
+            if (timeout_ms > POOL_IDLE_MS) {
+                timeout_ms = POOL_IDLE_MS;
             }
-            
-            // Socket is ready for writing
-            int bytes_sent = send(client_socket, video_chunk + total_sent, remaining, 0);
-            
-            if (bytes_sent < 0) {
-#ifdef _WIN32
-                if (WSAGetLastError() == WSAEWOULDBLOCK) {
-#else
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-#endif
-                    // Would block, try again
-                    retry_count++;
-                    usleep(50000); // 50ms delay before retry
-                } else {
-                    // Other error
-                    log_message("Failed to send TCP chunk to client %d", client_id);
-                    print_socket_error("Send error");
-                    CLOSE_SOCKET(client_socket);
+        }
+        __atomic_store_n(&w->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!pool_has_work(w)) {
+            pool_worker_wait(w, timeout_ms);
+        }
+        __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+    }
+    
 #ifdef _WIN32
-                    MUTEX_LOCK(stats_mutex);
+    return 0;
 #else
-                    pthread_mutex_lock(&stats_mutex);
+    return NULL;
 #endif
-                    client_stats[client_id].state = STATE_FINISHED;
-                    client_stats[client_id].active = 0;
+}
+
+// Start `workers` worker threads (0 = one per online CPU)
+bool pool_start(int workers) {
+    if (workers <= 0) {
+        workers = online_cpus();
+    }
+    if (workers > POOL_MAX_WORKERS) {
+        workers = POOL_MAX_WORKERS;
+    }
+    for (int i = 0; i < workers; i++) {
+        PoolWorker *w = &pool_workers[i];
+        w->id = i;
+        MUTEX_INIT(w->inbox_mutex);
 #ifdef _WIN32
-                    MUTEX_UNLOCK(stats_mutex);
+        w->wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#elif defined(__linux__)
+        w->wake_fd[0] = w->wake_fd[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
 #else
-                    pthread_mutex_unlock(&stats_mutex);
+        if (pipe(w->wake_fd) == 0) {
+            fcntl(w->wake_fd[0], F_SETFL, O_NONBLOCK);
+            fcntl(w->wake_fd[1], F_SETFL, O_NONBLOCK);
+        }
 #endif
+    }
+    pool_worker_count = workers;
+    for (int i = 0; i < workers; i++) {
+        if (!THREAD_CREATE(pool_workers[i].thread, pool_worker_thread, &pool_workers[i])) {
+            perror("Failed to create worker thread");
+            return false;
+        }
+        THREAD_DETACH(pool_workers[i].thread);
+    }
+    return true;
+}
+
+// ---- Stream model benchmark (--bench-workers) ----
+//
+// Simulated streams send BENCH_STREAM_CHUNKS chunks, one every
+// BENCH_CHUNK_MS, starting at random points of the first interval. Each
+// chunk costs a pass over UDP_CHUNK_SIZE bytes. Compares a thread per
+// stream with tasks on the worker pool: what it costs to start the
+// streams and how late chunks go out.
+
+#define BENCH_STREAM_CHUNKS 20
+#define BENCH_CHUNK_MS 100
+
+typedef struct {
+    PoolTask task;              // Must stay the first member
+    int chunk;                  // Chunks sent so far
+    double due;                 // When the next one should go out
+    double *lateness;           // This stream's BENCH_STREAM_CHUNKS samples, seconds
+    unsigned checksum;
+} BenchStream;
+
+unsigned char bench_chunk[UDP_CHUNK_SIZE];
+int bench_streams_left = 0;     // Pool streams still running (atomic)
+
+// Stand-in for putting a chunk on the wire
+void bench_send_chunk(BenchStream *b, double now) {
+    unsigned sum = 0;
+    for (int i = 0; i < UDP_CHUNK_SIZE; i++) {
+        sum = sum * 31 + bench_chunk[i];
+    }
+    b->checksum += sum;
+    b->lateness[b->chunk++] = now - b->due;
+    b->due += BENCH_CHUNK_MS / 1000.0;
+}
+
+THREAD_RETURN_TYPE bench_stream_thread(THREAD_PARAM arg) {
+    BenchStream *b = (BenchStream *)arg;
+    while (b->chunk < BENCH_STREAM_CHUNKS) {
+        double now = get_time();
+        if (b->due > now) {
+            usleep((int)((b->due - now) * 1000000.0) + 1);
+            now = get_time();
+        }
+        bench_send_chunk(b, now);
+    }
 #ifdef _WIN32
-                    return 0;
+    return 0;
 #else
-                    return NULL;
+    return NULL;
 #endif
+}
+
+int bench_stream_run(PoolTask *task, double now) {
+    BenchStream *b = (BenchStream *)task;
+    for (int sent = 0; b->due <= now && sent < POOL_RUN_CHUNKS; sent++) {
+        bench_send_chunk(b, now);
+        if (b->chunk == BENCH_STREAM_CHUNKS) {
+            __atomic_sub_fetch(&bench_streams_left, 1, __ATOMIC_RELEASE);
+            return POOL_DONE;  // The benchmark owns the memory
+        }
+        now = get_time();
+    }
+    task->wake = b->due;
+    return POOL_YIELD;
+}
+
+int bench_compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+void bench_report(const char *model, int clients, int started, double start_seconds,
+                  double *lateness, int samples) {
+    // No stream got a thread, so there is no lateness to rank
+    if (samples == 0) {
+        printf("%7d  %-18s %9.1f %7d  no samples\n",
+               clients, model, start_seconds * 1000000.0 / clients, clients - started);
+        return;
+    }
+    qsort(lateness, samples, sizeof(double), bench_compare_double);
+    printf("%7d  %-18s %9.1f %7d  %9.3f %9.3f %9.3f %9.3f\n",
+           clients, model, start_seconds * 1000000.0 / clients, clients - started,
+           lateness[samples / 2] * 1000.0, lateness[(int)(samples * 0.99)] * 1000.0,
+           lateness[(int)(samples * 0.999)] * 1000.0, lateness[samples - 1] * 1000.0);
+}
+
+void bench_streams(int clients) {
+    BenchStream *streams = calloc(clients, sizeof(BenchStream));
+    double *lateness = calloc((size_t)clients * BENCH_STREAM_CHUNKS, sizeof(double));
+    thread_t *threads = calloc(clients, sizeof(thread_t));
+    if (streams == NULL || lateness == NULL || threads == NULL) {
+        perror("Benchmark allocation failed");
+        exit(1);
+    }
+    
+    // A thread per stream
+    double base = get_time() + 0.05;
+    for (int i = 0; i < clients; i++) {
+        streams[i].due = base + (rand() % BENCH_CHUNK_MS) / 1000.0;
+        streams[i].lateness = lateness + (size_t)i * BENCH_STREAM_CHUNKS;
+    }
+    int started = 0;
+    double start = get_time();
+    for (int i = 0; i < clients; i++) {
+        if (!THREAD_CREATE(threads[i], bench_stream_thread, &streams[i])) {
+            break;
+        }
+        started++;
+    }
+    double start_seconds = get_time() - start;
+    for (int i = 0; i < started; i++) {
+        THREAD_JOIN(threads[i]);
+    }
+    bench_report("thread-per-stream", clients, started, start_seconds,
+                 lateness, started * BENCH_STREAM_CHUNKS);
+    
+    // Tasks on the pool
+    memset(streams, 0, clients * sizeof(BenchStream));
+    base = get_time() + 0.05;
+    for (int i = 0; i < clients; i++) {
+        streams[i].task.run = bench_stream_run;
+        streams[i].due = base + (rand() % BENCH_CHUNK_MS) / 1000.0;
+        streams[i].lateness = lateness + (size_t)i * BENCH_STREAM_CHUNKS;
+    }
+    __atomic_store_n(&bench_streams_left, clients, __ATOMIC_RELAXED);
+    start = get_time();
+    for (int i = 0; i < clients; i++) {
+        pool_submit(&streams[i].task);
+    }
+    start_seconds = get_time() - start;
+    while (__atomic_load_n(&bench_streams_left, __ATOMIC_ACQUIRE) > 0) {
+        usleep(10000);
+    }
+    bench_report("worker pool", clients, clients, start_seconds,
+                 lateness, clients * BENCH_STREAM_CHUNKS);
+    
+    free(threads);
+    free(lateness);
+    free(streams);
+}
+
+// Compare thread-per-stream with the worker pool for each client count
+// given (default 1000 and 10000)
+int run_worker_benchmark(int argc, char *argv[]) {
+    for (int i = 0; i < UDP_CHUNK_SIZE; i++) {
+        bench_chunk[i] = (unsigned char)rand();
+    }
+    if (!pool_start(0)) {
+        return 1;
+    }
+    printf("Stream model benchmark: %d chunks every %d ms per stream, %d pool workers\n",
+           BENCH_STREAM_CHUNKS, BENCH_CHUNK_MS, pool_worker_count);
+    printf("%7s  %-18s %9s %7s  %9s %9s %9s %9s\n", "clients", "model", "start us", "failed",
+           "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+    if (argc == 0) {
+        bench_streams(1000);
+        bench_streams(10000);
+    }
+    for (int i = 0; i < argc; i++) {
+        int clients = atoi(argv[i]);
+        if (clients > 0) {
+            bench_streams(clients);
+        }
+    }
+    return 0;
+}
+
+// ---- FEC benchmark (--bench-fec) ----
+//
+// Times every parity kernel this CPU runs, then streams BENCH_FEC_CHUNKS
+// chunks per group shape through the encoder under the simulated
+// UDP_PACKET_LOSS_RATE, rebuilds what a client could from the parity that
+// got through and checks each rebuilt payload against the original.
+
+#define BENCH_FEC_CHUNKS 20000
+#define BENCH_FEC_SECONDS 0.3
+
+void bench_fec_kernels(void) {
+    FecKernel kernels[3];
+    int n = fec_kernels(kernels);
+    uint8_t *dst = malloc(UDP_CHUNK_SIZE), *src = malloc(UDP_CHUNK_SIZE), *want = malloc(UDP_CHUNK_SIZE);
+    if (dst == NULL || src == NULL || want == NULL) {
+        perror("Memory allocation failed");
+        free(dst);
+        free(src);
+        free(want);
+        return;
+    }
+    // A stream XORs each payload byte into one parity datagram
+    double stream_rate = estimate_bandwidth("1080p") * 1000.0 / 8.0;
+    printf("%-8s %8s %12s  %s\n", "kernel", "GB/s", "1080p core", "check");
+    for (int k = 0; k < n; k++) {
+        // Unaligned, with a tail none of the vector loops covers
+        for (int i = 0; i < UDP_CHUNK_SIZE; i++) {
+            dst[i] = (uint8_t)rand();
+            src[i] = (uint8_t)rand();
+        }
+        for (int i = 0; i < UDP_CHUNK_SIZE; i++) {
+            want[i] = (uint8_t)(dst[i] ^ (i >= 1 && i < UDP_CHUNK_SIZE - 6 ? src[i + 2] : 0));
+        }
+        kernels[k].run(dst + 1, src + 3, UDP_CHUNK_SIZE - 7);
+        bool ok = memcmp(dst, want, UDP_CHUNK_SIZE) == 0;
+        
+        double start = get_time(), elapsed;
+        long rounds = 0;
+        do {
+            for (int i = 0; i < 1000; i++) {
+                kernels[k].run(dst, src, UDP_CHUNK_SIZE);
+            }
+            rounds += 1000;
+            elapsed = get_time() - start;
+        } while (elapsed < BENCH_FEC_SECONDS);
+        double rate = (double)rounds * UDP_CHUNK_SIZE / elapsed;
+        printf("%-8s %8.2f %11.4f%%  %s\n", kernels[k].name, rate / 1e9, stream_rate * 100.0 / rate,
+               ok ? "ok" : "MISMATCH");
+    }
+    free(dst);
+    free(src);
+    free(want);
+}
+
+// Send BENCH_FEC_CHUNKS through groups of `k` chunks with `r` parity and
+// print what got lost, what parity rebuilt and what it cost
+void bench_fec_shape(const char *label, int k, int r) {
+    FecEncoder f;
+    memset(&f, 0, sizeof(f));
+    f.group_size = k;
+    f.parity_count = r;
+    f.first = 1;
+    Pacer pacer;
+    ShareState share;
+    memset(&share, 0, sizeof(share));
+    pacer_init(&pacer, "1080p", UDP_CHUNK_SIZE, 0);
+    
+    int size = chunk_class_sizes[CHUNK_CLASS_UDP];
+    VideoChunk *group[FEC_MAX_GROUP];
+    for (int j = 0; j < k; j++) {
+        group[j] = malloc(sizeof(VideoChunk) + size);
+        if (group[j] == NULL) {
+            perror("Memory allocation failed");
+            while (j-- > 0) {
+                free(group[j]);
+            }
+            return;
+        }
+        group[j]->size = size;
+    }
+    uint8_t rebuilt[UDP_CHUNK_SIZE];
+    long chunks = 0, dropped = 0, repaired = 0, parity_sent = 0, mismatches = 0;
+    double coding = 0;
+    for (int id = 1; id <= BENCH_FEC_CHUNKS; id += k) {
+        uint32_t lost = 0;
+        for (int j = 0; j < k; j++) {
+            group[j]->chunk_id = id + j;
+            fill_video_chunk(group[j]->data, id + j, "1080p", size);
+            UdpFate fate;
+            udp_impair(-1, size, 0, &fate);
+            if (fate.dropped != 0) {
+                lost |= 1u << j;
+            }
+        }
+        double start = get_time();
+        for (int j = 0; j < k; j++) {
+            fec_add(&f, group[j], (lost >> j) & 1);
+        }
+        VideoChunk *parity[FEC_MAX_PARITY];
+        uint8_t headers[FEC_MAX_PARITY][FRAME_HEADER_SIZE];
+        UdpFate parity_fates[FEC_MAX_PARITY];
+        int count = fec_finish(&f, &pacer, &share, -1, 0, parity, headers, parity_fates);
+        coding += get_time() - start;
+        parity_sent += r;
+        chunks += k;
+        dropped += __builtin_popcount(lost);
+        
+        // The client's side: a parity rebuilds the one chunk its mask misses
+        for (int p = 0; p < count; p++) {
+            const uint8_t *body = (const uint8_t *)parity[p]->data;
+            uint32_t missing = wire_get32(body + 4) & lost;
+            if (parity_fates[p].dropped == 0 && __builtin_popcount(missing) == 1) {
+                int gone = __builtin_ctz(missing);
+                memcpy(rebuilt, body + FEC_HEADER_SIZE, size);
+                for (int j = 0; j < k; j++) {
+                    if (j != gone && ((wire_get32(body + 4) >> j) & 1)) {
+                        fec_xor(rebuilt, (const uint8_t *)group[j]->data, size);
+                    }
                 }
-            } else {
-                total_sent += bytes_sent;
-                remaining -= bytes_sent;
-                retry_count = 0; // Reset retry counter on successful send
+                if (memcmp(rebuilt, group[gone]->data, size) != 0) {
+                    mismatches++;
+                }
+                repaired++;
+                lost &= ~missing;
+            }
+            chunk_release(parity[p]);
+        }
+    }
+    printf("%-8s %3d %3d %9.1f%% %9.2f%% %9.2f%% %10.2f%% %9.1f %s\n", label, k, r,
+           parity_sent * 100.0 / chunks, dropped * 100.0 / chunks, (dropped - repaired) * 100.0 / chunks,
+           dropped > 0 ? repaired * 100.0 / dropped : 0.0, coding * 1e6 / chunks * k,
+           mismatches == 0 ? "ok" : "MISMATCH");
+    for (int j = 0; j < k; j++) {
+        free(group[j]);
+    }
+}
+
+int run_fec_benchmark(int argc, char *argv[]) {
+    fec_init();
+    impair_init();
+    if (argc > 1) {
+        server_config.mtu = atoi(argv[1]);
+    }
+    printf("FEC benchmark: %d-byte chunks in %d datagrams, %d%% simulated loss of each chunk, %s kernel in use\n",
+           chunk_class_sizes[CHUNK_CLASS_UDP], udp_fragment_count(chunk_class_sizes[CHUNK_CLASS_UDP]),
+           UDP_PACKET_LOSS_RATE, fec_kernel_name);
+    bench_fec_kernels();
+    
+    static const int shapes[][2] = { { 4, 1 }, { 8, 1 }, { 8, 2 }, { 16, 1 }, { 16, 2 }, { 16, 4 } };
+    printf("\n%-8s %3s %3s %10s %10s %10s %11s %9s %s\n", "shape", "K", "R", "overhead", "loss",
+           "residual", "recovered", "us/group", "check");
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        bench_fec_shape("fixed", shapes[i][0], shapes[i][1]);
+    }
+    // What each resolution gets from --fec PERCENT (default 25)
+    server_config.fec_percent = argc > 0 ? atoi(argv[0]) : 25;
+    if (server_config.fec_percent <= 0) {
+        return 0;
+    }
+    for (int res = 0; res < RESOLUTION_COUNT; res++) {
+        FecEncoder f;
+        fec_start(&f, resolution_names[res]);
+        bench_fec_shape(resolution_names[res], f.group_size, f.parity_count);
+    }
+    return 0;
+}
+
+#ifndef USE_EPOLL
+// Handle connection phase for a new client
+THREAD_RETURN_TYPE handle_connection_phase(THREAD_PARAM arg) {
+    socket_t client_socket = *((socket_t *)arg);
+    free(arg);
+    
+    // Get client's address information
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    getpeername(client_socket, (struct sockaddr*)&client_addr, &addr_len);
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    
+    // Register the client
+    int client_id = register_client(&client_addr);
+    
+    if (client_id == -1) {
+        // All client slots are occupied
+        printf("Maximum client limit reached, rejecting new connection from %s\n", client_ip);
+        CLOSE_SOCKET(client_socket);
+#ifdef _WIN32
+        return 0;
+#else
+        return NULL;
+#endif
+    }
+    
+    printf("Client %d connected: %s\n", client_id, client_ip);
+    
+    // Handle Type 1 Request
+    Message request, response;
+    memset(&request, 0, sizeof(request));
+    memset(&response, 0, sizeof(response));
+    
+    // Receive Type 1 Request with timeout
+#ifdef _WIN32
+    DWORD tv_ms = 5000;  // 5 seconds timeout
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv_ms, sizeof(tv_ms));
+#else
+    struct timeval tv;
+    tv.tv_sec = 5;  // 5 seconds timeout
+    tv.tv_usec = 0;
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+#endif
+    
+    uint8_t frame[WIRE_MESSAGE_FRAME];
+    int bytes_received = recv(client_socket, (char*)frame, sizeof(frame), MSG_WAITALL);
+    if (bytes_received != (int)sizeof(frame)) {
+        printf("Failed to receive Type 1 Request from client %d\n", client_id);
+        print_socket_error("Receive error");
+        CLOSE_SOCKET(client_socket);
+        release_client(client_id, STATE_IDLE);
+#ifdef _WIN32
+        return 0;
+#else
+        return NULL;
+#endif
+    }
+    
+    if (!wire_decode_message(frame, TYPE_1_REQUEST, &request)) {
+        printf("Received invalid request type from client %d\n", client_id);
+        CLOSE_SOCKET(client_socket);
+        release_client(client_id, STATE_IDLE);
+#ifdef _WIN32
+        return 0;
+#else
+        return NULL;
+#endif
+    }
+    
+    printf("Received Type 1 Request from client %d - Requested resolution: %s\n", 
+           client_id, request.resolution);
+    
+    // Prepare Type 2 Response
+    prepare_response(client_id, &request, &response);
+    
+    // A queued client hears its place in the queue, then waits here
+    if (response.status == ADMIT_QUEUED) {
+        wire_encode_message(&response, frame);
+        if (send(client_socket, (char*)frame, sizeof(frame), 0) <= 0) {
+            printf("Failed to send Type 2 Response to client %d\n", client_id);
+            CLOSE_SOCKET(client_socket);
+            release_client(client_id, STATE_IDLE);
+#ifdef _WIN32
+            return 0;
+#else
+            return NULL;
+#endif
+        }
+        printf("Client %d queued for admission at position %d\n", client_id, response.queue_position);
+        double give_up = get_time() + ADMIT_QUEUE_TIMEOUT_MS / 1000.0;
+        while (!admit_poll(client_id, &response)) {
+            if (get_time() > give_up) {
+                admit_withdraw(client_id, &response);
+                break;
+            }
+            usleep(ADMIT_RETRY_MS * 1000);
+        }
+    }
+    
+    // Send Type 2 Response
+    wire_encode_message(&response, frame);
+    int bytes_sent = send(client_socket, (char*)frame, sizeof(frame), 0);
+    if (bytes_sent <= 0 || response.status == ADMIT_REJECTED) {
+        if (bytes_sent <= 0) {
+            printf("Failed to send Type 2 Response to client %d\n", client_id);
+        } else {
+            printf("Rejected client %d: no capacity for %s\n", client_id, response.resolution);
+        }
+        CLOSE_SOCKET(client_socket);
+        release_client(client_id, STATE_IDLE);
+#ifdef _WIN32
+        return 0;
+#else
+        return NULL;
+#endif
+    }
+    
+    printf("Sent Type 2 Response to client %d - Resolution: %s, Protocol: %s, Bandwidth: %d Kbps\n",
+           client_id, response.resolution, response.protocol, response.bandwidth);
+    
+    // Close the connection phase socket
+    CLOSE_SOCKET(client_socket);
+    
+    // Add the client to the queue for scheduling
+    enqueue_client(client_id);
+    
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// ---- Stream tasks (worker pool) ----
+
+#define TASK_POLL_MS 10         // Re-check interval while waiting on a client
+#define TASK_SEND_RETRY_MS 5    // Back-off while a TCP socket buffer is full
+#define TASK_READY_RETRIES 5    // READY_TO_STREAM attempts, 100 ms apart
+
+// Steps of a stream task
+#define TASK_SEND_READY 1       // TCP: writing READY_TO_STREAM
+#define TASK_WAIT_START 2       // TCP: waiting for START_STREAM
+#define TASK_WAIT_REQUEST 3     // UDP: waiting for the dispatcher to see REQUEST_STREAM
+#define TASK_STREAM 4           // Sending chunks as the pacer allows
+#define TASK_DRAIN 5            // All chunks sent: TCP reads the last acks, UDP answers NACKs
+
+typedef struct {
+    PoolTask task;              // Must stay the first member
+    int client_id;
+    int protocol;               // MODE_TCP or MODE_UDP
+    int step;                   // TASK_*
+    char resolution[10];
+    socket_t fd;                // TCP stream socket
+    struct sockaddr_in peer;    // UDP destination once REQUEST_STREAM arrived
+    uint32_t client_ip;         // UDP session table key
+    Pacer pacer;
+    ShareState share;
+    int chunk_id;               // Next chunk (1..VIDEO_CHUNKS)
+    int acked;                  // TCP: last chunk the client acked
+    VideoChunk *chunk;          // Held across yields until sent
+    NackHistory nack;           // --nack: recent UDP chunks
+    FecEncoder fec;             // --fec: parity of the open chunk group
+    DelayLine delayed;          // UDP datagrams the impaired path holds back
+    uint8_t frame[FRAME_HEADER_SIZE]; // Header of the frame going out
+    uint8_t rx[WIRE_ACK_FRAME];       // START frame or chunk ack received so far
+    int rx_len;
+    bool encoded;               // ENCODE_COST_CLIENT: encoding time already paid
+    int sent;                   // Bytes of the current TCP chunk frame written
+    double hold_until;          // TCP: when the stamped chunk may be written, 0 before it is stamped
+    double last_progress;       // Last TCP send progress, for --send-stall-ms
+    double give_up;             // End of the current handshake wait
+    int retries;
+} StreamTask;
+
+int stream_task_tcp(PoolTask *task, double now);
+int stream_task_udp(PoolTask *task, double now);
+
+bool socket_would_block(void) {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// Run again at `wake`, or earlier when a held datagram is due
+int stream_task_yield(StreamTask *t, double wake) {
+    if (t->delayed.count > 0 && delay_line_next(&t->delayed) < wake) {
+        wake = delay_line_next(&t->delayed);
+    }
+    t->task.wake = wake;
+    return POOL_YIELD;
+}
+
+// Release everything the stream holds and the session itself
+int stream_task_end(StreamTask *t, int state) {
+    chunk_release(t->chunk);
+    nack_history_clear(&t->nack);
+    fec_end(&t->fec);
+    delay_line_clear(&t->delayed);
+    share_end(&t->share);
+    if (t->protocol == MODE_TCP) {
+        CLOSE_SOCKET(t->fd);
+#ifdef _WIN32
+        MUTEX_LOCK(stats_mutex);
+#else
+        pthread_mutex_lock(&stats_mutex);
+#endif
+        if (client_active(t->client_id) && CLIENT_STATS(t->client_id).socket_fd == t->fd) {
+            CLIENT_STATS(t->client_id).socket_fd = INVALID_SOCKET_VALUE;
+        }
+#ifdef _WIN32
+        MUTEX_UNLOCK(stats_mutex);
+#else
+        pthread_mutex_unlock(&stats_mutex);
+#endif
+    } else {
+        udp_table_remove(t->client_ip, t->step == TASK_WAIT_REQUEST ? 0 : t->peer.sin_port, t->client_id);
+    }
+    release_client(t->client_id, state);
+    free(t);
+    return POOL_DONE;
+}
+
+// Start streaming an admitted client on the worker pool. TCP clients have
+// their stream socket in CLIENT_STATS already.
+void stream_task_start(int client_id, int protocol) {
+    StreamTask *t = calloc(1, sizeof(StreamTask));
+    if (t == NULL) {
+        perror("Memory allocation failed");
+        release_client(client_id, STATE_FINISHED);
+        return;
+    }
+    t->task.run = protocol == MODE_TCP ? stream_task_tcp : stream_task_udp;
+    t->client_id = client_id;
+    t->protocol = protocol;
+    t->chunk_id = 1;
+    
+#ifdef _WIN32
+    MUTEX_LOCK(stats_mutex);
+#else
+    pthread_mutex_lock(&stats_mutex);
+#endif
+    stats_stream_started(client_id);
+    strncpy(t->resolution, CLIENT_STATS(client_id).resolution, sizeof(t->resolution));
+    t->resolution[sizeof(t->resolution) - 1] = '\0';
+    t->fd = CLIENT_STATS(client_id).socket_fd;
+    t->client_ip = CLIENT_STATS(client_id).address.sin_addr.s_addr;
+#ifdef _WIN32
+    MUTEX_UNLOCK(stats_mutex);
+#else
+    pthread_mutex_unlock(&stats_mutex);
+#endif
+    
+    if (protocol == MODE_TCP && t->fd == INVALID_SOCKET_VALUE) {
+        printf("*** CRITICAL ERROR: Invalid socket file descriptor for client %d ***\n", client_id);
+        release_client(client_id, STATE_FINISHED);
+        free(t);
+        return;
+    }
+    if (protocol == MODE_TCP) {
+#ifdef _WIN32
+        printf("*** Starting TCP streaming for client %d (socket_fd: %" PRIu64 ") ***\n", 
+               client_id, (uint64_t)t->fd);
+#else
+        printf("*** Starting TCP streaming for client %d (socket_fd: %d) ***\n", 
+               client_id, t->fd);
+#endif
+        // Never block a worker on the socket
+        if (fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+            printf("*** WARNING: Failed to set socket non-blocking for client %d ***\n", client_id);
+            print_socket_error("fcntl failed");
+        }
+        t->step = TASK_SEND_READY;
+    } else {
+        log_message("Starting UDP streaming for client %d", client_id);
+        
+        // The dispatcher thread reads the shared socket and signals us
+        // through udp_request_ready once our REQUEST_STREAM arrives. It has
+        // listened since admission, so the request may be in already.
+        __atomic_store_n(&session_entry(client_id)->nack_pending, 0, __ATOMIC_RELAXED);
+        udp_table_insert(t->client_ip, 0, client_id, UDP_OWNER_NONE);
+        log_message("Waiting for UDP REQUEST_STREAM message from client %d...", client_id);
+        t->step = TASK_WAIT_REQUEST;
+        t->give_up = get_time() + UDP_REQUEST_TIMEOUT_MS / 1000.0;
+    }
+    pool_submit(&t->task);
+}
+
+// Read the client's chunk acks without blocking. Returns -1 once the
+// client has closed the stream socket, or on errors.
+int stream_task_read_acks(StreamTask *t) {
+    while (1) {
+        int bytes_received = recv(t->fd, (char *)t->rx + t->rx_len, WIRE_ACK_FRAME - t->rx_len, 0);
+        if (bytes_received < 0 && socket_would_block()) {
+            return 0;
+        }
+        if (bytes_received <= 0) {
+            return -1;
+        }
+        t->rx_len += bytes_received;
+        if (t->rx_len < WIRE_ACK_FRAME) {
+            continue;
+        }
+        ChunkAck ack;
+        if (wire_decode_ack(t->rx, t->rx_len, &ack) && ack.client_id == t->client_id) {
+            latency_record_ack(t->client_id, &ack);
+            t->acked = ack.chunk_id;
+        }
+        t->rx_len = 0;
+    }
+}
+
+// TCP stream: READY_TO_STREAM, START_STREAM, the chunks, then the last acks
+int stream_task_tcp(PoolTask *task, double now) {
+    StreamTask *t = (StreamTask *)task;
+    int client_id = t->client_id;
+    
+    switch (t->step) {
+    case TASK_SEND_READY: {
+        wire_put_header(t->frame, FRAME_READY, 0, 0, 0);
+        int send_result = send(t->fd, (char *)t->frame, FRAME_HEADER_SIZE, 0);
+        if (send_result < 0 && socket_would_block() && ++t->retries < TASK_READY_RETRIES) {
+            printf("*** TCP send would block for client %d, retry %d/%d ***\n", 
+                   client_id, t->retries, TASK_READY_RETRIES);
+            return stream_task_yield(t, now + 0.1);
+        }
+        if (send_result < 0) {
+            printf("*** ERROR: Failed to send READY_TO_STREAM message to client %d ***\n", client_id);
+            print_socket_error("Send error");
+            return stream_task_end(t, STATE_FINISHED);
+        }
+        printf("*** Sent READY_TO_STREAM to TCP client %d ***\n", client_id);
+        printf("*** Waiting for START_STREAM from client %d (timeout: 5 seconds) ***\n", client_id);
+        t->step = TASK_WAIT_START;
+        t->give_up = now + 5.0;
+    }
+    // Fall through
+    case TASK_WAIT_START: {
+        int bytes_received = recv(t->fd, (char *)t->rx + t->rx_len, FRAME_HEADER_SIZE - t->rx_len, 0);
+        if (bytes_received > 0) {
+            t->rx_len += bytes_received;
+        }
+        if ((bytes_received > 0 && t->rx_len < FRAME_HEADER_SIZE) ||
+            (bytes_received < 0 && socket_would_block() && now < t->give_up)) {
+            return stream_task_yield(t, now + TASK_POLL_MS / 1000.0);
+        }
+        if (bytes_received <= 0) {
+            printf("*** ERROR: Client %d did not confirm stream start (timeout or error) ***\n", client_id);
+            print_socket_error("Receive error");
+            return stream_task_end(t, STATE_FINISHED);
+        }
+        FrameHeader h;
+        if (!wire_get_header(t->rx, &h) || h.type != FRAME_START || h.length != 0) {
+            printf("*** ERROR: Client %d sent incorrect confirmation (version %d, type %d) ***\n",
+                   client_id, h.version, h.type);
+            return stream_task_end(t, STATE_FINISHED);
+        }
+        printf("*** Client %d confirmed TCP stream start ***\n", client_id);
+        t->rx_len = 0;
+        pacer_init(&t->pacer, t->resolution, TCP_CHUNK_SIZE, now);
+        share_init(&t->share, t->resolution, TCP_CHUNK_SIZE, now);
+        t->step = TASK_STREAM;
+    }
+    // Fall through
+    default:
+        break;
+    }
+    
+    if (stream_task_read_acks(t) < 0) {
+        if (t->step != TASK_DRAIN) {
+            log_warning("TCP client %d closed its stream at chunk %d", client_id, t->chunk_id);
+        }
+        return stream_task_end(t, STATE_FINISHED);
+    }
+    if (t->step == TASK_DRAIN) {
+        if (now > t->give_up) {
+            return stream_task_end(t, STATE_FINISHED);  // The client never closed its end
+        }
+        return stream_task_yield(t, now + TASK_POLL_MS / 1000.0);
+    }
+    
+    int chunks = 0;
+    while (t->chunk_id <= VIDEO_CHUNKS) {
+        if (t->chunk == NULL) {
+            if (!client_active(client_id)) {
+                break;
+            }
+            // Simulate encoding time unless it was moved off the send path
+            if (server_config.encode_cost == ENCODE_COST_CLIENT && !t->encoded) {
+                t->encoded = true;
+                return stream_task_yield(t, now + ENCODE_TIME_MS / 1000.0);
+            }
+            // Shared chunk of video data; back off while the encoder is behind
+            if (!chunk_take(t->resolution, CHUNK_CLASS_TCP, t->chunk_id, &t->chunk)) {
+                return stream_task_yield(t, now + PIPELINE_RETRY_MS / 1000.0);
+            }
+            if (t->chunk == NULL) {
+                break;
+            }
+        }
+        
+        if (t->sent == 0) {
+            if (t->hold_until == 0) {
+                // Hold the chunk until the token bucket and the link budget allow it
+                double due = pacer_due(&t->pacer, TCP_CHUNK_SIZE, now);
+                double share = share_due(&t->share, t->chunk_id, TCP_CHUNK_SIZE, now);
+                if (share > due) {
+                    due = share;
+                }
+                if (due > now || chunks == POOL_RUN_CHUNKS) {
+                    // An ack's RTT runs until it is read, so poll while any are due
+                    double poll = now + TASK_POLL_MS / 1000.0;
+                    if (t->acked < t->chunk_id - 1 && due > poll) {
+                        due = poll;
+                    }
+                    return stream_task_yield(t, due > now ? due : now);
+                }
+                pacer_consume(&t->pacer, TCP_CHUNK_SIZE, now);
+                share_consume(&t->share, TCP_CHUNK_SIZE);
+                wire_put_chunk_header(t->frame, t->chunk, 0);
+                t->hold_until = now + impair_tcp_hold(client_id, TCP_CHUNK_SIZE, now);
+            }
+            // Then the impaired path holds the stamped chunk back
+            if (now < t->hold_until) {
+                double poll = now + TASK_POLL_MS / 1000.0;
+                return stream_task_yield(t, t->acked < t->chunk_id - 1 && t->hold_until > poll ?
+                                            poll : t->hold_until);
+            }
+            t->last_progress = now;
+        }
+        
+        int bytes_sent = send_frame(t->fd, t->frame, t->chunk->data, t->chunk->size, t->sent, NULL);
+        if (bytes_sent < 0) {
+            if (!socket_would_block()) {
+                log_warning("Failed to send TCP chunk to client %d", client_id);
+                print_socket_error("Send error");
+                return stream_task_end(t, STATE_FINISHED);
+            }
+            if (now - t->last_progress > server_config.send_stall_ms / 1000.0) {
+                log_warning("Failed to send complete chunk %d to client %d: no progress for %d ms", 
+                       t->chunk_id, client_id, server_config.send_stall_ms);
+                break;
+            }
+            return stream_task_yield(t, now + TASK_SEND_RETRY_MS / 1000.0);
+        }
+        now = get_time();
+        t->sent += bytes_sent;
+        t->last_progress = now;
+        if (t->sent < TCP_CHUNK_SIZE) {
+            continue;
+        }
+        
+        chunk_release(t->chunk);
+        t->chunk = NULL;
+        t->sent = 0;
+        t->hold_until = 0;
+        t->encoded = false;
+        
+        if (now > share_deadline(&t->share, t->chunk_id)) {
+            stats_record_deadline_miss(client_id, false);
+        }
+        
+        log_event(LOG_EV_TCP_CHUNK_SENT, t->chunk_id, VIDEO_CHUNKS, client_id);
+        update_stats(client_id, TCP_CHUNK_SIZE);
+        pacer_report(client_id, &t->pacer);
+        t->chunk_id++;
+        chunks++;
+    }
+    
+    log_message("TCP streaming completed for client %d", client_id);
+    if (t->chunk_id <= VIDEO_CHUNKS) {
+        return stream_task_end(t, STATE_FINISHED);
+    }
+    // Half-close and collect the last acks until the client closes too;
+    // closing with acks unread would reset the connection under the
+    // client's final chunk
+    shutdown(t->fd, SHUT_WR);
+    t->step = TASK_DRAIN;
+    t->give_up = now + 5.0;
+    return stream_task_yield(t, now + TASK_POLL_MS / 1000.0);
+}
+
+// Sole reader of the shared UDP socket: passes each REQUEST_STREAM to the
+// thread streaming the session it names, records chunk acks and leaves
+// NACKs for the stream tasks
+THREAD_RETURN_TYPE udp_dispatcher_thread(THREAD_PARAM arg) {
+    (void)arg;
+    uint8_t buffer[BUFFER_SIZE];
+    while (1) {
+        struct sockaddr_in sender_addr;
+        socklen_t sender_len = sizeof(sender_addr);
+        int bytes_received = recvfrom(udp_socket, (char *)buffer, BUFFER_SIZE, 0,
+                                      (struct sockaddr *)&sender_addr, &sender_len);
+        if (bytes_received < 0) {
+#ifdef _WIN32
+            if (WSAGetLastError() != WSAEINTR) {
+#else
+            if (errno != EINTR) {
+#endif
+                print_socket_error("UDP recvfrom error");
+                usleep(100000);
+            }
+            continue;
+        }
+        // Chunk acks of streaming sessions; this thread is their only reader
+        ChunkAck ack;
+        if (wire_decode_ack(buffer, bytes_received, &ack)) {
+            if (udp_table_lookup(sender_addr.sin_addr.s_addr, sender_addr.sin_port, ack.client_id) != -2) {
+                latency_record_ack(ack.client_id, &ack);
+            }
+            continue;
+        }
+        // The latest NACK of a session supersedes any its task has not seen:
+        // clients name every chunk still missing each time
+        ChunkNack nack;
+        if (wire_decode_nack(buffer, bytes_received, &nack)) {
+            if (server_config.nack &&
+                udp_table_lookup(sender_addr.sin_addr.s_addr, sender_addr.sin_port, nack.client_id) != -2) {
+                __atomic_store_n(&session_entry(nack.client_id)->nack_pending,
+                                 (uint64_t)nack.first << 32 | nack.mask, __ATOMIC_RELEASE);
+            }
+            continue;
+        }
+        int client_id;
+        if (!wire_decode_client_id(buffer, bytes_received, FRAME_REQUEST_STREAM, &client_id) ||
+            udp_route_request(&sender_addr, client_id) == -2) {
+            continue;
+        }
+        // The table only holds keys of registered sessions, so the entry exists
+        SessionEntry *e = session_entry(client_id);
+        e->udp_request_from = sender_addr;
+        __atomic_store_n(&e->udp_request_ready, 1, __ATOMIC_RELEASE);
+    }
+    
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// Send the datagrams of a frame with `header` and the chunk as its body
+// that the impaired path did not drop, fragments of one frame back to
+// back. Those it holds back go on the task's delay line. Returns false on
+// a send error.
+bool stream_task_send_udp(StreamTask *t, const uint8_t *header, VideoChunk *chunk,
+                          const UdpFate *fate) {
+    uint8_t fragment[FRAME_HEADER_SIZE + FRAGMENT_HEADER_SIZE];
+    int count = udp_fragment_count(chunk->size);
+    bool ok = true;
+#ifdef _WIN32
+    MUTEX_LOCK(udp_mutex);
+#else
+    pthread_mutex_lock(&udp_mutex);
+#endif
+    for (int f = 0; f < count; f++) {
+        if (fate->dropped & (1u << f)) {
+            continue;
+        }
+        int offset, len;
+        int header_len = wire_put_fragment_header(fragment, header, chunk->size, f, &offset, &len);
+        for (int copy = (fate->duplicated >> f) & 1; copy >= 0; copy--) {
+            if (fate->release[f] > 0) {
+                delay_line_push(&t->delayed, fate->release[f], chunk, fragment, header_len, offset, len, &t->peer);
+            } else if (send_frame_parts(udp_socket, fragment, header_len, chunk->data + offset, len, 0, &t->peer) < 0) {
+                ok = false;
+            }
+        }
+    }
+#ifdef _WIN32
+    MUTEX_UNLOCK(udp_mutex);
+#else
+    pthread_mutex_unlock(&udp_mutex);
+#endif
+    if (!ok) {
+        print_socket_error("UDP sendto error");
+    }
+    return ok;
+}
+
+// Send the held datagrams that are due
+void stream_task_send_delayed(StreamTask *t, double now) {
+    DelayedDatagram d;
+    while (delay_line_pop(&t->delayed, now, &d)) {
+#ifdef _WIN32
+        MUTEX_LOCK(udp_mutex);
+#else
+        pthread_mutex_lock(&udp_mutex);
+#endif
+        if (send_frame_parts(udp_socket, d.header, d.header_len, d.chunk->data + d.offset, d.len, 0, &d.dest) < 0) {
+            print_socket_error("UDP sendto error");
+        }
+#ifdef _WIN32
+        MUTEX_UNLOCK(udp_mutex);
+#else
+        pthread_mutex_unlock(&udp_mutex);
+#endif
+        chunk_release(d.chunk);
+    }
+}
+
+// Resend what the client's latest FRAME_NACK, left by the dispatcher,
+// asks for
+void stream_task_answer_nack(StreamTask *t, double now) {
+    uint64_t pending = __atomic_exchange_n(&session_entry(t->client_id)->nack_pending, 0, __ATOMIC_ACQUIRE);
+    if (pending == 0) {
+        return;
+    }
+    ChunkNack nack;
+    nack.client_id = t->client_id;
+    nack.first = (int)(pending >> 32);
+    nack.mask = (uint32_t)pending;
+    int ids[NACK_MAX_CHUNKS];
+    int count = nack_chunk_ids(&nack, ids);
+    for (int k = 0; k < count; k++) {
+        UdpFate fate;
+        VideoChunk *chunk = nack_resend(&t->nack, &t->pacer, &t->share, t->client_id, ids[k], now, &fate);
+        if (chunk == NULL) {
+            continue;
+        }
+        wire_put_chunk_header(t->frame, chunk, FRAME_FLAG_RETRANSMIT);
+        stream_task_send_udp(t, t->frame, chunk, &fate);
+        chunk_release(chunk);
+    }
+}
+
+// Send the parity of the stream's open FEC group
+void stream_task_send_parity(StreamTask *t, double now) {
+    VideoChunk *parity[FEC_MAX_PARITY];
+    uint8_t headers[FEC_MAX_PARITY][FRAME_HEADER_SIZE];
+    UdpFate fates[FEC_MAX_PARITY];
+    int count = fec_finish(&t->fec, &t->pacer, &t->share, t->client_id, now, parity, headers, fates);
+    for (int k = 0; k < count; k++) {
+        stream_task_send_udp(t, headers[k], parity[k], &fates[k]);
+        chunk_release(parity[k]);
+    }
+}
+
+// UDP stream: wait for REQUEST_STREAM, then the chunks
+int stream_task_udp(PoolTask *task, double now) {
+    StreamTask *t = (StreamTask *)task;
+    int client_id = t->client_id;
+    
+    if (t->step == TASK_WAIT_REQUEST) {
+        SessionEntry *entry = session_entry(client_id);
+        if (!__atomic_load_n(&entry->udp_request_ready, __ATOMIC_ACQUIRE)) {
+            if (now < t->give_up) {
+                return stream_task_yield(t, now + TASK_POLL_MS / 1000.0);
+            }
+            log_warning("UDP client %d did not request streaming within %d ms", 
+                   client_id, UDP_REQUEST_TIMEOUT_MS);
+            return stream_task_end(t, STATE_FINISHED);
+        }
+        t->peer = entry->udp_request_from;
+        udp_table_remove(t->client_ip, 0, client_id);
+        log_message("Received from client %d: REQUEST_STREAM", client_id);
+        udp_table_insert(t->client_ip, t->peer.sin_port, client_id, -1);
+        t->step = TASK_STREAM;
+        
+        // Store the client's UDP port which can be different from the TCP port
+#ifdef _WIN32
+        MUTEX_LOCK(stats_mutex);
+#else
+        pthread_mutex_lock(&stats_mutex);
+#endif
+        CLIENT_STATS(client_id).address = t->peer;
+#ifdef _WIN32
+        MUTEX_UNLOCK(stats_mutex);
+#else
+        pthread_mutex_unlock(&stats_mutex);
+#endif
+        
+        // Send ready message
+        wire_put_header(t->frame, FRAME_READY, udp_ready_flags(), 0, 0);
+        sendto(udp_socket, (char *)t->frame, FRAME_HEADER_SIZE, 0,
+               (struct sockaddr *)&t->peer, sizeof(t->peer));
+        log_message("Sending READY_TO_STREAM to UDP client %d", client_id);
+        
+        pacer_init(&t->pacer, t->resolution, UDP_CHUNK_SIZE, now);
+        share_init(&t->share, t->resolution, UDP_CHUNK_SIZE, now);
+        fec_start(&t->fec, t->resolution);
+    }
+    
+    stream_task_send_delayed(t, now);
+    if (server_config.nack) {
+        stream_task_answer_nack(t, now);
+    }
+    if (t->step == TASK_DRAIN) {
+        if (now > t->give_up && t->delayed.count == 0) {
+            return stream_task_end(t, STATE_FINISHED);
+        }
+        return stream_task_yield(t, now + TASK_POLL_MS / 1000.0);
+    }
+    
+    for (int chunks = 0; t->chunk_id <= VIDEO_CHUNKS; chunks++) {
+        int i = t->chunk_id;
+        if (fec_group_ended(&t->fec, i)) {
+            stream_task_send_parity(t, now);  // Its last chunks were skipped
+        }
+        
+        // Under EDF a chunk past its playout deadline is not worth sending
+        if (scheduling_policy == POLICY_EDF && now > share_deadline(&t->share, i)) {
+            stats_record_deadline_miss(client_id, true);
+            chunk_release(t->chunk);
+            t->chunk = NULL;
+            t->chunk_id++;
+            continue;
+        }
+        
+        // Shared chunk of video data specifically for UDP; back off while
+        // the encoder is behind
+        if (t->chunk == NULL) {
+            if (!chunk_take(t->resolution, CHUNK_CLASS_UDP, i, &t->chunk)) {
+                return stream_task_yield(t, now + PIPELINE_RETRY_MS / 1000.0);
+            }
+            if (t->chunk == NULL) {
+                break;
+            }
+        }
+        
+        // Lost chunks still use their transmission slot
+        double due = pacer_due(&t->pacer, UDP_CHUNK_SIZE, now);
+        double share = share_due(&t->share, i, UDP_CHUNK_SIZE, now);
+        if (share > due) {
+            due = share;
+        }
+        if (due > now || chunks == POOL_RUN_CHUNKS) {
+            // NACKs are only seen when the task runs, so poll for them
+            double poll = now + TASK_POLL_MS / 1000.0;
+            if (server_config.nack && due > poll) {
+                due = poll;
+            }
+            return stream_task_yield(t, due > now ? due : now);
+        }
+        pacer_consume(&t->pacer, UDP_CHUNK_SIZE, now);
+        share_consume(&t->share, UDP_CHUNK_SIZE);
+        t->chunk_id++;
+        
+        // Run the chunk's datagrams through the impaired path
+        UdpFate fate;
+        udp_impair(client_id, t->chunk->size, now, &fate);
+        bool lost = fate.dropped != 0;
+        if (server_config.nack) {
+            nack_history_store(&t->nack, t->chunk, fate.dropped, now);
+        }
+        bool group_done = t->fec.group_size > 0 && fec_add(&t->fec, t->chunk, lost);
+        
+        // Send chunk to client, as far as the path let it through
+        wire_put_chunk_header(t->frame, t->chunk, 0);
+        bool sent = stream_task_send_udp(t, t->frame, t->chunk, &fate);
+        chunk_release(t->chunk);
+        t->chunk = NULL;
+        
+        if (lost) {
+            log_event(LOG_EV_UDP_CHUNK_LOST, i, client_id, 0);
+            stats_record_drop(client_id);
+            update_stats(client_id, 0);
+        } else {
+            if (sent && now > share_deadline(&t->share, i)) {
+                stats_record_deadline_miss(client_id, false);
+            }
+            log_event(LOG_EV_UDP_CHUNK_SENT, i, VIDEO_CHUNKS, client_id);
+            
+            // Update statistics
+            update_stats(client_id, UDP_CHUNK_SIZE);
+            pacer_report(client_id, &t->pacer);
+        }
+        if (group_done) {
+            stream_task_send_parity(t, now);
+        }
+        now = get_time();
+    }
+    if (t->fec.covered != 0) {
+        stream_task_send_parity(t, now);
+    }
+    
+    log_message("UDP streaming completed for client %d", client_id);
+    if ((server_config.nack || t->delayed.count > 0) && t->chunk_id > VIDEO_CHUNKS) {
+        // Still answering NACKs for the last chunks, or sending what the path holds
+        t->step = TASK_DRAIN;
+        t->give_up = now + (server_config.nack ? NACK_LINGER_MS / 1000.0 : 0);
+        return stream_task_yield(t, now + TASK_POLL_MS / 1000.0);
+    }
+    return stream_task_end(t, STATE_FINISHED);
+}
+
+#endif // !USE_EPOLL
+
+#ifdef USE_EPOLL
+/*
+ * Event-driven streaming engine (Linux)
+ *
+ * Each reactor is one thread with its own epoll set. Client sockets are
+ * non-blocking and registered edge-triggered, so every handler drains its
+ * socket until EAGAIN. A session moves through the existing STATE_* values,
+ * and STEP_* says what it is waiting for inside that state. Handshake and
+ * idle timeouts, send stalls, the simulated encoding time and bandwidth
+ * pacing are timers in a per-reactor hierarchical timer wheel rather than
+ * blocking sleeps; an expiry drives the session state machine.
+ */
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)  // Older headers; needs Linux 4.5+
+#endif
+
+#define CONTROL_TIMEOUT_MS 5000      // Type 1 Request, client ID and START_STREAM waits
+#define MAX_EVENTS 256               // epoll_wait batch size
+
+// Session timers (each session has one of each)
+#define TIMER_HANDSHAKE 0  // Type 1 Request/Response, client ID, READY_TO_STREAM
+#define TIMER_IDLE 1       // Waiting for START_STREAM / REQUEST_STREAM
+#define TIMER_STALL 2      // No send progress on a TCP chunk
+#define TIMER_PACE 3       // Encoding time, encoder back-off and token bucket deadline
+#define TIMER_KINDS 4
+
+// Timer wheel geometry: 1 ms ticks, 4 levels of 64 slots covering 2^24 ms
+// (about 4.6 hours); later deadlines are clamped to the last slot
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+// What an epoll registration points at (first int of the data.ptr target)
+#define SOURCE_CONTROL_LISTENER 1  // server_fd, connection phase
+#define SOURCE_STREAM_LISTENER 2   // tcp_streaming_socket on server_port + 1
+#define SOURCE_UDP_SOCKET 3        // The reactor's own SO_REUSEPORT UDP socket
+#define SOURCE_WAKEUP 4            // eventfd signalled when sessions are handed over
+#define SOURCE_SESSION 5           // Client session socket
+
+// Steps inside a STATE_* value
+#define STEP_RECV_REQUEST 1    // STATE_CONNECTION: reading the Type 1 Request
+#define STEP_SEND_RESPONSE 2   // STATE_CONNECTION: writing the Type 2 Response
+#define STEP_RECV_CLIENT_ID 3  // STATE_CONNECTION: new TCP stream socket, reading the client ID
+#define STEP_SEND_READY 4      // STATE_STREAMING: writing READY_TO_STREAM (TCP)
+#define STEP_WAIT_START 5      // STATE_STREAMING: waiting for START_STREAM / REQUEST_STREAM
+#define STEP_ENCODE 6          // STATE_STREAMING: next chunk is being encoded
+#define STEP_SEND_CHUNK 7      // STATE_STREAMING: writing the current chunk
+#define STEP_PACE 8            // STATE_STREAMING: waiting for the token bucket
+#define STEP_WAIT_ADMIT 9      // STATE_CONNECTION: queued by admission control
+#define STEP_DRAIN 10          // STATE_STREAMING: all chunks sent, reading the last acks
+#define STEP_LINK_DELAY 11     // STATE_STREAMING: the impaired path holds the stamped chunk back
+
+typedef struct Reactor Reactor;
+struct Session;
+
+// Intrusive timer embedded in a session, linked into one wheel slot
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer **pprev;       // Link pointing at this timer, NULL when not armed
+    uint64_t expires;           // Wheel tick it fires on
+    int level;                  // Wheel position while armed
+    int slot;
+    int kind;                   // TIMER_*
+    struct Session *session;
+} Timer;
+
+// Hierarchical timer wheel: level L slot i holds timers due in the i-th
+// 64^L-tick block. Arm and cancel are O(1); a level-L slot is cascaded into
+// the levels below once every 64^L ticks.
+typedef struct {
+    double origin;              // Monotonic time of tick 0
+    uint64_t now;               // Last tick processed
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS]; // Bitmap of non-empty slots per level
+    int armed;
+} TimerWheel;
+
+// Data queued on a TCP session: up to two slices (e.g. a header and a shared
+// payload) written with one sendmsg() per attempt. EPOLLOUT resumes it from
+// `offset`; `last_progress` drives stall detection.
+typedef struct SendCursor {
+    struct iovec iov[2];
+    int iov_count;
+    size_t total;               // Bytes across all slices
+    size_t offset;              // Bytes already accepted by the kernel
+    double last_progress;       // Monotonic time offset last advanced
+} SendCursor;
+
+// A UDP datagram waiting for the next batch flush
+typedef struct {
+    struct Session *session;    // Whose udp_queued counts it, NULL in the benchmark
+    VideoChunk *chunk;          // Reference released once the datagram is sent
+    uint8_t header[FRAME_HEADER_SIZE + FRAGMENT_HEADER_SIZE]; // Frame or fragment header
+    int len;                    // Header and payload
+    struct sockaddr_in dest;
+} UdpDatagram;
+
+// Per-reactor UDP transmit batch. Sessions queue datagrams as their pacing
+// deadlines fire and the reactor flushes them with one sendmmsg() after the
+// timers have run. With GSO, consecutive datagrams to the same peer travel
+// as a single UDP_SEGMENT message that the kernel splits late.
+typedef struct {
+    socket_t fd;
+    int limit;                  // Flush once this many datagrams are queued
+    bool gso;                   // UDP_SEGMENT usable on this socket
+    int count;
+    UdpDatagram items[UDP_BATCH_MAX];
+    struct iovec iov[2 * UDP_BATCH_MAX]; // Header and payload of each datagram
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control[UDP_BATCH_MAX];
+    unsigned long syscalls;     // sendmmsg() calls made
+    unsigned long datagrams;    // Datagrams handed to the kernel
+    DelayLine delayed;          // Datagrams the impaired path holds back
+} UdpBatch;
+
+// One client connection (or UDP stream) driven by a reactor
+typedef struct Session {
+    int source;                 // SOURCE_SESSION, must stay the first member
+    Reactor *reactor;           // Owning reactor; only its thread touches the session
+    int protocol;               // MODE_TCP or MODE_UDP
+    int state;                  // STATE_* value
+    int step;                   // STEP_* inside the state
+    int client_id;              // -1 while the session does not own a client slot
+    socket_t fd;                // Control or TCP stream socket, invalid for UDP
+    struct sockaddr_in peer;    // Client address (UDP destination)
+    char resolution[10];
+    uint8_t rx[WIRE_MESSAGE_FRAME]; // Partially received control frame
+    int rx_len;
+    Message response;           // Type 2 Response while it is being written
+    uint8_t frame[WIRE_MESSAGE_FRAME]; // Encoded control frame or chunk header being written
+    SendCursor tx;              // Data being written and how much of it went out
+    Pacer pacer;                // Token bucket setting the chunk send times
+    ShareState share;           // Claim on the --capacity-kbps budget
+    unsigned long send_calls;   // sendmsg() calls since streaming started
+    unsigned long send_blocked; // ...of which hit a full socket buffer
+    VideoChunk *chunk;          // Reference to the chunk being sent, NULL between chunks
+    int udp_queued;             // Datagrams still sitting in the reactor's UDP batch
+    int chunk_id;               // Chunk being encoded or sent (1..VIDEO_CHUNKS)
+    NackHistory nack;           // --nack: recent UDP chunks
+    FecEncoder fec;             // --fec: parity of the open chunk group
+    Timer timers[TIMER_KINDS];  // TIMER_* deadlines in the reactor's wheel
+    struct Session *next;       // Reactor inbox or pending UDP list
+} Session;
+
+// REQUEST_STREAM that arrived on another reactor's socket, forwarded to the
+// reactor holding the client's waiting session
+typedef struct UdpRequest {
+    struct sockaddr_in sender;
+    int client_id;
+    Reactor *via;               // Reactor whose socket received it
+    struct UdpRequest *next;
+} UdpRequest;
+
+struct Reactor {
+    int id;
+    int epoll_fd;
+    int wake_fd;                // eventfd, readable when the inbox is not empty
+    int wake_source;            // SOURCE_WAKEUP, registered for wake_fd
+    pthread_mutex_t inbox_mutex;
+    Session *inbox;             // Sessions handed over by other threads
+    UdpRequest *requests;       // REQUEST_STREAM forwarded by other reactors
+    TimerWheel wheel;           // Every session timer owned by this reactor
+    Session *udp_pending;       // UDP sessions waiting for REQUEST_STREAM
+    socket_t udp_fd;            // UDP socket bound to server_port with SO_REUSEPORT
+    int udp_source;             // SOURCE_UDP_SOCKET, registered for udp_fd
+    UdpBatch udp_batch;         // Datagrams queued by this reactor's sessions
+    thread_t thread;
+};
+
+Reactor *reactors = NULL;
+int reactor_count = 0;
+int control_listener_source = SOURCE_CONTROL_LISTENER;
+int stream_listener_source = SOURCE_STREAM_LISTENER;
+
+void session_drive(Session *s);
+void session_timeout(Session *s, int kind);
+
+
+int set_nonblocking(socket_t fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// ---- Timer wheel ----
+
+uint64_t wheel_tick(TimerWheel *w, double t) {
+    return t <= w->origin ? 0 : (uint64_t)((t - w->origin) * 1000.0);
+}
+
+// Link a timer into the slot matching its expiry relative to w->now
+void wheel_insert(TimerWheel *w, Timer *t) {
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    if (delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+        t->expires = w->now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    int slot = (int)(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    Timer **head = &w->slots[level][slot];
+    t->level = level;
+    t->slot = slot;
+    t->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &t->next;
+    }
+    *head = t;
+    t->pprev = head;
+    w->occupied[level] |= (uint64_t)1 << slot;
+}
+
+// Unlink a timer from whatever list it is on (a slot or an expiry batch)
+void wheel_unlink(TimerWheel *w, Timer *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+    if (w->slots[t->level][t->slot] == NULL) {
+        w->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+    }
+}
+
+bool timer_armed(Session *s, int kind) {
+    return s->timers[kind].pprev != NULL;
+}
+
+void timer_cancel(Session *s, int kind) {
+    Timer *t = &s->timers[kind];
+    if (t->pprev != NULL) {
+        wheel_unlink(&s->reactor->wheel, t);
+        s->reactor->wheel.armed--;
+    }
+}
+
+// (Re)arm a session timer for an absolute monotonic deadline. It fires on
+// the first tick at or after the deadline, never earlier.
+void timer_arm_at(Session *s, int kind, double deadline) {
+    TimerWheel *w = &s->reactor->wheel;
+    Timer *t = &s->timers[kind];
+    timer_cancel(s, kind);
+    t->expires = wheel_tick(w, deadline);
+    if ((deadline - w->origin) * 1000.0 > (double)t->expires) {
+        t->expires++;
+    }
+    if (t->expires <= w->now) {
+        t->expires = w->now + 1;  // The current tick has already been processed
+    }
+    wheel_insert(w, t);
+    w->armed++;
+}
+
+void timer_arm(Session *s, int kind, int delay_ms) {
+    timer_arm_at(s, kind, get_monotonic_time() + delay_ms / 1000.0);
+}
+
+// Move the timers of one upper-level slot down the wheel
+void wheel_cascade(TimerWheel *w, int level) {
+    int slot = (int)(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    Timer *list = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~((uint64_t)1 << slot);
+    while (list != NULL) {
+        Timer *t = list;
+        list = t->next;
+        wheel_insert(w, t);
+    }
+}
+
+// Process every tick up to the current time, firing expired timers
+void wheel_advance(TimerWheel *w) {
+    uint64_t target = wheel_tick(w, get_monotonic_time());
+    if (w->armed == 0) {
+        w->now = target > w->now ? target : w->now;
+        return;
+    }
+    while (w->now < target) {
+        w->now++;
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((w->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) == 0) {
+                wheel_cascade(w, level);
+            }
+        }
+        
+        int slot = (int)w->now & WHEEL_MASK;
+        if (w->slots[0][slot] == NULL) {
+            continue;
+        }
+        // Detach the slot so handlers can arm and cancel freely meanwhile
+        Timer *batch = w->slots[0][slot];
+        w->slots[0][slot] = NULL;
+        w->occupied[0] &= ~((uint64_t)1 << slot);
+        batch->pprev = &batch;
+        while (batch != NULL) {
+            Timer *t = batch;
+            wheel_unlink(w, t);
+            w->armed--;
+            session_timeout(t->session, t->kind);
+        }
+    }
+}
+
+// Milliseconds until the next tick that has work (an expiry or a cascade),
+// -1 when no timer is armed
+int timer_next_timeout(Reactor *r) {
+    TimerWheel *w = &r->wheel;
+    if (w->armed == 0) {
+        return -1;
+    }
+    // Next occupied level-0 slot after now, or the next cascade boundary
+    // while upper levels hold timers
+    uint64_t next = UINT64_MAX;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (w->occupied[level] != 0) {
+            next = (w->now | WHEEL_MASK) + 1;
+            break;
+        }
+    }
+    uint64_t pending = w->occupied[0];
+    if (pending != 0) {
+        int from = (int)(w->now + 1) & WHEEL_MASK;
+        uint64_t rotated = (pending >> from) | (from ? pending << (WHEEL_SLOTS - from) : 0);
+        uint64_t candidate = w->now + 1 + __builtin_ctzll(rotated);
+        if (candidate < next) {
+            next = candidate;
+        }
+    }
+    double wait = w->origin + next / 1000.0 - get_monotonic_time();
+    if (wait <= 0) {
+        return 0;
+    }
+    return (int)(wait * 1000.0) + 1;
+}
+
+// ---- UDP transmit batch ----
+
+#define UDP_GSO_MAX_BYTES 65000   // Payload of one UDP_SEGMENT message (< 64 KB)
+#define UDP_GSO_MAX_SEGMENTS 64   // Kernel limit on segments per message
+
+// True when the kernel accepts UDP_SEGMENT on this socket
+bool udp_gso_supported(socket_t fd) {
+    int segment = 0;
+    socklen_t len = sizeof(segment);
+    return getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment, &len) == 0;
+}
+
+void udp_batch_init(UdpBatch *b, socket_t fd, int limit, bool gso) {
+    memset(b, 0, sizeof(*b));
+    b->fd = fd;
+    b->limit = limit < 1 ? 1 : limit > UDP_BATCH_MAX ? UDP_BATCH_MAX : limit;
+    b->gso = gso && udp_gso_supported(fd);
+}
+
+bool same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Build sendmmsg() messages for datagrams [from, count), merging runs to the
+// same peer when GSO is on. first[m] is the first datagram of message m.
+int udp_batch_build(UdpBatch *b, int from, int *first) {
+    int nmsgs = 0;
+    for (int i = from; i < b->count; ) {
+        int segs = 1;
+        if (b->gso) {
+            // Only the last segment of a message may be shorter, like a frame's last fragment
+            while (i + segs < b->count && segs < UDP_GSO_MAX_SEGMENTS &&
+                   same_peer(&b->items[i + segs].dest, &b->items[i].dest) &&
+                   b->items[i + segs].len <= b->items[i].len &&
+                   b->items[i + segs - 1].len == b->items[i].len &&
+                   (segs + 1) * b->items[i].len <= UDP_GSO_MAX_BYTES) {
+                segs++;
+            }
+        }
+        struct msghdr *msg = &b->msgs[nmsgs].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &b->items[i].dest;
+        msg->msg_namelen = sizeof(b->items[i].dest);
+        msg->msg_iov = &b->iov[2 * i];
+        msg->msg_iovlen = 2 * segs;
+        if (segs > 1) {
+            msg->msg_control = b->control[nmsgs].buf;
+            msg->msg_controllen = sizeof(b->control[nmsgs].buf);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = (uint16_t)b->items[i].len;
+            memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        }
+        first[nmsgs++] = i;
+        i += segs;
+    }
+    return nmsgs;
+}
+
+// Hand every queued datagram to the kernel and settle their accounting.
+// A send error drops the rest of the batch, like any lost UDP datagram.
+void udp_batch_flush(UdpBatch *b) {
+    if (b->count == 0) {
+        return;
+    }
+    int first[UDP_BATCH_MAX];
+    int next = 0;       // First datagram not yet accepted by the kernel
+    int delivered = b->count;
+    while (next < b->count) {
+        int nmsgs = udp_batch_build(b, next, first);
+        int done = 0;
+        while (done < nmsgs) {
+            int n = sendmmsg(b->fd, b->msgs + done, nmsgs - done, 0);
+            b->syscalls++;
+            if (n > 0) {
+                done += n;
+            } else if (errno != EINTR) {
+                break;
+            }
+        }
+        if (done == nmsgs) {
+            break;
+        }
+        next = first[done];
+        if (b->msgs[done].msg_hdr.msg_controllen > 0 && (errno == EIO || errno == EINVAL)) {
+            // No segmentation offload on this path: send datagrams one by one
+            log_message("UDP GSO rejected (%s), sending datagrams individually", strerror(errno));
+            b->gso = false;
+            continue;
+        }
+        print_socket_error("UDP sendmmsg error");
+        delivered = next;
+        break;
+    }
+    
+    for (int i = 0; i < b->count; i++) {
+        UdpDatagram *d = &b->items[i];
+        if (d->session != NULL) {
+            d->session->udp_queued--;
+        }
+        chunk_release(d->chunk);
+    }
+    b->datagrams += delivered;
+    __atomic_add_fetch(&udp_datagrams_sent, delivered, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&udp_send_syscalls, b->syscalls, __ATOMIC_RELAXED);
+    b->syscalls = 0;
+    b->count = 0;
+}
+
+// Queue one datagram: `header` and a slice of the chunk, which gains a
+// reference until the flush
+void udp_batch_queue(UdpBatch *b, Session *s, VideoChunk *chunk, const uint8_t *header,
+                     int header_len, int offset, int len, const struct sockaddr_in *dest) {
+    UdpDatagram *d = &b->items[b->count];
+    memcpy(d->header, header, header_len);
+    d->session = s;
+    d->chunk = chunk_retain(chunk);
+    d->len = header_len + len;
+    d->dest = *dest;
+    b->iov[2 * b->count].iov_base = d->header;
+    b->iov[2 * b->count].iov_len = header_len;
+    b->iov[2 * b->count + 1].iov_base = chunk->data + offset;
+    b->iov[2 * b->count + 1].iov_len = len;
+    b->count++;
+    if (s != NULL) {
+        s->udp_queued++;
+    }
+    if (b->count >= b->limit) {
+        udp_batch_flush(b);
+    }
+}
+
+// Queue the datagrams of a frame with a ready-made `header` and `chunk` as
+// its body, as the impaired path's `fate` has them: dropped fragments are
+// skipped and those it holds back wait on the delay line. A NULL `fate`
+// sends everything at once. The batch takes over the caller's chunk
+// reference.
+void udp_batch_add_frame(UdpBatch *b, Session *s, VideoChunk *chunk,
+                         const struct sockaddr_in *dest, const uint8_t *header, const UdpFate *fate) {
+    uint8_t fragment[FRAME_HEADER_SIZE + FRAGMENT_HEADER_SIZE];
+    int count = udp_fragment_count(chunk->size);
+    for (int f = 0; f < count; f++) {
+        if (fate != NULL && (fate->dropped & (1u << f))) {
+            continue;
+        }
+        int offset, len;
+        int header_len = wire_put_fragment_header(fragment, header, chunk->size, f, &offset, &len);
+        for (int copy = fate != NULL ? (fate->duplicated >> f) & 1 : 0; copy >= 0; copy--) {
+            if (fate != NULL && fate->release[f] > 0) {
+                // The session may be gone by then, so the datagram does not count for it
+                delay_line_push(&b->delayed, fate->release[f], chunk, fragment, header_len, offset, len, dest);
+            } else {
+                udp_batch_queue(b, s, chunk, fragment, header_len, offset, len, dest);
+            }
+        }
+    }
+    chunk_release(chunk);
+}
+
+// Move the held datagrams that are due into the batch
+void udp_batch_release(UdpBatch *b, double now) {
+    DelayedDatagram d;
+    while (delay_line_pop(&b->delayed, now, &d)) {
+        udp_batch_queue(b, NULL, d.chunk, d.header, d.header_len, d.offset, d.len, &d.dest);
+        chunk_release(d.chunk);
+    }
+}
+
+// Queue a chunk frame with header `flags`, as udp_batch_add_frame
+void udp_batch_add(UdpBatch *b, Session *s, VideoChunk *chunk,
+                   const struct sockaddr_in *dest, int flags, const UdpFate *fate) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    wire_put_chunk_header(header, chunk, flags);
+    udp_batch_add_frame(b, s, chunk, dest, header, fate);
+}
+
+// ---- Sessions ----
+
+Session *session_new(Reactor *r, int protocol) {
+    Session *s = calloc(1, sizeof(Session));
+    if (s == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    s->source = SOURCE_SESSION;
+    s->reactor = r;
+    s->protocol = protocol;
+    s->client_id = -1;
+    s->fd = INVALID_SOCKET_VALUE;
+    for (int kind = 0; kind < TIMER_KINDS; kind++) {
+        s->timers[kind].kind = kind;
+        s->timers[kind].session = s;
+    }
+    return s;
+}
+
+// Tear a session down. If it owns a client slot, the client ends in `state`.
+void session_close(Session *s, int state) {
+    Reactor *r = s->reactor;
+    for (int kind = 0; kind < TIMER_KINDS; kind++) {
+        timer_cancel(s, kind);
+    }
+    if (s->udp_queued > 0) {
+        udp_batch_flush(&r->udp_batch);  // Queued datagrams point at the session
+    }
+    share_end(&s->share);
+    
+    if (s->protocol == MODE_UDP && s->step == STEP_WAIT_START) {
+        Session **link = &r->udp_pending;
+        while (*link != NULL && *link != s) {
+            link = &(*link)->next;
+        }
+        if (*link != NULL) {
+            *link = s->next;
+        }
+    }
+    if (s->protocol == MODE_UDP && s->client_id >= 0) {
+        udp_table_remove(s->peer.sin_addr.s_addr,
+                         s->step == STEP_WAIT_START ? 0 : s->peer.sin_port, s->client_id);
+        if (session_entry(s->client_id)->udp_session == s) {
+            session_entry(s->client_id)->udp_session = NULL;
+        }
+    }
+    nack_history_clear(&s->nack);
+    fec_end(&s->fec);
+    
+    if (s->client_id >= 0) {
+        pthread_mutex_lock(&stats_mutex);
+        if (s->fd != INVALID_SOCKET_VALUE && CLIENT_STATS(s->client_id).socket_fd == s->fd) {
+            CLIENT_STATS(s->client_id).socket_fd = INVALID_SOCKET_VALUE;
+        }
+        pthread_mutex_unlock(&stats_mutex);
+        release_client(s->client_id, state);
+    }
+    
+    if (s->fd != INVALID_SOCKET_VALUE) {
+        CLOSE_SOCKET(s->fd);  // Also removes it from the epoll set
+    }
+    chunk_release(s->chunk);
+    free(s);
+}
+
+// Register the session socket for both directions once; with EPOLLET we
+// only hear about transitions, so handlers always run until EAGAIN.
+int session_watch(Session *s) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = s;
+    return epoll_ctl(s->reactor->epoll_fd, EPOLL_CTL_ADD, s->fd, &ev);
+}
+
+// Read what is available into s->rx, up to `want` bytes in total.
+// Returns -1 once the peer has closed the connection or on errors.
+int session_recv(Session *s, int want) {
+    while (s->rx_len < want) {
+        ssize_t n = recv(s->fd, s->rx + s->rx_len, want - s->rx_len, 0);
+        if (n > 0) {
+            s->rx_len += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            if (n == 0) {
+                errno = ECONNRESET;  // Orderly shutdown by the client
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Point the cursor at new data (header may be NULL)
+void cursor_set(SendCursor *c, const void *header, size_t header_len,
+                const void *payload, size_t payload_len) {
+    c->iov_count = 0;
+    if (header_len > 0) {
+        c->iov[c->iov_count].iov_base = (void *)header;
+        c->iov[c->iov_count].iov_len = header_len;
+        c->iov_count++;
+    }
+    if (payload_len > 0) {
+        c->iov[c->iov_count].iov_base = (void *)payload;
+        c->iov[c->iov_count].iov_len = payload_len;
+        c->iov_count++;
+    }
+    c->total = header_len + payload_len;
+    c->offset = 0;
+    c->last_progress = get_monotonic_time();
+}
+
+// Slices still to be written, skipping the first `offset` bytes
+int cursor_remaining(const SendCursor *c, struct iovec *out) {
+    size_t skip = c->offset;
+    int count = 0;
+    for (int i = 0; i < c->iov_count; i++) {
+        if (skip >= c->iov[i].iov_len) {
+            skip -= c->iov[i].iov_len;
+            continue;
+        }
+        out[count].iov_base = (char *)c->iov[i].iov_base + skip;
+        out[count].iov_len = c->iov[i].iov_len - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+// Queue data for writing and move to `step`
+void session_start_send(Session *s, const void *data, int len, int step) {
+    cursor_set(&s->tx, NULL, 0, data, len);
+    s->step = step;
+}
+
+// Queue a control frame without a body
+void session_send_control(Session *s, int type, int step) {
+    wire_put_header(s->frame, type, 0, 0, 0);
+    session_start_send(s, s->frame, FRAME_HEADER_SIZE, step);
+}
+
+// Queue the Type 2 Response in s->response
+void session_send_response(Session *s) {
+    session_start_send(s, s->frame, wire_encode_message(&s->response, s->frame), STEP_SEND_RESPONSE);
+}
+
+// Write pending data. Returns 1 when everything went out, 0 if the socket
+// buffer is full and -1 on errors. Nothing is retried here: the socket is
+// registered for EPOLLOUT once, so the next edge resumes from the cursor,
+// and a stall timer bounded by the last progress catches dead peers.
+int session_flush(Session *s) {
+    SendCursor *c = &s->tx;
+    while (c->offset < c->total) {
+        struct iovec iov[2];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cursor_remaining(c, iov);
+        
+        ssize_t n = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        s->send_calls++;
+        if (n >= 0) {
+            c->offset += n;
+            c->last_progress = get_monotonic_time();
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            s->send_blocked++;
+            if (s->step == STEP_SEND_CHUNK && !timer_armed(s, TIMER_STALL)) {
+                timer_arm_at(s, TIMER_STALL, c->last_progress + server_config.send_stall_ms / 1000.0);
+            }
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Check the scheduler or SIGINT path has not deactivated the client
+bool session_client_active(Session *s) {
+    return client_active(s->client_id);
+}
+
+// Read the client's chunk acks off a TCP stream socket. Returns -1 once
+// the client has closed it, or on errors.
+int session_read_acks(Session *s) {
+    while (1) {
+        if (session_recv(s, WIRE_ACK_FRAME) < 0) {
+            return -1;
+        }
+        if (s->rx_len < WIRE_ACK_FRAME) {
+            return 0;
+        }
+        ChunkAck ack;
+        if (wire_decode_ack(s->rx, s->rx_len, &ack) && ack.client_id == s->client_id) {
+            latency_record_ack(s->client_id, &ack);
+        }
+        s->rx_len = 0;
+    }
+}
+
+// All chunks are out: half-close and collect the last acks until the
+// client closes too. Closing with acks unread would reset the connection
+// under the client's final chunk.
+void session_drain(Session *s) {
+    shutdown(s->fd, SHUT_WR);
+    s->step = STEP_DRAIN;
+    timer_arm(s, TIMER_IDLE, CONTROL_TIMEOUT_MS);
+    if (session_read_acks(s) < 0) {
+        session_close(s, STATE_FINISHED);
+    }
+}
+
+// Write the stamped TCP chunk
+void tcp_send_chunk(Session *s) {
+    s->tx.last_progress = get_monotonic_time();
+    s->step = STEP_SEND_CHUNK;
+    session_drive(s);  // session_flush arms the stall timer if the socket fills up
+}
+
+// Send the current TCP chunk from the chunk store
+void tcp_start_chunk(Session *s) {
+    if (!session_client_active(s)) {
+        log_message("TCP streaming completed for client %d", s->client_id);
+        session_close(s, STATE_FINISHED);
+        return;
+    }
+    double now = get_monotonic_time();
+    double due = pacer_due(&s->pacer, TCP_CHUNK_SIZE, now);
+    double share = share_due(&s->share, s->chunk_id, TCP_CHUNK_SIZE, now);  // Credit accrues meanwhile
+    if (share > due) {
+        due = share;
+    }
+    if (due > now) {
+        s->step = STEP_PACE;
+        timer_arm_at(s, TIMER_PACE, due);
+        return;
+    }
+    if (!chunk_take(s->resolution, CHUNK_CLASS_TCP, s->chunk_id, &s->chunk)) {
+        s->step = STEP_ENCODE;  // The encoder is behind; poll until it publishes
+        timer_arm(s, TIMER_PACE, PIPELINE_RETRY_MS);
+        return;
+    }
+    if (s->chunk == NULL) {
+        session_close(s, STATE_FINISHED);
+        return;
+    }
+    pacer_consume(&s->pacer, TCP_CHUNK_SIZE, now);
+    share_consume(&s->share, TCP_CHUNK_SIZE);
+    wire_put_chunk_header(s->frame, s->chunk, 0);
+    cursor_set(&s->tx, s->frame, FRAME_HEADER_SIZE, s->chunk->data, s->chunk->size);
+    double hold = impair_tcp_hold(s->client_id, TCP_CHUNK_SIZE, now);
+    if (hold > 0) {
+        s->step = STEP_LINK_DELAY;
+        timer_arm_at(s, TIMER_PACE, now + hold);
+        return;
+    }
+    tcp_send_chunk(s);
+}
+
+// Start the current TCP chunk, after the simulated encoding time if the
+// client pays for it. The encoding time overlaps the pacing interval.
+void tcp_encode_chunk(Session *s) {
+    if (server_config.encode_cost == ENCODE_COST_CLIENT) {
+        s->step = STEP_ENCODE;
+        timer_arm(s, TIMER_PACE, ENCODE_TIME_MS);
+    } else {
+        tcp_start_chunk(s);
+    }
+}
+
+// Account for a fully written TCP chunk and schedule the next one
+void tcp_chunk_sent(Session *s) {
+    stats_record_sends(s->client_id, s->send_calls, s->send_blocked);
+    pacer_report(s->client_id, &s->pacer);
+    
+    chunk_release(s->chunk);
+    s->chunk = NULL;
+    timer_cancel(s, TIMER_STALL);
+    
+    log_event(LOG_EV_TCP_CHUNK_SENT, s->chunk_id, VIDEO_CHUNKS, s->client_id);
+    update_stats(s->client_id, TCP_CHUNK_SIZE);
+    if (get_monotonic_time() > share_deadline(&s->share, s->chunk_id)) {
+        stats_record_deadline_miss(s->client_id, false);
+    }
+    
+    if (s->chunk_id == VIDEO_CHUNKS) {
+        log_message("TCP streaming completed for client %d", s->client_id);
+        session_drain(s);
+        return;
+    }
+    
+    s->chunk_id++;
+    tcp_encode_chunk(s);
+}
+
+// Queue the parity of the session's open FEC group with the reactor's next flush
+void udp_send_parity(Session *s, double now) {
+    VideoChunk *parity[FEC_MAX_PARITY];
+    uint8_t headers[FEC_MAX_PARITY][FRAME_HEADER_SIZE];
+    UdpFate fates[FEC_MAX_PARITY];
+    int count = fec_finish(&s->fec, &s->pacer, &s->share, s->client_id, now, parity, headers, fates);
+    for (int k = 0; k < count; k++) {
+        udp_batch_add_frame(&s->reactor->udp_batch, s, parity[k], &s->peer, headers[k], &fates[k]);
+    }
+}
+
+// Send every UDP chunk the token bucket allows, then sleep until the next
+// one is due. Simulated losses use their transmission slot like real ones.
+void udp_send_next(Session *s) {
+    while (s->chunk_id <= VIDEO_CHUNKS) {
+        int i = s->chunk_id;
+        double now = get_monotonic_time();
+        if (fec_group_ended(&s->fec, i)) {
+            udp_send_parity(s, now);  // Its last chunks were skipped
+        }
+        if (scheduling_policy == POLICY_EDF && now > share_deadline(&s->share, i)) {
+            s->chunk_id++;  // Past its playout deadline; the player has moved on
+            stats_record_deadline_miss(s->client_id, true);
+            continue;
+        }
+        double due = pacer_due(&s->pacer, UDP_CHUNK_SIZE, now);
+        double share = share_due(&s->share, i, UDP_CHUNK_SIZE, now);
+        if (share > due) {
+            due = share;
+        }
+        if (due > now) {
+            s->step = STEP_PACE;
+            timer_arm_at(s, TIMER_PACE, due);
+            return;
+        }
+        VideoChunk *chunk;
+        if (!chunk_take(s->resolution, CHUNK_CLASS_UDP, i, &chunk)) {
+            s->step = STEP_ENCODE;  // The encoder is behind; poll until it publishes
+            timer_arm(s, TIMER_PACE, PIPELINE_RETRY_MS);
+            return;
+        }
+        if (chunk == NULL) {
+            break;
+        }
+        s->chunk_id++;
+        pacer_consume(&s->pacer, UDP_CHUNK_SIZE, now);
+        share_consume(&s->share, UDP_CHUNK_SIZE);
+        
+        // Run the chunk's datagrams through the impaired path
+        UdpFate fate;
+        udp_impair(s->client_id, chunk->size, now, &fate);
+        bool lost = fate.dropped != 0;
+        if (server_config.nack) {
+            nack_history_store(&s->nack, chunk, fate.dropped, now);
+        }
+        bool group_done = s->fec.group_size > 0 && fec_add(&s->fec, chunk, lost);
+        
+        // Goes out with the reactor's next flush, right after its timers ran,
+        // or once the path releases it, as far as the path let it through
+        udp_batch_add(&s->reactor->udp_batch, s, chunk, &s->peer, 0, &fate);
+        if (lost) {
+            log_event(LOG_EV_UDP_CHUNK_LOST, i, s->client_id, 0);
+            stats_record_drop(s->client_id);
+            update_stats(s->client_id, 0);
+        } else {
+            if (now > share_deadline(&s->share, i)) {
+                stats_record_deadline_miss(s->client_id, false);
+            }
+            
+            log_event(LOG_EV_UDP_CHUNK_SENT, i, VIDEO_CHUNKS, s->client_id);
+            update_stats(s->client_id, UDP_CHUNK_SIZE);
+            pacer_report(s->client_id, &s->pacer);
+        }
+        if (group_done) {
+            udp_send_parity(s, now);
+        }
+    }
+    if (s->fec.covered != 0) {
+        udp_send_parity(s, get_monotonic_time());
+    }
+    
+    log_message("UDP streaming completed for client %d", s->client_id);
+    if (server_config.nack) {
+        s->step = STEP_DRAIN;  // Still answering NACKs for the last chunks
+        timer_arm(s, TIMER_IDLE, NACK_LINGER_MS);
+        return;
+    }
+    session_close(s, STATE_FINISHED);
+}
+
+// Resend the chunks a FRAME_NACK names with the reactor's next flush
+void udp_answer_nack(Session *s, const ChunkNack *nack) {
+    int ids[NACK_MAX_CHUNKS];
+    int count = nack_chunk_ids(nack, ids);
+    double now = get_monotonic_time();
+    for (int k = 0; k < count; k++) {
+        UdpFate fate;
+        VideoChunk *chunk = nack_resend(&s->nack, &s->pacer, &s->share, s->client_id, ids[k], now, &fate);
+        if (chunk != NULL) {
+            udp_batch_add(&s->reactor->udp_batch, s, chunk, &s->peer, FRAME_FLAG_RETRANSMIT, &fate);
+        }
+    }
+}
+
+// A new TCP stream socket named its client: validate it and attach.
+// Returns false if the session was rejected (and closed).
+bool tcp_attach_client(Session *s) {
+    int client_id;
+    if (!wire_decode_client_id(s->rx, s->rx_len, FRAME_CLIENT_ID, &client_id)) {
+        printf("Invalid client ID frame, closing connection\n");
+        session_close(s, STATE_FINISHED);
+        return false;
+    }
+    printf("Client %d connected for TCP streaming (socket: %d)\n", client_id, s->fd);
+    
+    bool valid_client = false;
+    pthread_mutex_lock(&stats_mutex);
+    if (client_active(client_id) && 
+        strcmp(CLIENT_STATS(client_id).protocol, "TCP") == 0) {
+        
+        // The old socket belongs to another session, possibly on another
+        // reactor: shut it down and let its owner notice and close it
+        if (CLIENT_STATS(client_id).socket_fd != INVALID_SOCKET_VALUE) {
+            printf("Client %d already has an active streaming socket %d, closing old connection\n",
+                   client_id, CLIENT_STATS(client_id).socket_fd);
+            shutdown(CLIENT_STATS(client_id).socket_fd, SHUT_RDWR);
+        }
+        
+        CLIENT_STATS(client_id).socket_fd = s->fd;
+        stats_stream_started(client_id);
+        strncpy(s->resolution, CLIENT_STATS(client_id).resolution, sizeof(s->resolution));
+        s->resolution[sizeof(s->resolution) - 1] = '\0';
+        valid_client = true;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    
+    if (!valid_client) {
+        printf("Invalid TCP client ID: %d, closing connection\n", client_id);
+        session_close(s, STATE_FINISHED);
+        return false;
+    }
+    
+    s->client_id = client_id;
+    s->state = STATE_STREAMING;
+    printf("*** Starting TCP streaming for client %d (socket_fd: %d) ***\n", client_id, s->fd);
+    session_send_control(s, FRAME_READY, STEP_SEND_READY);
+    timer_arm(s, TIMER_HANDSHAKE, CONTROL_TIMEOUT_MS);
+    return true;
+}
+
+// Advance a socket-backed session as far as its socket allows
+void session_drive(Session *s) {
+    while (1) {
+        switch (s->step) {
+        case STEP_RECV_REQUEST: {
+            if (session_recv(s, WIRE_MESSAGE_FRAME) < 0) {
+                printf("Failed to receive Type 1 Request from client %d\n", s->client_id);
+                print_socket_error("Receive error");
+                session_close(s, STATE_IDLE);
+                return;
+            }
+            if (s->rx_len < WIRE_MESSAGE_FRAME) {
+                return;
+            }
+            Message request;
+            if (!wire_decode_message(s->rx, TYPE_1_REQUEST, &request)) {
+                printf("Received invalid request type from client %d\n", s->client_id);
+                session_close(s, STATE_IDLE);
+                return;
+            }
+            printf("Received Type 1 Request from client %d - Requested resolution: %s\n", 
+                   s->client_id, request.resolution);
+            prepare_response(s->client_id, &request, &s->response);
+            session_send_response(s);
+            break;
+        }
+        
+        case STEP_SEND_RESPONSE: {
+            int result = session_flush(s);
+            if (result == 0) {
+                return;
+            }
+            if (result < 0) {
+                printf("Failed to send Type 2 Response to client %d\n", s->client_id);
+                session_close(s, STATE_IDLE);
+                return;
+            }
+            if (s->response.status == ADMIT_QUEUED) {
+                printf("Client %d queued for admission at position %d\n",
+                       s->client_id, s->response.queue_position);
+                s->step = STEP_WAIT_ADMIT;
+                timer_cancel(s, TIMER_HANDSHAKE);
+                timer_arm(s, TIMER_IDLE, ADMIT_QUEUE_TIMEOUT_MS);
+                timer_arm(s, TIMER_PACE, ADMIT_RETRY_MS);
+                return;
+            }
+            if (s->response.status == ADMIT_REJECTED) {
+                printf("Rejected client %d: no capacity for %s\n", s->client_id, s->response.resolution);
+                session_close(s, STATE_IDLE);
+                return;
+            }
+            printf("Sent Type 2 Response to client %d - Resolution: %s, Protocol: %s, Bandwidth: %d Kbps\n",
+                   s->client_id, s->response.resolution, s->response.protocol, s->response.bandwidth);
+            
+            // Close the connection phase socket; the slot now belongs to the scheduler
+            int client_id = s->client_id;
+            s->client_id = -1;
+            session_close(s, STATE_IDLE);
+            enqueue_client(client_id);
+            return;
+        }
+        
+        case STEP_RECV_CLIENT_ID:
+            if (session_recv(s, WIRE_CLIENT_ID_FRAME) < 0) {
+                printf("Failed to receive client ID\n");
+                print_socket_error("Receive error");
+                session_close(s, STATE_FINISHED);
+                return;
+            }
+            if (s->rx_len < WIRE_CLIENT_ID_FRAME) {
+                return;
+            }
+            if (!tcp_attach_client(s)) {
+                return;  // Rejected and closed
+            }
+            break;
+        
+        case STEP_SEND_READY: {
+            int result = session_flush(s);
+            if (result == 0) {
+                return;
+            }
+            if (result < 0) {
+                printf("*** ERROR: Failed to send READY_TO_STREAM message to client %d ***\n", s->client_id);
+                print_socket_error("Send error");
+                session_close(s, STATE_FINISHED);
+                return;
+            }
+            printf("*** Sent READY_TO_STREAM to TCP client %d ***\n", s->client_id);
+            printf("*** Waiting for START_STREAM from client %d (timeout: 5 seconds) ***\n", s->client_id);
+            s->rx_len = 0;
+            s->step = STEP_WAIT_START;
+            timer_cancel(s, TIMER_HANDSHAKE);
+            timer_arm(s, TIMER_IDLE, CONTROL_TIMEOUT_MS);
+            break;
+        }
+        
+        case STEP_WAIT_START: {
+            if (session_recv(s, FRAME_HEADER_SIZE) < 0) {
+                printf("*** ERROR: Client %d did not confirm stream start (error) ***\n", s->client_id);
+                print_socket_error("Receive error");
+                session_close(s, STATE_FINISHED);
+                return;
+            }
+            if (s->rx_len < FRAME_HEADER_SIZE) {
+                return;
+            }
+            FrameHeader h;
+            if (!wire_get_header(s->rx, &h) || h.type != FRAME_START || h.length != 0) {
+                printf("*** ERROR: Client %d sent incorrect confirmation (version %d, type %d) ***\n",
+                       s->client_id, h.version, h.type);
+                session_close(s, STATE_FINISHED);
+                return;
+            }
+            printf("*** Client %d confirmed TCP stream start ***\n", s->client_id);
+            timer_cancel(s, TIMER_IDLE);
+            s->rx_len = 0;
+            s->send_calls = 0;
+            s->send_blocked = 0;
+            s->chunk_id = 1;
+            pacer_init(&s->pacer, s->resolution, TCP_CHUNK_SIZE, get_monotonic_time());
+            share_init(&s->share, s->resolution, TCP_CHUNK_SIZE, get_monotonic_time());
+            tcp_encode_chunk(s);
+            return;
+        }
+        
+        case STEP_SEND_CHUNK: {
+            int result = session_flush(s);
+            if (result == 0) {
+                return;
             }
+            if (result < 0) {
+                log_warning("Failed to send TCP chunk to client %d", s->client_id);
+                print_socket_error("Send error");
+                session_close(s, STATE_FINISHED);
+                return;
+            }
+            tcp_chunk_sent(s);
+            return;
         }
         
-        if (total_sent < TCP_CHUNK_SIZE) {
-            log_message("Failed to send complete chunk %d to client %d after %d retries", 
-                   i, client_id, max_send_retries);
-            break;
+        default:
+            // STEP_ENCODE / STEP_PACE / STEP_LINK_DELAY / STEP_WAIT_ADMIT / STEP_DRAIN:
+            // nothing to do until the timer fires
+            return;
         }
-        
-        // Calculate latency (in a real system we'd get ACKs)
-        double latency_ms = (get_time() - send_time) * 1000.0; // Convert to ms
-        total_latency += latency_ms;
-        measured_chunks++;
-        
-        // Update average latency
-        if (measured_chunks > 0) {
-#ifdef _WIN32
-            MUTEX_LOCK(stats_mutex);
-#else
-            pthread_mutex_lock(&stats_mutex);
-#endif
-            client_stats[client_id].latency = total_latency / measured_chunks;
-#ifdef _WIN32
-            MUTEX_UNLOCK(stats_mutex);
-#else
-            pthread_mutex_unlock(&stats_mutex);
-#endif
+    }
+}
+
+// Socket event on a session. Once a TCP stream runs, anything readable is
+// the client's acks; an end of file before STEP_DRAIN means it went away.
+void session_event(Session *s, uint32_t events) {
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && s->protocol == MODE_TCP &&
+        s->state == STATE_STREAMING && s->step != STEP_SEND_READY && s->step != STEP_WAIT_START) {
+        if (session_read_acks(s) < 0) {
+            if (s->step != STEP_DRAIN) {
+                log_warning("TCP client %d closed its stream at chunk %d", s->client_id, s->chunk_id);
+            }
+            session_close(s, STATE_FINISHED);
+            return;
         }
-        
-        log_message("Sent chunk %d/%d to TCP client %d", i, VIDEO_CHUNKS, client_id);
-        update_stats(client_id, total_sent, "TCP");
-        
-        // Simulate bandwidth limitations but don't delay too much
-        int bandwidth = estimate_bandwidth(resolution);
-        int delay_ms = (TCP_CHUNK_SIZE * 8) / bandwidth; // time in ms to send this chunk at specified bandwidth
-        delay_ms = delay_ms > 500 ? 500 : delay_ms; // Cap at 500ms max delay
-        usleep(delay_ms * 1000);
     }
+    session_drive(s);
+}
+
+// Answer a queued client once admission control lets it in, or when it
+// gave up waiting
+void session_admit(Session *s, bool give_up) {
+    if (give_up) {
+        admit_withdraw(s->client_id, &s->response);
+    } else if (!admit_poll(s->client_id, &s->response)) {
+        timer_arm(s, TIMER_PACE, ADMIT_RETRY_MS);
+        return;
+    }
+    timer_cancel(s, TIMER_IDLE);
+    timer_cancel(s, TIMER_PACE);
+    timer_arm(s, TIMER_HANDSHAKE, CONTROL_TIMEOUT_MS);
+    session_send_response(s);
+    session_drive(s);
+}
+
+// One of the session's timers expired
+void session_timeout(Session *s, int kind) {
+    switch (kind) {
+    case TIMER_HANDSHAKE:
+        switch (s->step) {
+        case STEP_RECV_REQUEST:
+            printf("Failed to receive Type 1 Request from client %d (timeout)\n", s->client_id);
+            session_close(s, STATE_IDLE);
+            break;
+        case STEP_SEND_RESPONSE:
+            printf("Failed to send Type 2 Response to client %d (timeout)\n", s->client_id);
+            session_close(s, STATE_IDLE);
+            break;
+        case STEP_RECV_CLIENT_ID:
+            printf("Failed to receive client ID (timeout)\n");
+            session_close(s, STATE_FINISHED);
+            break;
+        case STEP_SEND_READY:
+            printf("*** ERROR: Failed to send READY_TO_STREAM to client %d (timeout) ***\n", s->client_id);
+            session_close(s, STATE_FINISHED);
+            break;
+        }
+        break;
     
-    log_message("TCP streaming completed for client %d", client_id);
+    case TIMER_IDLE:
+        if (s->step == STEP_DRAIN) {
+            session_close(s, STATE_FINISHED);  // The client never closed its end
+            break;
+        }
+        if (s->step == STEP_WAIT_ADMIT) {
+            session_admit(s, true);
+            break;
+        }
+        if (s->protocol == MODE_UDP) {
+            log_warning("UDP client %d did not request streaming within %d ms", 
+                   s->client_id, UDP_REQUEST_TIMEOUT_MS);
+        } else {
+            printf("*** ERROR: Client %d did not confirm stream start (timeout) ***\n", s->client_id);
+        }
+        session_close(s, STATE_FINISHED);
+        break;
     
-    CLOSE_SOCKET(client_socket);
+    case TIMER_STALL: {
+        if (s->step != STEP_SEND_CHUNK) {
+            break;
+        }
+        // Progress since the timer was armed only moves the deadline
+        double stall_deadline = s->tx.last_progress + server_config.send_stall_ms / 1000.0;
+        if (stall_deadline > get_monotonic_time()) {
+            timer_arm_at(s, TIMER_STALL, stall_deadline);
+            break;
+        }
+        log_warning("Failed to send complete chunk %d to client %d: no progress for %d ms", 
+               s->chunk_id, s->client_id, server_config.send_stall_ms);
+        session_close(s, STATE_FINISHED);
+        break;
+    }
     
-#ifdef _WIN32
-    MUTEX_LOCK(stats_mutex);
-#else
+    case TIMER_PACE:
+        if (s->step == STEP_WAIT_ADMIT) {
+            session_admit(s, false);
+        } else if (s->protocol == MODE_UDP) {
+            udp_send_next(s);
+        } else if (s->step == STEP_LINK_DELAY) {
+            tcp_send_chunk(s);
+        } else {
+            tcp_start_chunk(s);
+        }
+        break;
+    }
+}
+
+// Wake a reactor whose inbox just gained work
+void reactor_wake(Reactor *r) {
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        print_socket_error("eventfd write failed");
+    }
+}
+
+// Hand a session to another reactor's thread
+void reactor_post(Reactor *r, Session *s) {
+    s->reactor = r;
+    pthread_mutex_lock(&r->inbox_mutex);
+    s->next = r->inbox;
+    r->inbox = s;
+    pthread_mutex_unlock(&r->inbox_mutex);
+    reactor_wake(r);
+}
+
+// Reactor holding the pending session of a UDP client. With --udp-steer the
+// cBPF program in start_reactors() applies the same function, so the
+// client's REQUEST_STREAM lands on this reactor's socket.
+Reactor *udp_home_reactor(struct in_addr addr) {
+    return &reactors[ntohl(addr.s_addr) % (uint32_t)reactor_count];
+}
+
+// Called by the scheduler once a UDP client has been selected. The session
+// waits on its home reactor until the client's REQUEST_STREAM shows up.
+void reactor_start_udp_session(int client_id) {
     pthread_mutex_lock(&stats_mutex);
-#endif
-    client_stats[client_id].state = STATE_FINISHED;
-    client_stats[client_id].active = 0;
-    client_stats[client_id].socket_fd = INVALID_SOCKET_VALUE; // Reset socket_fd
-#ifdef _WIN32
-    MUTEX_UNLOCK(stats_mutex);
-#else
+    Reactor *home = udp_home_reactor(CLIENT_STATS(client_id).address.sin_addr);
     pthread_mutex_unlock(&stats_mutex);
-#endif
     
-#ifdef _WIN32
-    return 0;
-#else
-    return NULL;
-#endif
-}
-
-// Handle UDP streaming for a client
-THREAD_RETURN_TYPE handle_udp_streaming(THREAD_PARAM arg) {
-    int client_id = *((int *)arg);
-    free(arg);
+    Session *s = session_new(home, MODE_UDP);
+    if (s == NULL) {
+        release_client(client_id, STATE_FINISHED);
+        return;
+    }
     
-#ifdef _WIN32
-    MUTEX_LOCK(stats_mutex);
-#else
     pthread_mutex_lock(&stats_mutex);
-#endif
-    client_stats[client_id].state = STATE_STREAMING;
-    client_stats[client_id].start_time = get_time();
-    client_stats[client_id].packets_dropped = 0;
-    struct sockaddr_in client_addr = client_stats[client_id].address;
-    char resolution[10];
-    strncpy(resolution, client_stats[client_id].resolution, sizeof(resolution));
-#ifdef _WIN32
-    MUTEX_UNLOCK(stats_mutex);
-#else
+    stats_stream_started(client_id);
+    s->peer = CLIENT_STATS(client_id).address;
+    strncpy(s->resolution, CLIENT_STATS(client_id).resolution, sizeof(s->resolution));
+    s->resolution[sizeof(s->resolution) - 1] = '\0';
     pthread_mutex_unlock(&stats_mutex);
-#endif
     
+    s->client_id = client_id;
+    s->state = STATE_STREAMING;
+    s->step = STEP_WAIT_START;
     log_message("Starting UDP streaming for client %d", client_id);
+    reactor_post(home, s);
+}
 
-    // We'll use the shared UDP socket that's already bound to the server port
+// Begin streaming a UDP session from this reactor's socket. The client's
+// later datagrams hash to the same socket, so the session stays here.
+void udp_stream_start(Reactor *r, Session *s) {
+    wire_put_header(s->frame, FRAME_READY, udp_ready_flags(), 0, 0);
+    sendto(r->udp_fd, s->frame, FRAME_HEADER_SIZE, 0, (struct sockaddr *)&s->peer, sizeof(s->peer));
+    log_message("Sending READY_TO_STREAM to UDP client %d", s->client_id);
+    
+    s->chunk_id = 1;
+    session_entry(s->client_id)->udp_session = s;
+    pacer_init(&s->pacer, s->resolution, UDP_CHUNK_SIZE, get_monotonic_time());
+    share_init(&s->share, s->resolution, UDP_CHUNK_SIZE, get_monotonic_time());
+    fec_start(&s->fec, s->resolution);
+    s->step = STEP_SEND_CHUNK;
+    udp_send_next(s);
+}
 
-    log_message("UDP streaming thread using shared socket on port %d for client %d", 
-           server_port, client_id);
+// Start the waiting session a REQUEST_STREAM was routed to. `via` is the
+// reactor whose socket received it; the session moves there if needed.
+void udp_request_stream(Reactor *r, Reactor *via, const struct sockaddr_in *sender,
+                        int client_id) {
+    Session **link = &r->udp_pending;
+    while (*link != NULL && (*link)->client_id != client_id) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        return;  // Timed out or already matched by a duplicate request
+    }
+    Session *s = *link;
+    *link = s->next;
+    timer_cancel(s, TIMER_IDLE);
     
-    // Wait for client to send a message to initiate streaming
-    char buffer[BUFFER_SIZE] = {0};
-    log_message("Waiting for UDP REQUEST_STREAM message from client %d...", client_id);
+    log_message("Received from client %d: REQUEST_STREAM", s->client_id);
     
-    int retries = 0;
-    int max_retries = 5;
-    bool got_request = false;
+    // Re-key the session with the client's UDP port, which can be
+    // different from the TCP port
+    udp_table_remove(s->peer.sin_addr.s_addr, 0, s->client_id);
+    udp_table_insert(sender->sin_addr.s_addr, sender->sin_port, s->client_id, via->id);
+    s->peer = *sender;
+    pthread_mutex_lock(&stats_mutex);
+    CLIENT_STATS(s->client_id).address = *sender;
+    pthread_mutex_unlock(&stats_mutex);
     
-    // Process incoming UDP messages to find our client
-    while (retries < max_retries && !got_request) {
-#ifdef _WIN32
-        MUTEX_LOCK(udp_mutex);
-#else
-        pthread_mutex_lock(&udp_mutex);
-#endif
-        memset(buffer, 0, BUFFER_SIZE);
+    if (via != r) {
+        // No timers are armed, so the session can change threads
+        __atomic_add_fetch(&udp_sessions_moved, 1, __ATOMIC_RELAXED);
+        s->step = STEP_SEND_CHUNK;
+        reactor_post(via, s);
+        return;
+    }
+    udp_stream_start(r, s);
+}
+
+// Pick up sessions and requests handed over by other threads
+void reactor_drain_inbox(Reactor *r) {
+    uint64_t count;
+    if (read(r->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        print_socket_error("eventfd read failed");
+    }
+    
+    pthread_mutex_lock(&r->inbox_mutex);
+    Session *list = r->inbox;
+    UdpRequest *requests = r->requests;
+    r->inbox = NULL;
+    r->requests = NULL;
+    pthread_mutex_unlock(&r->inbox_mutex);
+    
+    while (list != NULL) {
+        Session *s = list;
+        list = list->next;
+        if (s->step != STEP_WAIT_START) {
+            // Moved here because this reactor's socket got its REQUEST_STREAM
+            udp_stream_start(r, s);
+            continue;
+        }
+        // New UDP session from the scheduler: wait for the client's REQUEST_STREAM
+        s->next = r->udp_pending;
+        r->udp_pending = s;
+        if (!udp_table_insert(s->peer.sin_addr.s_addr, 0, s->client_id, r->id)) {
+            log_warning("UDP session table full, dropping client %d", s->client_id);
+            session_close(s, STATE_FINISHED);
+            continue;
+        }
+        timer_arm(s, TIMER_IDLE, UDP_REQUEST_TIMEOUT_MS);
+        log_message("Waiting for UDP REQUEST_STREAM message from client %d...", s->client_id);
+        
+        // The client may have sent it as soon as it was admitted. Pairs
+        // with the fence in reactor_read_udp(): either we see the parked
+        // request or the reader sees our key; a request matched twice is
+        // dropped by udp_request_stream().
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        SessionEntry *e = session_entry(s->client_id);
+        if (__atomic_load_n(&e->udp_request_ready, __ATOMIC_ACQUIRE)) {
+            udp_request_stream(r, &reactors[e->udp_request_via], &e->udp_request_from, s->client_id);
+        }
+    }
+    
+    while (requests != NULL) {
+        UdpRequest *req = requests;
+        requests = requests->next;
+        udp_request_stream(r, req->via, &req->sender, req->client_id);
+        free(req);
+    }
+}
+
+// Drain this reactor's UDP socket. Each REQUEST_STREAM is looked up in the
+// UDP session table and forwarded if its session waits on another reactor.
+void reactor_read_udp(Reactor *r) {
+    uint8_t buffer[BUFFER_SIZE];
+    while (1) {
         struct sockaddr_in sender_addr;
         socklen_t sender_len = sizeof(sender_addr);
-        
-        // Set a timeout for recvfrom to avoid blocking indefinitely
-#ifdef _WIN32
-        DWORD tv_ms = 1000;  // 1 second timeout
-        setsockopt(udp_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv_ms, sizeof(tv_ms));
-#else
-        struct timeval tv;
-        tv.tv_sec = 1;  // 1 second timeout
-        tv.tv_usec = 0;
-        setsockopt(udp_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-#endif
-        
-        int bytes_received = recvfrom(udp_socket, buffer, BUFFER_SIZE, 0,
+        int bytes_received = recvfrom(r->udp_fd, buffer, BUFFER_SIZE, 0,
                                       (struct sockaddr *)&sender_addr, &sender_len);
+        if (bytes_received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                print_socket_error("UDP recvfrom error");
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        // Acks and NACKs come in on the socket the stream goes out of, so
+        // this reactor owns the session and is the only reader of both
+        ChunkAck ack;
+        if (wire_decode_ack(buffer, bytes_received, &ack)) {
+            if (udp_table_lookup(sender_addr.sin_addr.s_addr, sender_addr.sin_port, ack.client_id) == r->id) {
+                latency_record_ack(ack.client_id, &ack);
+            }
+            continue;
+        }
+        ChunkNack nack;
+        if (wire_decode_nack(buffer, bytes_received, &nack)) {
+            if (server_config.nack &&
+                udp_table_lookup(sender_addr.sin_addr.s_addr, sender_addr.sin_port, nack.client_id) == r->id &&
+                session_entry(nack.client_id)->udp_session != NULL) {
+                udp_answer_nack(session_entry(nack.client_id)->udp_session, &nack);
+            }
+            continue;
+        }
         
-        if (bytes_received > 0) {
-            // Check if the sender is our client
-            char sender_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(sender_addr.sin_addr), sender_ip, INET_ADDRSTRLEN);
-            
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-            
-            if (strcmp(sender_ip, client_ip) == 0 && 
-                strcmp(buffer, "REQUEST_STREAM") == 0) {
-                log_message("Received from client %d: REQUEST_STREAM", client_id);
-                got_request = true;
-                
-                // Store the client's UDP port which can be different from the TCP port
-#ifdef _WIN32
-                MUTEX_LOCK(stats_mutex);
-#else
-                pthread_mutex_lock(&stats_mutex);
-#endif
-                client_stats[client_id].address = sender_addr;
-#ifdef _WIN32
-                MUTEX_UNLOCK(stats_mutex);
-#else
-                pthread_mutex_unlock(&stats_mutex);
-#endif
-                
-                // Send ready message
-                sendto(udp_socket, "READY_TO_STREAM", strlen("READY_TO_STREAM"), 0,
-                       (struct sockaddr *)&sender_addr, sender_len);
-                log_message("Sending READY_TO_STREAM to UDP client %d", client_id);
+        int client_id;
+        if (!wire_decode_client_id(buffer, bytes_received, FRAME_REQUEST_STREAM, &client_id)) {
+            continue;
+        }
+        int owner = udp_route_request(&sender_addr, client_id);
+        if (owner == UDP_OWNER_NONE) {
+            // Admitted but not handed to a reactor yet: park the request
+            // for reactor_drain_inbox(), then look again in case the
+            // session got there while we did
+            SessionEntry *e = session_entry(client_id);
+            e->udp_request_from = sender_addr;
+            e->udp_request_via = r->id;
+            __atomic_store_n(&e->udp_request_ready, 1, __ATOMIC_RELEASE);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            owner = udp_route_request(&sender_addr, client_id);
+        }
+        if (owner < 0 || owner >= reactor_count) {
+            continue;
+        }
+        if (owner == r->id) {
+            udp_request_stream(r, r, &sender_addr, client_id);
+            continue;
+        }
+        
+        Reactor *home = &reactors[owner];
+        UdpRequest *req = malloc(sizeof(UdpRequest));
+        if (req == NULL) {
+            continue;
+        }
+        req->sender = sender_addr;
+        req->client_id = client_id;
+        req->via = r;
+        pthread_mutex_lock(&home->inbox_mutex);
+        req->next = home->requests;
+        home->requests = req;
+        pthread_mutex_unlock(&home->inbox_mutex);
+        reactor_wake(home);
+    }
+}
+
+// Accept every pending connection on a listening socket
+void reactor_accept(Reactor *r, socket_t listener, int step) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        socket_t client_socket = accept4(listener, (struct sockaddr *)&client_addr, &addr_len,
+                                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == INVALID_SOCKET_VALUE) {
+            if (errno == EINTR) {
+                continue;
             }
-        } else if (bytes_received < 0) {
-#ifdef _WIN32
-            if (WSAGetLastError() != WSAETIMEDOUT) {
-#else
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
-#endif
-                print_socket_error("UDP recvfrom error");
-#ifdef _WIN32
-                MUTEX_UNLOCK(udp_mutex);
-#else
-                pthread_mutex_unlock(&udp_mutex);
-#endif
-                break;
+                print_socket_error(step == STEP_RECV_REQUEST ? "Accept failed" :
+                                   "Accept failed for TCP streaming connection");
             }
+            return;
         }
         
-#ifdef _WIN32
-        MUTEX_UNLOCK(udp_mutex);
-#else
-        pthread_mutex_unlock(&udp_mutex);
-#endif
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        
+        Session *s = session_new(r, MODE_TCP);
+        if (s == NULL) {
+            CLOSE_SOCKET(client_socket);
+            continue;
+        }
+        s->fd = client_socket;
+        s->peer = client_addr;
+        s->state = STATE_CONNECTION;
+        s->step = step;
+        
+        if (step == STEP_RECV_REQUEST) {
+            s->client_id = register_client(&client_addr);
+            if (s->client_id == -1) {
+                printf("Maximum client limit reached, rejecting new connection from %s\n", client_ip);
+                session_close(s, STATE_IDLE);
+                continue;
+            }
+            printf("Client %d connected: %s\n", s->client_id, client_ip);
+        } else {
+            printf("TCP streaming connection from %s\n", client_ip);
+            if (server_config.sndbuf > 0 &&
+                setsockopt(client_socket, SOL_SOCKET, SO_SNDBUF, &server_config.sndbuf,
+                           sizeof(server_config.sndbuf)) < 0) {
+                print_socket_error("setsockopt SO_SNDBUF failed");
+            }
+        }
         
-        if (!got_request) {
-            retries++;
-            usleep(500000); // 500ms
+        if (session_watch(s) < 0) {
+            print_socket_error("epoll_ctl failed");
+            session_close(s, STATE_IDLE);
+            continue;
+        }
+        timer_arm(s, TIMER_HANDSHAKE, CONTROL_TIMEOUT_MS);
+        session_drive(s);
+    }
+}
+
+// epoll_wait() timeout: until the next timer or held datagram is due
+int reactor_next_timeout(Reactor *r) {
+    int timeout = timer_next_timeout(r);
+    double release = delay_line_next(&r->udp_batch.delayed);
+    if (release > 0) {
+        double wait = release - get_monotonic_time();
+        int ms = wait <= 0 ? 0 : (int)(wait * 1000.0) + 1;
+        if (timeout < 0 || ms < timeout) {
+            timeout = ms;
         }
     }
+    return timeout;
+}
+
+// Event loop of one reactor
+THREAD_RETURN_TYPE reactor_thread(THREAD_PARAM arg) {
+    Reactor *r = (Reactor *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    
+    while (1) {
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, reactor_next_timeout(r));
+        if (n < 0 && errno != EINTR) {
+            print_socket_error("epoll_wait failed");
+        }
+        
+        for (int i = 0; i < n; i++) {
+            switch (*(int *)events[i].data.ptr) {
+            case SOURCE_CONTROL_LISTENER:
+                reactor_accept(r, server_fd, STEP_RECV_REQUEST);
+                break;
+            case SOURCE_STREAM_LISTENER:
+                reactor_accept(r, tcp_streaming_socket, STEP_RECV_CLIENT_ID);
+                break;
+            case SOURCE_UDP_SOCKET:
+                reactor_read_udp(r);
+                break;
+            case SOURCE_WAKEUP:
+                reactor_drain_inbox(r);
+                break;
+            case SOURCE_SESSION:
+                session_event((Session *)events[i].data.ptr, events[i].events);
+                break;
+            }
+        }
+        
+        wheel_advance(&r->wheel);
+        udp_batch_release(&r->udp_batch, get_monotonic_time());
+        udp_batch_flush(&r->udp_batch);
+    }
     
-    if (!got_request) {
-        log_message("UDP client %d did not request streaming after %d attempts", 
-               client_id, max_retries);
-#ifdef _WIN32
-        MUTEX_LOCK(stats_mutex);
-#else
-        pthread_mutex_lock(&stats_mutex);
-#endif
-        client_stats[client_id].state = STATE_FINISHED;
-        client_stats[client_id].active = 0;
 #ifdef _WIN32
-        MUTEX_UNLOCK(stats_mutex);
+    return 0;
 #else
-        pthread_mutex_unlock(&stats_mutex);
+    return NULL;
 #endif
-#ifdef _WIN32
+}
+
+// Add a listening socket (or eventfd) to a reactor's epoll set
+int reactor_watch(Reactor *r, int fd, int *source, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = source;
+    return epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Open another UDP socket on server_port in udp_socket's SO_REUSEPORT group
+socket_t open_reuseport_udp_socket() {
+    int opt = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(server_port);
+    
+    socket_t fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == INVALID_SOCKET_VALUE) {
+        return INVALID_SOCKET_VALUE;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 ||
+        bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        CLOSE_SOCKET(fd);
+        return INVALID_SOCKET_VALUE;
+    }
+    return fd;
+}
+
+// Replace the kernel's 4-tuple hash with source IP % reactor_count. Sockets
+// are numbered in bind order, which is reactor order, so this matches
+// udp_home_reactor() and pending sessions never change threads.
+int attach_udp_steering() {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },  // IPv4 source address
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)reactor_count },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    return setsockopt(udp_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+// Create the reactors. Every reactor accepts on both TCP listeners
+// (EPOLLEXCLUSIVE wakes only one of them per connection) and reads its own
+// UDP socket; reactor 0 uses udp_socket, the others join its SO_REUSEPORT
+// group. Reactor 0 runs on the calling thread later.
+int start_reactors() {
+    reactor_count = server_config.reactors;
+    if (reactor_count <= 0) {
+        reactor_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (reactor_count <= 0) {
+            reactor_count = 1;
+        }
+    }
+    
+    reactors = calloc(reactor_count, sizeof(Reactor));
+    if (reactors == NULL) {
+        perror("Memory allocation failed");
         return 0;
-#else
-        return NULL;
-#endif
     }
-    
-    // Send video chunks
-    char video_chunk[UDP_CHUNK_SIZE];
-    memset(video_chunk, 0, UDP_CHUNK_SIZE);
-    
-    // Initialize random seed for packet loss simulation
-    srand((unsigned int)time(NULL) + client_id);
-    
-    // Tracking variables for latency calculation
-    double total_latency = 0.0;
-    int measured_chunks = 0;
-    
-    for (int i = 1; i <= VIDEO_CHUNKS; i++) {
-        // Generate a chunk of video data specifically for UDP
-        int header_len = snprintf(video_chunk, 100, "VIDEO_CHUNK_%d_%s_", i, resolution);
-        
-        // Fill the rest with pattern data up to UDP_CHUNK_SIZE
-        char pattern[10] = "VIDEODATA";
-        for (int j = header_len; j < UDP_CHUNK_SIZE - 1; j += 9) {
-            int space_left = UDP_CHUNK_SIZE - j - 1;
-            int copy_size = (space_left < 9) ? space_left : 9;
-            memcpy(video_chunk + j, pattern, copy_size);
+    
+    for (int i = 0; i < reactor_count; i++) {
+        Reactor *r = &reactors[i];
+        r->id = i;
+        r->wake_source = SOURCE_WAKEUP;
+        r->udp_source = SOURCE_UDP_SOCKET;
+        r->wheel.origin = get_monotonic_time();
+        r->udp_fd = (i == 0) ? udp_socket : open_reuseport_udp_socket();
+        if (r->udp_fd == INVALID_SOCKET_VALUE) {
+            print_socket_error("Failed to open reactor UDP socket");
+            return 0;
+        }
+        udp_batch_init(&r->udp_batch, r->udp_fd, server_config.udp_batch, server_config.udp_gso);
+        pthread_mutex_init(&r->inbox_mutex, NULL);
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (r->epoll_fd < 0 || r->wake_fd < 0) {
+            print_socket_error("Failed to create reactor");
+            return 0;
+        }
+        if (reactor_watch(r, r->wake_fd, &r->wake_source, EPOLLIN) < 0 ||
+            reactor_watch(r, server_fd, &control_listener_source, EPOLLIN | EPOLLEXCLUSIVE) < 0 ||
+            reactor_watch(r, tcp_streaming_socket, &stream_listener_source, EPOLLIN | EPOLLEXCLUSIVE) < 0 ||
+            reactor_watch(r, r->udp_fd, &r->udp_source, EPOLLIN | EPOLLET) < 0) {
+            print_socket_error("Failed to register reactor sockets");
+            return 0;
+        }
+    }
+    
+    if (server_config.udp_steer && reactor_count > 1 && attach_udp_steering() < 0) {
+        print_socket_error("SO_ATTACH_REUSEPORT_CBPF failed, using the kernel's hash");
+    }
+    
+    for (int i = 1; i < reactor_count; i++) {
+        if (!THREAD_CREATE(reactors[i].thread, reactor_thread, &reactors[i])) {
+            print_socket_error("Failed to create reactor thread");
+            return 0;
+        }
+        THREAD_DETACH(reactors[i].thread);
+    }
+    
+    printf("Started %d event-loop reactor%s (UDP batch %d, GSO %s, UDP steering %s)\n", reactor_count,
+           reactor_count == 1 ? "" : "s", reactors[0].udp_batch.limit,
+           reactors[0].udp_batch.gso ? "on" : "off", server_config.udp_steer ? "by IP" : "kernel hash");
+    return 1;
+}
+
+// ---- UDP send path benchmark (--bench-udp) ----
+
+#define BENCH_SINKS 8           // Receiving sockets, one per simulated client
+#define BENCH_BURST 4           // Datagrams per client per flush
+
+typedef struct {
+    socket_t fds[BENCH_SINKS];
+    volatile int stop;
+} BenchSink;
+
+// Drain the receiving sockets so loopback delivery stays realistic
+THREAD_RETURN_TYPE bench_sink_thread(THREAD_PARAM arg) {
+    BenchSink *sink = (BenchSink *)arg;
+    static char buffers[16][UDP_CHUNK_SIZE];
+    struct mmsghdr msgs[16];
+    struct iovec iov[16];
+    struct pollfd pfds[BENCH_SINKS];
+    for (int i = 0; i < BENCH_SINKS; i++) {
+        pfds[i].fd = sink->fds[i];
+        pfds[i].events = POLLIN;
+    }
+    while (!sink->stop) {
+        if (poll(pfds, BENCH_SINKS, 100) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < BENCH_SINKS; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            for (int m = 0; m < 16; m++) {
+                iov[m].iov_base = buffers[m];
+                iov[m].iov_len = UDP_CHUNK_SIZE;
+                memset(&msgs[m].msg_hdr, 0, sizeof(msgs[m].msg_hdr));
+                msgs[m].msg_hdr.msg_iov = &iov[m];
+                msgs[m].msg_hdr.msg_iovlen = 1;
+            }
+            while (recvmmsg(sink->fds[i], msgs, 16, MSG_DONTWAIT, NULL) > 0) {
+            }
+        }
+    }
+    return NULL;
+}
+
+double thread_cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+// Send UDP_CHUNK_SIZE datagrams to the sinks for `seconds` using one of the
+// send paths and print packets per second and sender CPU per Gbit
+void bench_udp_mode(const char *name, socket_t fd, struct sockaddr_in *sinks,
+                    int batch_limit, bool gso, double seconds) {
+    UdpBatch *batch = NULL;
+    if (batch_limit > 0) {
+        batch = malloc(sizeof(UdpBatch));
+        if (batch == NULL) {
+            perror("Memory allocation failed");
+            return;
         }
-        
-        // Ensure null termination
-        video_chunk[UDP_CHUNK_SIZE - 1] = '\0';
-        
-        // Simulate random packet loss for UDP
-        if (rand() % 100 < UDP_PACKET_LOSS_RATE) {
-            log_message("Simulating packet loss for chunk %d to UDP client %d", i, client_id);
-            
-#ifdef _WIN32
-            MUTEX_LOCK(stats_mutex);
-#else
-            pthread_mutex_lock(&stats_mutex);
-#endif
-            client_stats[client_id].packets_dropped++;
-#ifdef _WIN32
-            MUTEX_UNLOCK(stats_mutex);
-#else
-            pthread_mutex_unlock(&stats_mutex);
-#endif
-            
-            // Skip sending but still track stats
-            update_stats(client_id, 0, "UDP");
-            continue;
+        udp_batch_init(batch, fd, batch_limit, gso);
+        if (gso && !batch->gso) {
+            printf("%-16s skipped: UDP_SEGMENT not supported\n", name);
+            free(batch);
+            return;
         }
-        
-        // Send chunk to client
-#ifdef _WIN32
-        MUTEX_LOCK(udp_mutex);
-#else
-        pthread_mutex_lock(&udp_mutex);
-#endif
-        socklen_t client_len = sizeof(struct sockaddr_in);
-        
-        // Measure latency
-        double send_time = get_time();
-        
-        int send_result = sendto(udp_socket, video_chunk, UDP_CHUNK_SIZE, 0,
-               (struct sockaddr *)&client_stats[client_id].address, client_len);
-        
-        if (send_result < 0) {
-            print_socket_error("UDP sendto error");
-        } else {
-            // Simulate network latency measurement (in a real system, we'd get ACKs)
-            double latency_ms = (get_time() - send_time) * 1000.0; // Convert to ms
-            total_latency += latency_ms;
-            measured_chunks++;
-            
-            // Update average latency
-            if (measured_chunks > 0) {
-#ifdef _WIN32
-                MUTEX_LOCK(stats_mutex);
-#else
-                pthread_mutex_lock(&stats_mutex);
-#endif
-                client_stats[client_id].latency = total_latency / measured_chunks;
-#ifdef _WIN32
-                MUTEX_UNLOCK(stats_mutex);
-#else
-                pthread_mutex_unlock(&stats_mutex);
-#endif
+    }
+    
+    VideoChunk *chunk = chunk_acquire("720p", CHUNK_CLASS_UDP, 1);
+    unsigned long datagrams = 0;
+    unsigned long syscalls = 0;
+    double start = get_monotonic_time();
+    double cpu_start = thread_cpu_seconds();
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        for (int k = 0; k < BENCH_SINKS; k++) {
+            for (int b = 0; b < BENCH_BURST; b++) {
+                if (batch != NULL) {
+                    __atomic_add_fetch(&chunk->refcount, 1, __ATOMIC_RELAXED);
+                    udp_batch_add(batch, NULL, chunk, &sinks[k], 0, NULL);
+                } else {
+                    uint8_t header[FRAME_HEADER_SIZE];
+                    wire_put_chunk_header(header, chunk, 0);
+                    if (send_frame(fd, header, chunk->data, chunk->size, 0, &sinks[k]) == UDP_CHUNK_SIZE) {
+                        datagrams++;
+                    }
+                    syscalls++;
+                }
             }
         }
-#ifdef _WIN32
-        MUTEX_UNLOCK(udp_mutex);
-#else
-        pthread_mutex_unlock(&udp_mutex);
-#endif
-        
-        log_message("Sent chunk %d/%d to UDP client %d", i, VIDEO_CHUNKS, client_id);
-        
-        // Update statistics
-        update_stats(client_id, UDP_CHUNK_SIZE, "UDP");
-        
-        // Simulate bandwidth limitations
-        int bandwidth = estimate_bandwidth(resolution);
-        int delay_ms = (UDP_CHUNK_SIZE * 8) / bandwidth; // time in ms to send this chunk at specified bandwidth
-        usleep(delay_ms * 1000);
+        if (batch != NULL) {
+            udp_batch_flush(batch);
+        }
+        elapsed = get_monotonic_time() - start;
+    }
+    double cpu = thread_cpu_seconds() - cpu_start;
+    if (batch != NULL) {
+        datagrams = batch->datagrams;
+        syscalls = __atomic_exchange_n(&udp_send_syscalls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&udp_datagrams_sent, 0, __ATOMIC_RELAXED);
+        free(batch);
     }
+    chunk_release(chunk);
     
-    log_message("UDP streaming completed for client %d", client_id);
+    double gbits = datagrams * (double)UDP_CHUNK_SIZE * 8.0 / 1e9;
+    printf("%-16s %10.0f pps %7.2f Gbit/s %7.3f CPU s/Gbit %6.1f datagrams/syscall\n",
+           name, datagrams / elapsed, gbits / elapsed, gbits > 0 ? cpu / gbits : 0.0,
+           syscalls > 0 ? (double)datagrams / syscalls : 0.0);
+}
+
+// Compare the per-datagram sendto() path with sendmmsg() batches, with and
+// without GSO, over loopback
+int run_udp_benchmark(int argc, char *argv[]) {
+    double seconds = argc > 0 ? atof(argv[0]) : 2.0;
+    if (seconds <= 0) {
+        seconds = 2.0;
+    }
+    server_config.mtu = 0;  // Whole-chunk datagrams in every mode, like the sendto() baseline
+    
+    BenchSink sink;
+    struct sockaddr_in sinks[BENCH_SINKS];
+    sink.stop = 0;
+    for (int i = 0; i < BENCH_SINKS; i++) {
+        memset(&sinks[i], 0, sizeof(sinks[i]));
+        sinks[i].sin_family = AF_INET;
+        sinks[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(sinks[i]);
+        int rcvbuf = 4 * 1024 * 1024;
+        sink.fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        setsockopt(sink.fds[i], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (sink.fds[i] < 0 || bind(sink.fds[i], (struct sockaddr *)&sinks[i], sizeof(sinks[i])) < 0 ||
+            getsockname(sink.fds[i], (struct sockaddr *)&sinks[i], &len) < 0) {
+            print_socket_error("Benchmark socket setup failed");
+            return 1;
+        }
+    }
+    socket_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        print_socket_error("Benchmark socket setup failed");
+        return 1;
+    }
     
-    // Mark client as finished
-#ifdef _WIN32
-    MUTEX_LOCK(stats_mutex);
-#else
-    pthread_mutex_lock(&stats_mutex);
-#endif
-    client_stats[client_id].state = STATE_FINISHED;
-    client_stats[client_id].active = 0;
-#ifdef _WIN32
-    MUTEX_UNLOCK(stats_mutex);
-#else
-    pthread_mutex_unlock(&stats_mutex);
-#endif
+    thread_t sink_thread;
+    if (!THREAD_CREATE(sink_thread, bench_sink_thread, &sink)) {
+        perror("Failed to create benchmark thread");
+        return 1;
+    }
     
-#ifdef _WIN32
+    printf("UDP send benchmark: %d-byte datagrams, %d clients x %d per flush, %.1f s per mode\n",
+           UDP_CHUNK_SIZE, BENCH_SINKS, BENCH_BURST, seconds);
+    bench_udp_mode("sendto", fd, sinks, 0, false, seconds);
+    bench_udp_mode("sendmmsg", fd, sinks, UDP_BATCH_MAX, false, seconds);
+    bench_udp_mode("sendmmsg+GSO", fd, sinks, UDP_BATCH_MAX, true, seconds);
+    
+    sink.stop = 1;
+    THREAD_JOIN(sink_thread);
+    for (int i = 0; i < BENCH_SINKS; i++) {
+        CLOSE_SOCKET(sink.fds[i]);
+    }
+    CLOSE_SOCKET(fd);
     return 0;
-#else
-    return NULL;
-#endif
 }
+#endif // USE_EPOLL
 
 // Scheduler thread that manages streaming for all clients
 THREAD_RETURN_TYPE scheduler_thread(THREAD_PARAM arg) {
@@ -1423,86 +7234,13 @@ THREAD_RETURN_TYPE scheduler_thread(THREAD_PARAM arg) {
     (void)arg;
     
     printf("Scheduler started with %s policy\n", 
-           scheduling_policy == POLICY_FCFS ? "FCFS" : "Round-Robin");
+           policy_names[scheduling_policy]);
     
     while (1) {
-        int client_id;
-        bool client_found = false;
-        
-        if (scheduling_policy == POLICY_FCFS) {
-            // First-Come-First-Serve scheduling
-#ifdef _WIN32
-            MUTEX_LOCK(queue_mutex);
-#else
-            pthread_mutex_lock(&queue_mutex);
-#endif
-            if (queue_head != NULL) {
-                // Get client from queue without waiting
-                QueueNode *temp = queue_head;
-                client_id = temp->client_id;
-                queue_head = queue_head->next;
-                
-                if (queue_head == NULL) {
-                    queue_tail = NULL;
-                }
-                
-                free(temp);
-                client_found = true;
-                printf("Scheduler: Dequeued client %d for processing\n", client_id);
-            }
-#ifdef _WIN32
-            MUTEX_UNLOCK(queue_mutex);
-#else
-            pthread_mutex_unlock(&queue_mutex);
-#endif
-            
-            if (!client_found) {
-                // No clients waiting, sleep briefly and try again
-                usleep(50000); // 50ms
-                continue;
-            }
-        } else {
-            // Round-Robin scheduling
-#ifdef _WIN32
-            MUTEX_LOCK(stats_mutex);
-#else
-            pthread_mutex_lock(&stats_mutex);
-#endif
-            
-            // Find the next active client in a round-robin fashion
-            int start_id = current_rr_client;
-            
-            // Only consider clients in IDLE state and active
-            do {
-                current_rr_client = (current_rr_client + 1) % client_count;
-                
-                if (client_count > 0 && 
-                    client_stats[current_rr_client].state == STATE_IDLE && 
-                    client_stats[current_rr_client].active) {
-                    client_id = current_rr_client;
-                    client_found = true;
-                    break;
-                }
-            } while (current_rr_client != start_id && client_count > 0);
-            
-            if (client_found) {
-                // Mark as no longer IDLE to prevent repeated attempts
-                client_stats[client_id].state = STATE_CONNECTION;
-                printf("Scheduler: Selected client %d (RR mode)\n", client_id);
-            }
-            
-#ifdef _WIN32
-            MUTEX_UNLOCK(stats_mutex);
-#else
-            pthread_mutex_unlock(&stats_mutex);
-#endif
-            
-            if (!client_found) {
-                // If no idle client is found, wait for new clients
-                usleep(50000); // 50ms
-                continue;
-            }
-        }
+        // Blocks until a client is admitted; no polling
+        int client_id = dequeue_client();
+        printf("Scheduler: %s client %d for processing\n",
+               scheduling_policy == POLICY_FCFS ? "Dequeued" : "Selected (RR mode)", client_id);
         
         // Get the protocol from client stats
         char protocol[10];
@@ -1513,7 +7251,7 @@ THREAD_RETURN_TYPE scheduler_thread(THREAD_PARAM arg) {
 #endif
         
         // Double-check client is still valid
-        if (client_id >= client_count || !client_stats[client_id].active) {
+        if (!client_active(client_id)) {
 #ifdef _WIN32
             MUTEX_UNLOCK(stats_mutex);
 #else
@@ -1523,7 +7261,7 @@ THREAD_RETURN_TYPE scheduler_thread(THREAD_PARAM arg) {
             continue;
         }
         
-        strncpy(protocol, client_stats[client_id].protocol, sizeof(protocol) - 1);
+        strncpy(protocol, CLIENT_STATS(client_id).protocol, sizeof(protocol) - 1);
         protocol[sizeof(protocol) - 1] = '\0'; // Ensure null termination
 #ifdef _WIN32
         MUTEX_UNLOCK(stats_mutex);
@@ -1531,19 +7269,11 @@ THREAD_RETURN_TYPE scheduler_thread(THREAD_PARAM arg) {
         pthread_mutex_unlock(&stats_mutex);
 #endif
         
-        // Create a thread to handle the streaming for this client
-        thread_t thread_id;
-        int *client_arg = malloc(sizeof(int));
-        if (client_arg == NULL) {
-            perror("Memory allocation failed");
-            continue;
-        }
-        *client_arg = client_id;
-        
+        // Start streaming this client
         if (strcasecmp(protocol, "TCP") == 0) {
-            // For TCP clients, do not immediately start the streaming thread
+            // For TCP clients, do not immediately start streaming
             // The client will connect to the streaming socket, and then handle_tcp_connections
-            // will create the streaming thread
+            // will start the stream
             printf("Scheduler: Client %d (TCP) will connect to streaming socket\n", client_id);
             
             // Mark client as waiting for TCP connection
@@ -1552,42 +7282,25 @@ THREAD_RETURN_TYPE scheduler_thread(THREAD_PARAM arg) {
 #else
             pthread_mutex_lock(&stats_mutex);
 #endif
-            client_stats[client_id].state = STATE_CONNECTION;
+            CLIENT_STATS(client_id).state = STATE_CONNECTION;
 #ifdef _WIN32
             MUTEX_UNLOCK(stats_mutex);
 #else
             pthread_mutex_unlock(&stats_mutex);
 #endif
-            
-            // Don't free client_arg as we're not using it immediately
-            free(client_arg);
-            
         } else if (strcasecmp(protocol, "UDP") == 0) {
-            printf("Scheduler: Starting UDP streaming thread for client %d\n", client_id);
-            THREAD_CREATE(thread_id, handle_udp_streaming, client_arg);
-            THREAD_DETACH(thread_id);
+            printf("Scheduler: Starting UDP streaming session for client %d\n", client_id);
+#ifdef USE_EPOLL
+            reactor_start_udp_session(client_id);
+#else
+            stream_task_start(client_id, MODE_UDP);
+#endif
         } else {
             printf("Unknown protocol for client %d: %s\n", client_id, protocol);
-            free(client_arg);
             
             // Mark client as finished if protocol is unknown
-#ifdef _WIN32
-            MUTEX_LOCK(stats_mutex);
-#else
-            pthread_mutex_lock(&stats_mutex);
-#endif
-            client_stats[client_id].state = STATE_FINISHED;
-            client_stats[client_id].active = 0;
-#ifdef _WIN32
-            MUTEX_UNLOCK(stats_mutex);
-#else
-            pthread_mutex_unlock(&stats_mutex);
-#endif
+            release_client(client_id, STATE_FINISHED);
         }
-        
-        // Small delay to prevent CPU hogging, but don't wait for stream to complete
-        // Reduced delay to make scheduler more responsive to new clients
-        usleep(5000); // 5ms delay (down from 10ms)
     }
     
 #ifdef _WIN32
@@ -1597,6 +7310,7 @@ THREAD_RETURN_TYPE scheduler_thread(THREAD_PARAM arg) {
 #endif
 }
 
+#ifndef USE_EPOLL
 // Thread to accept TCP streaming connections
 THREAD_RETURN_TYPE handle_tcp_connections(THREAD_PARAM arg) {
     (void)arg; // Silence unused parameter warning
@@ -1630,15 +7344,20 @@ THREAD_RETURN_TYPE handle_tcp_connections(THREAD_PARAM arg) {
 #endif
         
         // Receive client_id from the client
-        char id_buffer[32] = {0};
-        if (recv(client_socket, id_buffer, sizeof(id_buffer) - 1, 0) <= 0) {
+        uint8_t id_frame[WIRE_CLIENT_ID_FRAME];
+        int client_id;
+        int id_len = recv(client_socket, (char*)id_frame, sizeof(id_frame), MSG_WAITALL);
+        if (id_len <= 0) {
             printf("Failed to receive client ID\n");
             print_socket_error("Receive error");
             CLOSE_SOCKET(client_socket);
             continue;
         }
-        
-        int client_id = atoi(id_buffer);
+        if (!wire_decode_client_id(id_frame, id_len, FRAME_CLIENT_ID, &client_id)) {
+            printf("Invalid client ID frame, closing connection\n");
+            CLOSE_SOCKET(client_socket);
+            continue;
+        }
 #ifdef _WIN32
         printf("Client %d connected for TCP streaming (socket: %" PRIu64 ")\n", 
                client_id, (uint64_t)client_socket);
@@ -1654,24 +7373,23 @@ THREAD_RETURN_TYPE handle_tcp_connections(THREAD_PARAM arg) {
         pthread_mutex_lock(&stats_mutex);
 #endif
         bool valid_client = false;
-        if (client_id >= 0 && client_id < client_count && 
-            client_stats[client_id].active && 
-            strcmp(client_stats[client_id].protocol, "TCP") == 0) {
+        if (client_active(client_id) && 
+            strcmp(CLIENT_STATS(client_id).protocol, "TCP") == 0) {
             
             // Check if this client already has a streaming socket
-            if (client_stats[client_id].socket_fd != INVALID_SOCKET_VALUE) {
+            if (CLIENT_STATS(client_id).socket_fd != INVALID_SOCKET_VALUE) {
 #ifdef _WIN32
                 printf("Client %d already has an active streaming socket %" PRIu64 ", closing old connection\n",
-                       client_id, (uint64_t)client_stats[client_id].socket_fd);
+                       client_id, (uint64_t)CLIENT_STATS(client_id).socket_fd);
 #else
                 printf("Client %d already has an active streaming socket %d, closing old connection\n",
-                       client_id, client_stats[client_id].socket_fd);
+                       client_id, CLIENT_STATS(client_id).socket_fd);
 #endif
-                CLOSE_SOCKET(client_stats[client_id].socket_fd);
+                CLOSE_SOCKET(CLIENT_STATS(client_id).socket_fd);
             }
             
             // Update socket_fd
-            client_stats[client_id].socket_fd = client_socket;
+            CLIENT_STATS(client_id).socket_fd = client_socket;
             valid_client = true;
 #ifdef _WIN32
             printf("Updated socket_fd for client %d to %" PRIu64 "\n", 
@@ -1693,18 +7411,8 @@ THREAD_RETURN_TYPE handle_tcp_connections(THREAD_PARAM arg) {
             continue;
         }
         
-        // Start TCP streaming thread
-        thread_t streaming_thread;
-        int *client_arg = malloc(sizeof(int));
-        if (client_arg == NULL) {
-            perror("Memory allocation failed");
-            CLOSE_SOCKET(client_socket);
-            continue;
-        }
-        *client_arg = client_id;
-        
-        THREAD_CREATE(streaming_thread, handle_tcp_streaming, client_arg);
-        THREAD_DETACH(streaming_thread);
+        // Hand the stream to the worker pool
+        stream_task_start(client_id, MODE_TCP);
     }
     
 #ifdef _WIN32
@@ -1714,6 +7422,8 @@ THREAD_RETURN_TYPE handle_tcp_connections(THREAD_PARAM arg) {
 #endif
 }
 
+#endif // !USE_EPOLL
+
 // Signal handler for printing statistics
 #ifdef _WIN32
 BOOL WINAPI signal_handler(DWORD sig) {
@@ -1724,7 +7434,8 @@ BOOL WINAPI signal_handler(DWORD sig) {
         // Allow some time for any ongoing operations to complete
         Sleep(1000);
         
-        // Print final statistics
+        // Write out queued log records, then print final statistics directly
+        log_shutdown();
         print_stats();
         
         printf("\nServer terminated gracefully.\n");
@@ -1748,7 +7459,8 @@ void signal_handler(int sig) {
         // Allow some time for any ongoing operations to complete
         sleep(1);
         
-        // Print final statistics
+        // Write out queued log records, then print final statistics directly
+        log_shutdown();
         print_stats();
         
         printf("\nServer terminated gracefully.\n");
@@ -1762,12 +7474,244 @@ void signal_handler(int sig) {
 }
 #endif
 
+// Print command line help
+void print_usage(const char *program) {
+    printf("Usage: %s <Server Port> <Scheduling Policy: FCFS/RR/DRR/EDF> [options]\n", program);
+    printf("Options:\n");
+    printf("  --reactors N        Event-loop threads (default: one per CPU, Linux only)\n");
+    printf("  --workers N         Stream worker threads without epoll (default: one per CPU)\n");
+    printf("  --send-stall-ms N   Drop a TCP stream after N ms without send progress (default: 10000)\n");
+    printf("  --sndbuf BYTES      SO_SNDBUF for TCP stream sockets (default: kernel autotuning)\n");
+    printf("  --encode-cost MODE  pipeline: encoder workers run ahead of the senders (default)\n");
+    printf("                      client: each client waits %d ms per TCP chunk\n", ENCODE_TIME_MS);
+    printf("                      none: send straight from the shared chunk store\n");
+    printf("  --pipeline-depth N  Chunks encoded ahead of the leading sender (default: %d)\n", PIPELINE_DEPTH);
+    printf("  --burst BYTES       Token bucket depth for pacing (default: one chunk)\n");
+    printf("  --capacity-kbps N   Egress budget shared by all streams per the policy (default: unlimited)\n");
+    printf("  --admission MODE    When a new stream does not fit the committed bandwidth:\n");
+    printf("                      reject, queue (admit in arrival order) or downgrade its resolution\n");
+    printf("  --admit-kbps N      Bandwidth admission control may commit (default: --capacity-kbps)\n");
+    printf("  --preload-chunks    Build every video chunk at startup\n");
+    printf("  --udp-batch N       UDP datagrams per sendmmsg() flush, 1 disables batching (default: %d)\n", UDP_BATCH_MAX);
+    printf("  --no-gso            Do not merge UDP datagrams with UDP_SEGMENT\n");
+    printf("  --udp-steer         Steer each client IP to a fixed reactor UDP socket (SO_REUSEPORT cBPF)\n");
+    printf("  --nack              Resend UDP chunks clients report missing, while they can make their deadline\n");
+    printf("  --fec PERCENT       Follow UDP chunk groups with XOR parity worth PERCENT of their chunks\n");
+    printf("  --mtu BYTES         Split UDP frames into datagrams of this size, 0 = one per frame (default: %d)\n", UDP_MTU);
+    printf("  --advertise-port N  UDP port clients are told to stream from, e.g. a linkem proxy's\n");
+    printf("Network impairment, per stream (defaults: %d%% loss on UDP only, nothing else):\n", UDP_PACKET_LOSS_RATE);
+    printf("  --loss PERCENT      Packet loss on UDP and TCP; TCP pays a retransmission (>= %d ms) per lost segment\n", TCP_RTO_MIN_MS);
+    printf("  --loss-burst ENTER,EXIT[,LOSS]  Gilbert-Elliott bursts: %% chance per packet of entering\n");
+    printf("                      and leaving a bad state that loses LOSS%% (default: 100)\n");
+    printf("  --delay MS[,JITTER] One-way delay, varying uniformly by +/- JITTER ms\n");
+    printf("  --reorder PERCENT   UDP datagrams held %d ms longer than the rest\n", IMPAIR_REORDER_MS);
+    printf("  --duplicate PERCENT UDP datagrams delivered twice\n");
+    printf("  --link-kbps N       Bottleneck rate; UDP datagrams beyond %d ms of backlog are dropped\n", IMPAIR_QUEUE_MS);
+    printf("  --seed N            Impairment random seed, to replay a run (default: from the clock)\n");
+    printf("  --log-level LEVEL   debug, info, warn or error (default: info)\n");
+    printf("  --log-rate N        Per-chunk log lines per second per thread, 0 = all (default: %d)\n", LOG_RATE_DEFAULT);
+    printf("  --log-file PATH     Write the log as binary records to PATH instead of stdout\n");
+    printf("Benchmark: %s --bench-udp [seconds]   UDP send path over loopback (Linux only)\n", program);
+    printf("Benchmark: %s --bench-workers [clients ...]  Thread per stream vs. the worker pool\n", program);
+    printf("Benchmark: %s --bench-fec [percent [mtu]]  Parity kernels and the loss FEC recovers\n", program);
+    printf("Log files: %s --decode-log PATH       Print a --log-file log as text\n", program);
+}
+
+// Parse the optional flags that follow the two positional arguments
+int parse_server_options(int argc, char *argv[]) {
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--reactors") == 0 && i + 1 < argc) {
+            server_config.reactors = atoi(argv[++i]);
+            if (server_config.reactors < 0) {
+                printf("Invalid reactor count: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            server_config.workers = atoi(argv[++i]);
+            if (server_config.workers < 0) {
+                printf("Invalid worker count: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--send-stall-ms") == 0 && i + 1 < argc) {
+            server_config.send_stall_ms = atoi(argv[++i]);
+            if (server_config.send_stall_ms <= 0) {
+                printf("Invalid send stall timeout: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--sndbuf") == 0 && i + 1 < argc) {
+            server_config.sndbuf = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--encode-cost") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "pipeline") == 0) {
+                server_config.encode_cost = ENCODE_COST_PIPELINE;
+            } else if (strcmp(argv[i], "client") == 0) {
+                server_config.encode_cost = ENCODE_COST_CLIENT;
+            } else if (strcmp(argv[i], "none") == 0) {
+                server_config.encode_cost = ENCODE_COST_NONE;
+            } else {
+                printf("Invalid encode cost mode: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--pipeline-depth") == 0 && i + 1 < argc) {
+            server_config.pipeline_depth = atoi(argv[++i]);
+            if (server_config.pipeline_depth < 1 || server_config.pipeline_depth > MAX_PIPELINE_DEPTH) {
+                printf("Pipeline depth must be between 1 and %d\n", MAX_PIPELINE_DEPTH);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--burst") == 0 && i + 1 < argc) {
+            server_config.burst = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--capacity-kbps") == 0 && i + 1 < argc) {
+            server_config.capacity_kbps = atoi(argv[++i]);
+            if (server_config.capacity_kbps < 0) {
+                printf("Invalid capacity: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--admission") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "reject") == 0) {
+                server_config.admission = ADMISSION_REJECT;
+            } else if (strcmp(argv[i], "queue") == 0) {
+                server_config.admission = ADMISSION_QUEUE;
+            } else if (strcmp(argv[i], "downgrade") == 0) {
+                server_config.admission = ADMISSION_DOWNGRADE;
+            } else {
+                printf("Invalid admission mode: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--admit-kbps") == 0 && i + 1 < argc) {
+            server_config.admit_kbps = atoi(argv[++i]);
+            if (server_config.admit_kbps < 0) {
+                printf("Invalid admission limit: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--preload-chunks") == 0) {
+            server_config.preload_chunks = true;
+        } else if (strcmp(argv[i], "--udp-batch") == 0 && i + 1 < argc) {
+            server_config.udp_batch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-gso") == 0) {
+            server_config.udp_gso = false;
+        } else if (strcmp(argv[i], "--udp-steer") == 0) {
+            server_config.udp_steer = true;
+        } else if (strcmp(argv[i], "--nack") == 0) {
+            server_config.nack = true;
+        } else if (strcmp(argv[i], "--mtu") == 0 && i + 1 < argc) {
+            server_config.mtu = atoi(argv[++i]);
+            if (server_config.mtu != 0 && (server_config.mtu < UDP_MIN_MTU || server_config.mtu > 65535)) {
+                printf("Invalid MTU: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--fec") == 0 && i + 1 < argc) {
+            server_config.fec_percent = atoi(argv[++i]);
+            if (server_config.fec_percent < 0 || server_config.fec_percent > 100) {
+                printf("Invalid FEC parity share: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+            server_config.loss_percent = atof(argv[++i]);
+            if (server_config.loss_percent < 0 || server_config.loss_percent > 100) {
+                printf("Invalid loss rate: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--loss-burst") == 0 && i + 1 < argc) {
+            i++;
+            if (sscanf(argv[i], "%lf,%lf,%lf", &server_config.burst_enter, &server_config.burst_exit,
+                       &server_config.burst_loss) < 2 ||
+                server_config.burst_enter <= 0 || server_config.burst_enter > 100 ||
+                server_config.burst_exit <= 0 || server_config.burst_exit > 100 ||
+                server_config.burst_loss < 0 || server_config.burst_loss > 100) {
+                printf("Invalid burst loss: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {
+            i++;
+            if (sscanf(argv[i], "%d,%d", &server_config.delay_ms, &server_config.jitter_ms) < 1 ||
+                server_config.delay_ms < 0 || server_config.jitter_ms < 0) {
+                printf("Invalid delay: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) {
+            server_config.reorder_percent = atof(argv[++i]);
+            if (server_config.reorder_percent < 0 || server_config.reorder_percent > 100) {
+                printf("Invalid reorder rate: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--duplicate") == 0 && i + 1 < argc) {
+            server_config.duplicate_percent = atof(argv[++i]);
+            if (server_config.duplicate_percent < 0 || server_config.duplicate_percent > 100) {
+                printf("Invalid duplication rate: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--link-kbps") == 0 && i + 1 < argc) {
+            server_config.link_kbps = atoi(argv[++i]);
+            if (server_config.link_kbps < 0) {
+                printf("Invalid link rate: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--advertise-port") == 0 && i + 1 < argc) {
+            server_config.advertise_port = atoi(argv[++i]);
+            if (server_config.advertise_port < 0 || server_config.advertise_port > 65535) {
+                printf("Invalid advertised port: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            server_config.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            static const char *levels[] = { "debug", "info", "warn", "error" };
+            i++;
+            server_config.log_level = -1;
+            for (int level = LOG_DEBUG; level <= LOG_ERROR; level++) {
+                if (strcmp(argv[i], levels[level]) == 0) {
+                    server_config.log_level = level;
+                }
+            }
+            if (server_config.log_level < 0) {
+                printf("Invalid log level: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--log-rate") == 0 && i + 1 < argc) {
+            server_config.log_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log-file") == 0 && i + 1 < argc) {
+            server_config.log_file = argv[++i];
+        } else {
+            printf("Unknown or incomplete option: %s\n", argv[i]);
+            return 0;
+        }
+    }
+    if (server_config.admission != ADMISSION_OFF && admit_limit_kbps() <= 0) {
+        printf("--admission needs --admit-kbps or --capacity-kbps\n");
+        return 0;
+    }
+    return 1;
+}
+
 int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "--bench-udp") == 0) {
+#ifdef USE_EPOLL
+        return run_udp_benchmark(argc - 2, argv + 2);
+#else
+        printf("The UDP benchmark needs the Linux event-driven build\n");
+        return 1;
+#endif
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench-workers") == 0) {
+        return run_worker_benchmark(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench-fec") == 0) {
+        return run_fec_benchmark(argc - 2, argv + 2);
+    }
+    if (argc == 3 && strcmp(argv[1], "--decode-log") == 0) {
+        return run_log_decoder(argv[2]);
+    }
+    
     // Check command line arguments
-    if (argc != 3) {
-        printf("Usage: %s <Server Port> <Scheduling Policy: FCFS/RR>\n", argv[0]);
+    if (argc < 3 || !parse_server_options(argc, argv)) {
+        print_usage(argv[0]);
         return 1;
     }
+    if (server_config.fec_percent > 0) {
+        fec_init();
+        printf("FEC parity: %d%% of each chunk group, %s XOR kernel\n", server_config.fec_percent, fec_kernel_name);
+    }
     
     // Initialize socket system
     if (!initialize_socket_system()) {
@@ -1780,8 +7724,9 @@ int main(int argc, char *argv[]) {
     MUTEX_INIT(stats_mutex);
     MUTEX_INIT(queue_mutex);
     MUTEX_INIT(udp_mutex);
+    MUTEX_INIT(udp_table_mutex);
     MUTEX_INIT(log_mutex);
-    WIN_COND_INIT(queue_cond_var);
+    MUTEX_INIT(edf_mutex);
 #endif
     
     // Parse port number
@@ -1796,8 +7741,18 @@ int main(int argc, char *argv[]) {
         scheduling_policy = POLICY_FCFS;
     } else if (strcmp(argv[2], "RR") == 0) {
         scheduling_policy = POLICY_RR;
+    } else if (strcmp(argv[2], "DRR") == 0) {
+        scheduling_policy = POLICY_DRR;
+    } else if (strcmp(argv[2], "EDF") == 0) {
+        scheduling_policy = POLICY_EDF;
     } else {
-        printf("Invalid scheduling policy. Use 'FCFS' or 'RR'.\n");
+        printf("Invalid scheduling policy. Use 'FCFS', 'RR', 'DRR' or 'EDF'.\n");
+        return 1;
+    }
+    
+    // From here on log lines are queued and written by the formatter thread
+    if (!log_start()) {
+        printf("Failed to start the logger\n");
         return 1;
     }
     
@@ -1814,16 +7769,37 @@ int main(int argc, char *argv[]) {
 
     // Initialize random seed for port generation
     srand((unsigned int)time(NULL));
+    if (server_config.seed == 0) {
+        server_config.seed = (uint64_t)time(NULL);
+    }
+    impair_init();
+    if (server_config.loss_percent < 0) {
+        int datagrams = udp_fragment_count(UDP_CHUNK_SIZE);
+        printf("Simulated UDP loss: %d%% of chunks (%.2f%% of each of their %d datagrams); --loss sets it per datagram\n",
+               UDP_PACKET_LOSS_RATE, impair_loss_percent(MODE_UDP, datagrams), datagrams);
+    }
+    if (server_config.loss_percent >= 0 || server_config.burst_enter > 0 || server_config.delay_ms > 0 ||
+        server_config.jitter_ms > 0 || server_config.reorder_percent > 0 ||
+        server_config.duplicate_percent > 0 || server_config.link_kbps > 0) {
+        printf("Network impairment: loss %.2f%% UDP / %.2f%% TCP", impair_loss_percent(MODE_UDP, 1),
+               impair_loss_percent(MODE_TCP, 1));
+        if (server_config.burst_enter > 0) {
+            printf(", bursts %.2f%%/%.2f%% losing %.0f%%", server_config.burst_enter,
+                   server_config.burst_exit, server_config.burst_loss);
+        }
+        printf(", delay %d+/-%d ms, reorder %.2f%%, duplicate %.2f%%, link %d Kbps, seed %" PRIu64 "\n",
+               server_config.delay_ms, server_config.jitter_ms, server_config.reorder_percent,
+               server_config.duplicate_percent, server_config.link_kbps, server_config.seed);
+    }
     
-    // Initialize client statistics
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        client_stats[i].active = 0;
-        client_stats[i].state = STATE_IDLE;
-        client_stats[i].socket_fd = INVALID_SOCKET_VALUE;
+    if (server_config.preload_chunks) {
+        chunk_store_preload();
+    }
+    if (server_config.encode_cost == ENCODE_COST_PIPELINE && !pipeline_start()) {
+        return 1;
     }
     
     // Set up main TCP socket for connection phase
-    socket_t server_fd;
     struct sockaddr_in address;
     int opt = 1;
     
@@ -1860,7 +7836,7 @@ int main(int argc, char *argv[]) {
     }
     
     // Listen for connections
-    if (listen(server_fd, 10) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         print_socket_error("TCP listen failed");
         CLOSE_SOCKET(server_fd);
         cleanup_socket_system();
@@ -1905,7 +7881,7 @@ int main(int argc, char *argv[]) {
     }
     
     // Listen for TCP streaming connections
-    if (listen(tcp_streaming_socket, 10) < 0) {
+    if (listen(tcp_streaming_socket, SOMAXCONN) < 0) {
         print_socket_error("TCP streaming listen failed");
         CLOSE_SOCKET(server_fd);
         CLOSE_SOCKET(tcp_streaming_socket);
@@ -1935,6 +7911,17 @@ int main(int argc, char *argv[]) {
         cleanup_socket_system();
         return 1;
     }
+#ifdef USE_EPOLL
+    // Each reactor binds its own UDP socket to this port (start_reactors)
+    if (setsockopt(udp_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        print_socket_error("UDP setsockopt SO_REUSEPORT failed");
+        CLOSE_SOCKET(server_fd);
+        CLOSE_SOCKET(tcp_streaming_socket);
+        CLOSE_SOCKET(udp_socket);
+        cleanup_socket_system();
+        return 1;
+    }
+#endif
     
     // Bind UDP socket to the same port as connection phase
     struct sockaddr_in udp_address;
@@ -1953,10 +7940,21 @@ int main(int argc, char *argv[]) {
     }
     
     printf("TCP and UDP server started on port %d with %s scheduling policy\n", 
-           server_port, (scheduling_policy == POLICY_FCFS) ? "FCFS" : "Round-Robin");
+           server_port, policy_names[scheduling_policy]);
     printf("TCP streaming socket listening on port %d\n", server_port + 1);
     
+    // EDF hands out the --capacity-kbps budget from its own thread
+    if (scheduling_policy == POLICY_EDF && server_config.capacity_kbps > 0) {
+        thread_t edf_id;
+        if (!THREAD_CREATE(edf_id, edf_dispatcher_thread, NULL)) {
+            print_socket_error("Failed to create EDF dispatcher thread");
+            return 1;
+        }
+        THREAD_DETACH(edf_id);
+    }
+    
     // Start the scheduler thread
+    run_queue_init();
     thread_t scheduler_id;
     if (THREAD_CREATE(scheduler_id, scheduler_thread, NULL) == 0) {
         print_socket_error("Failed to create scheduler thread");
@@ -1967,6 +7965,29 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+#ifdef USE_EPOLL
+    // The reactors accept and drive every socket; reactor 0 uses this thread
+    if (set_nonblocking(server_fd) < 0 || set_nonblocking(tcp_streaming_socket) < 0 ||
+        set_nonblocking(udp_socket) < 0 || !start_reactors()) {
+        print_socket_error("Failed to start event loop");
+        CLOSE_SOCKET(server_fd);
+        CLOSE_SOCKET(tcp_streaming_socket);
+        CLOSE_SOCKET(udp_socket);
+        cleanup_socket_system();
+        return 1;
+    }
+    reactor_thread(&reactors[0]);
+#else
+    // Streams run as tasks on a fixed pool of workers
+    if (!pool_start(server_config.workers)) {
+        CLOSE_SOCKET(server_fd);
+        CLOSE_SOCKET(tcp_streaming_socket);
+        CLOSE_SOCKET(udp_socket);
+        cleanup_socket_system();
+        return 1;
+    }
+    printf("Streaming on %d worker threads\n", pool_worker_count);
+    
     // Start the TCP connections handler thread
     thread_t tcp_conn_id;
     if (THREAD_CREATE(tcp_conn_id, handle_tcp_connections, NULL) == 0) {
@@ -1981,6 +8002,18 @@ int main(int argc, char *argv[]) {
     }
     THREAD_DETACH(tcp_conn_id);
     
+    // Start the UDP dispatcher, the only reader of udp_socket
+    thread_t udp_dispatcher_id;
+    if (THREAD_CREATE(udp_dispatcher_id, udp_dispatcher_thread, NULL) == 0) {
+        print_socket_error("Failed to create UDP dispatcher thread");
+        CLOSE_SOCKET(server_fd);
+        CLOSE_SOCKET(tcp_streaming_socket);
+        CLOSE_SOCKET(udp_socket);
+        cleanup_socket_system();
+        return 1;
+    }
+    THREAD_DETACH(udp_dispatcher_id);
+    
     // Main loop
     while (1) {
         // Accept connection from client
@@ -2010,6 +8043,7 @@ int main(int argc, char *argv[]) {
         }
         THREAD_DETACH(thread);
     }
+#endif
     
     // This point should never be reached
     CLOSE_SOCKET(server_fd);
@@ -2024,8 +8058,10 @@ int main(int argc, char *argv[]) {
     MUTEX_DESTROY(stats_mutex);
     MUTEX_DESTROY(queue_mutex);
     MUTEX_DESTROY(udp_mutex);
+    MUTEX_DESTROY(udp_table_mutex);
     MUTEX_DESTROY(log_mutex);
-    WIN_COND_DESTROY(queue_cond_var);
+    MUTEX_DESTROY(edf_mutex);
+    CloseHandle(run_queue_event);
 #endif
     
     return 0;